@@ -129,6 +129,25 @@ OPTIONS = [
     "backend-tls",
     "backend-connections-per-host",
     "error-page",
+    "tls-dyn-rec-adaptive",
+    "frontend-tcp-notsent-lowat",
+    "event-backend",
+    "backend-http2-coalesce",
+    "backend-health-check-interval",
+    "backend-health-check-timeout",
+    "backend-cache-collapse-timeout",
+    "backend-http2-warm-connections",
+    "backend-limit-queue-timeout",
+    "accesslog-buffer",
+    "accesslog-overflow",
+    "accesslog-binary",
+    "metrics-frontend",
+    "tls-session-cache-shm-size",
+    "fetch-ocsp-response-builtin",
+    "fetch-ocsp-response-concurrency",
+    "ocsp-responder",
+    "subcert-lazy-cache-size",
+    "private-key-threads",
 ]
 
 LOGVARS = [
@@ -0,0 +1,173 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif // HAVE_CONFIG_H
+
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif // HAVE_UNISTD_H
+#include <getopt.h>
+
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <iostream>
+
+#include "shrpx_accesslog_binary.h"
+#include "template.h"
+
+using namespace shrpx;
+using namespace nghttp2;
+
+namespace {
+void print_help() {
+  std::cout << R"(Usage: nghttpx-logdecode [OPTIONS] [FILE...]
+
+Converts access log written by nghttpx with --accesslog-binary to text
+or JSON.   If FILE is  not given, or  it is "-", binary  access log is
+read from stdin.  Time is formatted in the local time zone.
+
+OPTIONS:
+    -j, --json        Output each entry as JSON object, one per line.
+                      The key is the variable name in --accesslog-format
+                      without leading "$".  The value which is not
+                      available is null.
+    -h, --help        Display this help and exit.)" << std::endl;
+}
+} // namespace
+
+namespace {
+int decode_file(AccessLogDecoder &decoder, int fd, const char *path) {
+  std::vector<uint8_t> buf;
+  std::string out;
+  size_t len = 0;
+
+  for (;;) {
+    if (buf.size() - len < 16_k) {
+      buf.resize(buf.size() + 64_k);
+    }
+
+    ssize_t nread;
+    while ((nread = read(fd, buf.data() + len, buf.size() - len)) == -1 &&
+           errno == EINTR)
+      ;
+
+    if (nread == -1) {
+      auto error = errno;
+      std::cerr << path << ": read failed: " << strerror(error) << std::endl;
+      return -1;
+    }
+
+    if (nread == 0) {
+      if (len) {
+        std::cerr << path << ": truncated record at the end" << std::endl;
+        return -1;
+      }
+      return 0;
+    }
+
+    len += nread;
+
+    auto n = decoder.decode(out, buf.data(), len);
+    if (n == -1) {
+      std::cerr << path << ": malformed access log" << std::endl;
+      return -1;
+    }
+
+    std::cout << out;
+    out.clear();
+
+    std::copy(std::begin(buf) + n, std::begin(buf) + len, std::begin(buf));
+    len -= n;
+  }
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  bool json = false;
+
+  for (;;) {
+    static struct option long_options[] = {{"json", no_argument, nullptr, 'j'},
+                                           {"help", no_argument, nullptr, 'h'},
+                                           {nullptr, 0, nullptr, 0}};
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "hj", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+    case 'h':
+      print_help();
+      exit(EXIT_SUCCESS);
+    case 'j':
+      // --json
+      json = true;
+      break;
+    case '?':
+      exit(EXIT_FAILURE);
+    default:
+      break;
+    }
+  }
+
+  int rv = 0;
+
+  if (optind == argc) {
+    AccessLogDecoder decoder(json);
+    return decode_file(decoder, 0, "-") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  for (auto i = optind; i < argc; ++i) {
+    // Each file starts with its own schema.
+    AccessLogDecoder decoder(json);
+
+    if (strcmp(argv[i], "-") == 0) {
+      if (decode_file(decoder, 0, "-") != 0) {
+        rv = -1;
+      }
+      continue;
+    }
+
+    auto fd = open(argv[i], O_RDONLY);
+    if (fd == -1) {
+      auto error = errno;
+      std::cerr << argv[i] << ": could not open file: " << strerror(error)
+                << std::endl;
+      rv = -1;
+      continue;
+    }
+
+    if (decode_file(decoder, fd, argv[i]) != 0) {
+      rv = -1;
+    }
+
+    close(fd);
+  }
+
+  return rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -27,6 +27,7 @@
 #endif // HAVE_CONFIG_H
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <CUnit/Basic.h>
 // include test cases' include files here
@@ -41,6 +42,19 @@
 #include "memchunk_test.h"
 #include "template_test.h"
 #include "shrpx_http_test.h"
+#include "shrpx_cache_test.h"
+#include "shrpx_concurrency_limiter_test.h"
+#include "shrpx_accesslog_writer_test.h"
+#include "shrpx_accesslog_binary_test.h"
+#include "shrpx_metrics_test.h"
+#include "shrpx_shm_session_cache_test.h"
+#include "shrpx_memcached_dispatcher_test.h"
+#include "shrpx_ocsp_test.h"
+#include "shrpx_ssl_context_pool_test.h"
+#include "shrpx_private_key_pool_test.h"
+#include "shrpx_router_test.h"
+#include "shrpx_health_monitor_test.h"
+#include "shrpx_connection_test.h"
 #include "base64_test.h"
 #include "shrpx_config.h"
 #include "ssl.h"
@@ -119,12 +133,91 @@ int main(int argc, char *argv[]) {
                    shrpx::test_shrpx_config_read_tls_ticket_key_file) ||
       !CU_add_test(pSuite, "config_read_tls_ticket_key_file_aes_256",
                    shrpx::test_shrpx_config_read_tls_ticket_key_file_aes_256) ||
+      !CU_add_test(pSuite, "config_configure_downstream_group",
+                   shrpx::test_shrpx_config_configure_downstream_group) ||
       !CU_add_test(pSuite, "worker_match_downstream_addr_group",
                    shrpx::test_shrpx_worker_match_downstream_addr_group) ||
+      !CU_add_test(pSuite, "worker_select_downstream_addr",
+                   shrpx::test_shrpx_worker_select_downstream_addr) ||
+      !CU_add_test(pSuite, "worker_select_affinity_downstream_addr",
+                   shrpx::test_shrpx_worker_select_affinity_downstream_addr) ||
+      !CU_add_test(pSuite, "worker_affinity_hash_key",
+                   shrpx::test_shrpx_worker_affinity_hash_key) ||
+      !CU_add_test(pSuite, "worker_select_weighted_downstream_addr",
+                   shrpx::test_shrpx_worker_select_weighted_downstream_addr) ||
+      !CU_add_test(pSuite, "worker_downstream_addr_cost",
+                   shrpx::test_shrpx_worker_downstream_addr_cost) ||
+      !CU_add_test(pSuite, "worker_count_http2_sessions_to_warm",
+                   shrpx::test_shrpx_worker_count_http2_sessions_to_warm) ||
+      !CU_add_test(pSuite, "worker_select_retry_downstream_addr",
+                   shrpx::test_shrpx_worker_select_retry_downstream_addr) ||
+      !CU_add_test(pSuite, "worker_compute_hedge_delay",
+                   shrpx::test_shrpx_worker_compute_hedge_delay) ||
+      !CU_add_test(pSuite, "worker_replace_downstream_routing",
+                   shrpx::test_shrpx_worker_replace_downstream_routing) ||
       !CU_add_test(pSuite, "http_create_forwarded",
                    shrpx::test_shrpx_http_create_forwarded) ||
       !CU_add_test(pSuite, "http_create_via_header_value",
                    shrpx::test_shrpx_http_create_via_header_value) ||
+      !CU_add_test(pSuite, "cache_parse_cache_control",
+                   shrpx::test_shrpx_cache_parse_cache_control) ||
+      !CU_add_test(pSuite, "cache_prepare_store",
+                   shrpx::test_shrpx_cache_prepare_store) ||
+      !CU_add_test(pSuite, "cache_lookup", shrpx::test_shrpx_cache_lookup) ||
+      !CU_add_test(pSuite, "cache_eviction",
+                   shrpx::test_shrpx_cache_eviction) ||
+      !CU_add_test(pSuite, "cache_replace", shrpx::test_shrpx_cache_replace) ||
+      !CU_add_test(pSuite, "cache_append_body",
+                   shrpx::test_shrpx_cache_append_body) ||
+      !CU_add_test(pSuite, "cache_lock", shrpx::test_shrpx_cache_lock) ||
+      !CU_add_test(pSuite, "concurrency_limiter_acquire",
+                   shrpx::test_shrpx_concurrency_limiter_acquire) ||
+      !CU_add_test(pSuite, "concurrency_limiter_queue",
+                   shrpx::test_shrpx_concurrency_limiter_queue) ||
+      !CU_add_test(pSuite, "concurrency_limiter_update",
+                   shrpx::test_shrpx_concurrency_limiter_update) ||
+      !CU_add_test(pSuite, "accesslog_buffer",
+                   shrpx::test_shrpx_accesslog_buffer) ||
+      !CU_add_test(pSuite, "accesslog_writer_many_buffers",
+                   shrpx::test_shrpx_accesslog_writer_many_buffers) ||
+      !CU_add_test(pSuite, "accesslog_binary_decode",
+                   shrpx::test_shrpx_accesslog_binary_decode) ||
+      !CU_add_test(pSuite, "accesslog_binary_malformed",
+                   shrpx::test_shrpx_accesslog_binary_malformed) ||
+      !CU_add_test(pSuite, "metrics_latency_histogram",
+                   shrpx::test_shrpx_metrics_latency_histogram) ||
+      !CU_add_test(pSuite, "metrics_format",
+                   shrpx::test_shrpx_metrics_format) ||
+      !CU_add_test(pSuite, "shm_session_cache",
+                   shrpx::test_shrpx_shm_session_cache) ||
+      !CU_add_test(pSuite, "shm_session_cache_evict",
+                   shrpx::test_shrpx_shm_session_cache_evict) ||
+      !CU_add_test(pSuite, "shm_session_cache_owner_dead",
+                   shrpx::test_shrpx_shm_session_cache_owner_dead) ||
+      !CU_add_test(pSuite, "memcached_dispatcher",
+                   shrpx::test_shrpx_memcached_dispatcher) ||
+      !CU_add_test(pSuite, "ocsp_create_query",
+                   shrpx::test_shrpx_ocsp_create_query) ||
+      !CU_add_test(pSuite, "ocsp_updater", shrpx::test_shrpx_ocsp_updater) ||
+      !CU_add_test(pSuite, "ssl_context_pool",
+                   shrpx::test_shrpx_ssl_context_pool) ||
+      !CU_add_test(pSuite, "ssl_context_pool_evicted_waiter",
+                   shrpx::test_shrpx_ssl_context_pool_evicted_waiter) ||
+      !CU_add_test(pSuite, "private_key_pool",
+                   shrpx::test_shrpx_private_key_pool) ||
+      !CU_add_test(pSuite, "private_key_pool_cancel",
+                   shrpx::test_shrpx_private_key_pool_cancel) ||
+      !CU_add_test(pSuite, "private_key_pool_connection",
+                   shrpx::test_shrpx_private_key_pool_connection) ||
+      !CU_add_test(pSuite, "router_match", shrpx::test_shrpx_router_match) ||
+      !CU_add_test(pSuite, "router_match_prefix",
+                   shrpx::test_shrpx_router_match_prefix) ||
+      !CU_add_test(pSuite, "health_monitor_http1",
+                   shrpx::test_shrpx_health_monitor_http1) ||
+      !CU_add_test(pSuite, "health_monitor_http2",
+                   shrpx::test_shrpx_health_monitor_http2) ||
+      !CU_add_test(pSuite, "connection_compute_tcp_info_write_limit",
+                   shrpx::test_shrpx_connection_compute_tcp_info_write_limit) ||
       !CU_add_test(pSuite, "util_streq", shrpx::test_util_streq) ||
       !CU_add_test(pSuite, "util_strieq", shrpx::test_util_strieq) ||
       !CU_add_test(pSuite, "util_inp_strlower",
@@ -198,6 +291,21 @@ int main(int argc, char *argv[]) {
     return CU_get_error();
   }
 
+  // Benchmarks take time, and print the results to stderr.  They are
+  // run only if NGHTTPX_BENCHMARK environment variable is set.
+  if (getenv("NGHTTPX_BENCHMARK") &&
+      (!CU_add_test(pSuite, "router_match_benchmark",
+                    shrpx::test_shrpx_router_match_benchmark) ||
+       !CU_add_test(pSuite, "accesslog_binary_benchmark",
+                    shrpx::test_shrpx_accesslog_binary_benchmark) ||
+       !CU_add_test(pSuite, "ssl_cert_lookup_tree_benchmark",
+                    shrpx::test_shrpx_ssl_cert_lookup_tree_benchmark) ||
+       !CU_add_test(pSuite, "memcached_dispatcher_benchmark",
+                    shrpx::test_shrpx_memcached_dispatcher_benchmark))) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
   // Run all tests using the CUnit Basic interface
   CU_basic_set_mode(CU_BRM_VERBOSE);
   CU_basic_run_tests();
@@ -81,6 +81,7 @@
 #include "shrpx_worker_process.h"
 #include "shrpx_process.h"
 #include "shrpx_signal.h"
+#include "shrpx_shm_session_cache.h"
 #include "util.h"
 #include "app_helper.h"
 #include "ssl.h"
@@ -145,52 +146,6 @@ struct SignalServer {
   pid_t worker_process_pid;
 };
 
-namespace {
-int resolve_hostname(Address *addr, const char *hostname, uint16_t port,
-                     int family) {
-  int rv;
-
-  auto service = util::utos(port);
-
-  addrinfo hints{};
-  hints.ai_family = family;
-  hints.ai_socktype = SOCK_STREAM;
-#ifdef AI_ADDRCONFIG
-  hints.ai_flags |= AI_ADDRCONFIG;
-#endif // AI_ADDRCONFIG
-  addrinfo *res;
-
-  rv = getaddrinfo(hostname, service.c_str(), &hints, &res);
-  if (rv != 0) {
-    LOG(FATAL) << "Unable to resolve address for " << hostname << ": "
-               << gai_strerror(rv);
-    return -1;
-  }
-
-  auto res_d = defer(freeaddrinfo, res);
-
-  char host[NI_MAXHOST];
-  rv = getnameinfo(res->ai_addr, res->ai_addrlen, host, sizeof(host), nullptr,
-                   0, NI_NUMERICHOST);
-  if (rv != 0) {
-    LOG(FATAL) << "Address resolution for " << hostname
-               << " failed: " << gai_strerror(rv);
-
-    return -1;
-  }
-
-  if (LOG_ENABLED(INFO)) {
-    LOG(INFO) << "Address resolution for " << hostname
-              << " succeeded: " << host;
-  }
-
-  memcpy(&addr->su, res->ai_addr, res->ai_addrlen);
-  addr->len = res->ai_addrlen;
-
-  return 0;
-}
-} // namespace
-
 namespace {
 int chown_to_running_user(const char *path) {
   return chown(path, get_config()->uid, get_config()->gid);
@@ -286,12 +241,23 @@ void exec_binary(SignalServer *ssv) {
 
   auto &listenerconf = get_config()->conn.listener;
 
-  auto envp = make_unique<char *[]>(envlen + listenerconf.addrs.size() + 1);
+  auto envp = make_unique<char *[]>(envlen + listenerconf.addrs.size() +
+                                    listenerconf.metrics_addrs.size() + 1);
   size_t envidx = 0;
 
+  // Metrics acceptors are passed in the same way as the frontend
+  // acceptors.  They are told apart by their address.
+  std::vector<const UpstreamAddr *> inherited_addrs;
+  for (auto &addr : listenerconf.addrs) {
+    inherited_addrs.push_back(&addr);
+  }
+  for (auto &addr : listenerconf.metrics_addrs) {
+    inherited_addrs.push_back(&addr);
+  }
+
   std::vector<ImmutableString> fd_envs;
-  for (size_t i = 0; i < listenerconf.addrs.size(); ++i) {
-    auto &addr = listenerconf.addrs[i];
+  for (size_t i = 0; i < inherited_addrs.size(); ++i) {
+    auto &addr = *inherited_addrs[i];
     std::string s = ENV_ACCEPT_PREFIX;
     s += util::utos(i + 1);
     s += '=';
@@ -395,6 +361,10 @@ void signal_cb(struct ev_loop *loop, ev_signal *w, int revents) {
   case GRACEFUL_SHUTDOWN_SIGNAL:
     ipc_send(ssv, SHRPX_IPC_GRACEFUL_SHUTDOWN);
     return;
+  case RELOAD_SIGNAL:
+    LOG(NOTICE) << "Reloading backend configuration";
+    ipc_send(ssv, SHRPX_IPC_RELOAD_CONFIG);
+    return;
   default:
     kill(ssv->worker_process_pid, w->signum);
     ev_break(loop);
@@ -805,26 +775,28 @@ int create_acceptor_socket() {
     }
   }
 
-  for (auto &addr : listenerconf.addrs) {
-    if (addr.host_unix) {
-      if (create_unix_domain_server_socket(addr, iaddrs) != 0) {
-        return -1;
-      }
+  for (auto addrs : {&listenerconf.addrs, &listenerconf.metrics_addrs}) {
+    for (auto &addr : *addrs) {
+      if (addr.host_unix) {
+        if (create_unix_domain_server_socket(addr, iaddrs) != 0) {
+          return -1;
+        }
 
-      if (get_config()->uid != 0) {
-        // fd is not associated to inode, so we cannot use fchown(2)
-        // here.  https://lkml.org/lkml/2004/11/1/84
-        if (chown_to_running_user(addr.host.c_str()) == -1) {
-          auto error = errno;
-          LOG(WARN) << "Changing owner of UNIX domain socket " << addr.host
-                    << " failed: " << strerror(error);
+        if (get_config()->uid != 0) {
+          // fd is not associated to inode, so we cannot use fchown(2)
+          // here.  https://lkml.org/lkml/2004/11/1/84
+          if (chown_to_running_user(addr.host.c_str()) == -1) {
+            auto error = errno;
+            LOG(WARN) << "Changing owner of UNIX domain socket " << addr.host
+                      << " failed: " << strerror(error);
+          }
         }
+        continue;
       }
-      continue;
-    }
 
-    if (create_tcp_server_socket(addr, iaddrs) != 0) {
-      return -1;
+      if (create_tcp_server_socket(addr, iaddrs) != 0) {
+        return -1;
+      }
     }
   }
 
@@ -964,7 +936,31 @@ int event_loop() {
     return -1;
   }
 
-  auto loop = EV_DEFAULT;
+  auto &shmconf = mod_config()->tls.session_cache.shm;
+
+  // Created before forking worker process so that the mapping is
+  // inherited by the worker process.
+  std::unique_ptr<ShmSessionCache> shm_session_cache;
+  if (!get_config()->conn.upstream.no_tls && shmconf.size) {
+    shm_session_cache = ShmSessionCache::create(shmconf.size);
+    if (!shm_session_cache) {
+      return -1;
+    }
+
+    shmconf.cache = shm_session_cache.get();
+
+    LOG(NOTICE) << "TLS session cache: " << shmconf.size
+                << " bytes of shared memory, "
+                << shm_session_cache->get_num_slots() << " slots";
+  }
+
+  auto loop = ev_default_loop(get_config()->ev_loop_flags);
+  if (!loop) {
+    LOG(WARN) << "Could not initialize event backend "
+              << str_event_backend(get_config()->ev_loop_flags)
+              << ", falling back to auto";
+    loop = EV_DEFAULT;
+  }
 
   auto pid = fork_worker_process(&ssv);
 
@@ -974,8 +970,9 @@ int event_loop() {
 
   ssv.worker_process_pid = pid;
 
-  constexpr auto signals = std::array<int, 3>{
-      {REOPEN_LOG_SIGNAL, EXEC_BINARY_SIGNAL, GRACEFUL_SHUTDOWN_SIGNAL}};
+  constexpr auto signals =
+      std::array<int, 4>{{REOPEN_LOG_SIGNAL, EXEC_BINARY_SIGNAL,
+                          GRACEFUL_SHUTDOWN_SIGNAL, RELOAD_SIGNAL}};
   auto sigevs = std::array<ev_signal, signals.size()>();
 
   for (size_t i = 0; i < signals.size(); ++i) {
@@ -996,15 +993,6 @@ int event_loop() {
 }
 } // namespace
 
-namespace {
-// Returns true if regular file or symbolic link |path| exists.
-bool conf_exists(const char *path) {
-  struct stat buf;
-  int rv = stat(path, &buf);
-  return rv == 0 && (buf.st_mode & (S_IFREG | S_IFLNK));
-}
-} // namespace
-
 namespace {
 constexpr char DEFAULT_NPN_LIST[] = "h2,h2-16,h2-14,"
 #ifdef HAVE_SPDYLAY
@@ -1024,11 +1012,6 @@ constexpr char DEFAULT_ACCESSLOG_FORMAT[] =
     R"("$http_referer" "$http_user_agent")";
 } // namespace
 
-namespace {
-constexpr char DEFAULT_DOWNSTREAM_HOST[] = "127.0.0.1";
-int16_t DEFAULT_DOWNSTREAM_PORT = 80;
-} // namespace;
-
 namespace {
 void fill_default_config() {
   *mod_config() = {};
@@ -1062,6 +1045,7 @@ void fill_default_config() {
     // ocsp update interval = 14400 secs = 4 hours, borrowed from h2o
     ocspconf.update_interval = 4_h;
     ocspconf.fetch_ocsp_response_file = PKGDATADIR "/fetch-ocsp-response";
+    ocspconf.fetch_concurrency = 8;
   }
 
   {
@@ -1113,12 +1097,15 @@ void fill_default_config() {
   {
     auto &accessconf = loggingconf.access;
     accessconf.format = parse_log_format(DEFAULT_ACCESSLOG_FORMAT);
+    accessconf.buffer_size = 0;
+    accessconf.overflow = ACCESSLOG_OVERFLOW_DROP;
 
     auto &errorconf = loggingconf.error;
     errorconf.file = "/dev/stderr";
   }
 
   loggingconf.syslog_facility = LOG_DAEMON;
+  loggingconf.severity = NOTICE;
 
   auto &connconf = mod_config()->conn;
   {
@@ -1156,10 +1143,20 @@ void fill_default_config() {
       timeoutconf.idle_read = 2_s;
     }
 
+    {
+      auto &healthconf = downstreamconf.health_check;
+      healthconf.interval = 5_s;
+      healthconf.timeout = 2_s;
+    }
+
+    downstreamconf.cache_collapse_timeout = 5_s;
+    downstreamconf.limit_queue_timeout = 0.;
+
     downstreamconf.connections_per_host = 8;
     downstreamconf.request_buffer_size = 16_k;
     downstreamconf.response_buffer_size = 128_k;
     downstreamconf.family = AF_UNSPEC;
+    downstreamconf.routing = std::make_shared<DownstreamRoutingConfig>();
     downstreamconf.no_tls = true;
   }
 }
@@ -1194,7 +1191,7 @@ Options:
   The options are categorized into several groups.
 
 Connections:
-  -b, --backend=(<HOST>,<PORT>|unix:<PATH>)[;[<PATTERN>[:...]][;proto=<PROTO>]]
+  -b, --backend=(<HOST>,<PORT>|unix:<PATH>)[;[<PATTERN>[:...]][[;<PARAM>]...]
               Set  backend  host  and   port.   The  multiple  backend
               addresses are  accepted by repeating this  option.  UNIX
               domain socket  can be  specified by prefixing  path name
@@ -1256,19 +1253,154 @@ Connections:
               The backend addresses sharing same <PATTERN> are grouped
               together forming  load balancing  group.
 
-              Optionally,   backend   application  protocol   can   be
-              specified in <PROTO>.  All that share the same <PATTERN>
-              must  have  the  same  <PROTO> value  if  it  is  given.
-              <PROTO>  should be  one  of the  following list  without
-              quotes: "h2", "http/1.1".  The  default value of <PROTO>
-              is "http/1.1".  Note that  usually "h2" refers to HTTP/2
-              over TLS.  But  in this option, it may  mean HTTP/2 over
-              cleartext TCP unless --backend-tls is used.
+              Optionally,  backend  parameters   can  be  given  after
+              <PATTERN>,   delimiting  them   by  ";".    All  backend
+              addresses that  share the  same <PATTERN> must  have the
+              same   parameters.    The   following   parameters   are
+              available.
+
+              The   parameter    "proto=<PROTO>"   specifies   backend
+              application  protocol.  <PROTO>  should  be  one of  the
+              following  list without  quotes: "h2",  "http/1.1".  The
+              default  value  of  <PROTO> is  "http/1.1".   Note  that
+              usually "h2"  refers to  HTTP/2 over  TLS.  But  in this
+              option,  it may  mean HTTP/2  over cleartext  TCP unless
+              --backend-tls is used.
+
+              The  parameter  "lb=<POLICY>"  specifies how  a  backend
+              address is selected among the  ones which share the same
+              <PATTERN>.  <POLICY> should be one of the following list
+              without   quotes:  "round-robin",   "least-outstanding",
+              "peak-ewma", "p2c".  "round-robin"  selects addresses in
+              turn.  "least-outstanding" selects the address which has
+              the  least number  of requests  in flight.   "peak-ewma"
+              selects  the address  which minimizes  the exponentially
+              weighted moving  average of response  latency multiplied
+              by  the number  of requests  in flight.   "p2c" picks  2
+              addresses  at   random,  and   selects  the   one  which
+              "peak-ewma" prefers.   The default value of  <POLICY> is
+              "round-robin".   Connections   in  the   HTTP/1  backend
+              connection pool are reused regardless of <POLICY>.
+
+              The parameter "affinity=<KEY>" enables session affinity.
+              Requests which have the same  <KEY> are forwarded to the
+              same backend address as long  as it is available.  <KEY>
+              should  be one  of  the following  list without  quotes:
+              "ip",   "header:<NAME>",  "cookie:<NAME>".    "ip"  uses
+              client IP  address.  "header:<NAME>"  uses the  value of
+              request header  field <NAME>.  "cookie:<NAME>"  uses the
+              value of cookie  <NAME>.  If the header  field or cookie
+              is missing, client IP address  is used instead.  The key
+              is  mapped to  an address  using consistent  hashing, so
+              that when an address  becomes unavailable, only the keys
+              which were mapped to it move to the other addresses.  If
+              "affinity" is  given, "lb" parameter is  ignored for the
+              requests which match <PATTERN>.
+
+              The parameter "weight=<N>" specifies the relative weight
+              of the backend address.  <N> should be an integer in [1,
+              256],  inclusive.   The  default  value  is  1.   Unlike
+              "proto" or  "lb", it may  be different for  each address
+              which shares  the same  <PATTERN>.  An  address receives
+              requests   in   proportion    to   its   weight.    With
+              "round-robin" policy,  addresses are selected  by smooth
+              weighted round  robin, which interleaves  the selections
+              of heavily weighted address  with the others.  The other
+              policies divide their cost  by weight.  With "affinity",
+              the number of  nodes of the address in the  hash ring is
+              multiplied by  weight.  If any address  has weight other
+              than 1,  backend address  is selected for  each request,
+              and connections  in the  HTTP/1 backend  connection pool
+              and  HTTP/2  sessions  are   reused  only  if  they  are
+              connected to the selected address.
+
+              The  parameter  "health=<TYPE>"  enables  active  health
+              check of the  backend address.  <TYPE> should  be one of
+              the following list without quotes: "tcp", "http".  "tcp"
+              checks  that  TCP  connection,   and  TLS  handshake  if
+              --backend-tls is used, can be established.  "http" sends
+              GET  request  in  the   protocol  specified  by  "proto"
+              parameter,  and checks  the response  status code.   The
+              request path  is specified by  "health-path=<PATH>", and
+              defaults to "/".  The  expected status code is specified
+              by "health-status=<CODE>".  If it  is not given, any 2xx
+              or 3xx status code is accepted.  Health check is done by
+              the   main  thread   at   the   interval  specified   by
+              --backend-health-check-interval.     The   address    is
+              considered unhealthy  after 2 consecutive  failures, and
+              healthy again after  2 consecutive successes.  Unhealthy
+              addresses are not selected  for new backend connections.
+              Health check does not use --backend-http-proxy-uri.
+
+              The parameter "cache=<SIZE>"  enables in-memory response
+              cache for the requests which match <PATTERN>.  <SIZE> is
+              the maximum number of bytes  the cache can use, and each
+              worker  has  its  own  cache of  this  size.   Only  the
+              response which  has explicit expiration time,  and which
+              is allowed to be stored  in shared cache is stored.  The
+              response whose body is larger than half of <SIZE> is not
+              stored.  By default, response cache is disabled.
+
+              The parameter "collapse" makes concurrent requests which
+              miss the  response cache for  the same URI wait  for the
+              response to the first one,  instead of sending their own
+              requests to backend.  When  the first response is stored
+              in the cache,  the waiting requests are  served from it.
+              If the response turns out not  to be cacheable, or it is
+              not  received  within  --backend-cache-collapse-timeout,
+              the waiting requests are forwarded to backend.  Only GET
+              request  without   request  body  is   collapsed.   This
+              parameter requires "cache" parameter.
+
+              The  parameter   "retry=<N>"  makes  nghttpx   retry  an
+              idempotent request on another  backend address up to <N>
+              times when  the backend connection fails,  is closed, or
+              times out before response  header is received.  Only the
+              request without request body is retried, because request
+              body is  not kept once  it is forwarded.   The addresses
+              which have  already been tried  for the request  are not
+              selected again.   The default value  of <N> is  0, which
+              disables retry.
+
+              The  parameter  "hedge=<P>" makes nghttpx send a copy of
+              an  idempotent  request  without request body to another
+              backend  address  if  no response is received within the
+              <P>-th  percentile  of  the  recent  response latency of
+              <PATTERN>,  keeping the original request in flight.  <P>
+              should  be  an  integer  in  [1,  99],  inclusive.   The
+              response  which  arrives  first  is  used, and the other
+              request  is canceled, using RST_STREAM if the backend is
+              HTTP/2.   If the original request fails before response,
+              the  hedged  request takes over it.  A request is hedged
+              at   most  once.   Hedging  is  not  done  until  enough
+              responses have been received to estimate the percentile.
+              The hedged request is not counted by "limit=aimd" below.
+              By default, hedging is disabled.
+
+              The   parameter  "limit=aimd"   limits  the   number  of
+              concurrent requests  forwarded to  <PATTERN> adaptively.
+              The  limit is  increased  while  response latency  stays
+              close  to  the  lowest latency  observed  recently,  and
+              decreased multiplicatively when latency grows.  When the
+              limit is  reached, a request without  request body waits
+              for      a      free      slot     for      at      most
+              --backend-limit-queue-timeout,  and  other requests  are
+              answered with  503 immediately.   Each worker  keeps its
+              own limit.  By default, concurrency is not limited.
 
               Since ";" and ":" are  used as delimiter, <PATTERN> must
               not  contain these  characters.  Since  ";" has  special
               meaning in shell, the option value must be quoted.
 
+              This  option  is  reloaded on SIGHUP.  The other options
+              for  backend  are  not reloaded, and the values given at
+              startup  are  used  for  the  reloaded  backends.   They
+              include                 --backend-health-check-interval,
+              --backend-health-check-timeout,
+              --backend-cache-collapse-timeout,
+              --backend-limit-queue-timeout,                       and
+              --backend-http2-warm-connections.
+
               Default: )" << DEFAULT_DOWNSTREAM_HOST << ","
       << DEFAULT_DOWNSTREAM_PORT << R"(
   -f, --frontend=(<HOST>,<PORT>|unix:<PATH>)
@@ -1279,6 +1411,15 @@ Connections:
               This  option can  be used  multiple times  to listen  to
               multiple addresses.
               Default: *,3000
+  --metrics-frontend=(<HOST>,<PORT>|unix:<PATH>)
+              Serve  metrics of   worker  process  in Prometheus  text
+              format  at   /metrics  on  this  address.   The  metrics
+              include   the  number  of  connections,   requests,  TLS
+              handshakes  and   backend  connects, and  histograms  of
+              request time and backend  response latency.  The address
+              is given in  the same  form as --frontend.  This  option
+              can be  used multiple   times.  The  port should  not be
+              exposed to untrusted network.
   --backlog=<N>
               Set listen backlog size.
               Default: )" << get_config()->conn.listener.backlog << R"(
@@ -1381,6 +1522,23 @@ Performance:
               Set maximum number of open files (RLIMIT_NOFILE) to <N>.
               If 0 is given, nghttpx does not set the limit.
               Default: )" << get_config()->rlimit_nofile << R"(
+  --event-backend=<BACKEND>
+              Specify the event notification mechanism (libev backend)
+              used  by nghttpx.  <BACKEND> is one of "auto", "select",
+              "poll",   "epoll",  "kqueue",  "port",  and  "io_uring".
+              "auto"  lets libev choose the best one for the platform.
+              This  only  selects how readiness of file descriptors is
+              notified.  Whatever backend is chosen, nghttpx reads and
+              writes   sockets   with  ordinary  system  calls.   Thus
+              "io_uring"  uses io_uring only as libev's poller, and it
+              does  not  submit  socket  I/O  to io_uring.  "io_uring"
+              requires  libev  4.31  or  later.   If  io_uring  is not
+              supported  by  the running kernel, nghttpx falls back to
+              the  backend  chosen  by  "auto".   Other  backends  are
+              rejected  at  startup  if  they are not supported on the
+              platform.
+              Default: )" << str_event_backend(get_config()->ev_loop_flags)
+      << R"(
   --backend-request-buffer=<SIZE>
               Set buffer size used to store backend request.
               Default: )"
@@ -1397,6 +1555,21 @@ Performance:
               that have not yet completed the three-way handshake.  If
               value is 0 then fast open is disabled.
               Default: )" << get_config()->conn.listener.fastopen << R"(
+  --frontend-tcp-notsent-lowat=<SIZE>
+              Set TCP_NOTSENT_LOWAT  socket option to <SIZE>  for each
+              accepted frontend  connection.  The kernel  then reports
+              the socket writable only when  the amount of unsent data
+              in its send buffer falls below <SIZE>, and nghttpx keeps
+              the remaining  data inside  its HTTP/2  scheduler rather
+              than queuing it in the  kernel.  This lets high priority
+              streams  overtake  bulk  transfers  already  in  flight.
+              HTTP/2  frontend also  limits its  own output  buffer to
+              <SIZE>.  Specify 0 to disable this feature.  This option
+              is   silently  ignored   if  TCP_NOTSENT_LOWAT   is  not
+              available.
+              Default: )"
+      << util::utos_unit(get_config()->conn.upstream.tcp_notsent_lowat)
+      << R"(
 Timeout:
   --frontend-http2-read-timeout=<DURATION>
               Specify  read  timeout  for  HTTP/2  and  SPDY  frontend
@@ -1435,6 +1608,37 @@ Timeout:
               Default: )"
       << util::duration_str(get_config()->conn.downstream.timeout.idle_read)
       << R"(
+  --backend-health-check-interval=<DURATION>
+              Specify the  interval between active health  checks of a
+              backend address.   Health check  is enabled  per backend
+              address by "health" parameter of --backend option.
+              Default: )"
+      << util::duration_str(
+             get_config()->conn.downstream.health_check.interval) << R"(
+  --backend-health-check-timeout=<DURATION>
+              Specify the timeout of an active health check, including
+              connection  establishment.   If  health check  does  not
+              finish in this period, it fails.
+              Default: )"
+      << util::duration_str(get_config()->conn.downstream.health_check.timeout)
+      << R"(
+  --backend-cache-collapse-timeout=<DURATION>
+              Specify  the   maximum  time  a  request   collapsed  by
+              "collapse" parameter  of --backend option waits  for the
+              response to the identical request in flight.  After this
+              period, the request is forwarded to backend.
+              Default: )"
+      << util::duration_str(
+             get_config()->conn.downstream.cache_collapse_timeout) << R"(
+  --backend-limit-queue-timeout=<DURATION>
+              Specify  the  maximum  time  a  request  waits  for  the
+              concurrency limit set by  "limit" parameter of --backend
+              option.  If no slot becomes free within this period, the
+              request is answered with  503.  Specifying 0 rejects the
+              request immediately.
+              Default: )"
+      << util::duration_str(get_config()->conn.downstream.limit_queue_timeout)
+      << R"(
   --listener-disable-timeout=<DURATION>
               After accepting  connection failed,  connection listener
               is disabled  for a given  amount of time.   Specifying 0
@@ -1459,12 +1663,33 @@ SSL/TLS:
               Path  to file  that contains  password for  the server's
               private key.   If none is  given and the private  key is
               password protected it'll be requested interactively.
+  --private-key-threads=<N>
+              Perform  RSA and  ECDSA  private key  operations in  TLS
+              handshake in <N> dedicated  threads, using OpenSSL async
+              job, so that  handshakes do not block the  event loop of
+              worker threads.   0 disables it, and  the operations are
+              performed  in  worker  threads.   This  option  requires
+              OpenSSL 1.1.0  or later,  and is  ignored if  nghttpx is
+              built with neverbleed.
+              Default: )"
+      << get_config()->tls.private_key_threads << R"(
   --subcert=<KEYPATH>:<CERTPATH>
               Specify  additional certificate  and  private key  file.
               nghttpx will  choose certificates based on  the hostname
               indicated  by  client  using TLS  SNI  extension.   This
               option  can  be  used  multiple  times.   To  make  OCSP
               stapling work, <CERTPATH> must be absolute path.
+  --subcert-lazy-cache-size=<N>
+              Load  private key  and  certificate  given by  --subcert
+              lazily when a  client first asks for their  names by TLS
+              SNI,  and keep  at most  <N> of  them in  memory.  Least
+              recently used one  is freed when the  limit is exceeded.
+              Certificate  files are  still read  at startup  to build
+              hostname  index.   0  disables  lazy  loading,  and  all
+              certificates are loaded at  startup.  OCSP stapling does
+              not work for lazily loaded certificates.
+              Default: )"
+      << get_config()->tls.subcert_lazy_cache_size << R"(
   --backend-tls-sni-field=<HOST>
               Explicitly  set the  content of  the TLS  SNI extension.
               This will default to the backend HOST name.
@@ -1582,6 +1807,36 @@ SSL/TLS:
               Default: )"
       << util::duration_str(get_config()->tls.ocsp.update_interval) << R"(
   --no-ocsp   Disable OCSP stapling.
+  --fetch-ocsp-response-builtin
+              Fetch  OCSP  responses  by  builtin  client  instead  of
+              running  fetch-ocsp-response script.   The client  sends
+              OCSP  requests  to   responders  over  HTTP/1.1  without
+              blocking  the event  loop,  verifies  the signature  and
+              validity  of responses,  and then  replaces the  stapled
+              responses.  The  issuer certificate must be  included in
+              the   certificate  file,   unless  the   certificate  is
+              self-signed.  --fetch-ocsp-response-file is ignored.
+  --fetch-ocsp-response-concurrency=<N>
+              Set the maximum  number of OCSP queries  made by builtin
+              OCSP client concurrently.
+              Default: )"
+      << get_config()->tls.ocsp.fetch_concurrency << R"(
+  --ocsp-responder=<URI>
+              Send OCSP requests to <URI> instead of the responder URI
+              found in certificate.  Only http URI is supported.  This
+              option is only used by builtin OCSP client.
+  --tls-session-cache-shm-size=<SIZE>
+              Specify the size  of shared memory to  store TLS session
+              cache.  The cache  is shared by all  worker threads, and
+              lookup does not require  any external service.  Sessions
+              are stored in fixed size  slots, and session larger than
+              1KiB is not cached.  If --tls-session-cache-memcached is
+              also given, memcached  is used as second  tier cache.  0
+              disables this  feature.  The shared memory  is allocated
+              when nghttpx  starts, and  it is  not retained  when the
+              executable is replaced with SIGUSR2.
+              Default: )"
+      << util::utos_unit(get_config()->tls.session_cache.shm.size) << R"(
   --tls-session-cache-memcached=<HOST>,<PORT>
               Specify  address of  memcached server  to store  session
               cache.   This  enables   shared  session  cache  between
@@ -1622,6 +1877,18 @@ SSL/TLS:
               TLS HTTP/2 backends.
               Default: )"
       << util::duration_str(get_config()->tls.dyn_rec.idle_timeout) << R"(
+  --tls-dyn-rec-adaptive
+              Derive TLS  record size  from the congestion  window and
+              the round  trip time  of the underlying  TCP connection,
+              which  are periodically  obtained using  TCP_INFO socket
+              option.  The record size is  chosen so that a record can
+              be sent within one round  trip, and is refreshed at most
+              once per  round trip  time.  This  option is  ignored if
+              --tls-dyn-rec-warmup-threshold is 0.  If TCP_INFO is not
+              available,      the      behaviour     described      in
+              --tls-dyn-rec-warmup-threshold is  used.  This behaviour
+              applies  to  all TLS  based  frontends,  and TLS  HTTP/2
+              backends.
   --no-http2-cipher-black-list
               Allow black  listed cipher  suite on  HTTP/2 connection.
               See  https://tools.ietf.org/html/rfc7540#appendix-A  for
@@ -1640,6 +1907,31 @@ HTTP/2 and SPDY:
               concurrent requests are set by a remote server.
               Default: )"
       << get_config()->http2.downstream.max_concurrent_streams << R"(
+  --backend-http2-coalesce
+              Coalesce requests to a backend address group into as few
+              HTTP/2  sessions as  possible.  A  worker creates  a new
+              session  only when  all of  its sessions  for the  group
+              reached  the  maximum   number  of  concurrent  streams,
+              instead of preparing one  session per backend address up
+              front.   Each   worker  also  starts  its   round  robin
+              selection  from  a  random   backend  address,  so  that
+              connections  from different  workers  are spread  across
+              backend  addresses rather  than all  going to  the first
+              one.
+  --backend-http2-warm-connections=<N>
+              Open  <N> HTTP/2  sessions to  each backend  address per
+              worker in advance, so that  requests do not wait for TCP
+              connection,  TLS handshake  and SETTINGS  exchange.  The
+              idle sessions are kept alive  with PING.  When a session
+              is  closed or  saturated,  a new  one  is opened.   Each
+              worker also opens an extra  session ahead of demand when
+              the  number of  requests in  flight, estimated  from the
+              recent request rate and response latency of the address,
+              approaches the  number of streams the  open sessions can
+              accept.   This option  only  affects  the backends  with
+              "proto=h2".  0 disables this feature.
+              Default: )"
+      << get_config()->http2.downstream.warm_connections << R"(
   --frontend-http2-window-bits=<N>
               Sets the  per-stream initial window size  of HTTP/2 SPDY
               frontend connection.  For HTTP/2,  the size is 2**<N>-1.
@@ -1731,6 +2023,30 @@ Logging:
               disambiguation (e.g., ${remote_addr}).
 
               Default: )" << DEFAULT_ACCESSLOG_FORMAT << R"(
+  --accesslog-buffer=<SIZE>
+              Write access  log asynchronously in a  dedicated thread.
+              Each worker appends  access log lines to  its own buffer
+              of <SIZE> bytes,  and the writer thread  writes them out
+              in  batch.   This  prevents  slow disk  or  syslog  from
+              stalling workers.   Specifying 0 disables  this feature,
+              and access log is written by each worker synchronously.
+              Default: )"
+      << util::utos_unit(get_config()->logging.access.buffer_size) << R"(
+  --accesslog-overflow=<POLICY>
+              Specify  what  to  do   when  the  buffer  specified  by
+              --accesslog-buffer is full.  If  <POLICY> is "drop", the
+              access  log  line  is   discarded,  and  the  number  of
+              discarded lines is written to error log.  If <POLICY> is
+              "block", the worker waits  until the writer thread makes
+              enough space.
+              Default: drop
+  --accesslog-binary
+              Write  access log  in compact  binary format  instead of
+              text.  The variables specified by --accesslog-format are
+              stored   in   length-prefixed  records   without   being
+              formatted.  Use nghttpx-logdecode to  convert it to text
+              or   JSON.    This   option    cannot   be   used   with
+              --accesslog-syslog.
   --errorlog-file=<PATH>
               Set path to write error  log.  To reopen file, send USR1
               signal  to nghttpx.   stderr will  be redirected  to the
@@ -1909,7 +2225,8 @@ void process_options(
     std::vector<std::pair<const char *, const char *>> &cmdcfgs) {
   if (conf_exists(get_config()->conf_path.c_str())) {
     std::set<std::string> include_set;
-    if (load_config(get_config()->conf_path.c_str(), include_set) == -1) {
+    if (load_config(mod_config(), get_config()->conf_path.c_str(),
+                    include_set) == -1) {
       LOG(FATAL) << "Failed to load configuration from "
                  << get_config()->conf_path;
       exit(EXIT_FAILURE);
@@ -1917,6 +2234,8 @@ void process_options(
     assert(include_set.empty());
   }
 
+  Log::set_severity_level(get_config()->logging.severity);
+
   if (argc - optind >= 2) {
     cmdcfgs.emplace_back(SHRPX_OPT_PRIVATE_KEY_FILE, argv[optind++]);
     cmdcfgs.emplace_back(SHRPX_OPT_CERTIFICATE_FILE, argv[optind++]);
@@ -1929,8 +2248,8 @@ void process_options(
     std::set<std::string> include_set;
 
     for (size_t i = 0, len = cmdcfgs.size(); i < len; ++i) {
-      if (parse_config(cmdcfgs[i].first, cmdcfgs[i].second, include_set) ==
-          -1) {
+      if (parse_config(mod_config(), cmdcfgs[i].first, cmdcfgs[i].second,
+                       include_set) == -1) {
         LOG(FATAL) << "Failed to parse command-line argument.";
         exit(EXIT_FAILURE);
       }
@@ -1939,8 +2258,18 @@ void process_options(
     assert(include_set.empty());
   }
 
+  Log::set_severity_level(get_config()->logging.severity);
+
+  // Kept for configuration reload.
+  mod_config()->cmdcfgs = cmdcfgs;
+
   auto &loggingconf = get_config()->logging;
 
+  if (loggingconf.access.binary && loggingconf.access.syslog) {
+    LOG(FATAL) << "--accesslog-binary cannot be used with --accesslog-syslog";
+    exit(EXIT_FAILURE);
+  }
+
   if (loggingconf.access.syslog || loggingconf.error.syslog) {
     openlog("nghttpx", LOG_NDELAY | LOG_NOWAIT | LOG_PID,
             loggingconf.syslog_facility);
@@ -2056,7 +2385,8 @@ void process_options(
     exit(EXIT_FAILURE);
   }
 
-  if (!upstreamconf.no_tls && !tlsconf.ocsp.disabled) {
+  if (!upstreamconf.no_tls && !tlsconf.ocsp.disabled &&
+      !tlsconf.ocsp.fetch_builtin) {
     struct stat buf;
     if (stat(tlsconf.ocsp.fetch_ocsp_response_file.c_str(), &buf) != 0) {
       tlsconf.ocsp.disabled = true;
@@ -2066,137 +2396,13 @@ void process_options(
     }
   }
 
-  auto &addr_groups = downstreamconf.addr_groups;
-
-  if (addr_groups.empty()) {
-    DownstreamAddrConfig addr{};
-    addr.host = ImmutableString::from_lit(DEFAULT_DOWNSTREAM_HOST);
-    addr.port = DEFAULT_DOWNSTREAM_PORT;
-
-    DownstreamAddrGroupConfig g(StringRef::from_lit("/"));
-    g.proto = PROTO_HTTP1;
-    g.addrs.push_back(std::move(addr));
-    mod_config()->router.add_route(StringRef{g.pattern}, addr_groups.size());
-    addr_groups.push_back(std::move(g));
-  } else if (get_config()->http2_proxy) {
-    // We don't support host mapping in these cases.  Move all
-    // non-catch-all patterns to catch-all pattern.
-    DownstreamAddrGroupConfig catch_all(StringRef::from_lit("/"));
-    auto proto = PROTO_NONE;
-    for (auto &g : addr_groups) {
-      if (proto == PROTO_NONE) {
-        proto = g.proto;
-      } else if (proto != g.proto) {
-        LOG(ERROR) << SHRPX_OPT_BACKEND << ": <PATTERN> was ignored with "
-                                           "--http2-proxy, and protocol must "
-                                           "be the same for all backends.";
-        exit(EXIT_FAILURE);
-      }
-      std::move(std::begin(g.addrs), std::end(g.addrs),
-                std::back_inserter(catch_all.addrs));
-    }
-    catch_all.proto = proto;
-    std::vector<DownstreamAddrGroupConfig>().swap(addr_groups);
-    std::vector<WildcardPattern>().swap(mod_config()->wildcard_patterns);
-    // maybe not necessary?
-    mod_config()->router = Router();
-    mod_config()->router.add_route(StringRef{catch_all.pattern},
-                                   addr_groups.size());
-    addr_groups.push_back(std::move(catch_all));
-  } else {
-    auto &wildcard_patterns = mod_config()->wildcard_patterns;
-    std::sort(std::begin(wildcard_patterns), std::end(wildcard_patterns),
-              [](const WildcardPattern &lhs, const WildcardPattern &rhs) {
-                return std::lexicographical_compare(
-                    rhs.host.rbegin(), rhs.host.rend(), lhs.host.rbegin(),
-                    lhs.host.rend());
-              });
-    if (LOG_ENABLED(INFO)) {
-      LOG(INFO) << "Reverse sorted wildcard hosts (compared from tail to head, "
-                   "and sorted in reverse order):";
-      for (auto &wp : mod_config()->wildcard_patterns) {
-        LOG(INFO) << wp.host;
-      }
-    }
-  }
-
-  if (LOG_ENABLED(INFO)) {
-    LOG(INFO) << "Resolving backend address";
-  }
-
-  ssize_t catch_all_group = -1;
-  for (size_t i = 0; i < addr_groups.size(); ++i) {
-    auto &g = addr_groups[i];
-    if (g.pattern == "/") {
-      catch_all_group = i;
-    }
-    if (LOG_ENABLED(INFO)) {
-      LOG(INFO) << "Host-path pattern: group " << i << ": '" << g.pattern
-                << "', proto=" << strproto(g.proto);
-      for (auto &addr : g.addrs) {
-        LOG(INFO) << "group " << i << " -> " << addr.host.c_str()
-                  << (addr.host_unix ? "" : ":" + util::utos(addr.port));
-      }
-    }
-  }
-
-  if (catch_all_group == -1) {
-    LOG(FATAL) << "backend: No catch-all backend address is configured";
+  if (configure_downstream_group(*downstreamconf.routing,
+                                 get_config()->http2_proxy,
+                                 downstreamconf.family) != 0) {
+    LOG(FATAL) << "Failed to configure backend";
     exit(EXIT_FAILURE);
   }
 
-  downstreamconf.addr_group_catch_all = catch_all_group;
-
-  if (LOG_ENABLED(INFO)) {
-    LOG(INFO) << "Catch-all pattern is group " << catch_all_group;
-  }
-
-  for (auto &g : addr_groups) {
-    for (auto &addr : g.addrs) {
-
-      if (addr.host_unix) {
-        // for AF_UNIX socket, we use "localhost" as host for backend
-        // hostport.  This is used as Host header field to backend and
-        // not going to be passed to any syscalls.
-        addr.hostport = "localhost";
-
-        auto path = addr.host.c_str();
-        auto pathlen = addr.host.size();
-
-        if (pathlen + 1 > sizeof(addr.addr.su.un.sun_path)) {
-          LOG(FATAL) << "UNIX domain socket path " << path << " is too long > "
-                     << sizeof(addr.addr.su.un.sun_path);
-          exit(EXIT_FAILURE);
-        }
-
-        if (LOG_ENABLED(INFO)) {
-          LOG(INFO) << "Use UNIX domain socket path " << path
-                    << " for backend connection";
-        }
-
-        addr.addr.su.un.sun_family = AF_UNIX;
-        // copy path including terminal NULL
-        std::copy_n(path, pathlen + 1, addr.addr.su.un.sun_path);
-        addr.addr.len = sizeof(addr.addr.su.un);
-
-        continue;
-      }
-
-      addr.hostport = ImmutableString(
-          util::make_http_hostport(StringRef(addr.host), addr.port));
-
-      auto hostport = util::make_hostport(StringRef{addr.host}, addr.port);
-
-      if (resolve_hostname(&addr.addr, addr.host.c_str(), addr.port,
-                           downstreamconf.family) == -1) {
-        LOG(FATAL) << "Resolving backend address failed: " << hostport;
-        exit(EXIT_FAILURE);
-      }
-      LOG(NOTICE) << "Resolved backend address: " << hostport << " -> "
-                  << util::to_numeric_addr(&addr.addr);
-    }
-  }
-
   auto &proxy = mod_config()->downstream_http_proxy;
   if (!proxy.host.empty()) {
     auto hostport = util::make_hostport(StringRef{proxy.host}, proxy.port);
@@ -2467,6 +2673,31 @@ int main(int argc, char **argv) {
         {SHRPX_OPT_BACKEND_TLS, no_argument, &flag, 120},
         {SHRPX_OPT_BACKEND_CONNECTIONS_PER_HOST, required_argument, &flag, 121},
         {SHRPX_OPT_ERROR_PAGE, required_argument, &flag, 122},
+        {SHRPX_OPT_TLS_DYN_REC_ADAPTIVE, no_argument, &flag, 123},
+        {SHRPX_OPT_FRONTEND_TCP_NOTSENT_LOWAT, required_argument, &flag, 124},
+        {SHRPX_OPT_EVENT_BACKEND, required_argument, &flag, 125},
+        {SHRPX_OPT_BACKEND_HTTP2_COALESCE, no_argument, &flag, 126},
+        {SHRPX_OPT_BACKEND_HEALTH_CHECK_INTERVAL, required_argument, &flag,
+         127},
+        {SHRPX_OPT_BACKEND_HEALTH_CHECK_TIMEOUT, required_argument, &flag,
+         128},
+        {SHRPX_OPT_BACKEND_CACHE_COLLAPSE_TIMEOUT, required_argument, &flag,
+         129},
+        {SHRPX_OPT_BACKEND_HTTP2_WARM_CONNECTIONS, required_argument, &flag,
+         130},
+        {SHRPX_OPT_BACKEND_LIMIT_QUEUE_TIMEOUT, required_argument, &flag,
+         131},
+        {SHRPX_OPT_ACCESSLOG_BUFFER, required_argument, &flag, 132},
+        {SHRPX_OPT_ACCESSLOG_OVERFLOW, required_argument, &flag, 133},
+        {SHRPX_OPT_ACCESSLOG_BINARY, no_argument, &flag, 134},
+        {SHRPX_OPT_METRICS_FRONTEND, required_argument, &flag, 135},
+        {SHRPX_OPT_TLS_SESSION_CACHE_SHM_SIZE, required_argument, &flag, 136},
+        {SHRPX_OPT_FETCH_OCSP_RESPONSE_BUILTIN, no_argument, &flag, 137},
+        {SHRPX_OPT_FETCH_OCSP_RESPONSE_CONCURRENCY, required_argument, &flag,
+         138},
+        {SHRPX_OPT_OCSP_RESPONDER, required_argument, &flag, 139},
+        {SHRPX_OPT_SUBCERT_LAZY_CACHE_SIZE, required_argument, &flag, 140},
+        {SHRPX_OPT_PRIVATE_KEY_THREADS, required_argument, &flag, 141},
         {nullptr, 0, nullptr, 0}};
 
     int option_index = 0;
@@ -2989,6 +3220,82 @@ int main(int argc, char **argv) {
         // --error-page
         cmdcfgs.emplace_back(SHRPX_OPT_ERROR_PAGE, optarg);
         break;
+      case 123:
+        // --tls-dyn-rec-adaptive
+        cmdcfgs.emplace_back(SHRPX_OPT_TLS_DYN_REC_ADAPTIVE, "yes");
+        break;
+      case 124:
+        // --frontend-tcp-notsent-lowat
+        cmdcfgs.emplace_back(SHRPX_OPT_FRONTEND_TCP_NOTSENT_LOWAT, optarg);
+        break;
+      case 125:
+        // --event-backend
+        cmdcfgs.emplace_back(SHRPX_OPT_EVENT_BACKEND, optarg);
+        break;
+      case 126:
+        // --backend-http2-coalesce
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_HTTP2_COALESCE, "yes");
+        break;
+      case 127:
+        // --backend-health-check-interval
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_HEALTH_CHECK_INTERVAL, optarg);
+        break;
+      case 128:
+        // --backend-health-check-timeout
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_HEALTH_CHECK_TIMEOUT, optarg);
+        break;
+      case 129:
+        // --backend-cache-collapse-timeout
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_CACHE_COLLAPSE_TIMEOUT, optarg);
+        break;
+      case 130:
+        // --backend-http2-warm-connections
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_HTTP2_WARM_CONNECTIONS, optarg);
+        break;
+      case 131:
+        // --backend-limit-queue-timeout
+        cmdcfgs.emplace_back(SHRPX_OPT_BACKEND_LIMIT_QUEUE_TIMEOUT, optarg);
+        break;
+      case 132:
+        // --accesslog-buffer
+        cmdcfgs.emplace_back(SHRPX_OPT_ACCESSLOG_BUFFER, optarg);
+        break;
+      case 133:
+        // --accesslog-overflow
+        cmdcfgs.emplace_back(SHRPX_OPT_ACCESSLOG_OVERFLOW, optarg);
+        break;
+      case 134:
+        // --accesslog-binary
+        cmdcfgs.emplace_back(SHRPX_OPT_ACCESSLOG_BINARY, "yes");
+        break;
+      case 135:
+        // --metrics-frontend
+        cmdcfgs.emplace_back(SHRPX_OPT_METRICS_FRONTEND, optarg);
+        break;
+      case 136:
+        // --tls-session-cache-shm-size
+        cmdcfgs.emplace_back(SHRPX_OPT_TLS_SESSION_CACHE_SHM_SIZE, optarg);
+        break;
+      case 137:
+        // --fetch-ocsp-response-builtin
+        cmdcfgs.emplace_back(SHRPX_OPT_FETCH_OCSP_RESPONSE_BUILTIN, "yes");
+        break;
+      case 138:
+        // --fetch-ocsp-response-concurrency
+        cmdcfgs.emplace_back(SHRPX_OPT_FETCH_OCSP_RESPONSE_CONCURRENCY, optarg);
+        break;
+      case 139:
+        // --ocsp-responder
+        cmdcfgs.emplace_back(SHRPX_OPT_OCSP_RESPONDER, optarg);
+        break;
+      case 140:
+        // --subcert-lazy-cache-size
+        cmdcfgs.emplace_back(SHRPX_OPT_SUBCERT_LAZY_CACHE_SIZE, optarg);
+        break;
+      case 141:
+        // --private-key-threads
+        cmdcfgs.emplace_back(SHRPX_OPT_PRIVATE_KEY_THREADS, optarg);
+        break;
       default:
         break;
       }
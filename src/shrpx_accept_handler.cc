@@ -27,8 +27,12 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif // HAVE_UNISTD_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <cerrno>
+#include <cstring>
 
 #include "shrpx_connection_handler.h"
 #include "shrpx_config.h"
@@ -101,6 +105,22 @@ void AcceptHandler::accept_connection() {
 
     util::make_socket_nodelay(cfd);
 
+#ifdef TCP_NOTSENT_LOWAT
+    auto notsent_lowat = get_config()->conn.upstream.tcp_notsent_lowat;
+    if (notsent_lowat > 0) {
+      int val = notsent_lowat;
+      if (setsockopt(cfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val,
+                     static_cast<socklen_t>(sizeof(val))) == -1) {
+        if (LOG_ENABLED(INFO)) {
+          auto error = errno;
+          LOG(INFO) << "Failed to set TCP_NOTSENT_LOWAT option to frontend "
+                       "socket: "
+                    << strerror(error);
+        }
+      }
+    }
+#endif // TCP_NOTSENT_LOWAT
+
     conn_hnr_->handle_connection(cfd, &sockaddr.sa, addrlen, faddr_);
   }
 }
@@ -0,0 +1,612 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_accesslog_binary.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cinttypes>
+#include <algorithm>
+
+#include "shrpx_downstream.h"
+#include "util.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+namespace {
+// Entry encoder which never writes past the end of buffer.  If the
+// buffer is too small for integer, it is marked as overflowed.
+class Encoder {
+public:
+  Encoder(uint8_t *buf, size_t buflen, size_t nfields)
+      : p_(buf), last_(buf + buflen), nfields_(nfields), overflow_(false) {}
+
+  void put_uvarint(uint64_t n) {
+    if (last_ - p_ < 10) {
+      overflow_ = true;
+      return;
+    }
+    for (; n >= 0x80; n >>= 7) {
+      *p_++ = (n & 0x7f) | 0x80;
+    }
+    *p_++ = n;
+  }
+
+  void put_str(const uint8_t *s, size_t len) {
+    // Leave room for the variables which follow.
+    auto reserve = nfields_ * FIELD_RESERVE + 10;
+    auto avail = static_cast<size_t>(last_ - p_);
+    len = avail > reserve ? std::min(len, avail - reserve) : 0;
+
+    put_uvarint(len + 1);
+    if (overflow_) {
+      return;
+    }
+    p_ = std::copy_n(s, len, p_);
+  }
+
+  void put_str(const StringRef &s) {
+    put_str(reinterpret_cast<const uint8_t *>(s.c_str()), s.size());
+  }
+
+  void put_missing() { put_uvarint(0); }
+
+  // Call this function after each variable is encoded.
+  void next_field() { --nfields_; }
+
+  uint8_t *pos() const { return p_; }
+  bool overflow() const { return overflow_; }
+
+private:
+  // The number of bytes reserved for each remaining variable, when
+  // string is truncated.
+  static constexpr size_t FIELD_RESERVE = 24;
+
+  uint8_t *p_;
+  uint8_t *last_;
+  size_t nfields_;
+  bool overflow_;
+};
+} // namespace
+
+namespace {
+void put_uvarint(std::string &out, uint64_t n) {
+  for (; n >= 0x80; n >>= 7) {
+    out += static_cast<char>((n & 0x7f) | 0x80);
+  }
+  out += static_cast<char>(n);
+}
+} // namespace
+
+namespace {
+void put_record_length(uint8_t *buf, size_t len) {
+  buf[0] = len >> 8;
+  buf[1] = len & 0xff;
+}
+} // namespace
+
+std::string encode_accesslog_schema(const std::vector<LogFragment> &lfv) {
+  std::string res;
+
+  res.resize(2);
+  res += static_cast<char>(ACCESSLOG_RECORD_SCHEMA);
+
+  put_uvarint(res, lfv.size());
+
+  for (auto &lf : lfv) {
+    put_uvarint(res, lf.type);
+
+    switch (lf.type) {
+    case SHRPX_LOGF_LITERAL:
+    case SHRPX_LOGF_HTTP:
+      put_uvarint(res, lf.value.size());
+      res.append(lf.value.c_str(), lf.value.size());
+      break;
+    default:
+      break;
+    }
+  }
+
+  assert(res.size() - 2 <= ACCESSLOG_RECORD_MAX);
+
+  put_record_length(reinterpret_cast<uint8_t *>(&res[0]), res.size() - 2);
+
+  return res;
+}
+
+size_t encode_accesslog_entry(uint8_t *buf, size_t buflen,
+                              const std::vector<LogFragment> &lfv,
+                              const LogSpec &lgsp) {
+  assert(buflen >= 64);
+
+  const Request *req = nullptr;
+  if (lgsp.downstream) {
+    req = &lgsp.downstream->request();
+  }
+
+  auto nfields = std::count_if(
+      std::begin(lfv), std::end(lfv),
+      [](const LogFragment &lf) { return lf.type != SHRPX_LOGF_LITERAL; });
+
+  buf[2] = ACCESSLOG_RECORD_ENTRY;
+
+  Encoder enc(buf + 3, std::min(buflen, ACCESSLOG_RECORD_MAX + 2) - 3,
+              nfields);
+
+  for (auto &lf : lfv) {
+    switch (lf.type) {
+    case SHRPX_LOGF_LITERAL:
+      continue;
+    case SHRPX_LOGF_REMOTE_ADDR:
+      enc.put_str(lgsp.remote_addr);
+      break;
+    case SHRPX_LOGF_TIME_LOCAL:
+    case SHRPX_LOGF_TIME_ISO8601:
+      enc.put_uvarint(std::chrono::duration_cast<std::chrono::milliseconds>(
+                          lgsp.time_now.time_since_epoch()).count());
+      break;
+    case SHRPX_LOGF_REQUEST:
+      enc.put_str(lgsp.method);
+      enc.put_str(lgsp.path);
+      enc.put_uvarint(lgsp.major);
+      enc.put_uvarint(lgsp.minor);
+      break;
+    case SHRPX_LOGF_STATUS:
+      enc.put_uvarint(lgsp.status);
+      break;
+    case SHRPX_LOGF_BODY_BYTES_SENT:
+      enc.put_uvarint(std::max(static_cast<int64_t>(0), lgsp.body_bytes_sent));
+      break;
+    case SHRPX_LOGF_HTTP: {
+      auto hd = req ? req->fs.header(StringRef(lf.value)) : nullptr;
+      if (hd) {
+        enc.put_str((*hd).value);
+      } else {
+        enc.put_missing();
+      }
+      break;
+    }
+    case SHRPX_LOGF_AUTHORITY:
+      if (req && !req->authority.empty()) {
+        enc.put_str(req->authority);
+      } else {
+        enc.put_missing();
+      }
+      break;
+    case SHRPX_LOGF_REMOTE_PORT:
+      enc.put_str(lgsp.remote_port);
+      break;
+    case SHRPX_LOGF_SERVER_PORT:
+      enc.put_uvarint(lgsp.server_port);
+      break;
+    case SHRPX_LOGF_REQUEST_TIME:
+      enc.put_uvarint(std::chrono::duration_cast<std::chrono::milliseconds>(
+                          lgsp.request_end_time - lgsp.request_start_time)
+                          .count());
+      break;
+    case SHRPX_LOGF_PID:
+      enc.put_uvarint(lgsp.pid);
+      break;
+    case SHRPX_LOGF_ALPN:
+      enc.put_str(lgsp.alpn);
+      break;
+    case SHRPX_LOGF_SSL_CIPHER:
+      if (lgsp.tls_info) {
+        enc.put_str(StringRef{lgsp.tls_info->cipher});
+      } else {
+        enc.put_missing();
+      }
+      break;
+    case SHRPX_LOGF_SSL_PROTOCOL:
+      if (lgsp.tls_info) {
+        enc.put_str(StringRef{lgsp.tls_info->protocol});
+      } else {
+        enc.put_missing();
+      }
+      break;
+    case SHRPX_LOGF_SSL_SESSION_ID:
+      if (lgsp.tls_info && lgsp.tls_info->session_id_length) {
+        enc.put_str(lgsp.tls_info->session_id,
+                    lgsp.tls_info->session_id_length);
+      } else {
+        enc.put_missing();
+      }
+      break;
+    case SHRPX_LOGF_SSL_SESSION_REUSED:
+      // 0: no TLS, 1: new session, 2: session was reused.
+      enc.put_uvarint(lgsp.tls_info ? lgsp.tls_info->session_reused ? 2 : 1
+                                    : 0);
+      break;
+    default:
+      break;
+    }
+
+    enc.next_field();
+  }
+
+  if (enc.overflow()) {
+    return 0;
+  }
+
+  auto len = enc.pos() - buf;
+
+  put_record_length(buf, len - 2);
+
+  return len;
+}
+
+AccessLogDecoder::AccessLogDecoder(bool json) : json_(json) {}
+
+namespace {
+int get_uvarint(uint64_t &res, const uint8_t *&p, const uint8_t *last) {
+  res = 0;
+  for (size_t shift = 0; p != last && shift < 64; shift += 7) {
+    auto c = *p++;
+    res |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+} // namespace
+
+namespace {
+// Decodes string into |res|.  |missing| is set to true if the value
+// is not available.
+int get_str(StringRef &res, bool &missing, const uint8_t *&p,
+            const uint8_t *last) {
+  uint64_t n;
+  if (get_uvarint(n, p, last) != 0) {
+    return -1;
+  }
+  missing = n == 0;
+  if (missing) {
+    res = StringRef{};
+    return 0;
+  }
+  --n;
+  if (static_cast<uint64_t>(last - p) < n) {
+    return -1;
+  }
+  res = StringRef{p, p + n};
+  p += n;
+  return 0;
+}
+} // namespace
+
+ssize_t AccessLogDecoder::decode(std::string &out, const uint8_t *data,
+                                 size_t len) {
+  auto p = data;
+  auto last = data + len;
+
+  while (last - p >= 2) {
+    size_t reclen = (p[0] << 8) | p[1];
+    if (static_cast<size_t>(last - p - 2) < reclen) {
+      break;
+    }
+
+    auto first = p + 2;
+    p = first + reclen;
+
+    if (reclen == 0) {
+      return -1;
+    }
+
+    switch (*first) {
+    case ACCESSLOG_RECORD_SCHEMA:
+      if (decode_schema(first + 1, p) != 0) {
+        return -1;
+      }
+      break;
+    case ACCESSLOG_RECORD_ENTRY:
+      if (decode_entry(out, first + 1, p) != 0) {
+        return -1;
+      }
+      break;
+    default:
+      // Ignore unknown record for future extension.
+      break;
+    }
+  }
+
+  return p - data;
+}
+
+int AccessLogDecoder::decode_schema(const uint8_t *p, const uint8_t *last) {
+  uint64_t n;
+  if (get_uvarint(n, p, last) != 0) {
+    return -1;
+  }
+
+  std::vector<LogFragment> schema;
+
+  for (; n; --n) {
+    uint64_t type;
+    if (get_uvarint(type, p, last) != 0 ||
+        type > SHRPX_LOGF_SSL_SESSION_REUSED) {
+      return -1;
+    }
+
+    switch (type) {
+    case SHRPX_LOGF_LITERAL:
+    case SHRPX_LOGF_HTTP: {
+      uint64_t len;
+      if (get_uvarint(len, p, last) != 0 ||
+          static_cast<uint64_t>(last - p) < len) {
+        return -1;
+      }
+      schema.emplace_back(
+          static_cast<LogFragmentType>(type),
+          ImmutableString(reinterpret_cast<const char *>(p), len));
+      p += len;
+      break;
+    }
+    default:
+      schema.emplace_back(static_cast<LogFragmentType>(type));
+      break;
+    }
+  }
+
+  schema_ = std::move(schema);
+
+  return 0;
+}
+
+namespace {
+void append_json_str(std::string &out, const StringRef &s) {
+  out += '"';
+  for (auto c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    default:
+      if (static_cast<uint8_t>(c) < 0x20) {
+        char buf[7];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+  out += '"';
+}
+} // namespace
+
+namespace {
+// Returns JSON object key for |lf|.
+std::string json_key(const LogFragment &lf) {
+  switch (lf.type) {
+  case SHRPX_LOGF_REMOTE_ADDR:
+    return "remote_addr";
+  case SHRPX_LOGF_TIME_LOCAL:
+    return "time_local";
+  case SHRPX_LOGF_TIME_ISO8601:
+    return "time_iso8601";
+  case SHRPX_LOGF_REQUEST:
+    return "request";
+  case SHRPX_LOGF_STATUS:
+    return "status";
+  case SHRPX_LOGF_BODY_BYTES_SENT:
+    return "body_bytes_sent";
+  case SHRPX_LOGF_HTTP: {
+    std::string key = "http_";
+    key.append(lf.value.c_str(), lf.value.size());
+    std::replace(std::begin(key), std::end(key), '-', '_');
+    return key;
+  }
+  case SHRPX_LOGF_AUTHORITY:
+    return "authority";
+  case SHRPX_LOGF_REMOTE_PORT:
+    return "remote_port";
+  case SHRPX_LOGF_SERVER_PORT:
+    return "server_port";
+  case SHRPX_LOGF_REQUEST_TIME:
+    return "request_time";
+  case SHRPX_LOGF_PID:
+    return "pid";
+  case SHRPX_LOGF_ALPN:
+    return "alpn";
+  case SHRPX_LOGF_SSL_CIPHER:
+    return "ssl_cipher";
+  case SHRPX_LOGF_SSL_PROTOCOL:
+    return "ssl_protocol";
+  case SHRPX_LOGF_SSL_SESSION_ID:
+    return "ssl_session_id";
+  case SHRPX_LOGF_SSL_SESSION_REUSED:
+    return "ssl_session_reused";
+  default:
+    return "";
+  }
+}
+} // namespace
+
+int AccessLogDecoder::decode_entry(std::string &out, const uint8_t *p,
+                                   const uint8_t *last) {
+  if (schema_.empty()) {
+    // Entry without schema
+    return -1;
+  }
+
+  std::string line;
+  bool first_field = true;
+
+  if (json_) {
+    line += '{';
+  }
+
+  for (auto &lf : schema_) {
+    if (lf.type == SHRPX_LOGF_LITERAL) {
+      if (!json_) {
+        line.append(lf.value.c_str(), lf.value.size());
+      }
+      continue;
+    }
+
+    // Decoded value.  |quote| is true if it is quoted in JSON.
+    std::string value;
+    bool missing = false;
+    bool quote = true;
+
+    switch (lf.type) {
+    case SHRPX_LOGF_REMOTE_ADDR:
+    case SHRPX_LOGF_HTTP:
+    case SHRPX_LOGF_AUTHORITY:
+    case SHRPX_LOGF_REMOTE_PORT:
+    case SHRPX_LOGF_ALPN:
+    case SHRPX_LOGF_SSL_CIPHER:
+    case SHRPX_LOGF_SSL_PROTOCOL: {
+      StringRef s;
+      if (get_str(s, missing, p, last) != 0) {
+        return -1;
+      }
+      value.assign(s.c_str(), s.size());
+      break;
+    }
+    case SHRPX_LOGF_TIME_LOCAL:
+    case SHRPX_LOGF_TIME_ISO8601: {
+      uint64_t t;
+      if (get_uvarint(t, p, last) != 0) {
+        return -1;
+      }
+      auto tp = std::chrono::system_clock::time_point(
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              std::chrono::milliseconds(t)));
+      value = lf.type == SHRPX_LOGF_TIME_LOCAL ? util::format_common_log(tp)
+                                               : util::format_iso8601(tp);
+      break;
+    }
+    case SHRPX_LOGF_REQUEST: {
+      StringRef method, path;
+      bool method_missing, path_missing;
+      uint64_t major, minor;
+      if (get_str(method, method_missing, p, last) != 0 ||
+          get_str(path, path_missing, p, last) != 0 ||
+          get_uvarint(major, p, last) != 0 ||
+          get_uvarint(minor, p, last) != 0) {
+        return -1;
+      }
+      value.assign(method.c_str(), method.size());
+      value += ' ';
+      value.append(path.c_str(), path.size());
+      value += " HTTP/";
+      value += util::utos(major);
+      if (major < 2) {
+        value += '.';
+        value += util::utos(minor);
+      }
+      break;
+    }
+    case SHRPX_LOGF_STATUS:
+    case SHRPX_LOGF_BODY_BYTES_SENT:
+    case SHRPX_LOGF_SERVER_PORT:
+    case SHRPX_LOGF_PID: {
+      uint64_t n;
+      if (get_uvarint(n, p, last) != 0) {
+        return -1;
+      }
+      value = util::utos(n);
+      quote = false;
+      break;
+    }
+    case SHRPX_LOGF_REQUEST_TIME: {
+      uint64_t t;
+      if (get_uvarint(t, p, last) != 0) {
+        return -1;
+      }
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%" PRIu64 ".%03u", t / 1000,
+               static_cast<unsigned int>(t % 1000));
+      value = buf;
+      quote = false;
+      break;
+    }
+    case SHRPX_LOGF_SSL_SESSION_ID: {
+      StringRef s;
+      if (get_str(s, missing, p, last) != 0) {
+        return -1;
+      }
+      value = util::format_hex(reinterpret_cast<const uint8_t *>(s.c_str()),
+                               s.size());
+      break;
+    }
+    case SHRPX_LOGF_SSL_SESSION_REUSED: {
+      uint64_t n;
+      if (get_uvarint(n, p, last) != 0) {
+        return -1;
+      }
+      missing = n == 0;
+      value = n == 2 ? "r" : ".";
+      break;
+    }
+    default:
+      continue;
+    }
+
+    if (!json_) {
+      if (missing) {
+        line += '-';
+      } else {
+        line += value;
+      }
+      continue;
+    }
+
+    if (!first_field) {
+      line += ',';
+    }
+    first_field = false;
+
+    append_json_str(line, StringRef{json_key(lf)});
+    line += ':';
+
+    if (missing) {
+      line += "null";
+    } else if (quote) {
+      append_json_str(line, StringRef{value});
+    } else {
+      line += value;
+    }
+  }
+
+  if (json_) {
+    line += '}';
+  }
+
+  line += '\n';
+
+  out += line;
+
+  return 0;
+}
+
+} // namespace shrpx
@@ -0,0 +1,97 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_ACCESSLOG_BINARY_H
+#define SHRPX_ACCESSLOG_BINARY_H
+
+#include "shrpx.h"
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "shrpx_log.h"
+
+namespace shrpx {
+
+// Binary access log consists of records.  Each record starts with
+// 2 bytes payload length in network byte order, followed by payload.
+// The first byte of payload is the record type.
+//
+// Schema record describes the format of the following entry records,
+// and is written whenever access log file is opened.  It contains
+// the number of log fragments, and the type of each fragment.
+// Literal, and $http_<VAR> fragments are followed by their value.
+//
+// Entry record contains the value of each variable in schema in
+// order.  Literal is not included.  Integers are encoded as unsigned
+// varint, and strings are encoded as varint length plus 1 followed
+// by the bytes.  Length 0 means that the value is not available,
+// which is written as "-" in text format.  Time is encoded as
+// milliseconds since the epoch.
+enum {
+  ACCESSLOG_RECORD_SCHEMA = 0x01,
+  ACCESSLOG_RECORD_ENTRY = 0x02,
+};
+
+// The maximum length of payload of a record.
+constexpr size_t ACCESSLOG_RECORD_MAX = 65535;
+
+// Returns schema record for |lfv|.
+std::string encode_accesslog_schema(const std::vector<LogFragment> &lfv);
+
+// Encodes entry record of |lgsp| following |lfv| into |buf| of
+// length |buflen|, and returns the length of record.  String values
+// are truncated if |buf| is too small.  |buflen| must be at least
+// 64.
+size_t encode_accesslog_entry(uint8_t *buf, size_t buflen,
+                              const std::vector<LogFragment> &lfv,
+                              const LogSpec &lgsp);
+
+// AccessLogDecoder converts binary access log to text or JSON lines.
+class AccessLogDecoder {
+public:
+  // If |json| is true, each entry is converted to JSON object.
+  // Otherwise, it is converted to text formatted as nghttpx does.
+  AccessLogDecoder(bool json);
+
+  // Decodes records in |data| of length |len|, and appends the lines
+  // to |out|.  This function returns the number of bytes consumed,
+  // which may be less than |len| if the last record is incomplete.
+  // It returns -1 if |data| is malformed.
+  ssize_t decode(std::string &out, const uint8_t *data, size_t len);
+
+private:
+  int decode_schema(const uint8_t *first, const uint8_t *last);
+  int decode_entry(std::string &out, const uint8_t *first,
+                   const uint8_t *last);
+
+  std::vector<LogFragment> schema_;
+  bool json_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_ACCESSLOG_BINARY_H
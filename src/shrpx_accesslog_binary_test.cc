@@ -0,0 +1,215 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_accesslog_binary_test.h"
+
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <iostream>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_accesslog_binary.h"
+#include "shrpx_config.h"
+#include "shrpx_downstream.h"
+
+namespace shrpx {
+
+namespace {
+constexpr char TEST_LOG_FORMAT[] =
+    R"($remote_addr - - [$time_local] "$request" $status $body_bytes_sent )"
+    R"("$http_referer" "$http_user_agent" $request_time $alpn $ssl_cipher)";
+} // namespace
+
+namespace {
+LogSpec make_logspec(Downstream *downstream) {
+  auto now = std::chrono::system_clock::now();
+  auto start = std::chrono::high_resolution_clock::now();
+
+  return {
+      downstream, StringRef::from_lit("192.168.0.1"),
+      StringRef::from_lit("GET"), StringRef::from_lit("/alpha?bravo=charlie"),
+      StringRef::from_lit("h2"), nullptr, now, start,
+      start + std::chrono::milliseconds(1234), 2, 0, 200, 1048576,
+      StringRef::from_lit("54321"), 3000, 12345,
+  };
+}
+} // namespace
+
+namespace {
+void add_request_headers(Downstream &d) {
+  auto &req = d.request();
+  req.fs.add_header_token(StringRef::from_lit("user-agent"),
+                          StringRef::from_lit("nghttp2/\"1.9\""), false,
+                          http2::HD_USER_AGENT);
+}
+} // namespace
+
+namespace {
+std::string encode_entry(const std::vector<LogFragment> &lfv,
+                         const LogSpec &lgsp) {
+  std::array<uint8_t, 4_k> buf;
+  auto len = encode_accesslog_entry(buf.data(), buf.size(), lfv, lgsp);
+  return std::string(buf.data(), buf.data() + len);
+}
+} // namespace
+
+void test_shrpx_accesslog_binary_decode(void) {
+  auto lfv = parse_log_format(TEST_LOG_FORMAT);
+  Downstream d(nullptr, nullptr, 0);
+  add_request_headers(d);
+  auto lgsp = make_logspec(&d);
+
+  auto data = encode_accesslog_schema(lfv);
+  data += encode_entry(lfv, lgsp);
+
+  std::array<char, 4_k> text;
+  auto textlen = format_accesslog(text.data(), text.size(), lfv, lgsp);
+
+  {
+    AccessLogDecoder decoder(false);
+    std::string out;
+
+    CU_ASSERT(static_cast<ssize_t>(data.size()) ==
+              decoder.decode(out, reinterpret_cast<const uint8_t *>(
+                                      data.c_str()),
+                             data.size()));
+    CU_ASSERT(std::string(text.data(), textlen) + "\n" == out);
+  }
+
+  {
+    AccessLogDecoder decoder(true);
+    std::string out;
+
+    CU_ASSERT(static_cast<ssize_t>(data.size()) ==
+              decoder.decode(out, reinterpret_cast<const uint8_t *>(
+                                      data.c_str()),
+                             data.size()));
+    CU_ASSERT(0 == out.find(R"({"remote_addr":"192.168.0.1","time_local":")"));
+    CU_ASSERT(std::string::npos !=
+              out.find(R"("request":"GET /alpha?bravo=charlie HTTP/2",)"
+                       R"("status":200,"body_bytes_sent":1048576,)"
+                       R"("http_referer":null,)"
+                       R"("http_user_agent":"nghttp2/\"1.9\"",)"
+                       R"("request_time":1.234,"alpn":"h2",)"
+                       R"("ssl_cipher":null}
+)"));
+  }
+
+  // Entry without Downstream and with truncated record at the end.
+  auto entry = encode_entry(lfv, make_logspec(nullptr));
+  data += entry;
+  data += entry.substr(0, entry.size() - 1);
+
+  {
+    AccessLogDecoder decoder(false);
+    std::string out;
+
+    CU_ASSERT(static_cast<ssize_t>(data.size() - entry.size() + 1) ==
+              decoder.decode(out, reinterpret_cast<const uint8_t *>(
+                                      data.c_str()),
+                             data.size()));
+    CU_ASSERT(2 == std::count(std::begin(out), std::end(out), '\n'));
+    CU_ASSERT(std::string::npos != out.find(R"(1048576 "-" "-" 1.234)"));
+  }
+}
+
+void test_shrpx_accesslog_binary_malformed(void) {
+  auto lfv = parse_log_format(TEST_LOG_FORMAT);
+  auto entry = encode_entry(lfv, make_logspec(nullptr));
+
+  AccessLogDecoder decoder(false);
+  std::string out;
+
+  // Entry without schema
+  CU_ASSERT(-1 ==
+            decoder.decode(out, reinterpret_cast<const uint8_t *>(
+                                    entry.c_str()),
+                           entry.size()));
+
+  auto data = encode_accesslog_schema(lfv);
+  // Cut the last field of entry off, and fix up record length.
+  auto bad = entry.substr(0, entry.size() - 1);
+  bad[1] = static_cast<char>(bad[1] - 1);
+  data += bad;
+
+  CU_ASSERT(-1 ==
+            decoder.decode(out, reinterpret_cast<const uint8_t *>(
+                                    data.c_str()),
+                           data.size()));
+
+  // Empty record
+  CU_ASSERT(-1 == decoder.decode(out,
+                                 reinterpret_cast<const uint8_t *>("\x00\x00"),
+                                 2));
+
+  CU_ASSERT(out.empty());
+}
+
+namespace {
+constexpr size_t NUM_BENCHMARK_ENTRIES = 100000;
+} // namespace
+
+void test_shrpx_accesslog_binary_benchmark(void) {
+  auto lfv = parse_log_format(TEST_LOG_FORMAT);
+  Downstream d(nullptr, nullptr, 0);
+  add_request_headers(d);
+  auto lgsp = make_logspec(&d);
+
+  std::array<char, 4_k> text;
+  std::array<uint8_t, 4_k> bin;
+  size_t textlen = 0, binlen = 0;
+
+  auto t = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < NUM_BENCHMARK_ENTRIES; ++i) {
+    textlen += format_accesslog(text.data(), text.size(), lfv, lgsp);
+  }
+
+  auto text_d = std::chrono::steady_clock::now() - t;
+
+  t = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < NUM_BENCHMARK_ENTRIES; ++i) {
+    binlen += encode_accesslog_entry(bin.data(), bin.size(), lfv, lgsp);
+  }
+
+  auto bin_d = std::chrono::steady_clock::now() - t;
+
+  CU_ASSERT(binlen < textlen);
+
+  std::cerr << "accesslog: text "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(text_d)
+                       .count() /
+                   NUM_BENCHMARK_ENTRIES
+            << "ns " << textlen / NUM_BENCHMARK_ENTRIES << " bytes, binary "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(bin_d)
+                       .count() /
+                   NUM_BENCHMARK_ENTRIES
+            << "ns " << binlen / NUM_BENCHMARK_ENTRIES
+            << " bytes per entry" << std::endl;
+}
+
+} // namespace shrpx
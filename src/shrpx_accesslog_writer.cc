@@ -0,0 +1,336 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_accesslog_writer.h"
+
+#include <syslog.h>
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <array>
+#include <limits>
+#include <algorithm>
+
+#include "shrpx_log.h"
+#include "shrpx_log_config.h"
+#include "shrpx_config.h"
+#include "template.h"
+
+namespace shrpx {
+
+AccessLogBuffer::AccessLogBuffer(size_t size)
+    : buf_(new uint8_t[size]), size_(size), rpos_(0), wpos_(0) {}
+
+int AccessLogBuffer::write(const uint8_t *data, size_t len) {
+  auto wpos = wpos_.load(std::memory_order_relaxed);
+  auto rpos = rpos_.load(std::memory_order_acquire);
+
+  if (size_ - (wpos - rpos) < len) {
+    return -1;
+  }
+
+  auto pos = wpos & (size_ - 1);
+  auto n = std::min(len, size_ - pos);
+
+  std::copy_n(data, n, buf_.get() + pos);
+  std::copy_n(data + n, len - n, buf_.get());
+
+  wpos_.store(wpos + len, std::memory_order_release);
+
+  return 0;
+}
+
+size_t AccessLogBuffer::riovec(struct iovec *iov) const {
+  auto rpos = rpos_.load(std::memory_order_relaxed);
+  auto wpos = wpos_.load(std::memory_order_acquire);
+  auto len = wpos - rpos;
+
+  if (len == 0) {
+    return 0;
+  }
+
+  auto pos = rpos & (size_ - 1);
+  auto n = std::min(len, size_ - pos);
+
+  iov[0].iov_base = buf_.get() + pos;
+  iov[0].iov_len = n;
+
+  if (n == len) {
+    return 1;
+  }
+
+  iov[1].iov_base = buf_.get();
+  iov[1].iov_len = len - n;
+
+  return 2;
+}
+
+void AccessLogBuffer::drain(size_t len) {
+  rpos_.store(rpos_.load(std::memory_order_relaxed) + len,
+              std::memory_order_release);
+}
+
+size_t AccessLogBuffer::rleft() const {
+  return wpos_.load(std::memory_order_acquire) -
+         rpos_.load(std::memory_order_acquire);
+}
+
+size_t AccessLogBuffer::capacity() const { return size_; }
+
+namespace {
+// The writer thread drains the buffers at least in this interval.
+constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(100);
+// The minimum interval between the warnings of dropped lines.
+constexpr auto DROP_WARN_INTERVAL = std::chrono::seconds(1);
+} // namespace
+
+namespace {
+size_t round2pow(size_t n) {
+  size_t m = 1;
+  for (; m < n; m <<= 1)
+    ;
+  return m;
+}
+} // namespace
+
+AccessLogWriter::AccessLogWriter(size_t bufsize,
+                                 shrpx_accesslog_overflow overflow)
+    : num_dropped_(0),
+      bufsize_(round2pow(bufsize)),
+      overflow_(overflow),
+      wakeup_(false),
+      reopen_(false),
+      stop_(false),
+      running_(false) {}
+
+AccessLogWriter::~AccessLogWriter() { stop(); }
+
+AccessLogBuffer *AccessLogWriter::add_buffer() {
+  assert(!running_);
+
+  buffers_.push_back(make_unique<AccessLogBuffer>(bufsize_));
+  return buffers_.back().get();
+}
+
+void AccessLogWriter::run() {
+#ifndef NOTHREADS
+  running_ = true;
+  fut_ = std::async(std::launch::async, [this] { loop(); });
+#endif // !NOTHREADS
+}
+
+void AccessLogWriter::stop() {
+  if (!running_) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(mu_);
+    stop_ = true;
+  }
+
+  cv_.notify_one();
+  drain_cv_.notify_all();
+
+#ifndef NOTHREADS
+  fut_.get();
+#endif // !NOTHREADS
+
+  running_ = false;
+}
+
+void AccessLogWriter::write(AccessLogBuffer *buf, const uint8_t *data,
+                            size_t len) {
+  if (buf->write(data, len) == 0) {
+    // Wake up the writer thread early, so that the buffer does not
+    // overflow under heavy load.
+    if (buf->rleft() >= buf->capacity() / 2) {
+      {
+        std::lock_guard<std::mutex> g(mu_);
+        wakeup_ = true;
+      }
+      cv_.notify_one();
+    }
+    return;
+  }
+
+  if (overflow_ == ACCESSLOG_OVERFLOW_DROP || len > buf->capacity()) {
+    ++num_dropped_;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lk(mu_);
+
+  wakeup_ = true;
+  cv_.notify_one();
+
+  drain_cv_.wait(lk, [this, buf, data, len] {
+    return buf->write(data, len) == 0 || stop_;
+  });
+}
+
+void AccessLogWriter::reopen() {
+  {
+    std::lock_guard<std::mutex> g(mu_);
+    reopen_ = true;
+  }
+
+  cv_.notify_one();
+}
+
+uint64_t AccessLogWriter::get_num_dropped() const {
+  return num_dropped_.load(std::memory_order_relaxed);
+}
+
+void AccessLogWriter::write_syslog(AccessLogBuffer *buf) {
+  std::array<struct iovec, 2> iov;
+  auto iovcnt = buf->riovec(iov.data());
+  if (iovcnt == 0) {
+    return;
+  }
+
+  std::string s;
+  for (size_t i = 0; i < iovcnt; ++i) {
+    s.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+  }
+
+  buf->drain(s.size());
+
+  for (auto first = std::begin(s); first != std::end(s);) {
+    auto eol = std::find(first, std::end(s), '\n');
+    syslog(LOG_INFO, "%.*s", static_cast<int>(eol - first), &*first);
+    if (eol == std::end(s)) {
+      break;
+    }
+    first = eol + 1;
+  }
+}
+
+void AccessLogWriter::flush() {
+  if (get_config()->logging.access.syslog) {
+    for (auto &buf : buffers_) {
+      write_syslog(buf.get());
+    }
+    return;
+  }
+
+  auto fd = log_config()->accesslog_fd;
+
+  // Each buffer takes at most 2 iovecs.
+  std::array<struct iovec, 64> iov;
+  std::array<size_t, 32> lens;
+
+  for (auto first = std::begin(buffers_); first != std::end(buffers_);) {
+    size_t iovcnt = 0;
+    size_t nbuf = 0;
+    for (; first != std::end(buffers_) && iovcnt + 2 <= iov.size() &&
+           nbuf < lens.size();
+         ++first) {
+      auto n = (*first)->riovec(iov.data() + iovcnt);
+      size_t len = 0;
+      for (size_t i = iovcnt; i < iovcnt + n; ++i) {
+        len += iov[i].iov_len;
+      }
+      iovcnt += n;
+      lens[nbuf++] = len;
+    }
+
+    if (iovcnt == 0) {
+      continue;
+    }
+
+    ssize_t nwrite = 0;
+    if (fd != -1) {
+      while ((nwrite = writev(fd, iov.data(), iovcnt)) == -1 &&
+             errno == EINTR)
+        ;
+    }
+
+    auto left = nwrite == -1 || fd == -1 ? std::numeric_limits<size_t>::max()
+                                         : static_cast<size_t>(nwrite);
+
+    // Lines which could not be written because of error are
+    // discarded.  The short write leaves the rest in the buffer.
+    for (size_t i = 0; i < nbuf; ++i) {
+      auto n = std::min(lens[i], left);
+      (*(first - nbuf + i))->drain(n);
+      if (left != std::numeric_limits<size_t>::max()) {
+        left -= n;
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> g(mu_);
+  }
+
+  drain_cv_.notify_all();
+}
+
+void AccessLogWriter::loop() {
+  (void)reopen_log_files();
+
+  uint64_t num_dropped = 0;
+  auto drop_warn_time = std::chrono::steady_clock::now();
+
+  for (;;) {
+    bool reopen, stop;
+    {
+      std::unique_lock<std::mutex> lk(mu_);
+      cv_.wait_for(lk, FLUSH_INTERVAL,
+                   [this] { return wakeup_ || reopen_ || stop_; });
+
+      wakeup_ = false;
+      reopen = reopen_;
+      reopen_ = false;
+      stop = stop_;
+    }
+
+    flush();
+
+    if (reopen) {
+      (void)reopen_log_files();
+    }
+
+    auto n = get_num_dropped();
+    if (n != num_dropped) {
+      auto now = std::chrono::steady_clock::now();
+      if (stop || now - drop_warn_time >= DROP_WARN_INTERVAL) {
+        LOG(WARN) << "Dropped " << n - num_dropped
+                  << " access log line(s) because buffer was full";
+        num_dropped = n;
+        drop_warn_time = now;
+      }
+    }
+
+    if (stop) {
+      break;
+    }
+  }
+
+  delete_log_config();
+}
+
+} // namespace shrpx
@@ -0,0 +1,133 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_ACCESSLOG_WRITER_H
+#define SHRPX_ACCESSLOG_WRITER_H
+
+#include "shrpx.h"
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+
+#include "shrpx_config.h"
+
+namespace shrpx {
+
+// AccessLogBuffer is a lock-free single producer, single consumer
+// ring buffer of formatted access log lines.  The worker thread
+// appends lines, and the access log writer thread drains them.
+class AccessLogBuffer {
+public:
+  // |size| must be a power of 2.
+  AccessLogBuffer(size_t size);
+
+  // Appends |len| bytes pointed by |data|.  This function returns 0
+  // if it succeeds, or -1 if there is not enough space.  Only the
+  // producer thread can call this function.
+  int write(const uint8_t *data, size_t len);
+  // Fills at most 2 buffers which contain the bytes to read to |iov|,
+  // and returns the number of buffers filled.  Only the consumer
+  // thread can call this function.
+  size_t riovec(struct iovec *iov) const;
+  // Consumes |len| bytes.  Only the consumer thread can call this
+  // function.
+  void drain(size_t len);
+  // Returns the number of bytes to read.
+  size_t rleft() const;
+  size_t capacity() const;
+
+private:
+  std::unique_ptr<uint8_t[]> buf_;
+  size_t size_;
+  // The total number of bytes read.  This is only written by the
+  // consumer.
+  std::atomic<size_t> rpos_;
+  // The total number of bytes written.  This is only written by the
+  // producer.
+  std::atomic<size_t> wpos_;
+};
+
+// AccessLogWriter writes access log lines buffered by workers in a
+// dedicated thread, so that the slow log file or syslog does not
+// stall the event loop of workers.  The writer thread owns the file
+// descriptor of access log file.
+class AccessLogWriter {
+public:
+  AccessLogWriter(size_t bufsize, shrpx_accesslog_overflow overflow);
+  ~AccessLogWriter();
+
+  // Creates the buffer for a worker thread.  This function must be
+  // called before run().
+  AccessLogBuffer *add_buffer();
+  // Starts the writer thread.
+  void run();
+  // Writes out the remaining lines, and stops the writer thread.
+  void stop();
+  // Appends a record pointed by |data| of length |len| to |buf|.
+  // Text record must be a line terminated by '\n'.  If |buf| is
+  // full, the record is dropped or this function blocks depending on
+  // the overflow policy.
+  void write(AccessLogBuffer *buf, const uint8_t *data, size_t len);
+  // Makes the writer thread reopen access log file.
+  void reopen();
+  // Returns the number of lines dropped because of the full buffer.
+  uint64_t get_num_dropped() const;
+
+private:
+  void flush();
+  void write_syslog(AccessLogBuffer *buf);
+  void loop();
+
+  std::vector<std::unique_ptr<AccessLogBuffer>> buffers_;
+  std::mutex mu_;
+  // Signaled when the buffer gets filled, or the writer thread has
+  // something else to do.
+  std::condition_variable cv_;
+  // Signaled when the writer thread drained the buffers.
+  std::condition_variable drain_cv_;
+#ifndef NOTHREADS
+  std::future<void> fut_;
+#endif // !NOTHREADS
+  std::atomic<uint64_t> num_dropped_;
+  size_t bufsize_;
+  shrpx_accesslog_overflow overflow_;
+  // The following 3 fields are guarded by mu_.
+  // true if the writer thread is asked to drain the buffers.
+  bool wakeup_;
+  // true if the writer thread is asked to reopen access log file.
+  bool reopen_;
+  // true if the writer thread is asked to stop.
+  bool stop_;
+  bool running_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_ACCESSLOG_WRITER_H
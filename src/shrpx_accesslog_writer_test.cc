@@ -0,0 +1,142 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_accesslog_writer_test.h"
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_accesslog_writer.h"
+#include "shrpx_config.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+int write_str(AccessLogBuffer &buf, const std::string &s) {
+  return buf.write(reinterpret_cast<const uint8_t *>(s.c_str()), s.size());
+}
+} // namespace
+
+namespace {
+std::string read_all(AccessLogBuffer &buf) {
+  std::array<struct iovec, 2> iov;
+  std::string s;
+
+  auto iovcnt = buf.riovec(iov.data());
+  for (size_t i = 0; i < iovcnt; ++i) {
+    s.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+  }
+
+  buf.drain(s.size());
+
+  return s;
+}
+} // namespace
+
+void test_shrpx_accesslog_buffer(void) {
+  AccessLogBuffer buf(16);
+
+  CU_ASSERT(0 == buf.rleft());
+  CU_ASSERT("" == read_all(buf));
+
+  CU_ASSERT(0 == write_str(buf, "alpha\n"));
+  CU_ASSERT(0 == write_str(buf, "bravo\n"));
+  CU_ASSERT(12 == buf.rleft());
+
+  // Not enough space
+  CU_ASSERT(-1 == write_str(buf, "charlie\n"));
+  CU_ASSERT(12 == buf.rleft());
+
+  CU_ASSERT("alpha\nbravo\n" == read_all(buf));
+  CU_ASSERT(0 == buf.rleft());
+
+  // The line wraps around the end of buffer.
+  CU_ASSERT(0 == write_str(buf, "charlie\n"));
+
+  std::array<struct iovec, 2> iov;
+
+  CU_ASSERT(2 == buf.riovec(iov.data()));
+  CU_ASSERT(4 == iov[0].iov_len);
+  CU_ASSERT(4 == iov[1].iov_len);
+
+  CU_ASSERT(0 == write_str(buf, "delta\n"));
+  CU_ASSERT(-1 == write_str(buf, "echo\n"));
+  CU_ASSERT("charlie\ndelta\n" == read_all(buf));
+
+  // The buffer can be filled up completely.
+  CU_ASSERT(0 == write_str(buf, "0123456789abcde\n"));
+  CU_ASSERT(16 == buf.rleft());
+  CU_ASSERT("0123456789abcde\n" == read_all(buf));
+}
+
+void test_shrpx_accesslog_writer_many_buffers(void) {
+  char path[] = "/tmp/nghttpx-unittest-accesslog.XXXXXX";
+  auto fd = mkstemp(path);
+  CU_ASSERT(-1 != fd);
+  close(fd);
+
+  auto &accessconf = mod_config()->logging.access;
+  accessconf.file = ImmutableString{path};
+
+  // More buffers than flush() writes in one writev call, each of
+  // which has a single line.
+  constexpr size_t num_buffers = 100;
+
+  {
+    AccessLogWriter writer(4096, ACCESSLOG_OVERFLOW_DROP);
+
+    for (size_t i = 0; i < num_buffers; ++i) {
+      auto buf = writer.add_buffer();
+      auto line = util::utos(i) + "\n";
+      writer.write(buf, reinterpret_cast<const uint8_t *>(line.c_str()),
+                   line.size());
+    }
+
+    writer.run();
+    writer.stop();
+
+    CU_ASSERT(0 == writer.get_num_dropped());
+  }
+
+  accessconf.file = ImmutableString{};
+
+  std::ifstream f(path);
+  std::string line;
+  size_t n = 0;
+  for (; std::getline(f, line); ++n) {
+    CU_ASSERT(util::utos(n) == line);
+  }
+
+  CU_ASSERT(num_buffers == n);
+
+  unlink(path);
+}
+
+} // namespace shrpx
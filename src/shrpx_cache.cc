@@ -0,0 +1,725 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_cache.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "shrpx_downstream.h"
+#include "shrpx_upstream.h"
+#include "shrpx_client_handler.h"
+#include "shrpx_log.h"
+#include "http-parser/http_parser.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+bool is_ows(char c) { return c == ' ' || c == '\t'; }
+} // namespace
+
+void parse_cache_control(CacheControl &cc, const StringRef &value) {
+  auto first = std::begin(value);
+  auto last = std::end(value);
+
+  for (;;) {
+    for (; first != last && (is_ows(*first) || *first == ','); ++first)
+      ;
+    if (first == last) {
+      return;
+    }
+
+    auto name_first = first;
+    for (; first != last && *first != '=' && *first != ',' && !is_ows(*first);
+         ++first)
+      ;
+    auto name = StringRef{name_first, first};
+
+    for (; first != last && is_ows(*first); ++first)
+      ;
+
+    StringRef arg;
+    if (first != last && *first == '=') {
+      ++first;
+      for (; first != last && is_ows(*first); ++first)
+        ;
+      if (first != last && *first == '"') {
+        ++first;
+        auto arg_first = first;
+        for (; first != last && *first != '"'; ++first) {
+          if (*first == '\\' && first + 1 != last) {
+            ++first;
+          }
+        }
+        arg = StringRef{arg_first, first};
+        if (first != last) {
+          ++first;
+        }
+      } else {
+        auto arg_first = first;
+        for (; first != last && *first != ',' && !is_ows(*first); ++first)
+          ;
+        arg = StringRef{arg_first, first};
+      }
+    }
+
+    if (util::strieq_l("no-store", name)) {
+      cc.no_store = true;
+    } else if (util::strieq_l("no-cache", name)) {
+      cc.no_cache = true;
+    } else if (util::strieq_l("private", name)) {
+      cc.is_private = true;
+    } else if (util::strieq_l("max-age", name)) {
+      // Malformed value makes response stale.
+      cc.max_age = std::max(static_cast<int64_t>(0), util::parse_uint(arg));
+    } else if (util::strieq_l("s-maxage", name)) {
+      cc.s_maxage = std::max(static_cast<int64_t>(0), util::parse_uint(arg));
+    }
+
+    // skip garbage until next directive
+    for (; first != last && *first != ','; ++first)
+      ;
+  }
+}
+
+std::string make_cache_key(const Request &req) {
+  auto authority = req.authority;
+  if (authority.empty()) {
+    auto host = req.fs.header(http2::HD_HOST);
+    if (host) {
+      authority = host->value;
+    }
+  }
+
+  std::string key;
+  key.reserve(req.scheme.size() + str_size("://") + authority.size() +
+              req.path.size());
+  key.append(req.scheme.c_str(), req.scheme.size());
+  key += "://";
+  key.append(authority.c_str(), authority.size());
+  key.append(req.path.c_str(), req.path.size());
+
+  return key;
+}
+
+CacheEntry::CacheEntry(ResponseCache *cache, MemchunkPool *mcpool)
+    : body(mcpool),
+      date(0.),
+      expires(0.),
+      size(0),
+      hash(0),
+      charged(0),
+      http_status(0),
+      cache(cache),
+      dlnext(nullptr),
+      dlprev(nullptr) {}
+
+CacheEntry::~CacheEntry() {
+  if (charged) {
+    cache->uncharge(this);
+  }
+}
+
+namespace {
+// Returns the number of bytes accounted to the body of length
+// |len|.  Body buffers are accounted in the unit of Memchunk16K.
+size_t body_charge(size_t len) {
+  return (len + Memchunk16K::size - 1) / Memchunk16K::size *
+         Memchunk16K::size;
+}
+} // namespace
+
+namespace {
+constexpr uint8_t SKETCH_MAX_COUNT = 15;
+} // namespace
+
+FrequencySketch::FrequencySketch(size_t width) : width_(1), additions_(0) {
+  for (; width_ < width; width_ <<= 1)
+    ;
+  table_.resize(width_ * 4);
+  sample_size_ = width_ * 10;
+}
+
+size_t FrequencySketch::index(size_t hash, size_t row) const {
+  uint64_t h = (static_cast<uint64_t>(hash) + row) * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 32;
+  return row * width_ + (h & (width_ - 1));
+}
+
+void FrequencySketch::increment(size_t hash) {
+  for (size_t i = 0; i < 4; ++i) {
+    auto &c = table_[index(hash, i)];
+    if (c < SKETCH_MAX_COUNT) {
+      ++c;
+    }
+  }
+
+  if (++additions_ == sample_size_) {
+    reset();
+  }
+}
+
+uint32_t FrequencySketch::estimate(size_t hash) const {
+  uint32_t res = SKETCH_MAX_COUNT;
+  for (size_t i = 0; i < 4; ++i) {
+    res = std::min(res, static_cast<uint32_t>(table_[index(hash, i)]));
+  }
+  return res;
+}
+
+void FrequencySketch::reset() {
+  for (auto &c : table_) {
+    c >>= 1;
+  }
+  additions_ /= 2;
+}
+
+namespace {
+// Returns the width of FrequencySketch for cache of |max_size|
+// bytes.  We assume that an average entry takes 4KiB.
+size_t sketch_width(size_t max_size) {
+  return std::min(static_cast<size_t>(1 << 20),
+                  std::max(static_cast<size_t>(256), max_size / 4096));
+}
+} // namespace
+
+CacheLock::CacheLock(ResponseCache *cache, std::string key, Downstream *owner)
+    : cache(cache), key(std::move(key)), owner(owner) {}
+
+namespace {
+void lock_timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto lk = static_cast<CacheLock *>(w->data);
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Response cache lock timed out: " << lk->key;
+  }
+
+  lk->cache->release_lock(lk);
+}
+} // namespace
+
+namespace {
+void resumecb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto cache = static_cast<ResponseCache *>(w->data);
+  cache->resume_waiters();
+}
+} // namespace
+
+ResponseCache::ResponseCache(struct ev_loop *loop, size_t max_size,
+                             ev_tstamp lock_timeout)
+    : sketch_(sketch_width(max_size)),
+      loop_(loop),
+      stat_{},
+      max_size_(max_size),
+      lock_timeout_(lock_timeout) {
+  ev_timer_init(&resumetimer_, resumecb, 0., 0.);
+  resumetimer_.data = this;
+}
+
+ResponseCache::~ResponseCache() {
+  // Each request in locks_ and ready_ keeps this object alive.
+  assert(locks_.empty());
+  assert(ready_.empty());
+
+  ev_timer_stop(loop_, &resumetimer_);
+}
+
+namespace {
+// Fills |cc| with the directives in Cache-Control header fields in
+// |fs|.
+void parse_cache_control(CacheControl &cc, const FieldStore &fs) {
+  for (auto &kv : fs.headers()) {
+    if (kv.token == http2::HD_CACHE_CONTROL) {
+      parse_cache_control(cc, kv.value);
+    }
+  }
+}
+} // namespace
+
+namespace {
+// Returns true if |req| prohibits the use of stored response.
+bool request_no_cache(const Request &req, const CacheControl &cc) {
+  if (cc.no_store || cc.no_cache || cc.max_age == 0) {
+    return true;
+  }
+
+  if (req.fs.header(StringRef::from_lit("authorization"))) {
+    return true;
+  }
+
+  auto pragma = req.fs.header(StringRef::from_lit("pragma"));
+  if (!pragma) {
+    return false;
+  }
+
+  auto no_cache = StringRef::from_lit("no-cache");
+  return std::search(std::begin(pragma->value), std::end(pragma->value),
+                     std::begin(no_cache), std::end(no_cache),
+                     util::CaseCmp()) != std::end(pragma->value);
+}
+} // namespace
+
+namespace {
+// Returns true if the request header fields in |req| nominated by
+// Vary header field in |ent| match.
+bool match_vary(const CacheEntry *ent, const Request &req) {
+  for (auto &v : ent->vary) {
+    auto kv = req.fs.header(StringRef{v.name});
+    auto value = kv ? kv->value : StringRef{};
+    if (value != v.value) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+const CacheEntry *ResponseCache::lookup(const Request &req, ev_tstamp now) {
+  if (req.method != HTTP_GET && req.method != HTTP_HEAD) {
+    return nullptr;
+  }
+
+  auto key = make_cache_key(req);
+  auto hash = std::hash<std::string>()(key);
+
+  sketch_.increment(hash);
+
+  CacheControl cc;
+  parse_cache_control(cc, req.fs);
+
+  if (request_no_cache(req, cc)) {
+    ++stat_.misses;
+    return nullptr;
+  }
+
+  auto it = entries_.find(key);
+  if (it == std::end(entries_)) {
+    ++stat_.misses;
+    return nullptr;
+  }
+
+  auto ent = (*it).second.get();
+
+  if (ent->expires <= now) {
+    remove_entry(ent);
+    ++stat_.misses;
+    return nullptr;
+  }
+
+  if (!match_vary(ent, req) ||
+      (cc.max_age > 0 && now - ent->date > cc.max_age)) {
+    ++stat_.misses;
+    return nullptr;
+  }
+
+  lru_.remove(ent);
+  lru_.append(ent);
+
+  ++stat_.hits;
+  if (req.method != HTTP_HEAD) {
+    stat_.hit_bytes += ent->body.rleft();
+  }
+
+  return ent;
+}
+
+namespace {
+bool cacheable_status(unsigned int status) {
+  switch (status) {
+  case 200:
+  case 203:
+  case 204:
+  case 300:
+  case 301:
+  case 404:
+  case 405:
+  case 410:
+  case 414:
+  case 501:
+    return true;
+  default:
+    return false;
+  }
+}
+} // namespace
+
+namespace {
+// Returns time in |value| which is HTTP-date, or |def| if |value| is
+// missing.  Returns 0 if |value| is malformed.
+time_t parse_date_or(const HeaderRefs::value_type *value, time_t def) {
+  if (!value) {
+    return def;
+  }
+  return util::parse_http_date(value->value);
+}
+} // namespace
+
+std::unique_ptr<CacheEntry> ResponseCache::prepare_store(const Request &req,
+                                                         const Response &resp,
+                                                         ev_tstamp now) {
+  if (req.method != HTTP_GET || req.http2_expect_body ||
+      !cacheable_status(resp.http_status)) {
+    return nullptr;
+  }
+
+  if (req.fs.header(StringRef::from_lit("authorization"))) {
+    return nullptr;
+  }
+
+  CacheControl req_cc;
+  parse_cache_control(req_cc, req.fs);
+  if (req_cc.no_store) {
+    return nullptr;
+  }
+
+  CacheControl cc;
+  parse_cache_control(cc, resp.fs);
+  if (cc.no_store || cc.no_cache || cc.is_private) {
+    return nullptr;
+  }
+
+  if (resp.fs.header(StringRef::from_lit("set-cookie"))) {
+    return nullptr;
+  }
+
+  auto tnow = static_cast<time_t>(now);
+  auto date = parse_date_or(resp.fs.header(http2::HD_DATE), tnow);
+
+  int64_t lifetime;
+  if (cc.s_maxage != -1) {
+    lifetime = cc.s_maxage;
+  } else if (cc.max_age != -1) {
+    lifetime = cc.max_age;
+  } else {
+    auto expires = resp.fs.header(StringRef::from_lit("expires"));
+    if (!expires) {
+      // We do not use heuristic freshness.
+      return nullptr;
+    }
+    lifetime = static_cast<int64_t>(util::parse_http_date(expires->value)) -
+               static_cast<int64_t>(date);
+  }
+
+  int64_t age = std::max(static_cast<int64_t>(0),
+                         static_cast<int64_t>(tnow) - date);
+  auto age_hd = resp.fs.header(StringRef::from_lit("age"));
+  if (age_hd) {
+    age = std::max(age, util::parse_uint(age_hd->value));
+  }
+
+  if (lifetime <= age) {
+    return nullptr;
+  }
+
+  auto ent = make_unique<CacheEntry>(this, &mcpool_);
+
+  for (auto &kv : resp.fs.headers()) {
+    if (kv.name != "vary") {
+      continue;
+    }
+    for (auto &name : util::split_str(kv.value, ',')) {
+      auto first = std::begin(name);
+      auto last = std::end(name);
+      for (; first != last && is_ows(*first); ++first)
+        ;
+      for (; first != last && is_ows(*(last - 1)); --last)
+        ;
+      if (first == last) {
+        continue;
+      }
+      if (*first == '*') {
+        return nullptr;
+      }
+      auto vary_name = std::string(first, last);
+      util::inp_strlower(vary_name);
+      auto rkv = req.fs.header(StringRef{vary_name});
+      ent->vary.emplace_back(std::move(vary_name),
+                             rkv ? rkv->value.str() : std::string());
+    }
+  }
+
+  for (auto &kv : resp.fs.headers()) {
+    switch (kv.token) {
+    case http2::HD_CONNECTION:
+    case http2::HD_CONTENT_LENGTH:
+    case http2::HD_KEEP_ALIVE:
+    case http2::HD_PROXY_CONNECTION:
+    case http2::HD_TE:
+    case http2::HD_TRANSFER_ENCODING:
+    case http2::HD_UPGRADE:
+      continue;
+    }
+    if (kv.name.empty() || kv.name[0] == ':' || kv.name == "age") {
+      continue;
+    }
+    ent->headers.emplace_back(kv.name.str(), kv.value.str(), kv.no_index,
+                              kv.token);
+  }
+
+  ent->key = make_cache_key(req);
+  ent->hash = std::hash<std::string>()(ent->key);
+  ent->http_status = resp.http_status;
+  ent->date = now - age;
+  ent->expires = now + (lifetime - age);
+
+  return ent;
+}
+
+void ResponseCache::store(std::unique_ptr<CacheEntry> ent) {
+  // The body is accounted to stat_.used below if it is stored.
+  uncharge(ent.get());
+
+  ent->headers.emplace_back("content-length",
+                            util::utos(ent->body.rleft()), false,
+                            http2::HD_CONTENT_LENGTH);
+
+  auto size = sizeof(CacheEntry) + ent->key.size() +
+              body_charge(ent->body.rleft());
+  for (auto &kv : ent->headers) {
+    size += kv.name.size() + kv.value.size();
+  }
+  for (auto &kv : ent->vary) {
+    size += kv.name.size() + kv.value.size();
+  }
+
+  if (size > max_size_) {
+    ++stat_.rejections;
+    return;
+  }
+
+  ent->size = size;
+
+  // Older response (or another variant) is replaced only if the new
+  // one is admitted.
+  auto it = entries_.find(ent->key);
+  auto old = it == std::end(entries_) ? nullptr : (*it).second.get();
+
+  if (!make_room(ent->hash, size, old)) {
+    ++stat_.rejections;
+    return;
+  }
+
+  if (old) {
+    remove_entry(old);
+  }
+
+  stat_.used += size;
+  ++stat_.num_entries;
+
+  lru_.append(ent.get());
+
+  auto key = ent->key;
+  entries_.emplace(std::move(key), std::move(ent));
+}
+
+int ResponseCache::append_body(CacheEntry *ent, const uint8_t *data,
+                               size_t len) {
+  auto bodylen = ent->body.rleft() + len;
+
+  if (bodylen > get_max_body_size()) {
+    return -1;
+  }
+
+  auto charge = body_charge(bodylen);
+  if (charge > ent->charged) {
+    auto n = charge - ent->charged;
+
+    if (!make_room(ent->hash, n, nullptr)) {
+      ++stat_.rejections;
+      return -1;
+    }
+
+    stat_.filling += n;
+    ent->charged = charge;
+  }
+
+  ent->body.append(data, len);
+
+  return 0;
+}
+
+void ResponseCache::uncharge(CacheEntry *ent) {
+  stat_.filling -= ent->charged;
+  ent->charged = 0;
+}
+
+bool ResponseCache::make_room(size_t hash, size_t size,
+                              const CacheEntry *replaced) {
+  auto freed = replaced ? replaced->size : 0;
+
+  if (stat_.used - freed + stat_.filling + size <= max_size_) {
+    return true;
+  }
+
+  // The bytes in flight cannot be evicted.
+  if (stat_.filling + size > max_size_) {
+    return false;
+  }
+
+  auto victim = lru_.head == replaced ? replaced->dlnext : lru_.head;
+
+  // TinyLFU admission: a new entry must be more popular than the one
+  // which would be evicted first.
+  if (sketch_.estimate(hash) <= sketch_.estimate(victim->hash)) {
+    return false;
+  }
+
+  for (; stat_.used - freed + stat_.filling + size > max_size_;) {
+    victim = lru_.head == replaced ? replaced->dlnext : lru_.head;
+    remove_entry(victim);
+    ++stat_.evictions;
+  }
+
+  return true;
+}
+
+void ResponseCache::remove_entry(CacheEntry *ent) {
+  lru_.remove(ent);
+
+  stat_.used -= ent->size;
+  --stat_.num_entries;
+
+  // This deletes ent.
+  entries_.erase(entries_.find(ent->key));
+}
+
+namespace {
+// Returns true if the request of |downstream| can wait for the
+// response to the other request.
+bool collapsible(const Downstream *downstream) {
+  const auto &req = downstream->request();
+
+  if (req.method != HTTP_GET || req.http2_expect_body ||
+      req.fs.content_length != -1 || downstream->get_chunked_request() ||
+      downstream->get_http2_upgrade_request()) {
+    return false;
+  }
+
+  CacheControl cc;
+  parse_cache_control(cc, req.fs);
+
+  return !request_no_cache(req, cc);
+}
+} // namespace
+
+int ResponseCache::lock(Downstream *downstream) {
+  if (lock_timeout_ == 0. ||
+      downstream->get_cache_lock_state() != Downstream::CACHE_LOCK_NONE ||
+      !collapsible(downstream)) {
+    return -1;
+  }
+
+  auto key = make_cache_key(downstream->request());
+
+  auto it = locks_.find(key);
+  if (it != std::end(locks_)) {
+    auto lk = (*it).second.get();
+    lk->waiters.push_back(downstream);
+    downstream->set_cache_lock(lk, Downstream::CACHE_LOCK_WAIT);
+
+    ++stat_.collapsed;
+
+    return 1;
+  }
+
+  auto lk = make_unique<CacheLock>(this, key, downstream);
+
+  ev_timer_init(&lk->timer, lock_timeoutcb, lock_timeout_, 0.);
+  lk->timer.data = lk.get();
+  ev_timer_start(loop_, &lk->timer);
+
+  downstream->set_cache_lock(lk.get(), Downstream::CACHE_LOCK_OWNER);
+
+  locks_.emplace(std::move(key), std::move(lk));
+
+  return 0;
+}
+
+void ResponseCache::unlock(Downstream *downstream) {
+  if (downstream->get_cache_lock_state() != Downstream::CACHE_LOCK_OWNER) {
+    return;
+  }
+
+  release_lock(downstream->get_cache_lock());
+}
+
+void ResponseCache::remove_waiter(Downstream *downstream) {
+  switch (downstream->get_cache_lock_state()) {
+  case Downstream::CACHE_LOCK_WAIT: {
+    auto &waiters = downstream->get_cache_lock()->waiters;
+    waiters.erase(
+        std::find(std::begin(waiters), std::end(waiters), downstream));
+    break;
+  }
+  case Downstream::CACHE_LOCK_READY:
+    ready_.erase(std::find(std::begin(ready_), std::end(ready_), downstream));
+    break;
+  default:
+    return;
+  }
+
+  downstream->set_cache_lock(nullptr, Downstream::CACHE_LOCK_DONE);
+}
+
+void ResponseCache::release_lock(CacheLock *lk) {
+  ev_timer_stop(loop_, &lk->timer);
+
+  if (lk->owner) {
+    lk->owner->set_cache_lock(nullptr, Downstream::CACHE_LOCK_DONE);
+  }
+
+  for (auto downstream : lk->waiters) {
+    downstream->set_cache_lock(nullptr, Downstream::CACHE_LOCK_READY);
+    ready_.push_back(downstream);
+  }
+
+  if (!ready_.empty()) {
+    // Resume them later, because we may be in the middle of the
+    // processing of the owner.
+    ev_timer_start(loop_, &resumetimer_);
+  }
+
+  // This deletes lk.
+  locks_.erase(locks_.find(lk->key));
+}
+
+void ResponseCache::resume_waiters() {
+  // Resuming a request may delete the other requests in ready_.
+  while (!ready_.empty()) {
+    auto downstream = ready_.front();
+    ready_.pop_front();
+
+    downstream->set_cache_lock(nullptr, Downstream::CACHE_LOCK_DONE);
+
+    auto handler = downstream->get_upstream()->get_client_handler();
+    handler->resume_collapsed_request(downstream);
+  }
+}
+
+size_t ResponseCache::get_max_body_size() const { return max_size_ / 2; }
+
+const CacheStat &ResponseCache::get_stat() const { return stat_; }
+
+} // namespace shrpx
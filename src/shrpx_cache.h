@@ -0,0 +1,253 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_CACHE_H
+#define SHRPX_CACHE_H
+
+#include "shrpx.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+
+#include <ev.h>
+
+#include "http2.h"
+#include "memchunk.h"
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+struct Request;
+struct Response;
+class Downstream;
+class ResponseCache;
+
+// Cache-Control directives which affect caching decision.
+struct CacheControl {
+  CacheControl()
+      : max_age(-1),
+        s_maxage(-1),
+        no_store(false),
+        no_cache(false),
+        is_private(false) {}
+
+  // Value of max-age directive in seconds, or -1 if it is not present.
+  int64_t max_age;
+  // Value of s-maxage directive in seconds, or -1 if it is not
+  // present.
+  int64_t s_maxage;
+  bool no_store;
+  bool no_cache;
+  bool is_private;
+};
+
+// Parses Cache-Control header field value |value|, and merges the
+// directives found into |cc|.  Unknown directives are ignored.
+void parse_cache_control(CacheControl &cc, const StringRef &value);
+
+// Returns the cache key for |req|.  The key is made from scheme,
+// authority and path.
+std::string make_cache_key(const Request &req);
+
+// Stored response.
+struct CacheEntry {
+  CacheEntry(ResponseCache *cache, MemchunkPool *mcpool);
+  ~CacheEntry();
+
+  std::string key;
+  // Request header fields nominated by Vary header field, and their
+  // values in the request which produced this response.  Names are
+  // lower cased.
+  Headers vary;
+  // Response header fields, excluding hop-by-hop header fields and
+  // Age.
+  Headers headers;
+  DefaultMemchunks body;
+  // The time when the response was generated at the origin server.
+  // The current age is computed from this value.
+  ev_tstamp date;
+  // The time when this response becomes stale.
+  ev_tstamp expires;
+  // The number of bytes accounted to this entry.
+  size_t size;
+  // Hash value of |key|.
+  size_t hash;
+  // The number of bytes of |body| charged to |cache| while the
+  // response is being received.
+  size_t charged;
+  unsigned int http_status;
+  ResponseCache *cache;
+  CacheEntry *dlnext, *dlprev;
+};
+
+// Approximates access frequency of cache keys with count-min sketch
+// of 4 rows.  Counters saturate at 15, and all counters are halved
+// after certain number of increments, so that old popularity fades.
+class FrequencySketch {
+public:
+  // |width| is the number of counters per row, and rounded up to
+  // power of 2.
+  FrequencySketch(size_t width);
+  void increment(size_t hash);
+  uint32_t estimate(size_t hash) const;
+
+private:
+  size_t index(size_t hash, size_t row) const;
+  void reset();
+
+  std::vector<uint8_t> table_;
+  size_t width_;
+  size_t additions_;
+  size_t sample_size_;
+};
+
+struct CacheStat {
+  // The number of requests served from cache.
+  uint64_t hits;
+  // The number of cacheable requests which were not served from
+  // cache.
+  uint64_t misses;
+  // The number of response body bytes served from cache.
+  uint64_t hit_bytes;
+  // The number of entries evicted to make room for new ones.
+  uint64_t evictions;
+  // The number of responses which were not stored because admission
+  // policy rejected them.
+  uint64_t rejections;
+  // The number of requests which waited for the response to the
+  // identical request in flight.
+  uint64_t collapsed;
+  // The number of bytes used by stored entries.
+  size_t used;
+  // The number of bytes used by the bodies of the responses being
+  // received, which are not stored yet.
+  size_t filling;
+  // The number of stored entries.
+  size_t num_entries;
+};
+
+// Request in flight to backend, and the requests for the same key
+// which wait for its response.
+struct CacheLock {
+  CacheLock(ResponseCache *cache, std::string key, Downstream *owner);
+
+  ev_timer timer;
+  ResponseCache *cache;
+  std::string key;
+  // The request sent to backend.  nullptr if it has gone.
+  Downstream *owner;
+  std::vector<Downstream *> waiters;
+};
+
+// In-memory HTTP response cache described in RFC 7234.  This cache
+// is not thread-safe, and each worker has its own instance per
+// backend group.  The entries are evicted in LRU order.  If the
+// cache is full, a new response is admitted only if its key is
+// accessed more frequently than the least recently used entry's.
+class ResponseCache {
+public:
+  // |max_size| is the maximum number of bytes the stored entries can
+  // use, including the response body buffers.  If |lock_timeout| is
+  // not 0, concurrent requests which miss the cache for the same key
+  // are collapsed, and they wait for the response at most
+  // |lock_timeout| seconds.
+  ResponseCache(struct ev_loop *loop, size_t max_size,
+                ev_tstamp lock_timeout);
+  ~ResponseCache();
+  // Returns fresh response for |req| at the time |now|.  If no such
+  // response is found, returns nullptr.
+  const CacheEntry *lookup(const Request &req, ev_tstamp now);
+  // Returns new CacheEntry to store the response |resp| to |req|
+  // received at the time |now|.  The response body must be appended
+  // by append_body(), and then the entry is passed to store().  If
+  // the response must not be stored, returns nullptr.
+  std::unique_ptr<CacheEntry> prepare_store(const Request &req,
+                                            const Response &resp,
+                                            ev_tstamp now);
+  // Stores |ent| whose response body has been received completely.
+  // The least recently used entries are evicted if necessary.
+  void store(std::unique_ptr<CacheEntry> ent);
+  // Appends |data| of length |len| to the body of |ent| which is not
+  // stored yet.  The body buffers are charged to this cache, and the
+  // least recently used entries are evicted if necessary.  Returns 0
+  // if it succeeds, or -1 if |ent| cannot be stored.
+  int append_body(CacheEntry *ent, const uint8_t *data, size_t len);
+  // Releases the bytes charged for the body of |ent|.
+  void uncharge(CacheEntry *ent);
+  // Returns the maximum number of response body bytes a single entry
+  // can have.
+  size_t get_max_body_size() const;
+  const CacheStat &get_stat() const;
+
+  // Locks the key of the request of |downstream| which missed the
+  // cache.  If no other request holds the lock, |downstream| becomes
+  // the owner, and this function returns 0.  Otherwise, |downstream|
+  // waits until the owner calls unlock(), or the lock times out, and
+  // this function returns 1.  The waiting request is resumed by
+  // ClientHandler::resume_collapsed_request().  Returns -1 if the
+  // request cannot be collapsed.
+  int lock(Downstream *downstream);
+  // Releases the lock owned by |downstream|, if any.
+  void unlock(Downstream *downstream);
+  // Removes |downstream| from the requests waiting for lock.
+  void remove_waiter(Downstream *downstream);
+  // Releases |lk|, and schedules its waiters to be resumed.
+  void release_lock(CacheLock *lk);
+  // Resumes the waiters whose lock has been released.
+  void resume_waiters();
+
+private:
+  void remove_entry(CacheEntry *ent);
+  // Makes room for |size| bytes of the entry whose key hash is
+  // |hash|, evicting the least recently used entries.  The bytes of
+  // |replaced|, if not nullptr, are counted as free, and it is never
+  // evicted.  Returns false if the entry is not admitted.
+  bool make_room(size_t hash, size_t size, const CacheEntry *replaced);
+
+  // This must be declared before other members which keep
+  // Memchunks, so that it outlives them.
+  MemchunkPool mcpool_;
+  std::unordered_map<std::string, std::unique_ptr<CacheEntry>> entries_;
+  // Head is the least recently used entry.
+  DList<CacheEntry> lru_;
+  FrequencySketch sketch_;
+  std::unordered_map<std::string, std::unique_ptr<CacheLock>> locks_;
+  // Waiters whose lock has been released, and which are going to be
+  // resumed.
+  std::deque<Downstream *> ready_;
+  ev_timer resumetimer_;
+  struct ev_loop *loop_;
+  CacheStat stat_;
+  size_t max_size_;
+  ev_tstamp lock_timeout_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_CACHE_H
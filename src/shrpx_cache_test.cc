@@ -0,0 +1,542 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_cache_test.h"
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_cache.h"
+#include "shrpx_downstream.h"
+#include "http-parser/http_parser.h"
+
+namespace shrpx {
+
+void test_shrpx_cache_parse_cache_control(void) {
+  {
+    CacheControl cc;
+    parse_cache_control(cc, StringRef::from_lit("max-age=60, public"));
+
+    CU_ASSERT(60 == cc.max_age);
+    CU_ASSERT(-1 == cc.s_maxage);
+    CU_ASSERT(!cc.no_store);
+    CU_ASSERT(!cc.no_cache);
+    CU_ASSERT(!cc.is_private);
+  }
+  {
+    CacheControl cc;
+    parse_cache_control(cc, StringRef::from_lit(
+                                "Private=\"set-cookie, foo\",S-MaxAge=\"10\","
+                                "no-cache , no-store"));
+
+    CU_ASSERT(-1 == cc.max_age);
+    CU_ASSERT(10 == cc.s_maxage);
+    CU_ASSERT(cc.no_store);
+    CU_ASSERT(cc.no_cache);
+    CU_ASSERT(cc.is_private);
+  }
+  {
+    // Malformed max-age makes response stale.
+    CacheControl cc;
+    parse_cache_control(cc, StringRef::from_lit("max-age=foo"));
+
+    CU_ASSERT(0 == cc.max_age);
+  }
+  {
+    CacheControl cc;
+    parse_cache_control(cc, StringRef::from_lit(" , ,"));
+
+    CU_ASSERT(-1 == cc.max_age);
+    CU_ASSERT(!cc.no_store);
+  }
+}
+
+namespace {
+// 2001-09-09T01:46:40Z
+constexpr ev_tstamp NOW = 1000000000.;
+} // namespace
+
+namespace {
+void init_request(Request &req, const StringRef &path) {
+  req.method = HTTP_GET;
+  req.scheme = StringRef::from_lit("https");
+  req.authority = StringRef::from_lit("example.com");
+  req.path = path;
+}
+} // namespace
+
+namespace {
+void add_header(FieldStore &fs, const StringRef &name, const StringRef &value,
+                int32_t token = -1) {
+  fs.add_header_token(name, value, false, token);
+}
+} // namespace
+
+namespace {
+std::unique_ptr<CacheEntry> prepare(ResponseCache &cache,
+                                    const StringRef &cache_control,
+                                    const StringRef &name = StringRef{},
+                                    const StringRef &value = StringRef{}) {
+  BlockAllocator balloc(1024, 1024);
+  Request req(balloc);
+  Response resp(balloc);
+
+  init_request(req, StringRef::from_lit("/"));
+
+  resp.http_status = 200;
+  if (!cache_control.empty()) {
+    add_header(resp.fs, StringRef::from_lit("cache-control"), cache_control,
+               http2::HD_CACHE_CONTROL);
+  }
+  if (!name.empty()) {
+    add_header(resp.fs, name, value, http2::lookup_token(name));
+  }
+
+  return cache.prepare_store(req, resp, NOW);
+}
+} // namespace
+
+void test_shrpx_cache_prepare_store(void) {
+  ResponseCache cache(EV_DEFAULT, 1024 * 1024, 0.);
+
+  CU_ASSERT(nullptr != prepare(cache, StringRef::from_lit("max-age=60")));
+  CU_ASSERT(nullptr != prepare(cache, StringRef::from_lit("s-maxage=60")));
+  // No explicit expiration time
+  CU_ASSERT(nullptr == prepare(cache, StringRef{}));
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("max-age=0")));
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("no-store")));
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("no-cache")));
+  CU_ASSERT(nullptr ==
+            prepare(cache, StringRef::from_lit("private, max-age=60")));
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("max-age=60"),
+                               StringRef::from_lit("set-cookie"),
+                               StringRef::from_lit("a=b")));
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("max-age=60"),
+                               StringRef::from_lit("vary"),
+                               StringRef::from_lit("*")));
+  // Already stale
+  CU_ASSERT(nullptr == prepare(cache, StringRef::from_lit("max-age=60"),
+                               StringRef::from_lit("age"),
+                               StringRef::from_lit("60")));
+
+  {
+    auto ent = prepare(cache, StringRef::from_lit("max-age=60"),
+                       StringRef::from_lit("age"), StringRef::from_lit("10"));
+
+    CU_ASSERT(nullptr != ent);
+    CU_ASSERT(NOW - 10 == ent->date);
+    CU_ASSERT(NOW + 50 == ent->expires);
+    CU_ASSERT("https://example.com/" == ent->key);
+    CU_ASSERT(200 == ent->http_status);
+    // Age is not stored.
+    CU_ASSERT(1 == ent->headers.size());
+  }
+  {
+    auto ent = prepare(cache, StringRef{}, StringRef::from_lit("expires"),
+                       StringRef::from_lit("Sun, 09 Sep 2001 01:48:20 GMT"));
+
+    CU_ASSERT(nullptr != ent);
+    CU_ASSERT(NOW + 100 == ent->expires);
+  }
+
+  {
+    BlockAllocator balloc(1024, 1024);
+    Request req(balloc);
+    Response resp(balloc);
+
+    init_request(req, StringRef::from_lit("/"));
+    add_header(req.fs, StringRef::from_lit("authorization"),
+               StringRef::from_lit("Basic Zm9vOmJhcg=="));
+
+    resp.http_status = 200;
+    add_header(resp.fs, StringRef::from_lit("cache-control"),
+               StringRef::from_lit("max-age=60"), http2::HD_CACHE_CONTROL);
+
+    CU_ASSERT(nullptr == cache.prepare_store(req, resp, NOW));
+
+    req.fs.clear_headers();
+    req.method = HTTP_POST;
+
+    CU_ASSERT(nullptr == cache.prepare_store(req, resp, NOW));
+
+    req.method = HTTP_GET;
+    resp.http_status = 206;
+
+    CU_ASSERT(nullptr == cache.prepare_store(req, resp, NOW));
+  }
+}
+
+void test_shrpx_cache_lookup(void) {
+  ResponseCache cache(EV_DEFAULT, 1024 * 1024, 0.);
+  BlockAllocator balloc(1024, 1024);
+  Request req(balloc);
+  Response resp(balloc);
+
+  init_request(req, StringRef::from_lit("/alpha"));
+  add_header(req.fs, StringRef::from_lit("accept-encoding"),
+             StringRef::from_lit("gzip"), http2::HD_ACCEPT_ENCODING);
+
+  resp.http_status = 200;
+  add_header(resp.fs, StringRef::from_lit("cache-control"),
+             StringRef::from_lit("max-age=60"), http2::HD_CACHE_CONTROL);
+  add_header(resp.fs, StringRef::from_lit("vary"),
+             StringRef::from_lit("Accept-Encoding"));
+
+  CU_ASSERT(nullptr == cache.lookup(req, NOW));
+
+  auto ent = cache.prepare_store(req, resp, NOW);
+
+  CU_ASSERT(nullptr != ent);
+
+  ent->body.append("hello");
+  cache.store(std::move(ent));
+
+  CU_ASSERT(1 == cache.get_stat().num_entries);
+
+  auto res = cache.lookup(req, NOW + 10);
+
+  CU_ASSERT(nullptr != res);
+  CU_ASSERT(5 == res->body.rleft());
+  CU_ASSERT("content-length" == res->headers.back().name);
+  CU_ASSERT("5" == res->headers.back().value);
+  CU_ASSERT(1 == cache.get_stat().hits);
+  CU_ASSERT(5 == cache.get_stat().hit_bytes);
+
+  // HEAD is served from the response to GET.
+  req.method = HTTP_HEAD;
+
+  CU_ASSERT(nullptr != cache.lookup(req, NOW + 10));
+  CU_ASSERT(5 == cache.get_stat().hit_bytes);
+
+  req.method = HTTP_GET;
+
+  // Request cache-control prevents the use of stored response.
+  {
+    BlockAllocator balloc(1024, 1024);
+    Request req2(balloc);
+
+    init_request(req2, StringRef::from_lit("/alpha"));
+    add_header(req2.fs, StringRef::from_lit("accept-encoding"),
+               StringRef::from_lit("gzip"), http2::HD_ACCEPT_ENCODING);
+    add_header(req2.fs, StringRef::from_lit("cache-control"),
+               StringRef::from_lit("no-cache"), http2::HD_CACHE_CONTROL);
+
+    CU_ASSERT(nullptr == cache.lookup(req2, NOW + 10));
+
+    req2.fs.clear_headers();
+    add_header(req2.fs, StringRef::from_lit("accept-encoding"),
+               StringRef::from_lit("gzip"), http2::HD_ACCEPT_ENCODING);
+    add_header(req2.fs, StringRef::from_lit("cache-control"),
+               StringRef::from_lit("max-age=5"), http2::HD_CACHE_CONTROL);
+
+    CU_ASSERT(nullptr == cache.lookup(req2, NOW + 10));
+
+    req2.fs.clear_headers();
+    add_header(req2.fs, StringRef::from_lit("pragma"),
+               StringRef::from_lit("no-cache"));
+
+    CU_ASSERT(nullptr == cache.lookup(req2, NOW + 10));
+
+    // Different value of the header field nominated by Vary
+    req2.fs.clear_headers();
+    add_header(req2.fs, StringRef::from_lit("accept-encoding"),
+               StringRef::from_lit("br"), http2::HD_ACCEPT_ENCODING);
+
+    CU_ASSERT(nullptr == cache.lookup(req2, NOW + 10));
+
+    req2.path = StringRef::from_lit("/bravo");
+
+    CU_ASSERT(nullptr == cache.lookup(req2, NOW + 10));
+  }
+
+  // Stale response is removed.
+  CU_ASSERT(nullptr == cache.lookup(req, NOW + 60));
+  CU_ASSERT(0 == cache.get_stat().num_entries);
+  CU_ASSERT(0 == cache.get_stat().used);
+  CU_ASSERT(2 == cache.get_stat().hits);
+  CU_ASSERT(7 == cache.get_stat().misses);
+}
+
+namespace {
+// Returns new CacheEntry for the cacheable response to |path|.
+std::unique_ptr<CacheEntry> prepare_path(ResponseCache &cache,
+                                         const StringRef &path) {
+  BlockAllocator balloc(1024, 1024);
+  Request req(balloc);
+  Response resp(balloc);
+
+  init_request(req, path);
+
+  resp.http_status = 200;
+  add_header(resp.fs, StringRef::from_lit("cache-control"),
+             StringRef::from_lit("max-age=60"), http2::HD_CACHE_CONTROL);
+
+  return cache.prepare_store(req, resp, NOW);
+}
+} // namespace
+
+namespace {
+// Returns the response body stored for |path|, or -1 if it is not
+// found.
+ssize_t lookup_body(ResponseCache &cache, const StringRef &path) {
+  BlockAllocator balloc(1024, 1024);
+  Request req(balloc);
+
+  init_request(req, path);
+
+  auto ent = cache.lookup(req, NOW);
+  if (!ent) {
+    return -1;
+  }
+
+  return ent->body.rleft();
+}
+} // namespace
+
+namespace {
+// Looks up |path| in |cache|, and stores the response if it is not
+// found.  Returns true if it is found.
+bool lookup_or_store(ResponseCache &cache, const StringRef &path) {
+  if (lookup_body(cache, path) != -1) {
+    return true;
+  }
+
+  auto ent = prepare_path(cache, path);
+  ent->body.append("x");
+  cache.store(std::move(ent));
+
+  return false;
+}
+} // namespace
+
+void test_shrpx_cache_eviction(void) {
+  // Each entry takes one Memchunk16K, so that 2 entries fit.
+  ResponseCache cache(EV_DEFAULT, 40000, 0.);
+  auto &stat = cache.get_stat();
+
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/alpha")));
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/bravo")));
+  CU_ASSERT(2 == stat.num_entries);
+
+  // /charlie is not accessed more frequently than /alpha which is
+  // the least recently used one.
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/charlie")));
+  CU_ASSERT(2 == stat.num_entries);
+  CU_ASSERT(1 == stat.rejections);
+  CU_ASSERT(0 == stat.evictions);
+
+  // Now /charlie is more popular than /alpha.
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/charlie")));
+  CU_ASSERT(2 == stat.num_entries);
+  CU_ASSERT(1 == stat.evictions);
+
+  CU_ASSERT(lookup_or_store(cache, StringRef::from_lit("/bravo")));
+  CU_ASSERT(lookup_or_store(cache, StringRef::from_lit("/charlie")));
+
+  // /alpha was evicted.  The least recently used entry is now
+  // /bravo.
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/alpha")));
+  CU_ASSERT(2 == stat.rejections);
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/alpha")));
+  CU_ASSERT(2 == stat.evictions);
+
+  CU_ASSERT(lookup_or_store(cache, StringRef::from_lit("/charlie")));
+  CU_ASSERT(lookup_or_store(cache, StringRef::from_lit("/alpha")));
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/bravo")));
+}
+
+void test_shrpx_cache_replace(void) {
+  ResponseCache cache(EV_DEFAULT, 40000, 0.);
+  auto &stat = cache.get_stat();
+  auto alpha = StringRef::from_lit("/alpha");
+  auto bravo = StringRef::from_lit("/bravo");
+
+  CU_ASSERT(!lookup_or_store(cache, alpha));
+  CU_ASSERT(!lookup_or_store(cache, bravo));
+
+  for (size_t i = 0; i < 3; ++i) {
+    CU_ASSERT(lookup_or_store(cache, bravo));
+  }
+
+  auto used = stat.used;
+
+  // The response of the same size replaces the stored one without
+  // eviction.
+  auto ent = prepare_path(cache, alpha);
+  ent->body.append("yy");
+  cache.store(std::move(ent));
+
+  CU_ASSERT(2 == stat.num_entries);
+  CU_ASSERT(used == stat.used);
+  CU_ASSERT(2 == lookup_body(cache, alpha));
+
+  // The larger response needs /bravo to be evicted, but it is not
+  // more popular than /bravo.  The stored response must be kept.
+  ent = prepare_path(cache, alpha);
+  ent->body.append(std::string(Memchunk16K::size + 1, 'z').c_str());
+  cache.store(std::move(ent));
+
+  CU_ASSERT(1 == stat.rejections);
+  CU_ASSERT(0 == stat.evictions);
+  CU_ASSERT(2 == stat.num_entries);
+  CU_ASSERT(used == stat.used);
+  CU_ASSERT(2 == lookup_body(cache, alpha));
+  CU_ASSERT(1 == lookup_body(cache, bravo));
+}
+
+void test_shrpx_cache_append_body(void) {
+  ResponseCache cache(EV_DEFAULT, 40000, 0.);
+  auto &stat = cache.get_stat();
+  auto data = std::string(cache.get_max_body_size(), 'x');
+  auto p = reinterpret_cast<const uint8_t *>(data.c_str());
+
+  CU_ASSERT(!lookup_or_store(cache, StringRef::from_lit("/alpha")));
+
+  auto used = stat.used;
+
+  // The body of the response in flight is charged to the cache.
+  auto bravo = prepare_path(cache, StringRef::from_lit("/bravo"));
+
+  CU_ASSERT(0 == cache.append_body(bravo.get(), p, 1));
+  CU_ASSERT(Memchunk16K::size == stat.filling);
+  CU_ASSERT(0 == cache.append_body(bravo.get(), p + 1, 100));
+  CU_ASSERT(Memchunk16K::size == stat.filling);
+
+  // Another response in flight does not fit unless /alpha is
+  // evicted, but it is not more popular than /alpha.
+  auto charlie = prepare_path(cache, StringRef::from_lit("/charlie"));
+
+  CU_ASSERT(-1 == cache.append_body(charlie.get(), p, 1));
+  CU_ASSERT(1 == stat.rejections);
+  CU_ASSERT(Memchunk16K::size == stat.filling);
+  CU_ASSERT(used == stat.used);
+
+  // The body larger than the limit is rejected.
+  CU_ASSERT(-1 == cache.append_body(bravo.get(), p, data.size()));
+
+  // Dropping the entry releases its bytes.
+  charlie.reset();
+  bravo.reset();
+
+  CU_ASSERT(0 == stat.filling);
+
+  bravo = prepare_path(cache, StringRef::from_lit("/bravo"));
+
+  CU_ASSERT(0 == cache.append_body(bravo.get(), p, 101));
+
+  cache.store(std::move(bravo));
+
+  CU_ASSERT(0 == stat.filling);
+  CU_ASSERT(2 == stat.num_entries);
+  CU_ASSERT(101 == lookup_body(cache, StringRef::from_lit("/bravo")));
+}
+
+namespace {
+std::unique_ptr<Downstream>
+make_downstream(MemchunkPool *mcpool,
+                const std::shared_ptr<ResponseCache> &cache,
+                const StringRef &path) {
+  auto downstream = make_unique<Downstream>(nullptr, mcpool, 0);
+  init_request(downstream->request(), path);
+  downstream->set_response_cache(cache);
+  return downstream;
+}
+} // namespace
+
+void test_shrpx_cache_lock(void) {
+  MemchunkPool mcpool;
+  auto cache = std::make_shared<ResponseCache>(EV_DEFAULT, 1024 * 1024, 5.);
+  auto &stat = cache->get_stat();
+
+  auto alpha = StringRef::from_lit("/alpha");
+  auto bravo = StringRef::from_lit("/bravo");
+
+  auto d1 = make_downstream(&mcpool, cache, alpha);
+  auto d2 = make_downstream(&mcpool, cache, alpha);
+  auto d3 = make_downstream(&mcpool, cache, bravo);
+
+  CU_ASSERT(0 == cache->lock(d1.get()));
+  CU_ASSERT(Downstream::CACHE_LOCK_OWNER == d1->get_cache_lock_state());
+  CU_ASSERT(1 == cache->lock(d2.get()));
+  CU_ASSERT(d2->cache_lock_waiting());
+  CU_ASSERT(d1->get_cache_lock() == d2->get_cache_lock());
+  CU_ASSERT(0 == cache->lock(d3.get()));
+  CU_ASSERT(1 == stat.collapsed);
+
+  // The request which has already taken part in locking cannot lock
+  // again.
+  CU_ASSERT(-1 == cache->lock(d2.get()));
+
+  {
+    // POST request is not collapsed.
+    auto d = make_downstream(&mcpool, cache, alpha);
+    d->request().method = HTTP_POST;
+
+    CU_ASSERT(-1 == cache->lock(d.get()));
+  }
+  {
+    // The request which must not be served from cache is not
+    // collapsed.
+    auto d = make_downstream(&mcpool, cache, alpha);
+    add_header(d->request().fs, StringRef::from_lit("cache-control"),
+               StringRef::from_lit("no-cache"), http2::HD_CACHE_CONTROL);
+
+    CU_ASSERT(-1 == cache->lock(d.get()));
+  }
+
+  // Deleting the waiting request removes it from the lock.
+  auto lk = d1->get_cache_lock();
+  d2.reset();
+  CU_ASSERT(lk->waiters.empty());
+
+  d2 = make_downstream(&mcpool, cache, alpha);
+  CU_ASSERT(1 == cache->lock(d2.get()));
+
+  // Releasing the lock makes the waiters ready to be resumed.
+  cache->unlock(d1.get());
+  CU_ASSERT(Downstream::CACHE_LOCK_DONE == d1->get_cache_lock_state());
+  CU_ASSERT(nullptr == d1->get_cache_lock());
+  CU_ASSERT(Downstream::CACHE_LOCK_READY == d2->get_cache_lock_state());
+
+  // The key is not locked any more.
+  auto d4 = make_downstream(&mcpool, cache, alpha);
+  CU_ASSERT(0 == cache->lock(d4.get()));
+
+  // Deleting the owner releases the lock.
+  d3.reset();
+  auto d5 = make_downstream(&mcpool, cache, bravo);
+  CU_ASSERT(0 == cache->lock(d5.get()));
+
+  d2.reset();
+
+  {
+    // Collapsing is disabled.
+    auto nocollapse =
+        std::make_shared<ResponseCache>(EV_DEFAULT, 1024 * 1024, 0.);
+    auto d = make_downstream(&mcpool, nocollapse, bravo);
+
+    CU_ASSERT(-1 == nocollapse->lock(d.get()));
+  }
+}
+
+} // namespace shrpx
@@ -47,6 +47,8 @@
 #include "shrpx_downstream_connection_pool.h"
 #include "shrpx_downstream.h"
 #include "shrpx_http2_session.h"
+#include "shrpx_cache.h"
+#include "shrpx_concurrency_limiter.h"
 #ifdef HAVE_SPDYLAY
 #include "shrpx_spdy_upstream.h"
 #endif // HAVE_SPDYLAY
@@ -203,6 +205,12 @@ int ClientHandler::tls_handshake() {
     CLOG(INFO, this) << "SSL/TLS handshake completed";
   }
 
+  auto metrics = worker_->get_metrics();
+  metrics->tls_handshakes.add();
+  if (SSL_session_reused(conn_.tls.ssl)) {
+    metrics->tls_resumptions.add();
+  }
+
   if (validate_next_proto() != 0) {
     return -1;
   }
@@ -257,7 +265,9 @@ int ClientHandler::read_tls() {
 }
 
 int ClientHandler::write_tls() {
-  struct iovec iov;
+  // A TLS record is at most 16KiB, and so is a memchunk.  2 buffers
+  // are enough to fill up a record.
+  std::array<struct iovec, 2> iov;
 
   ev_timer_again(conn_.loop, &conn_.rt);
 
@@ -268,13 +278,13 @@ int ClientHandler::write_tls() {
       return -1;
     }
 
-    auto iovcnt = upstream_->response_riovec(&iov, 1);
+    auto iovcnt = upstream_->response_riovec(iov.data(), iov.size());
     if (iovcnt == 0) {
       conn_.start_tls_write_idle();
       break;
     }
 
-    auto nwrite = conn_.write_tls(iov.iov_base, iov.iov_len);
+    auto nwrite = conn_.writev_tls(iov.data(), iovcnt);
     if (nwrite < 0) {
       return -1;
     }
@@ -399,7 +409,8 @@ ClientHandler::ClientHandler(Worker *worker, int fd, SSL *ssl,
             get_config()->conn.upstream.ratelimit.write,
             get_config()->conn.upstream.ratelimit.read, writecb, readcb,
             timeoutcb, this, get_config()->tls.dyn_rec.warmup_threshold,
-            get_config()->tls.dyn_rec.idle_timeout, PROTO_NONE),
+            get_config()->tls.dyn_rec.idle_timeout,
+            get_config()->tls.dyn_rec.adaptive, PROTO_NONE),
       ipaddr_(ipaddr),
       port_(port),
       faddr_(faddr),
@@ -410,6 +421,10 @@ ClientHandler::ClientHandler(Worker *worker, int fd, SSL *ssl,
 
   ++worker_->get_worker_stat()->num_connections;
 
+  auto metrics = worker_->get_metrics();
+  metrics->frontend_connections.add();
+  metrics->active_frontend_connections.add();
+
   ev_timer_init(&reneg_shutdown_timer_, shutdowncb, 0., 0.);
 
   reneg_shutdown_timer_.data = this;
@@ -475,12 +490,16 @@ ClientHandler::~ClientHandler() {
   auto worker_stat = worker_->get_worker_stat();
   --worker_stat->num_connections;
 
+  worker_->get_metrics()->active_frontend_connections.sub();
+
   if (worker_stat->num_connections == 0) {
     worker_->schedule_clear_mcpool();
   }
 
   ev_timer_stop(conn_.loop, &reneg_shutdown_timer_);
 
+  worker_->remove_ssl_ctx_waiter(&conn_);
+
   // TODO If backend is http/2, and it is in CONNECTED state, signal
   // it and make it loopbreak when output is zero.
   if (worker_->get_graceful_shutdown() && worker_stat->num_connections == 0) {
@@ -661,6 +680,12 @@ void ClientHandler::pool_downstream_connection(
 
   auto group = dconn->get_downstream_addr_group();
 
+  if (group->shared_addr->retired) {
+    // Backend configuration was reloaded, and this connection is no
+    // longer used.
+    return;
+  }
+
   if (LOG_ENABLED(INFO)) {
     CLOG(INFO, this) << "Pooling downstream connection DCONN:" << dconn.get()
                      << " in group " << group;
@@ -680,11 +705,9 @@ void ClientHandler::remove_downstream_connection(DownstreamConnection *dconn) {
   dconn_pool.remove_downstream_connection(dconn);
 }
 
-std::unique_ptr<DownstreamConnection>
-ClientHandler::get_downstream_connection(Downstream *downstream) {
-  size_t group_idx;
-  auto &downstreamconf = get_config()->conn.downstream;
-  auto catch_all = downstreamconf.addr_group_catch_all;
+size_t ClientHandler::get_downstream_addr_group_idx(Downstream *downstream) {
+  auto routing = worker_->get_downstream_routing();
+  auto catch_all = routing->addr_group_catch_all;
   auto &groups = worker_->get_downstream_addr_groups();
 
   const auto &req = downstream->request();
@@ -692,41 +715,275 @@ ClientHandler::get_downstream_connection(Downstream *downstream) {
   // Fast path.  If we have one group, it must be catch-all group.
   // proxy mode falls in this case.
   if (groups.size() == 1) {
-    group_idx = 0;
-  } else if (req.method == HTTP_CONNECT) {
+    return 0;
+  }
+
+  if (req.method == HTTP_CONNECT) {
     //  We don't know how to treat CONNECT request in host-path
     //  mapping.  It most likely appears in proxy scenario.  Since we
     //  have dealt with proxy case already, just use catch-all group.
-    group_idx = catch_all;
+    return catch_all;
+  }
+
+  auto &routerconf = routing->router;
+  if (!req.authority.empty()) {
+    return match_downstream_addr_group(routerconf, req.authority, req.path,
+                                       groups, catch_all);
+  }
+
+  auto h = req.fs.header(http2::HD_HOST);
+  if (h) {
+    return match_downstream_addr_group(routerconf, h->value, req.path, groups,
+                                       catch_all);
+  }
+
+  return match_downstream_addr_group(routerconf, StringRef{}, req.path, groups,
+                                     catch_all);
+}
+
+int ClientHandler::lookup_response_cache(Downstream *downstream) {
+  if (!worker_->has_response_cache()) {
+    return 0;
+  }
+
+  auto &group =
+      worker_->get_downstream_addr_groups()[get_downstream_addr_group_idx(
+          downstream)];
+  auto &cache = group->cache;
+
+  if (!cache) {
+    return 0;
+  }
+
+  const auto &req = downstream->request();
+  auto now = ev_now(conn_.loop);
+
+  auto ent = cache->lookup(req, now);
+  if (!ent) {
+    downstream->set_response_cache(cache);
+
+    if (cache->lock(downstream) == 1) {
+      if (LOG_ENABLED(INFO)) {
+        CLOG(INFO, this) << "Waiting for the response to the identical "
+                            "request";
+      }
+      return 2;
+    }
+
+    return 0;
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    CLOG(INFO, this) << "Response cache hit: " << ent->key;
+  }
+
+  auto &resp = downstream->response();
+  auto &balloc = downstream->get_block_allocator();
+
+  resp.http_status = ent->http_status;
+
+  for (auto &kv : ent->headers) {
+    resp.fs.add_header_token(make_string_ref(balloc, StringRef{kv.name}),
+                             make_string_ref(balloc, StringRef{kv.value}),
+                             kv.no_index, kv.token);
+  }
+
+  auto age = static_cast<uint64_t>(std::max(0., now - ent->date));
+  resp.fs.add_header_token(StringRef::from_lit("age"),
+                           util::make_string_ref_uint(balloc, age), false, -1);
+
+  resp.fs.content_length = ent->body.rleft();
+
+  // The number of Memchunk16K in body is usually small.
+  std::vector<struct iovec> iov;
+  if (downstream->expect_response_body()) {
+    for (auto m = ent->body.head; m; m = m->next) {
+      iov.push_back({m->pos, m->len()});
+    }
+  }
+
+  if (upstream_->send_reply(downstream, iov.data(), iov.size()) != 0) {
+    return -1;
+  }
+
+  signal_write();
+
+  return 1;
+}
+
+void ClientHandler::resume_collapsed_request(Downstream *downstream) {
+  auto rv = lookup_response_cache(downstream);
+  if (rv == 0) {
+    rv = acquire_concurrency_limit(downstream);
+    if (rv == 0) {
+      upstream_->start_downstream(downstream);
+    } else if (rv == -1) {
+      upstream_->on_downstream_abort_request(downstream, 503);
+    }
+  } else if (rv == -1) {
+    upstream_->on_downstream_abort_request(downstream, 500);
+  }
+
+  signal_write();
+}
+
+int ClientHandler::acquire_concurrency_limit(Downstream *downstream) {
+  const auto &req = downstream->request();
+
+  // Upgraded connection and tunnel are not limited, since they may
+  // last forever.
+  if (req.method == HTTP_CONNECT || req.upgrade_request) {
+    return 0;
+  }
+
+  auto &group =
+      worker_->get_downstream_addr_groups()[get_downstream_addr_group_idx(
+          downstream)];
+  auto &limiter = group->shared_addr->limiter;
+
+  if (!limiter) {
+    return 0;
+  }
+
+  downstream->set_concurrency_limiter(limiter);
+
+  auto rv = limiter->acquire(downstream);
+  if (rv == -1) {
+    if (LOG_ENABLED(INFO)) {
+      CLOG(INFO, this) << "Concurrency limit reached: limit="
+                       << limiter->get_limit()
+                       << ", inflight=" << limiter->get_num_inflight();
+    }
+  } else if (rv == 1) {
+    if (LOG_ENABLED(INFO)) {
+      CLOG(INFO, this) << "Waiting for concurrency limit";
+    }
+  }
+
+  return rv;
+}
+
+void ClientHandler::resume_limited_request(Downstream *downstream,
+                                           bool admitted) {
+  if (admitted) {
+    upstream_->start_downstream(downstream);
   } else {
-    auto &router = get_config()->router;
-    auto &wildcard_patterns = get_config()->wildcard_patterns;
-    if (!req.authority.empty()) {
-      group_idx =
-          match_downstream_addr_group(router, wildcard_patterns, req.authority,
-                                      req.path, groups, catch_all);
-    } else {
-      auto h = req.fs.header(http2::HD_HOST);
-      if (h) {
-        group_idx = match_downstream_addr_group(
-            router, wildcard_patterns, h->value, req.path, groups, catch_all);
-      } else {
-        group_idx =
-            match_downstream_addr_group(router, wildcard_patterns, StringRef{},
-                                        req.path, groups, catch_all);
+    upstream_->on_downstream_abort_request(downstream, 503);
+  }
+
+  signal_write();
+}
+
+namespace {
+// Returns the value of cookie |name| in |req|.  Returns empty string
+// if there is no such cookie.
+StringRef find_cookie(const Request &req, const StringRef &name) {
+  for (auto &kv : req.fs.headers()) {
+    if (kv.token != http2::HD_COOKIE) {
+      continue;
+    }
+
+    auto first = std::begin(kv.value);
+    auto last = std::end(kv.value);
+
+    while (first != last) {
+      for (; first != last && (*first == ' ' || *first == '\t'); ++first)
+        ;
+      auto end = std::find(first, last, ';');
+      auto eq = std::find(first, end, '=');
+      if (eq != end && StringRef{first, eq} == name) {
+        auto value = StringRef{eq + 1, end};
+        if (!value.empty()) {
+          return value;
+        }
       }
+      if (end == last) {
+        break;
+      }
+      first = end + 1;
     }
   }
 
+  return StringRef{};
+}
+} // namespace
+
+namespace {
+// Returns the key to hash for session affinity.  If the header field
+// or cookie designated by |shared_addr| is missing, client IP
+// address |ipaddr| is used instead.
+StringRef get_affinity_key(const SharedDownstreamAddr *shared_addr,
+                           const Request &req, const std::string &ipaddr) {
+  switch (shared_addr->affinity) {
+  case AFFINITY_HEADER: {
+    auto kv = req.fs.header(StringRef{shared_addr->affinity_name});
+    if (kv && !kv->value.empty()) {
+      return kv->value;
+    }
+    break;
+  }
+  case AFFINITY_COOKIE: {
+    auto value = find_cookie(req, StringRef{shared_addr->affinity_name});
+    if (!value.empty()) {
+      return value;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  return StringRef{ipaddr};
+}
+} // namespace
+
+std::unique_ptr<DownstreamConnection>
+ClientHandler::get_downstream_connection(Downstream *downstream) {
+  auto group_idx = get_downstream_addr_group_idx(downstream);
+
   if (LOG_ENABLED(INFO)) {
     CLOG(INFO, this) << "Downstream address group_idx: " << group_idx;
   }
 
   auto &group = worker_->get_downstream_addr_groups()[group_idx];
-  auto &shared_addr = group.shared_addr;
+  auto &shared_addr = group->shared_addr;
   auto &dconn_pool = shared_addr->dconn_pool;
 
-  auto dconn = dconn_pool.pop_downstream_connection();
+  // Backend address selected for this request by retry, session
+  // affinity or weighted load balancing.  nullptr if none of them is
+  // enabled, or no address is available.
+  DownstreamAddr *pinned_addr = nullptr;
+  std::unique_ptr<DownstreamConnection> dconn;
+
+  auto &tried_addrs = downstream->get_tried_addrs();
+
+  if (!tried_addrs.empty()) {
+    // The request is being retried.  Select the address which has
+    // not been tried yet.
+    pinned_addr = select_retry_downstream_addr(shared_addr.get(), tried_addrs);
+  }
+
+  if (pinned_addr) {
+    dconn = dconn_pool.pop_downstream_connection(pinned_addr);
+  } else if (shared_addr->affinity != AFFINITY_NONE) {
+    auto hash = compute_affinity_key_hash(
+        get_affinity_key(shared_addr.get(), downstream->request(), ipaddr_));
+    downstream->set_affinity_hash(hash);
+    pinned_addr = select_affinity_downstream_addr(shared_addr.get(), hash);
+    if (pinned_addr) {
+      dconn = dconn_pool.pop_downstream_connection(pinned_addr);
+    }
+  } else if (shared_addr->weighted) {
+    // Connections in pool are not reused blindly, otherwise the
+    // weight would not be honored.
+    pinned_addr = select_downstream_addr(
+        shared_addr.get(), worker_->get_randgen(), ev_now(conn_.loop));
+    if (pinned_addr) {
+      dconn = dconn_pool.pop_downstream_connection(pinned_addr);
+    }
+  } else {
+    dconn = dconn_pool.pop_downstream_connection();
+  }
 
   if (!dconn) {
     if (LOG_ENABLED(INFO)) {
@@ -737,24 +994,57 @@ ClientHandler::get_downstream_connection(Downstream *downstream) {
     if (shared_addr->proto == PROTO_HTTP2) {
       auto &http2_freelist = shared_addr->http2_freelist;
 
-      if (http2_freelist.empty() ||
-          http2_freelist.size() < shared_addr->addrs.size()) {
-        if (LOG_ENABLED(INFO)) {
-          if (http2_freelist.empty()) {
-            CLOG(INFO, this)
-                << "http2_freelist is empty; create new Http2Session";
-          } else {
-            CLOG(INFO, this) << "Create new Http2Session; current "
-                             << http2_freelist.size() << ", min "
-                             << shared_addr->addrs.size();
+      Http2Session *http2session;
+
+      if (pinned_addr) {
+        http2session =
+            select_http2_session_by_addr(shared_addr.get(), pinned_addr);
+        if (!http2session) {
+          if (LOG_ENABLED(INFO)) {
+            CLOG(INFO, this) << "No Http2Session for selected address; "
+                                "create new Http2Session";
           }
+          auto session = make_unique<Http2Session>(
+              conn_.loop, worker_->get_cl_ssl_ctx(), worker_, group);
+          session->set_pinned_addr(pinned_addr);
+          http2session = session.get();
+          http2_freelist.append(session.release());
+        }
+      } else {
+        // Unless coalescing is enabled, we prepare at least one
+        // Http2Session per backend address.
+        if (http2_freelist.empty() ||
+            (!get_config()->http2.downstream.coalesce &&
+             http2_freelist.size() < shared_addr->addrs.size())) {
+          if (LOG_ENABLED(INFO)) {
+            if (http2_freelist.empty()) {
+              CLOG(INFO, this)
+                  << "http2_freelist is empty; create new Http2Session";
+            } else {
+              CLOG(INFO, this) << "Create new Http2Session; current "
+                               << http2_freelist.size() << ", min "
+                               << shared_addr->addrs.size();
+            }
+          }
+          auto session = make_unique<Http2Session>(
+              conn_.loop, worker_->get_cl_ssl_ctx(), worker_, group);
+          http2_freelist.append(session.release());
         }
-        auto session = make_unique<Http2Session>(
-            conn_.loop, worker_->get_cl_ssl_ctx(), worker_, &group);
-        http2_freelist.append(session.release());
-      }
 
-      auto http2session = http2_freelist.head;
+        http2session =
+            select_http2_session(shared_addr.get(), ev_now(conn_.loop));
+
+        if (!http2session) {
+          if (LOG_ENABLED(INFO)) {
+            CLOG(INFO, this) << "All Http2Sessions are connected to unhealthy "
+                                "backend; create new Http2Session";
+          }
+          auto session = make_unique<Http2Session>(
+              conn_.loop, worker_->get_cl_ssl_ctx(), worker_, group);
+          http2session = session.get();
+          http2_freelist.append(session.release());
+        }
+      }
 
       if (http2session->max_concurrency_reached(1)) {
         if (LOG_ENABLED(INFO)) {
@@ -767,8 +1057,10 @@ ClientHandler::get_downstream_connection(Downstream *downstream) {
 
       dconn = make_unique<Http2DownstreamConnection>(http2session);
     } else {
-      dconn =
-          make_unique<HttpDownstreamConnection>(&group, conn_.loop, worker_);
+      auto http_dconn =
+          make_unique<HttpDownstreamConnection>(group, conn_.loop, worker_);
+      http_dconn->set_pinned_addr(pinned_addr);
+      dconn = std::move(http_dconn);
     }
     dconn->set_client_handler(this);
     return dconn;
@@ -892,6 +1184,14 @@ void ClientHandler::write_accesslog(Downstream *downstream) {
 
   auto &balloc = downstream->get_block_allocator();
 
+  auto request_end_time = std::chrono::high_resolution_clock::now();
+
+  worker_->get_metrics()->on_request_complete(
+      resp.http_status, req.recv_body_length,
+      downstream->response_sent_body_length,
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          request_end_time - downstream->get_request_start_time()).count());
+
   upstream_accesslog(
       get_config()->logging.access.format,
       LogSpec{
@@ -911,8 +1211,8 @@ void ClientHandler::write_accesslog(Downstream *downstream) {
           nghttp2::ssl::get_tls_session_info(&tls_info, conn_.tls.ssl),
 
           std::chrono::system_clock::now(),          // time_now
-          downstream->get_request_start_time(),      // request_start_time
-          std::chrono::high_resolution_clock::now(), // request_end_time
+          downstream->get_request_start_time(), // request_start_time
+          request_end_time,                     // request_end_time
 
           req.http_major, req.http_minor, resp.http_status,
           downstream->response_sent_body_length, StringRef(port_), faddr_->port,
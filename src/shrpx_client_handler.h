@@ -98,6 +98,32 @@ public:
   void remove_downstream_connection(DownstreamConnection *dconn);
   std::unique_ptr<DownstreamConnection>
   get_downstream_connection(Downstream *downstream);
+  // Returns the index of downstream address group which serves
+  // |downstream|.
+  size_t get_downstream_addr_group_idx(Downstream *downstream);
+  // Looks up response cache for |downstream|.  If fresh response is
+  // found, sends it to the client, and returns 1.  If it is not
+  // found, the response to |downstream| may be stored in the cache,
+  // and returns 0.  If the identical request is in flight and
+  // |downstream| is made to wait for its response, returns 2.  In
+  // this case, resume_collapsed_request() is called later.  This
+  // function returns -1 if it fails to send the response.
+  int lookup_response_cache(Downstream *downstream);
+  // Resumes |downstream| which has been waiting for the response to
+  // the identical request.  The response is sent from cache if it is
+  // available.  Otherwise, |downstream| is forwarded to backend.
+  void resume_collapsed_request(Downstream *downstream);
+  // Acquires a slot of the concurrency limiter of the backend group
+  // which serves |downstream|.  This function returns 0 if
+  // |downstream| can be forwarded to backend now, or the group has no
+  // limiter.  It returns 1 if |downstream| waits for a free slot.  In
+  // this case, resume_limited_request() is called later.  It returns
+  // -1 if |downstream| must be rejected.
+  int acquire_concurrency_limit(Downstream *downstream);
+  // Resumes |downstream| which has been waiting for a free slot of
+  // the concurrency limiter.  If |admitted| is true, |downstream| is
+  // forwarded to backend.  Otherwise, 503 response is sent.
+  void resume_limited_request(Downstream *downstream, bool admitted);
   MemchunkPool *get_mcpool();
   SSL *get_ssl() const;
   // Call this function when HTTP/2 connection header is received at
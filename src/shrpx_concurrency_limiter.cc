@@ -0,0 +1,257 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_concurrency_limiter.h"
+
+#include <algorithm>
+
+#include "shrpx_downstream.h"
+#include "shrpx_upstream.h"
+#include "shrpx_client_handler.h"
+#include "shrpx_log.h"
+
+namespace shrpx {
+
+namespace {
+// The limit which is used until the backend responds.
+constexpr double INITIAL_LIMIT = 100.;
+constexpr double MIN_LIMIT = 1.;
+constexpr double MAX_LIMIT = 10000.;
+// The limit is multiplied by this value when the latency grows.
+constexpr double BACKOFF_RATIO = 0.9;
+// The latency which exceeds the minimum latency multiplied by this
+// value is considered to be the sign of queueing.
+constexpr double LATENCY_TOLERANCE = 2.;
+// The latency which exceeds the minimum latency by less than this
+// value is never considered to be the sign of queueing.
+constexpr ev_tstamp MIN_QUEUEING_DELAY = 0.005;
+// The minimum latency is forgotten after this period, so that the
+// limit follows the change of the backend.
+constexpr ev_tstamp MIN_LATENCY_WINDOW = 30.;
+} // namespace
+
+namespace {
+void queuecb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto limiter = static_cast<ConcurrencyLimiter *>(w->data);
+  limiter->expire_waiters();
+}
+} // namespace
+
+namespace {
+void resumecb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto limiter = static_cast<ConcurrencyLimiter *>(w->data);
+  limiter->resume_waiters();
+}
+} // namespace
+
+ConcurrencyLimiter::ConcurrencyLimiter(struct ev_loop *loop,
+                                       ev_tstamp queue_timeout)
+    : loop_(loop),
+      stat_{},
+      queue_timeout_(queue_timeout),
+      limit_(INITIAL_LIMIT),
+      min_latency_(0.),
+      min_latency_tstamp_(0.),
+      backoff_tstamp_(0.),
+      num_inflight_(0) {
+  ev_timer_init(&queuetimer_, queuecb, 0., 0.);
+  queuetimer_.data = this;
+
+  ev_timer_init(&resumetimer_, resumecb, 0., 0.);
+  resumetimer_.data = this;
+}
+
+ConcurrencyLimiter::~ConcurrencyLimiter() {
+  ev_timer_stop(loop_, &resumetimer_);
+  ev_timer_stop(loop_, &queuetimer_);
+}
+
+namespace {
+// Returns true if |downstream| can wait in the queue.  The request
+// body which arrives while the request is queued cannot be
+// forwarded, so the request which has request body is not queued.
+bool queueable(Downstream *downstream) {
+  const auto &req = downstream->request();
+  return !req.http2_expect_body && req.fs.content_length <= 0 &&
+         !downstream->get_chunked_request();
+}
+} // namespace
+
+int ConcurrencyLimiter::acquire(Downstream *downstream) {
+  if (waiters_.empty() && num_inflight_ < limit_) {
+    ++num_inflight_;
+    downstream->set_limit_state(Downstream::LIMIT_ACQUIRED);
+    return 0;
+  }
+
+  if (queue_timeout_ == 0. || !queueable(downstream)) {
+    ++stat_.rejected;
+    return -1;
+  }
+
+  ++stat_.queued;
+
+  waiters_.push_back({downstream, ev_now(loop_) + queue_timeout_});
+  downstream->set_limit_state(Downstream::LIMIT_WAIT);
+
+  if (!ev_is_active(&queuetimer_)) {
+    ev_timer_set(&queuetimer_, queue_timeout_, 0.);
+    ev_timer_start(loop_, &queuetimer_);
+  }
+
+  return 1;
+}
+
+void ConcurrencyLimiter::release(Downstream *downstream) {
+  switch (downstream->get_limit_state()) {
+  case Downstream::LIMIT_ACQUIRED:
+    --num_inflight_;
+    break;
+  case Downstream::LIMIT_WAIT:
+    waiters_.erase(std::find_if(
+        std::begin(waiters_), std::end(waiters_),
+        [downstream](const Waiter &w) { return w.downstream == downstream; }));
+    downstream->set_limit_state(Downstream::LIMIT_NONE);
+    return;
+  case Downstream::LIMIT_READY:
+    ready_.erase(std::find(std::begin(ready_), std::end(ready_), downstream));
+    --num_inflight_;
+    break;
+  case Downstream::LIMIT_REJECTED:
+    ready_.erase(std::find(std::begin(ready_), std::end(ready_), downstream));
+    downstream->set_limit_state(Downstream::LIMIT_NONE);
+    return;
+  default:
+    return;
+  }
+
+  downstream->set_limit_state(Downstream::LIMIT_NONE);
+
+  dequeue_waiters();
+}
+
+void ConcurrencyLimiter::update(ev_tstamp latency, ev_tstamp now) {
+  if (min_latency_tstamp_ == 0. || latency < min_latency_ ||
+      now - min_latency_tstamp_ > MIN_LATENCY_WINDOW) {
+    min_latency_ = latency;
+    min_latency_tstamp_ = now;
+  }
+
+  if (latency > std::max(min_latency_ * LATENCY_TOLERANCE,
+                         min_latency_ + MIN_QUEUEING_DELAY)) {
+    // Decrease the limit at most once per round trip; the responses
+    // to the requests sent before the last decrease do not reflect
+    // it.
+    if (now - backoff_tstamp_ >= latency) {
+      limit_ = std::max(MIN_LIMIT, limit_ * BACKOFF_RATIO);
+      backoff_tstamp_ = now;
+
+      if (LOG_ENABLED(INFO)) {
+        LOG(INFO) << "Concurrency limit decreased to " << limit_
+                  << ", latency=" << latency << ", min=" << min_latency_;
+      }
+    }
+
+    return;
+  }
+
+  // Do not increase the limit unless it is actually used.
+  if (num_inflight_ * 2 < limit_) {
+    return;
+  }
+
+  // This increases the limit by 1 per limit_ responses.
+  limit_ = std::min(MAX_LIMIT, limit_ + 1. / limit_);
+
+  dequeue_waiters();
+}
+
+void ConcurrencyLimiter::dequeue_waiters() {
+  while (!waiters_.empty() && num_inflight_ < limit_) {
+    auto downstream = waiters_.front().downstream;
+    waiters_.pop_front();
+
+    ++num_inflight_;
+    downstream->set_limit_state(Downstream::LIMIT_READY);
+    ready_.push_back(downstream);
+  }
+
+  if (waiters_.empty()) {
+    ev_timer_stop(loop_, &queuetimer_);
+  }
+
+  if (!ready_.empty()) {
+    // Resume them later, because we may be in the middle of the
+    // processing of the other request.
+    ev_timer_start(loop_, &resumetimer_);
+  }
+}
+
+void ConcurrencyLimiter::expire_waiters() {
+  auto now = ev_now(loop_);
+
+  while (!waiters_.empty() && waiters_.front().deadline <= now) {
+    auto downstream = waiters_.front().downstream;
+    waiters_.pop_front();
+
+    ++stat_.rejected;
+    downstream->set_limit_state(Downstream::LIMIT_REJECTED);
+    ready_.push_back(downstream);
+  }
+
+  if (!waiters_.empty()) {
+    ev_timer_set(&queuetimer_, waiters_.front().deadline - now, 0.);
+    ev_timer_start(loop_, &queuetimer_);
+  }
+
+  if (!ready_.empty()) {
+    ev_timer_start(loop_, &resumetimer_);
+  }
+}
+
+void ConcurrencyLimiter::resume_waiters() {
+  // Resuming a request may delete the other requests in ready_.
+  while (!ready_.empty()) {
+    auto downstream = ready_.front();
+    ready_.pop_front();
+
+    auto admitted = downstream->get_limit_state() == Downstream::LIMIT_READY;
+
+    downstream->set_limit_state(admitted ? Downstream::LIMIT_ACQUIRED
+                                         : Downstream::LIMIT_NONE);
+
+    auto handler = downstream->get_upstream()->get_client_handler();
+    handler->resume_limited_request(downstream, admitted);
+  }
+}
+
+double ConcurrencyLimiter::get_limit() const { return limit_; }
+
+size_t ConcurrencyLimiter::get_num_inflight() const { return num_inflight_; }
+
+const ConcurrencyLimiterStat &ConcurrencyLimiter::get_stat() const {
+  return stat_;
+}
+
+} // namespace shrpx
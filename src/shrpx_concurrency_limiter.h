@@ -0,0 +1,113 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_CONCURRENCY_LIMITER_H
+#define SHRPX_CONCURRENCY_LIMITER_H
+
+#include "shrpx.h"
+
+#include <deque>
+
+#include <ev.h>
+
+namespace shrpx {
+
+class Downstream;
+
+struct ConcurrencyLimiterStat {
+  // The number of requests which were queued because the limit was
+  // reached.
+  uint64_t queued;
+  // The number of requests which were rejected because the limit was
+  // reached.
+  uint64_t rejected;
+};
+
+// ConcurrencyLimiter limits the number of requests in flight to a
+// backend group.  The limit is adjusted by AIMD (additive increase,
+// multiplicative decrease) algorithm driven by the response latency
+// of the backend: it is increased while the latency stays close to
+// the minimum latency observed recently, and it is decreased when
+// the latency grows, which is the sign of queueing in the backend.
+class ConcurrencyLimiter {
+public:
+  // If |queue_timeout| is 0, requests which exceed the limit are
+  // rejected immediately.  Otherwise, they are queued for at most
+  // |queue_timeout| seconds.
+  ConcurrencyLimiter(struct ev_loop *loop, ev_tstamp queue_timeout);
+  ~ConcurrencyLimiter();
+
+  // Acquires a slot for |downstream|.  This function returns 0 if it
+  // can be forwarded to backend now, 1 if it is queued, or -1 if it
+  // must be rejected.  If it is queued,
+  // ClientHandler::resume_limited_request() is called later.
+  int acquire(Downstream *downstream);
+  // Releases the slot held by |downstream|, or removes it from the
+  // queue.
+  void release(Downstream *downstream);
+  // Updates the limit with the response |latency| in seconds
+  // observed at the time |now|.
+  void update(ev_tstamp latency, ev_tstamp now);
+  // Resumes the requests which acquired a slot or timed out in the
+  // queue.
+  void resume_waiters();
+  // Removes the requests which have been in the queue for too long.
+  void expire_waiters();
+
+  double get_limit() const;
+  size_t get_num_inflight() const;
+  const ConcurrencyLimiterStat &get_stat() const;
+
+private:
+  struct Waiter {
+    Downstream *downstream;
+    // The time after which the request is rejected.
+    ev_tstamp deadline;
+  };
+
+  // Moves the waiters which can acquire a slot to ready_.
+  void dequeue_waiters();
+
+  std::deque<Waiter> waiters_;
+  // Requests which are going to be resumed.  The slot has been
+  // acquired if the state of the request is LIMIT_READY.
+  std::deque<Downstream *> ready_;
+  ev_timer queuetimer_;
+  ev_timer resumetimer_;
+  struct ev_loop *loop_;
+  ConcurrencyLimiterStat stat_;
+  ev_tstamp queue_timeout_;
+  double limit_;
+  // The minimum response latency observed recently.
+  ev_tstamp min_latency_;
+  // The time when min_latency_ was set.
+  ev_tstamp min_latency_tstamp_;
+  // The time when the limit was decreased last time.
+  ev_tstamp backoff_tstamp_;
+  size_t num_inflight_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_CONCURRENCY_LIMITER_H
@@ -0,0 +1,195 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_concurrency_limiter_test.h"
+
+#include <vector>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_concurrency_limiter.h"
+#include "shrpx_downstream.h"
+
+namespace shrpx {
+
+namespace {
+std::vector<std::unique_ptr<Downstream>>
+acquire_n(MemchunkPool *mcpool,
+          const std::shared_ptr<ConcurrencyLimiter> &limiter, size_t n) {
+  std::vector<std::unique_ptr<Downstream>> res;
+  for (size_t i = 0; i < n; ++i) {
+    auto downstream = make_unique<Downstream>(nullptr, mcpool, 0);
+    downstream->set_concurrency_limiter(limiter);
+    CU_ASSERT(0 == limiter->acquire(downstream.get()));
+    res.push_back(std::move(downstream));
+  }
+  return res;
+}
+} // namespace
+
+namespace {
+std::unique_ptr<Downstream>
+make_downstream(MemchunkPool *mcpool,
+                const std::shared_ptr<ConcurrencyLimiter> &limiter) {
+  auto downstream = make_unique<Downstream>(nullptr, mcpool, 0);
+  downstream->set_concurrency_limiter(limiter);
+  return downstream;
+}
+} // namespace
+
+void test_shrpx_concurrency_limiter_acquire(void) {
+  MemchunkPool mcpool;
+  auto limiter = std::make_shared<ConcurrencyLimiter>(EV_DEFAULT, 0.);
+  auto &stat = limiter->get_stat();
+
+  auto limit = static_cast<size_t>(limiter->get_limit());
+  auto ds = acquire_n(&mcpool, limiter, limit);
+
+  CU_ASSERT(limit == limiter->get_num_inflight());
+  CU_ASSERT(Downstream::LIMIT_ACQUIRED == ds[0]->get_limit_state());
+
+  // The request is rejected immediately without queue.
+  auto d = make_downstream(&mcpool, limiter);
+
+  CU_ASSERT(-1 == limiter->acquire(d.get()));
+  CU_ASSERT(Downstream::LIMIT_NONE == d->get_limit_state());
+  CU_ASSERT(1 == stat.rejected);
+  CU_ASSERT(0 == stat.queued);
+
+  // Deleting the request releases its slot.
+  ds.pop_back();
+
+  CU_ASSERT(limit - 1 == limiter->get_num_inflight());
+  CU_ASSERT(0 == limiter->acquire(d.get()));
+  CU_ASSERT(limit == limiter->get_num_inflight());
+}
+
+void test_shrpx_concurrency_limiter_queue(void) {
+  MemchunkPool mcpool;
+  auto limiter = std::make_shared<ConcurrencyLimiter>(EV_DEFAULT, 1.);
+  auto &stat = limiter->get_stat();
+
+  auto limit = static_cast<size_t>(limiter->get_limit());
+  auto ds = acquire_n(&mcpool, limiter, limit);
+
+  auto d1 = make_downstream(&mcpool, limiter);
+  auto d2 = make_downstream(&mcpool, limiter);
+
+  CU_ASSERT(1 == limiter->acquire(d1.get()));
+  CU_ASSERT(Downstream::LIMIT_WAIT == d1->get_limit_state());
+  CU_ASSERT(d1->concurrency_limit_waiting());
+  CU_ASSERT(1 == limiter->acquire(d2.get()));
+  CU_ASSERT(2 == stat.queued);
+
+  {
+    // The request which has request body is not queued.
+    auto d = make_downstream(&mcpool, limiter);
+    d->request().fs.content_length = 100;
+
+    CU_ASSERT(-1 == limiter->acquire(d.get()));
+    CU_ASSERT(1 == stat.rejected);
+  }
+
+  // Releasing a slot passes it to the first waiter.
+  ds.pop_back();
+
+  CU_ASSERT(Downstream::LIMIT_READY == d1->get_limit_state());
+  CU_ASSERT(Downstream::LIMIT_WAIT == d2->get_limit_state());
+  CU_ASSERT(limit == limiter->get_num_inflight());
+
+  // Deleting the waiting request removes it from the queue.
+  d2.reset();
+  ds.pop_back();
+
+  CU_ASSERT(limit - 1 == limiter->get_num_inflight());
+
+  // Deleting the request which is about to be resumed releases its
+  // slot.
+  d1.reset();
+
+  CU_ASSERT(limit - 2 == limiter->get_num_inflight());
+}
+
+void test_shrpx_concurrency_limiter_update(void) {
+  MemchunkPool mcpool;
+  auto limiter = std::make_shared<ConcurrencyLimiter>(EV_DEFAULT, 0.);
+
+  auto limit = limiter->get_limit();
+
+  limiter->update(0.01, 1.);
+
+  // The limit is not increased unless it is used.
+  CU_ASSERT(limit == limiter->get_limit());
+
+  auto ds = acquire_n(&mcpool, limiter, static_cast<size_t>(limit / 2));
+
+  limiter->update(0.01, 1.1);
+
+  CU_ASSERT(limit < limiter->get_limit());
+
+  limit = limiter->get_limit();
+
+  // Latency grows.  The limit is decreased.
+  limiter->update(0.1, 2.);
+
+  CU_ASSERT(limit * 0.9 == limiter->get_limit());
+
+  limit = limiter->get_limit();
+
+  // The limit is decreased at most once per latency.
+  limiter->update(0.1, 2.05);
+
+  CU_ASSERT(limit == limiter->get_limit());
+
+  limiter->update(0.1, 2.1);
+
+  CU_ASSERT(limit * 0.9 == limiter->get_limit());
+
+  limit = limiter->get_limit();
+
+  // The small increase of latency is tolerated.
+  limiter->update(0.014, 3.);
+
+  CU_ASSERT(limit < limiter->get_limit());
+
+  limit = limiter->get_limit();
+
+  // The minimum latency is forgotten after a while, and the new
+  // latency becomes the baseline.
+  limiter->update(0.1, 40.);
+
+  CU_ASSERT(limit < limiter->get_limit());
+
+  ds.clear();
+
+  // The limit never goes below 1.
+  for (size_t i = 0; i < 100; ++i) {
+    limiter->update(0.1, 41. + i);
+    limiter->update(1., 41.5 + i);
+  }
+
+  CU_ASSERT(1. == limiter->get_limit());
+}
+
+} // namespace shrpx
@@ -568,46 +568,220 @@ int parse_duration(ev_tstamp *dest, const char *opt, const char *optarg) {
 }
 } // namespace
 
+namespace {
+// Parameters which can be given to backend group in --backend
+// option.
+struct DownstreamParams {
+  StringRef health_check_path;
+  StringRef affinity_name;
+  shrpx_proto proto;
+  shrpx_lb_policy lb_policy;
+  shrpx_health_check health_check;
+  shrpx_affinity affinity;
+  size_t cache_size;
+  size_t weight;
+  size_t retry;
+  unsigned int health_check_status;
+  unsigned int hedge;
+  bool cache_collapse;
+  bool adaptive_limit;
+};
+} // namespace
+
+namespace {
+// Parses backend parameters in |src_params|, and stores them in
+// |out|.  Each parameter is separated by ';'.  This function returns
+// 0 if it succeeds, or -1.
+int parse_downstream_params(DownstreamParams &out,
+                            const StringRef &src_params) {
+  auto last = std::end(src_params);
+  for (auto first = std::begin(src_params); first != last;) {
+    auto end = std::find(first, last, ';');
+    auto param = StringRef{first, end};
+
+    if (util::istarts_with_l(param, "proto=")) {
+      auto protostr = StringRef{first + str_size("proto="), end};
+      if (protostr.empty()) {
+        LOG(ERROR) << "backend: proto: protocol is empty";
+        return -1;
+      }
+
+      if (util::streq_l("h2", std::begin(protostr), protostr.size())) {
+        out.proto = PROTO_HTTP2;
+      } else if (util::streq_l("http/1.1", std::begin(protostr),
+                               protostr.size())) {
+        out.proto = PROTO_HTTP1;
+      } else {
+        LOG(ERROR) << "backend: proto: unknown protocol " << protostr;
+        return -1;
+      }
+    } else if (util::istarts_with_l(param, "lb=")) {
+      auto policy = StringRef{first + str_size("lb="), end};
+      if (util::strieq_l("round-robin", policy)) {
+        out.lb_policy = LB_ROUND_ROBIN;
+      } else if (util::strieq_l("least-outstanding", policy)) {
+        out.lb_policy = LB_LEAST_OUTSTANDING;
+      } else if (util::strieq_l("peak-ewma", policy)) {
+        out.lb_policy = LB_PEAK_EWMA;
+      } else if (util::strieq_l("p2c", policy)) {
+        out.lb_policy = LB_P2C;
+      } else {
+        LOG(ERROR) << "backend: lb: unknown policy " << policy;
+        return -1;
+      }
+    } else if (util::istarts_with_l(param, "affinity=")) {
+      auto value = StringRef{first + str_size("affinity="), end};
+      if (util::strieq_l("ip", value)) {
+        out.affinity = AFFINITY_IP;
+      } else if (util::istarts_with_l(value, "header:")) {
+        out.affinity = AFFINITY_HEADER;
+        out.affinity_name =
+            StringRef{std::begin(value) + str_size("header:"), std::end(value)};
+      } else if (util::istarts_with_l(value, "cookie:")) {
+        out.affinity = AFFINITY_COOKIE;
+        out.affinity_name =
+            StringRef{std::begin(value) + str_size("cookie:"), std::end(value)};
+      } else {
+        LOG(ERROR) << "backend: affinity: unknown key " << value;
+        return -1;
+      }
+
+      if (out.affinity != AFFINITY_IP && out.affinity_name.empty()) {
+        LOG(ERROR) << "backend: affinity: name is empty";
+        return -1;
+      }
+    } else if (util::istarts_with_l(param, "cache=")) {
+      auto valstr = std::string{first + str_size("cache="), end};
+      auto n = util::parse_uint_with_unit(valstr.c_str());
+      if (n == -1) {
+        LOG(ERROR) << "backend: cache: bad size " << valstr;
+        return -1;
+      }
+      out.cache_size = n;
+    } else if (util::strieq_l("collapse", param)) {
+      out.cache_collapse = true;
+    } else if (util::istarts_with_l(param, "weight=")) {
+      auto valstr = StringRef{first + str_size("weight="), end};
+      auto n = util::parse_uint(valstr);
+      if (n < 1 || n > 256) {
+        LOG(ERROR) << "backend: weight: weight must be in [1, 256], inclusive: "
+                   << valstr;
+        return -1;
+      }
+      out.weight = n;
+    } else if (util::istarts_with_l(param, "retry=")) {
+      auto valstr = StringRef{first + str_size("retry="), end};
+      auto n = util::parse_uint(valstr);
+      if (n < 0 || n > 16) {
+        LOG(ERROR) << "backend: retry: retry must be in [0, 16], inclusive: "
+                   << valstr;
+        return -1;
+      }
+      out.retry = n;
+    } else if (util::istarts_with_l(param, "hedge=")) {
+      auto valstr = StringRef{first + str_size("hedge="), end};
+      auto n = util::parse_uint(valstr);
+      if (n < 1 || n > 99) {
+        LOG(ERROR) << "backend: hedge: percentile must be in [1, 99], "
+                      "inclusive: "
+                   << valstr;
+        return -1;
+      }
+      out.hedge = n;
+    } else if (util::istarts_with_l(param, "limit=")) {
+      auto valstr = StringRef{first + str_size("limit="), end};
+      if (util::strieq_l("aimd", valstr)) {
+        out.adaptive_limit = true;
+      } else {
+        LOG(ERROR) << "backend: limit: unknown algorithm: " << valstr;
+        return -1;
+      }
+    } else if (util::istarts_with_l(param, "health-path=")) {
+      auto path = StringRef{first + str_size("health-path="), end};
+      if (path.empty() || path[0] != '/') {
+        LOG(ERROR) << "backend: health-path: path must start with '/'";
+        return -1;
+      }
+      out.health_check_path = path;
+    } else if (util::istarts_with_l(param, "health-status=")) {
+      auto valstr = StringRef{first + str_size("health-status="), end};
+      auto n = util::parse_uint(valstr);
+      if (n < 100 || n > 599) {
+        LOG(ERROR) << "backend: health-status: bad status code " << valstr;
+        return -1;
+      }
+      out.health_check_status = n;
+    } else if (util::istarts_with_l(param, "health=")) {
+      auto type = StringRef{first + str_size("health="), end};
+      if (util::strieq_l("tcp", type)) {
+        out.health_check = HEALTH_CHECK_TCP;
+      } else if (util::strieq_l("http", type)) {
+        out.health_check = HEALTH_CHECK_HTTP;
+      } else {
+        LOG(ERROR) << "backend: health: unknown type " << type;
+        return -1;
+      }
+    } else if (!param.empty()) {
+      LOG(ERROR) << "backend: " << param << ": unknown keyword";
+      return -1;
+    }
+
+    if (end == last) {
+      break;
+    }
+
+    first = end + 1;
+  }
+
+  if (out.cache_collapse && out.cache_size == 0) {
+    LOG(ERROR) << "backend: collapse: cache is not enabled";
+    return -1;
+  }
+
+  return 0;
+}
+} // namespace
+
 namespace {
 // Parses host-path mapping patterns in |src_pattern|, and stores
-// mappings in config.  We will store each host-path pattern found in
-// |src| with |addr|.  |addr| will be copied accordingly.  Also we
+// mappings in |config|.  We will store each host-path pattern found
+// in |src| with |addr|.  |addr| will be copied accordingly.  Also we
 // make a group based on the pattern.  The "/" pattern is considered
-// as catch-all.  We also parse protocol specified in |src_proto|.
+// as catch-all.  We also parse backend parameters specified in
+// |src_params|.
 //
 // This function returns 0 if it succeeds, or -1.
-int parse_mapping(const DownstreamAddrConfig &addr,
-                  const StringRef &src_pattern, const StringRef &src_proto) {
+int parse_mapping(Config *config, const DownstreamAddrConfig &addr,
+                  const StringRef &src_pattern, const StringRef &src_params) {
   // This returns at least 1 element (it could be empty string).  We
   // will append '/' to all patterns, so it becomes catch-all pattern.
   auto mapping = util::split_str(src_pattern, ':');
   assert(!mapping.empty());
-  auto &addr_groups = mod_config()->conn.downstream.addr_groups;
+  auto &routing = *config->conn.downstream.routing;
+  auto &addr_groups = routing.addr_groups;
 
-  auto proto = PROTO_HTTP1;
+  DownstreamParams params{};
+  params.proto = PROTO_HTTP1;
+  params.lb_policy = LB_ROUND_ROBIN;
+  params.weight = 1;
 
-  if (!src_proto.empty()) {
-    if (!util::istarts_with_l(src_proto, "proto=")) {
-      LOG(ERROR) << "backend: proto keyword not found";
-      return -1;
-    }
+  if (parse_downstream_params(params, src_params) != 0) {
+    return -1;
+  }
 
-    auto protostr = StringRef{std::begin(src_proto) + str_size("proto="),
-                              std::end(src_proto)};
-    if (protostr.empty()) {
-      LOG(ERROR) << "backend: protocol is empty";
-      return -1;
-    }
+  auto daddr = addr;
+  daddr.health_check = params.health_check;
+  daddr.health_check_path =
+      params.health_check_path.empty()
+          ? ImmutableString::from_lit("/")
+          : ImmutableString{std::begin(params.health_check_path),
+                            std::end(params.health_check_path)};
+  daddr.health_check_status = params.health_check_status;
+  daddr.weight = params.weight;
 
-    if (util::streq_l("h2", std::begin(protostr), protostr.size())) {
-      proto = PROTO_HTTP2;
-    } else if (util::streq_l("http/1.1", std::begin(protostr),
-                             protostr.size())) {
-      proto = PROTO_HTTP1;
-    } else {
-      LOG(ERROR) << "backend: unknown protocol " << protostr;
-      return -1;
-    }
+  auto affinity_name = params.affinity_name.str();
+  if (params.affinity == AFFINITY_HEADER) {
+    util::inp_strlower(affinity_name);
   }
 
   for (const auto &raw_pattern : mapping) {
@@ -627,14 +801,65 @@ int parse_mapping(const DownstreamAddrConfig &addr,
     }
     for (auto &g : addr_groups) {
       if (g.pattern == pattern) {
-        if (g.proto != proto) {
+        if (g.proto != params.proto) {
           LOG(ERROR) << "backend: protocol mismatch.  We saw protocol "
                      << strproto(g.proto) << " for pattern " << g.pattern
-                     << ", but another protocol " << strproto(proto);
+                     << ", but another protocol " << strproto(params.proto);
+          return -1;
+        }
+
+        if (g.lb_policy != params.lb_policy) {
+          LOG(ERROR) << "backend: lb policy mismatch.  We saw lb policy "
+                     << strlbpolicy(g.lb_policy) << " for pattern "
+                     << g.pattern << ", but another lb policy "
+                     << strlbpolicy(params.lb_policy);
+          return -1;
+        }
+
+        if (g.affinity != params.affinity ||
+            g.affinity_name != affinity_name) {
+          LOG(ERROR) << "backend: affinity mismatch.  We saw different "
+                        "affinity for pattern "
+                     << g.pattern;
+          return -1;
+        }
+
+        if (g.cache_size != params.cache_size) {
+          LOG(ERROR) << "backend: cache size mismatch.  We saw cache size "
+                     << g.cache_size << " for pattern " << g.pattern
+                     << ", but another cache size " << params.cache_size;
+          return -1;
+        }
+
+        if (g.cache_collapse != params.cache_collapse) {
+          LOG(ERROR) << "backend: collapse mismatch.  We saw different "
+                        "collapse setting for pattern "
+                     << g.pattern;
+          return -1;
+        }
+
+        if (g.retry != params.retry) {
+          LOG(ERROR) << "backend: retry mismatch.  We saw retry " << g.retry
+                     << " for pattern " << g.pattern << ", but another retry "
+                     << params.retry;
+          return -1;
+        }
+
+        if (g.hedge != params.hedge) {
+          LOG(ERROR) << "backend: hedge mismatch.  We saw hedge " << g.hedge
+                     << " for pattern " << g.pattern << ", but another hedge "
+                     << params.hedge;
           return -1;
         }
 
-        g.addrs.push_back(addr);
+        if (g.adaptive_limit != params.adaptive_limit) {
+          LOG(ERROR) << "backend: limit mismatch.  We saw different limit "
+                        "setting for pattern "
+                     << g.pattern;
+          return -1;
+        }
+
+        g.addrs.push_back(daddr);
         done = true;
         break;
       }
@@ -643,8 +868,16 @@ int parse_mapping(const DownstreamAddrConfig &addr,
       continue;
     }
     DownstreamAddrGroupConfig g(StringRef{pattern});
-    g.addrs.push_back(addr);
-    g.proto = proto;
+    g.addrs.push_back(daddr);
+    g.proto = params.proto;
+    g.lb_policy = params.lb_policy;
+    g.affinity = params.affinity;
+    g.affinity_name = ImmutableString{affinity_name};
+    g.cache_size = params.cache_size;
+    g.cache_collapse = params.cache_collapse;
+    g.retry = params.retry;
+    g.hedge = params.hedge;
+    g.adaptive_limit = params.adaptive_limit;
 
     if (pattern[0] == '*') {
       // wildcard pattern
@@ -654,23 +887,23 @@ int parse_mapping(const DownstreamAddrConfig &addr,
       auto host = StringRef{std::begin(g.pattern) + 1, path_first};
       auto path = StringRef{path_first, std::end(g.pattern)};
 
-      auto &wildcard_patterns = mod_config()->wildcard_patterns;
+      auto &wildcard_patterns = routing.router.wildcard_patterns;
 
       auto it = std::find_if(
           std::begin(wildcard_patterns), std::end(wildcard_patterns),
           [&host](const WildcardPattern &wp) { return wp.host == host; });
 
       if (it == std::end(wildcard_patterns)) {
-        mod_config()->wildcard_patterns.push_back(
+        wildcard_patterns.push_back(
             {ImmutableString{std::begin(host), std::end(host)}});
 
-        auto &router = mod_config()->wildcard_patterns.back().router;
+        auto &router = wildcard_patterns.back().router;
         router.add_route(path, addr_groups.size());
       } else {
         (*it).router.add_route(path, addr_groups.size());
       }
     } else {
-      mod_config()->router.add_route(StringRef{g.pattern}, addr_groups.size());
+      routing.router.router.add_route(StringRef{g.pattern}, addr_groups.size());
     }
 
     addr_groups.push_back(std::move(g));
@@ -765,8 +998,11 @@ int parse_error_page(std::vector<ErrorPage> &error_pages, const char *opt,
 // generated by gennghttpxfun.py
 enum {
   SHRPX_OPTID_ACCEPT_PROXY_PROTOCOL,
+  SHRPX_OPTID_ACCESSLOG_BINARY,
+  SHRPX_OPTID_ACCESSLOG_BUFFER,
   SHRPX_OPTID_ACCESSLOG_FILE,
   SHRPX_OPTID_ACCESSLOG_FORMAT,
+  SHRPX_OPTID_ACCESSLOG_OVERFLOW,
   SHRPX_OPTID_ACCESSLOG_SYSLOG,
   SHRPX_OPTID_ADD_FORWARDED,
   SHRPX_OPTID_ADD_REQUEST_HEADER,
@@ -775,19 +1011,25 @@ enum {
   SHRPX_OPTID_ALTSVC,
   SHRPX_OPTID_BACKEND,
   SHRPX_OPTID_BACKEND_ADDRESS_FAMILY,
+  SHRPX_OPTID_BACKEND_CACHE_COLLAPSE_TIMEOUT,
   SHRPX_OPTID_BACKEND_CONNECTIONS_PER_FRONTEND,
   SHRPX_OPTID_BACKEND_CONNECTIONS_PER_HOST,
+  SHRPX_OPTID_BACKEND_HEALTH_CHECK_INTERVAL,
+  SHRPX_OPTID_BACKEND_HEALTH_CHECK_TIMEOUT,
   SHRPX_OPTID_BACKEND_HTTP_PROXY_URI,
   SHRPX_OPTID_BACKEND_HTTP1_CONNECTIONS_PER_FRONTEND,
   SHRPX_OPTID_BACKEND_HTTP1_CONNECTIONS_PER_HOST,
   SHRPX_OPTID_BACKEND_HTTP1_TLS,
+  SHRPX_OPTID_BACKEND_HTTP2_COALESCE,
   SHRPX_OPTID_BACKEND_HTTP2_CONNECTION_WINDOW_BITS,
   SHRPX_OPTID_BACKEND_HTTP2_CONNECTIONS_PER_WORKER,
   SHRPX_OPTID_BACKEND_HTTP2_MAX_CONCURRENT_STREAMS,
+  SHRPX_OPTID_BACKEND_HTTP2_WARM_CONNECTIONS,
   SHRPX_OPTID_BACKEND_HTTP2_WINDOW_BITS,
   SHRPX_OPTID_BACKEND_IPV4,
   SHRPX_OPTID_BACKEND_IPV6,
   SHRPX_OPTID_BACKEND_KEEP_ALIVE_TIMEOUT,
+  SHRPX_OPTID_BACKEND_LIMIT_QUEUE_TIMEOUT,
   SHRPX_OPTID_BACKEND_NO_TLS,
   SHRPX_OPTID_BACKEND_READ_TIMEOUT,
   SHRPX_OPTID_BACKEND_REQUEST_BUFFER,
@@ -809,7 +1051,10 @@ enum {
   SHRPX_OPTID_ERROR_PAGE,
   SHRPX_OPTID_ERRORLOG_FILE,
   SHRPX_OPTID_ERRORLOG_SYSLOG,
+  SHRPX_OPTID_EVENT_BACKEND,
   SHRPX_OPTID_FASTOPEN,
+  SHRPX_OPTID_FETCH_OCSP_RESPONSE_BUILTIN,
+  SHRPX_OPTID_FETCH_OCSP_RESPONSE_CONCURRENCY,
   SHRPX_OPTID_FETCH_OCSP_RESPONSE_FILE,
   SHRPX_OPTID_FORWARDED_BY,
   SHRPX_OPTID_FORWARDED_FOR,
@@ -823,6 +1068,7 @@ enum {
   SHRPX_OPTID_FRONTEND_HTTP2_WINDOW_BITS,
   SHRPX_OPTID_FRONTEND_NO_TLS,
   SHRPX_OPTID_FRONTEND_READ_TIMEOUT,
+  SHRPX_OPTID_FRONTEND_TCP_NOTSENT_LOWAT,
   SHRPX_OPTID_FRONTEND_WRITE_TIMEOUT,
   SHRPX_OPTID_HEADER_FIELD_BUFFER,
   SHRPX_OPTID_HOST_REWRITE,
@@ -837,6 +1083,7 @@ enum {
   SHRPX_OPTID_MAX_HEADER_FIELDS,
   SHRPX_OPTID_MAX_REQUEST_HEADER_FIELDS,
   SHRPX_OPTID_MAX_RESPONSE_HEADER_FIELDS,
+  SHRPX_OPTID_METRICS_FRONTEND,
   SHRPX_OPTID_MRUBY_FILE,
   SHRPX_OPTID_NO_HOST_REWRITE,
   SHRPX_OPTID_NO_HTTP2_CIPHER_BLACK_LIST,
@@ -845,11 +1092,13 @@ enum {
   SHRPX_OPTID_NO_SERVER_PUSH,
   SHRPX_OPTID_NO_VIA,
   SHRPX_OPTID_NPN_LIST,
+  SHRPX_OPTID_OCSP_RESPONDER,
   SHRPX_OPTID_OCSP_UPDATE_INTERVAL,
   SHRPX_OPTID_PADDING,
   SHRPX_OPTID_PID_FILE,
   SHRPX_OPTID_PRIVATE_KEY_FILE,
   SHRPX_OPTID_PRIVATE_KEY_PASSWD_FILE,
+  SHRPX_OPTID_PRIVATE_KEY_THREADS,
   SHRPX_OPTID_READ_BURST,
   SHRPX_OPTID_READ_RATE,
   SHRPX_OPTID_REQUEST_HEADER_FIELD_BUFFER,
@@ -860,7 +1109,9 @@ enum {
   SHRPX_OPTID_STRIP_INCOMING_FORWARDED,
   SHRPX_OPTID_STRIP_INCOMING_X_FORWARDED_FOR,
   SHRPX_OPTID_SUBCERT,
+  SHRPX_OPTID_SUBCERT_LAZY_CACHE_SIZE,
   SHRPX_OPTID_SYSLOG_FACILITY,
+  SHRPX_OPTID_TLS_DYN_REC_ADAPTIVE,
   SHRPX_OPTID_TLS_DYN_REC_IDLE_TIMEOUT,
   SHRPX_OPTID_TLS_DYN_REC_WARMUP_THRESHOLD,
   SHRPX_OPTID_TLS_PROTO_LIST,
@@ -869,6 +1120,7 @@ enum {
   SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_CERT_FILE,
   SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_PRIVATE_KEY_FILE,
   SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_TLS,
+  SHRPX_OPTID_TLS_SESSION_CACHE_SHM_SIZE,
   SHRPX_OPTID_TLS_TICKET_KEY_CIPHER,
   SHRPX_OPTID_TLS_TICKET_KEY_FILE,
   SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED,
@@ -1094,6 +1346,9 @@ int option_lookup_token(const char *name, size_t namelen) {
       if (util::strieq_l("add-forwarde", name, 12)) {
         return SHRPX_OPTID_ADD_FORWARDED;
       }
+      if (util::strieq_l("event-backen", name, 12)) {
+        return SHRPX_OPTID_EVENT_BACKEND;
+      }
       break;
     case 'e':
       if (util::strieq_l("dh-param-fil", name, 12)) {
@@ -1130,6 +1385,11 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_NO_SERVER_PUSH;
       }
       break;
+    case 'r':
+      if (util::strieq_l("ocsp-responde", name, 13)) {
+        return SHRPX_OPTID_OCSP_RESPONDER;
+      }
+      break;
     case 's':
       if (util::strieq_l("backend-no-tl", name, 13)) {
         return SHRPX_OPTID_BACKEND_NO_TLS;
@@ -1168,6 +1428,11 @@ int option_lookup_token(const char *name, size_t namelen) {
     break;
   case 16:
     switch (name[15]) {
+    case 'd':
+      if (util::strieq_l("metrics-fronten", name, 15)) {
+        return SHRPX_OPTID_METRICS_FRONTEND;
+      }
+      break;
     case 'e':
       if (util::strieq_l("certificate-fil", name, 15)) {
         return SHRPX_OPTID_CERTIFICATE_FILE;
@@ -1187,11 +1452,21 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_ACCESSLOG_SYSLOG;
       }
       break;
+    case 'r':
+      if (util::strieq_l("accesslog-buffe", name, 15)) {
+        return SHRPX_OPTID_ACCESSLOG_BUFFER;
+      }
+      break;
     case 't':
       if (util::strieq_l("accesslog-forma", name, 15)) {
         return SHRPX_OPTID_ACCESSLOG_FORMAT;
       }
       break;
+    case 'y':
+      if (util::strieq_l("accesslog-binar", name, 15)) {
+        return SHRPX_OPTID_ACCESSLOG_BINARY;
+      }
+      break;
     }
     break;
   case 17:
@@ -1228,6 +1503,11 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_WORKER_WRITE_BURST;
       }
       break;
+    case 'w':
+      if (util::strieq_l("accesslog-overflo", name, 17)) {
+        return SHRPX_OPTID_ACCESSLOG_OVERFLOW;
+      }
+      break;
     }
     break;
   case 19:
@@ -1251,6 +1531,11 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_HEADER_FIELD_BUFFER;
       }
       break;
+    case 's':
+      if (util::strieq_l("private-key-thread", name, 18)) {
+        return SHRPX_OPTID_PRIVATE_KEY_THREADS;
+      }
+      break;
     case 't':
       if (util::strieq_l("stream-read-timeou", name, 18)) {
         return SHRPX_OPTID_STREAM_READ_TIMEOUT;
@@ -1260,6 +1545,11 @@ int option_lookup_token(const char *name, size_t namelen) {
     break;
   case 20:
     switch (name[19]) {
+    case 'e':
+      if (util::strieq_l("tls-dyn-rec-adaptiv", name, 19)) {
+        return SHRPX_OPTID_TLS_DYN_REC_ADAPTIVE;
+      }
+      break;
     case 'g':
       if (util::strieq_l("frontend-frame-debu", name, 19)) {
         return SHRPX_OPTID_FRONTEND_FRAME_DEBUG;
@@ -1312,6 +1602,11 @@ int option_lookup_token(const char *name, size_t namelen) {
     break;
   case 22:
     switch (name[21]) {
+    case 'e':
+      if (util::strieq_l("backend-http2-coalesc", name, 21)) {
+        return SHRPX_OPTID_BACKEND_HTTP2_COALESCE;
+      }
+      break;
     case 'i':
       if (util::strieq_l("backend-http-proxy-ur", name, 21)) {
         return SHRPX_OPTID_BACKEND_HTTP_PROXY_URI;
@@ -1343,6 +1638,9 @@ int option_lookup_token(const char *name, size_t namelen) {
       if (util::strieq_l("private-key-passwd-fil", name, 22)) {
         return SHRPX_OPTID_PRIVATE_KEY_PASSWD_FILE;
       }
+      if (util::strieq_l("subcert-lazy-cache-siz", name, 22)) {
+        return SHRPX_OPTID_SUBCERT_LAZY_CACHE_SIZE;
+      }
       break;
     case 'r':
       if (util::strieq_l("backend-response-buffe", name, 22)) {
@@ -1395,6 +1693,11 @@ int option_lookup_token(const char *name, size_t namelen) {
     break;
   case 26:
     switch (name[25]) {
+    case 'e':
+      if (util::strieq_l("tls-session-cache-shm-siz", name, 25)) {
+        return SHRPX_OPTID_TLS_SESSION_CACHE_SHM_SIZE;
+      }
+      break;
     case 's':
       if (util::strieq_l("frontend-http2-window-bit", name, 25)) {
         return SHRPX_OPTID_FRONTEND_HTTP2_WINDOW_BITS;
@@ -1407,6 +1710,9 @@ int option_lookup_token(const char *name, size_t namelen) {
       if (util::strieq_l("backend-keep-alive-timeou", name, 25)) {
         return SHRPX_OPTID_BACKEND_KEEP_ALIVE_TIMEOUT;
       }
+      if (util::strieq_l("frontend-tcp-notsent-lowa", name, 25)) {
+        return SHRPX_OPTID_FRONTEND_TCP_NOTSENT_LOWAT;
+      }
       if (util::strieq_l("no-http2-cipher-black-lis", name, 25)) {
         return SHRPX_OPTID_NO_HTTP2_CIPHER_BLACK_LIST;
       }
@@ -1420,6 +1726,11 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED;
       }
       break;
+    case 'n':
+      if (util::strieq_l("fetch-ocsp-response-builti", name, 26)) {
+        return SHRPX_OPTID_FETCH_OCSP_RESPONSE_BUILTIN;
+      }
+      break;
     case 'r':
       if (util::strieq_l("request-header-field-buffe", name, 26)) {
         return SHRPX_OPTID_REQUEST_HEADER_FIELD_BUFFER;
@@ -1431,6 +1742,9 @@ int option_lookup_token(const char *name, size_t namelen) {
       }
       break;
     case 't':
+      if (util::strieq_l("backend-limit-queue-timeou", name, 26)) {
+        return SHRPX_OPTID_BACKEND_LIMIT_QUEUE_TIMEOUT;
+      }
       if (util::strieq_l("frontend-http2-read-timeou", name, 26)) {
         return SHRPX_OPTID_FRONTEND_HTTP2_READ_TIMEOUT;
       }
@@ -1461,6 +1775,18 @@ int option_lookup_token(const char *name, size_t namelen) {
       if (util::strieq_l("backend-connections-per-hos", name, 27)) {
         return SHRPX_OPTID_BACKEND_CONNECTIONS_PER_HOST;
       }
+      if (util::strieq_l("backend-health-check-timeou", name, 27)) {
+        return SHRPX_OPTID_BACKEND_HEALTH_CHECK_TIMEOUT;
+      }
+      break;
+    }
+    break;
+  case 29:
+    switch (name[28]) {
+    case 'l':
+      if (util::strieq_l("backend-health-check-interva", name, 28)) {
+        return SHRPX_OPTID_BACKEND_HEALTH_CHECK_INTERVAL;
+      }
       break;
     }
     break;
@@ -1471,6 +1797,16 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_STRIP_INCOMING_X_FORWARDED_FOR;
       }
       break;
+    case 's':
+      if (util::strieq_l("backend-http2-warm-connection", name, 29)) {
+        return SHRPX_OPTID_BACKEND_HTTP2_WARM_CONNECTIONS;
+      }
+      break;
+    case 't':
+      if (util::strieq_l("backend-cache-collapse-timeou", name, 29)) {
+        return SHRPX_OPTID_BACKEND_CACHE_COLLAPSE_TIMEOUT;
+      }
+      break;
     }
     break;
   case 31:
@@ -1480,6 +1816,11 @@ int option_lookup_token(const char *name, size_t namelen) {
         return SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_TLS;
       }
       break;
+    case 'y':
+      if (util::strieq_l("fetch-ocsp-response-concurrenc", name, 30)) {
+        return SHRPX_OPTID_FETCH_OCSP_RESPONSE_CONCURRENCY;
+      }
+      break;
     }
     break;
   case 32:
@@ -1623,13 +1964,70 @@ int option_lookup_token(const char *name, size_t namelen) {
 }
 } // namespace
 
-int parse_config(const char *opt, const char *optarg,
+namespace {
+// Parses frontend address in |optarg|, and appends it to |addrs|.
+// If host is not numeric address, both IPv4 and IPv6 addresses are
+// appended.
+int parse_upstream_addr(std::vector<UpstreamAddr> &addrs,
+                        const char *optarg) {
+  char host[NI_MAXHOST];
+  uint16_t port;
+
+  UpstreamAddr addr{};
+  addr.fd = -1;
+
+  if (util::istarts_with(optarg, SHRPX_UNIX_PATH_PREFIX)) {
+    auto path = optarg + str_size(SHRPX_UNIX_PATH_PREFIX);
+    addr.host = ImmutableString(path);
+    addr.host_unix = true;
+
+    addrs.push_back(std::move(addr));
+
+    return 0;
+  }
+
+  if (split_host_port(host, sizeof(host), &port, optarg, strlen(optarg)) ==
+      -1) {
+    return -1;
+  }
+
+  addr.host = ImmutableString(host);
+  addr.port = port;
+
+  if (util::numeric_host(host, AF_INET)) {
+    addr.family = AF_INET;
+    addrs.push_back(std::move(addr));
+    return 0;
+  }
+
+  if (util::numeric_host(host, AF_INET6)) {
+    addr.family = AF_INET6;
+    addrs.push_back(std::move(addr));
+    return 0;
+  }
+
+  addr.family = AF_INET;
+  addrs.push_back(addr);
+
+  addr.family = AF_INET6;
+  addrs.push_back(std::move(addr));
+
+  return 0;
+}
+} // namespace
+
+int parse_config(Config *config, const char *opt, const char *optarg,
                  std::set<std::string> &included_set) {
   char host[NI_MAXHOST];
   uint16_t port;
 
   auto optid = option_lookup_token(opt, strlen(opt));
 
+  if (config->backend_only && optid != -1 && optid != SHRPX_OPTID_BACKEND &&
+      optid != SHRPX_OPTID_INCLUDE) {
+    return 0;
+  }
+
   switch (optid) {
   case SHRPX_OPTID_BACKEND: {
     auto src = StringRef{optarg};
@@ -1653,66 +2051,29 @@ int parse_config(const char *opt, const char *optarg,
     auto mapping = addr_end == std::end(src) ? addr_end : addr_end + 1;
     auto mapping_end = std::find(mapping, std::end(src), ';');
 
-    auto proto = mapping_end == std::end(src) ? mapping_end : mapping_end + 1;
-    auto proto_end = std::find(proto, std::end(src), ';');
+    auto params =
+        mapping_end == std::end(src) ? mapping_end : mapping_end + 1;
 
-    if (parse_mapping(addr, StringRef{mapping, mapping_end},
-                      StringRef{proto, proto_end}) != 0) {
+    if (parse_mapping(config, addr, StringRef{mapping, mapping_end},
+                      StringRef{params, std::end(src)}) != 0) {
       return -1;
     }
 
     return 0;
   }
-  case SHRPX_OPTID_FRONTEND: {
-    auto &listenerconf = mod_config()->conn.listener;
-
-    UpstreamAddr addr{};
-    addr.fd = -1;
-
-    if (util::istarts_with(optarg, SHRPX_UNIX_PATH_PREFIX)) {
-      auto path = optarg + str_size(SHRPX_UNIX_PATH_PREFIX);
-      addr.host = ImmutableString(path);
-      addr.host_unix = true;
-
-      listenerconf.addrs.push_back(std::move(addr));
-
-      return 0;
-    }
-
-    if (split_host_port(host, sizeof(host), &port, optarg, strlen(optarg)) ==
-        -1) {
-      return -1;
-    }
-
-    addr.host = ImmutableString(host);
-    addr.port = port;
-
-    if (util::numeric_host(host, AF_INET)) {
-      addr.family = AF_INET;
-      listenerconf.addrs.push_back(std::move(addr));
-      return 0;
-    }
-
-    if (util::numeric_host(host, AF_INET6)) {
-      addr.family = AF_INET6;
-      listenerconf.addrs.push_back(std::move(addr));
-      return 0;
-    }
-
-    addr.family = AF_INET;
-    listenerconf.addrs.push_back(addr);
-
-    addr.family = AF_INET6;
-    listenerconf.addrs.push_back(std::move(addr));
-
-    return 0;
-  }
+  case SHRPX_OPTID_FRONTEND:
+    return parse_upstream_addr(config->conn.listener.addrs, optarg);
+  case SHRPX_OPTID_METRICS_FRONTEND:
+    return parse_upstream_addr(config->conn.listener.metrics_addrs, optarg);
+  case SHRPX_OPTID_TLS_SESSION_CACHE_SHM_SIZE:
+    return parse_uint_with_unit(&config->tls.session_cache.shm.size, opt,
+                                optarg);
   case SHRPX_OPTID_WORKERS:
 #ifdef NOTHREADS
     LOG(WARN) << "Threading disabled at build time, no threads created.";
     return 0;
 #else // !NOTHREADS
-    return parse_uint(&mod_config()->num_worker, opt, optarg);
+    return parse_uint(&config->num_worker, opt, optarg);
 #endif // !NOTHREADS
   case SHRPX_OPTID_HTTP2_MAX_CONCURRENT_STREAMS: {
     LOG(WARN) << opt << ": deprecated. Use "
@@ -1722,25 +2083,29 @@ int parse_config(const char *opt, const char *optarg,
     if (parse_uint(&n, opt, optarg) != 0) {
       return -1;
     }
-    auto &http2conf = mod_config()->http2;
+    auto &http2conf = config->http2;
     http2conf.upstream.max_concurrent_streams = n;
     http2conf.downstream.max_concurrent_streams = n;
 
     return 0;
   }
-  case SHRPX_OPTID_LOG_LEVEL:
-    if (Log::set_severity_level_by_name(optarg) == -1) {
+  case SHRPX_OPTID_LOG_LEVEL: {
+    auto severity = Log::get_severity_level_by_name(optarg);
+    if (severity == -1) {
       LOG(ERROR) << opt << ": Invalid severity level: " << optarg;
       return -1;
     }
 
+    config->logging.severity = severity;
+
     return 0;
+  }
   case SHRPX_OPTID_DAEMON:
-    mod_config()->daemon = util::strieq(optarg, "yes");
+    config->daemon = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_HTTP2_PROXY:
-    mod_config()->http2_proxy = util::strieq(optarg, "yes");
+    config->http2_proxy = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_HTTP2_BRIDGE:
@@ -1752,56 +2117,80 @@ int parse_config(const char *opt, const char *optarg,
                          "backend=<addr>,<port>;;proto=h2 and backend-tls";
     return -1;
   case SHRPX_OPTID_ADD_X_FORWARDED_FOR:
-    mod_config()->http.xff.add = util::strieq(optarg, "yes");
+    config->http.xff.add = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_STRIP_INCOMING_X_FORWARDED_FOR:
-    mod_config()->http.xff.strip_incoming = util::strieq(optarg, "yes");
+    config->http.xff.strip_incoming = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_NO_VIA:
-    mod_config()->http.no_via = util::strieq(optarg, "yes");
+    config->http.no_via = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_FRONTEND_HTTP2_READ_TIMEOUT:
-    return parse_duration(&mod_config()->conn.upstream.timeout.http2_read, opt,
+    return parse_duration(&config->conn.upstream.timeout.http2_read, opt,
                           optarg);
   case SHRPX_OPTID_FRONTEND_READ_TIMEOUT:
-    return parse_duration(&mod_config()->conn.upstream.timeout.read, opt,
-                          optarg);
+    return parse_duration(&config->conn.upstream.timeout.read, opt, optarg);
   case SHRPX_OPTID_FRONTEND_WRITE_TIMEOUT:
-    return parse_duration(&mod_config()->conn.upstream.timeout.write, opt,
-                          optarg);
+    return parse_duration(&config->conn.upstream.timeout.write, opt, optarg);
   case SHRPX_OPTID_BACKEND_READ_TIMEOUT:
-    return parse_duration(&mod_config()->conn.downstream.timeout.read, opt,
-                          optarg);
+    return parse_duration(&config->conn.downstream.timeout.read, opt, optarg);
+  case SHRPX_OPTID_BACKEND_HEALTH_CHECK_INTERVAL:
+    return parse_duration(
+        &config->conn.downstream.health_check.interval, opt, optarg);
+  case SHRPX_OPTID_BACKEND_HEALTH_CHECK_TIMEOUT:
+    return parse_duration(&config->conn.downstream.health_check.timeout,
+                          opt, optarg);
+  case SHRPX_OPTID_BACKEND_CACHE_COLLAPSE_TIMEOUT:
+    return parse_duration(
+        &config->conn.downstream.cache_collapse_timeout, opt, optarg);
+  case SHRPX_OPTID_BACKEND_LIMIT_QUEUE_TIMEOUT:
+    return parse_duration(&config->conn.downstream.limit_queue_timeout,
+                          opt, optarg);
   case SHRPX_OPTID_BACKEND_WRITE_TIMEOUT:
-    return parse_duration(&mod_config()->conn.downstream.timeout.write, opt,
-                          optarg);
+    return parse_duration(&config->conn.downstream.timeout.write, opt, optarg);
   case SHRPX_OPTID_STREAM_READ_TIMEOUT:
-    return parse_duration(&mod_config()->http2.timeout.stream_read, opt,
-                          optarg);
+    return parse_duration(&config->http2.timeout.stream_read, opt, optarg);
   case SHRPX_OPTID_STREAM_WRITE_TIMEOUT:
-    return parse_duration(&mod_config()->http2.timeout.stream_write, opt,
-                          optarg);
+    return parse_duration(&config->http2.timeout.stream_write, opt, optarg);
   case SHRPX_OPTID_ACCESSLOG_FILE:
-    mod_config()->logging.access.file = optarg;
+    config->logging.access.file = optarg;
 
     return 0;
   case SHRPX_OPTID_ACCESSLOG_SYSLOG:
-    mod_config()->logging.access.syslog = util::strieq(optarg, "yes");
+    config->logging.access.syslog = util::strieq(optarg, "yes");
+
+    return 0;
+  case SHRPX_OPTID_ACCESSLOG_BUFFER:
+    return parse_uint_with_unit(&config->logging.access.buffer_size, opt,
+                                optarg);
+  case SHRPX_OPTID_ACCESSLOG_OVERFLOW:
+    if (util::strieq(optarg, "drop")) {
+      config->logging.access.overflow = ACCESSLOG_OVERFLOW_DROP;
+    } else if (util::strieq(optarg, "block")) {
+      config->logging.access.overflow = ACCESSLOG_OVERFLOW_BLOCK;
+    } else {
+      LOG(ERROR) << opt << ": must be either drop or block: " << optarg;
+      return -1;
+    }
+
+    return 0;
+  case SHRPX_OPTID_ACCESSLOG_BINARY:
+    config->logging.access.binary = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_ACCESSLOG_FORMAT:
-    mod_config()->logging.access.format = parse_log_format(optarg);
+    config->logging.access.format = parse_log_format(optarg);
 
     return 0;
   case SHRPX_OPTID_ERRORLOG_FILE:
-    mod_config()->logging.error.file = optarg;
+    config->logging.error.file = optarg;
 
     return 0;
   case SHRPX_OPTID_ERRORLOG_SYSLOG:
-    mod_config()->logging.error.syslog = util::strieq(optarg, "yes");
+    config->logging.error.syslog = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_FASTOPEN: {
@@ -1815,21 +2204,21 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    mod_config()->conn.listener.fastopen = n;
+    config->conn.listener.fastopen = n;
 
     return 0;
   }
   case SHRPX_OPTID_BACKEND_KEEP_ALIVE_TIMEOUT:
-    return parse_duration(&mod_config()->conn.downstream.timeout.idle_read, opt,
+    return parse_duration(&config->conn.downstream.timeout.idle_read, opt,
                           optarg);
   case SHRPX_OPTID_FRONTEND_HTTP2_WINDOW_BITS:
   case SHRPX_OPTID_BACKEND_HTTP2_WINDOW_BITS: {
     size_t *resp;
 
     if (optid == SHRPX_OPTID_FRONTEND_HTTP2_WINDOW_BITS) {
-      resp = &mod_config()->http2.upstream.window_bits;
+      resp = &config->http2.upstream.window_bits;
     } else {
-      resp = &mod_config()->http2.downstream.window_bits;
+      resp = &config->http2.downstream.window_bits;
     }
 
     errno = 0;
@@ -1855,9 +2244,9 @@ int parse_config(const char *opt, const char *optarg,
     size_t *resp;
 
     if (optid == SHRPX_OPTID_FRONTEND_HTTP2_CONNECTION_WINDOW_BITS) {
-      resp = &mod_config()->http2.upstream.connection_window_bits;
+      resp = &config->http2.upstream.connection_window_bits;
     } else {
-      resp = &mod_config()->http2.downstream.connection_window_bits;
+      resp = &config->http2.downstream.connection_window_bits;
     }
 
     errno = 0;
@@ -1879,7 +2268,7 @@ int parse_config(const char *opt, const char *optarg,
     return 0;
   }
   case SHRPX_OPTID_FRONTEND_NO_TLS:
-    mod_config()->conn.upstream.no_tls = util::strieq(optarg, "yes");
+    config->conn.upstream.no_tls = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_BACKEND_NO_TLS:
@@ -1887,11 +2276,11 @@ int parse_config(const char *opt, const char *optarg,
                         "default.  See also " << SHRPX_OPT_BACKEND_TLS;
     return 0;
   case SHRPX_OPTID_BACKEND_TLS_SNI_FIELD:
-    mod_config()->tls.backend_sni_name = optarg;
+    config->tls.backend_sni_name = optarg;
 
     return 0;
   case SHRPX_OPTID_PID_FILE:
-    mod_config()->pid_file = optarg;
+    config->pid_file = optarg;
 
     return 0;
   case SHRPX_OPTID_USER: {
@@ -1901,14 +2290,14 @@ int parse_config(const char *opt, const char *optarg,
                  << strerror(errno);
       return -1;
     }
-    mod_config()->user = pwd->pw_name;
-    mod_config()->uid = pwd->pw_uid;
-    mod_config()->gid = pwd->pw_gid;
+    config->user = pwd->pw_name;
+    config->uid = pwd->pw_uid;
+    config->gid = pwd->pw_gid;
 
     return 0;
   }
   case SHRPX_OPTID_PRIVATE_KEY_FILE:
-    mod_config()->tls.private_key_file = optarg;
+    config->tls.private_key_file = optarg;
 
     return 0;
   case SHRPX_OPTID_PRIVATE_KEY_PASSWD_FILE: {
@@ -1917,16 +2306,16 @@ int parse_config(const char *opt, const char *optarg,
       LOG(ERROR) << opt << ": Couldn't read key file's passwd from " << optarg;
       return -1;
     }
-    mod_config()->tls.private_key_passwd = passwd;
+    config->tls.private_key_passwd = passwd;
 
     return 0;
   }
   case SHRPX_OPTID_CERTIFICATE_FILE:
-    mod_config()->tls.cert_file = optarg;
+    config->tls.cert_file = optarg;
 
     return 0;
   case SHRPX_OPTID_DH_PARAM_FILE:
-    mod_config()->tls.dh_param_file = optarg;
+    config->tls.dh_param_file = optarg;
 
     return 0;
   case SHRPX_OPTID_SUBCERT: {
@@ -1935,7 +2324,7 @@ int parse_config(const char *opt, const char *optarg,
     if (sp) {
       std::string keyfile(optarg, sp);
       // TODO Do we need private key for subcert?
-      mod_config()->tls.subcerts.emplace_back(keyfile, sp + 1);
+      config->tls.subcerts.emplace_back(keyfile, sp + 1);
     }
 
     return 0;
@@ -1946,7 +2335,18 @@ int parse_config(const char *opt, const char *optarg,
       LOG(ERROR) << opt << ": Unknown syslog facility: " << optarg;
       return -1;
     }
-    mod_config()->logging.syslog_facility = facility;
+    config->logging.syslog_facility = facility;
+
+    return 0;
+  }
+  case SHRPX_OPTID_EVENT_BACKEND: {
+    auto flags = int_event_backend(optarg);
+    if (flags == -1) {
+      LOG(ERROR) << opt << ": Unknown or unsupported event backend: "
+                 << optarg;
+      return -1;
+    }
+    config->ev_loop_flags = flags;
 
     return 0;
   }
@@ -1962,12 +2362,12 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    mod_config()->conn.listener.backlog = n;
+    config->conn.listener.backlog = n;
 
     return 0;
   }
   case SHRPX_OPTID_CIPHERS:
-    mod_config()->tls.ciphers = optarg;
+    config->tls.ciphers = optarg;
 
     return 0;
   case SHRPX_OPTID_CLIENT:
@@ -1975,29 +2375,29 @@ int parse_config(const char *opt, const char *optarg,
                          "backend=<addr>,<port>;;proto=h2 and backend-tls";
     return -1;
   case SHRPX_OPTID_INSECURE:
-    mod_config()->tls.insecure = util::strieq(optarg, "yes");
+    config->tls.insecure = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_CACERT:
-    mod_config()->tls.cacert = optarg;
+    config->tls.cacert = optarg;
 
     return 0;
   case SHRPX_OPTID_BACKEND_IPV4:
     LOG(WARN) << opt
               << ": deprecated.  Use backend-address-family=IPv4 instead.";
 
-    mod_config()->conn.downstream.family = AF_INET;
+    config->conn.downstream.family = AF_INET;
 
     return 0;
   case SHRPX_OPTID_BACKEND_IPV6:
     LOG(WARN) << opt
               << ": deprecated.  Use backend-address-family=IPv6 instead.";
 
-    mod_config()->conn.downstream.family = AF_INET6;
+    config->conn.downstream.family = AF_INET6;
 
     return 0;
   case SHRPX_OPTID_BACKEND_HTTP_PROXY_URI: {
-    auto &proxy = mod_config()->downstream_http_proxy;
+    auto &proxy = config->downstream_http_proxy;
     // Reset here so that multiple option occurrence does not merge
     // the results.
     proxy = {};
@@ -2035,16 +2435,16 @@ int parse_config(const char *opt, const char *optarg,
   }
   case SHRPX_OPTID_READ_RATE:
     return parse_uint_with_unit(
-        &mod_config()->conn.upstream.ratelimit.read.rate, opt, optarg);
+        &config->conn.upstream.ratelimit.read.rate, opt, optarg);
   case SHRPX_OPTID_READ_BURST:
     return parse_uint_with_unit(
-        &mod_config()->conn.upstream.ratelimit.read.burst, opt, optarg);
+        &config->conn.upstream.ratelimit.read.burst, opt, optarg);
   case SHRPX_OPTID_WRITE_RATE:
     return parse_uint_with_unit(
-        &mod_config()->conn.upstream.ratelimit.write.rate, opt, optarg);
+        &config->conn.upstream.ratelimit.write.rate, opt, optarg);
   case SHRPX_OPTID_WRITE_BURST:
     return parse_uint_with_unit(
-        &mod_config()->conn.upstream.ratelimit.write.burst, opt, optarg);
+        &config->conn.upstream.ratelimit.write.burst, opt, optarg);
   case SHRPX_OPTID_WORKER_READ_RATE:
     LOG(WARN) << opt << ": not implemented yet";
     return 0;
@@ -2058,48 +2458,47 @@ int parse_config(const char *opt, const char *optarg,
     LOG(WARN) << opt << ": not implemented yet";
     return 0;
   case SHRPX_OPTID_NPN_LIST:
-    mod_config()->tls.npn_list = util::parse_config_str_list(optarg);
+    config->tls.npn_list = util::parse_config_str_list(optarg);
 
     return 0;
   case SHRPX_OPTID_TLS_PROTO_LIST:
-    mod_config()->tls.tls_proto_list = util::parse_config_str_list(optarg);
+    config->tls.tls_proto_list = util::parse_config_str_list(optarg);
 
     return 0;
   case SHRPX_OPTID_VERIFY_CLIENT:
-    mod_config()->tls.client_verify.enabled = util::strieq(optarg, "yes");
+    config->tls.client_verify.enabled = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_VERIFY_CLIENT_CACERT:
-    mod_config()->tls.client_verify.cacert = optarg;
+    config->tls.client_verify.cacert = optarg;
 
     return 0;
   case SHRPX_OPTID_CLIENT_PRIVATE_KEY_FILE:
-    mod_config()->tls.client.private_key_file = optarg;
+    config->tls.client.private_key_file = optarg;
 
     return 0;
   case SHRPX_OPTID_CLIENT_CERT_FILE:
-    mod_config()->tls.client.cert_file = optarg;
+    config->tls.client.cert_file = optarg;
 
     return 0;
   case SHRPX_OPTID_FRONTEND_HTTP2_DUMP_REQUEST_HEADER:
-    mod_config()->http2.upstream.debug.dump.request_header_file = optarg;
+    config->http2.upstream.debug.dump.request_header_file = optarg;
 
     return 0;
   case SHRPX_OPTID_FRONTEND_HTTP2_DUMP_RESPONSE_HEADER:
-    mod_config()->http2.upstream.debug.dump.response_header_file = optarg;
+    config->http2.upstream.debug.dump.response_header_file = optarg;
 
     return 0;
   case SHRPX_OPTID_HTTP2_NO_COOKIE_CRUMBLING:
-    mod_config()->http2.no_cookie_crumbling = util::strieq(optarg, "yes");
+    config->http2.no_cookie_crumbling = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_FRONTEND_FRAME_DEBUG:
-    mod_config()->http2.upstream.debug.frame_debug =
-        util::strieq(optarg, "yes");
+    config->http2.upstream.debug.frame_debug = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_PADDING:
-    return parse_uint(&mod_config()->padding, opt, optarg);
+    return parse_uint(&config->padding, opt, optarg);
   case SHRPX_OPTID_ALTSVC: {
     auto tokens = util::parse_config_str_list(optarg);
 
@@ -2142,7 +2541,7 @@ int parse_config(const char *opt, const char *optarg,
       }
     }
 
-    mod_config()->http.altsvcs.push_back(std::move(altsvc));
+    config->http.altsvcs.push_back(std::move(altsvc));
 
     return 0;
   }
@@ -2154,17 +2553,16 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
     if (optid == SHRPX_OPTID_ADD_REQUEST_HEADER) {
-      mod_config()->http.add_request_headers.push_back(std::move(p));
+      config->http.add_request_headers.push_back(std::move(p));
     } else {
-      mod_config()->http.add_response_headers.push_back(std::move(p));
+      config->http.add_response_headers.push_back(std::move(p));
     }
     return 0;
   }
   case SHRPX_OPTID_WORKER_FRONTEND_CONNECTIONS:
-    return parse_uint(&mod_config()->conn.upstream.worker_connections, opt,
-                      optarg);
+    return parse_uint(&config->conn.upstream.worker_connections, opt, optarg);
   case SHRPX_OPTID_NO_LOCATION_REWRITE:
-    mod_config()->http.no_location_rewrite = util::strieq(optarg, "yes");
+    config->http.no_location_rewrite = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_NO_HOST_REWRITE:
@@ -2191,7 +2589,7 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    mod_config()->conn.downstream.connections_per_host = n;
+    config->conn.downstream.connections_per_host = n;
 
     return 0;
   }
@@ -2200,13 +2598,12 @@ int parse_config(const char *opt, const char *optarg,
               << SHRPX_OPT_BACKEND_CONNECTIONS_PER_FRONTEND << " instead.";
   // fall through
   case SHRPX_OPTID_BACKEND_CONNECTIONS_PER_FRONTEND:
-    return parse_uint(&mod_config()->conn.downstream.connections_per_frontend,
+    return parse_uint(&config->conn.downstream.connections_per_frontend,
                       opt, optarg);
   case SHRPX_OPTID_LISTENER_DISABLE_TIMEOUT:
-    return parse_duration(&mod_config()->conn.listener.timeout.sleep, opt,
-                          optarg);
+    return parse_duration(&config->conn.listener.timeout.sleep, opt, optarg);
   case SHRPX_OPTID_TLS_TICKET_KEY_FILE:
-    mod_config()->tls.ticket.files.push_back(optarg);
+    config->tls.ticket.files.push_back(optarg);
     return 0;
   case SHRPX_OPTID_RLIMIT_NOFILE: {
     int n;
@@ -2221,7 +2618,7 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    mod_config()->rlimit_nofile = n;
+    config->rlimit_nofile = n;
 
     return 0;
   }
@@ -2239,50 +2636,99 @@ int parse_config(const char *opt, const char *optarg,
     }
 
     if (optid == SHRPX_OPTID_BACKEND_REQUEST_BUFFER) {
-      mod_config()->conn.downstream.request_buffer_size = n;
+      config->conn.downstream.request_buffer_size = n;
     } else {
-      mod_config()->conn.downstream.response_buffer_size = n;
+      config->conn.downstream.response_buffer_size = n;
     }
 
     return 0;
   }
 
+  case SHRPX_OPTID_FRONTEND_TCP_NOTSENT_LOWAT: {
+    size_t n;
+    if (parse_uint_with_unit(&n, opt, optarg) != 0) {
+      return -1;
+    }
+
+    if (n > std::numeric_limits<int>::max()) {
+      LOG(ERROR) << opt << ": too large";
+
+      return -1;
+    }
+
+    config->conn.upstream.tcp_notsent_lowat = n;
+
+    return 0;
+  }
+
   case SHRPX_OPTID_NO_SERVER_PUSH:
-    mod_config()->http2.no_server_push = util::strieq(optarg, "yes");
+    config->http2.no_server_push = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_BACKEND_HTTP2_CONNECTIONS_PER_WORKER:
     LOG(WARN) << opt << ": deprecated.";
     return 0;
+  case SHRPX_OPTID_BACKEND_HTTP2_COALESCE:
+    config->http2.downstream.coalesce = util::strieq(optarg, "yes");
+
+    return 0;
+  case SHRPX_OPTID_BACKEND_HTTP2_WARM_CONNECTIONS:
+    return parse_uint(&config->http2.downstream.warm_connections, opt, optarg);
   case SHRPX_OPTID_FETCH_OCSP_RESPONSE_FILE:
-    mod_config()->tls.ocsp.fetch_ocsp_response_file = optarg;
+    config->tls.ocsp.fetch_ocsp_response_file = optarg;
 
     return 0;
   case SHRPX_OPTID_OCSP_UPDATE_INTERVAL:
-    return parse_duration(&mod_config()->tls.ocsp.update_interval, opt, optarg);
+    return parse_duration(&config->tls.ocsp.update_interval, opt, optarg);
   case SHRPX_OPTID_NO_OCSP:
-    mod_config()->tls.ocsp.disabled = util::strieq(optarg, "yes");
+    config->tls.ocsp.disabled = util::strieq(optarg, "yes");
+
+    return 0;
+  case SHRPX_OPTID_FETCH_OCSP_RESPONSE_BUILTIN:
+    config->tls.ocsp.fetch_builtin = util::strieq(optarg, "yes");
+
+    return 0;
+  case SHRPX_OPTID_FETCH_OCSP_RESPONSE_CONCURRENCY: {
+    size_t n;
+    if (parse_uint(&n, opt, optarg) != 0) {
+      return -1;
+    }
+
+    if (n == 0) {
+      LOG(ERROR) << opt << ": specify an integer strictly more than 0";
+
+      return -1;
+    }
+
+    config->tls.ocsp.fetch_concurrency = n;
 
     return 0;
+  }
+  case SHRPX_OPTID_OCSP_RESPONDER:
+    config->tls.ocsp.responder = optarg;
+
+    return 0;
+  case SHRPX_OPTID_SUBCERT_LAZY_CACHE_SIZE:
+    return parse_uint(&config->tls.subcert_lazy_cache_size, opt, optarg);
+  case SHRPX_OPTID_PRIVATE_KEY_THREADS:
+    return parse_uint(&config->tls.private_key_threads, opt, optarg);
   case SHRPX_OPTID_HEADER_FIELD_BUFFER:
     LOG(WARN) << opt
               << ": deprecated.  Use request-header-field-buffer instead.";
   // fall through
   case SHRPX_OPTID_REQUEST_HEADER_FIELD_BUFFER:
-    return parse_uint_with_unit(&mod_config()->http.request_header_field_buffer,
+    return parse_uint_with_unit(&config->http.request_header_field_buffer,
                                 opt, optarg);
   case SHRPX_OPTID_MAX_HEADER_FIELDS:
     LOG(WARN) << opt << ": deprecated.  Use max-request-header-fields instead.";
   // fall through
   case SHRPX_OPTID_MAX_REQUEST_HEADER_FIELDS:
-    return parse_uint(&mod_config()->http.max_request_header_fields, opt,
-                      optarg);
+    return parse_uint(&config->http.max_request_header_fields, opt, optarg);
   case SHRPX_OPTID_RESPONSE_HEADER_FIELD_BUFFER:
     return parse_uint_with_unit(
-        &mod_config()->http.response_header_field_buffer, opt, optarg);
+        &config->http.response_header_field_buffer, opt, optarg);
   case SHRPX_OPTID_MAX_RESPONSE_HEADER_FIELDS:
-    return parse_uint(&mod_config()->http.max_response_header_fields, opt,
-                      optarg);
+    return parse_uint(&config->http.max_response_header_fields, opt, optarg);
   case SHRPX_OPTID_INCLUDE: {
     if (included_set.count(optarg)) {
       LOG(ERROR) << opt << ": " << optarg << " has already been included";
@@ -2290,7 +2736,7 @@ int parse_config(const char *opt, const char *optarg,
     }
 
     included_set.insert(optarg);
-    auto rv = load_config(optarg, included_set);
+    auto rv = load_config(config, optarg, included_set);
     included_set.erase(optarg);
 
     if (rv != 0) {
@@ -2301,19 +2747,19 @@ int parse_config(const char *opt, const char *optarg,
   }
   case SHRPX_OPTID_TLS_TICKET_KEY_CIPHER:
     if (util::strieq(optarg, "aes-128-cbc")) {
-      mod_config()->tls.ticket.cipher = EVP_aes_128_cbc();
+      config->tls.ticket.cipher = EVP_aes_128_cbc();
     } else if (util::strieq(optarg, "aes-256-cbc")) {
-      mod_config()->tls.ticket.cipher = EVP_aes_256_cbc();
+      config->tls.ticket.cipher = EVP_aes_256_cbc();
     } else {
       LOG(ERROR) << opt
                  << ": unsupported cipher for ticket encryption: " << optarg;
       return -1;
     }
-    mod_config()->tls.ticket.cipher_given = true;
+    config->tls.ticket.cipher_given = true;
 
     return 0;
   case SHRPX_OPTID_HOST_REWRITE:
-    mod_config()->http.no_host_rewrite = !util::strieq(optarg, "yes");
+    config->http.no_host_rewrite = !util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED: {
@@ -2322,7 +2768,7 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    auto &memcachedconf = mod_config()->tls.session_cache.memcached;
+    auto &memcachedconf = config->tls.session_cache.memcached;
     memcachedconf.host = host;
     memcachedconf.port = port;
 
@@ -2334,15 +2780,14 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    auto &memcachedconf = mod_config()->tls.ticket.memcached;
+    auto &memcachedconf = config->tls.ticket.memcached;
     memcachedconf.host = host;
     memcachedconf.port = port;
 
     return 0;
   }
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_INTERVAL:
-    return parse_duration(&mod_config()->tls.ticket.memcached.interval, opt,
-                          optarg);
+    return parse_duration(&config->tls.ticket.memcached.interval, opt, optarg);
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_MAX_RETRY: {
     int n;
     if (parse_uint(&n, opt, optarg) != 0) {
@@ -2354,41 +2799,44 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    mod_config()->tls.ticket.memcached.max_retry = n;
+    config->tls.ticket.memcached.max_retry = n;
     return 0;
   }
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_MAX_FAIL:
-    return parse_uint(&mod_config()->tls.ticket.memcached.max_fail, opt,
-                      optarg);
+    return parse_uint(&config->tls.ticket.memcached.max_fail, opt, optarg);
   case SHRPX_OPTID_TLS_DYN_REC_WARMUP_THRESHOLD: {
     size_t n;
     if (parse_uint_with_unit(&n, opt, optarg) != 0) {
       return -1;
     }
 
-    mod_config()->tls.dyn_rec.warmup_threshold = n;
+    config->tls.dyn_rec.warmup_threshold = n;
 
     return 0;
   }
 
   case SHRPX_OPTID_TLS_DYN_REC_IDLE_TIMEOUT:
-    return parse_duration(&mod_config()->tls.dyn_rec.idle_timeout, opt, optarg);
+    return parse_duration(&config->tls.dyn_rec.idle_timeout, opt, optarg);
+
+  case SHRPX_OPTID_TLS_DYN_REC_ADAPTIVE:
+    config->tls.dyn_rec.adaptive = util::strieq(optarg, "yes");
+
+    return 0;
 
   case SHRPX_OPTID_MRUBY_FILE:
 #ifdef HAVE_MRUBY
-    mod_config()->mruby_file = optarg;
+    config->mruby_file = optarg;
 #else  // !HAVE_MRUBY
     LOG(WARN) << opt
               << ": ignored because mruby support is disabled at build time.";
 #endif // !HAVE_MRUBY
     return 0;
   case SHRPX_OPTID_ACCEPT_PROXY_PROTOCOL:
-    mod_config()->conn.upstream.accept_proxy_protocol =
-        util::strieq(optarg, "yes");
+    config->conn.upstream.accept_proxy_protocol = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_ADD_FORWARDED: {
-    auto &fwdconf = mod_config()->http.forwarded;
+    auto &fwdconf = config->http.forwarded;
     fwdconf.params = FORWARDED_NONE;
     for (const auto &param : util::parse_config_str_list(optarg)) {
       if (util::strieq(param, "by")) {
@@ -2416,7 +2864,7 @@ int parse_config(const char *opt, const char *optarg,
     return 0;
   }
   case SHRPX_OPTID_STRIP_INCOMING_FORWARDED:
-    mod_config()->http.forwarded.strip_incoming = util::strieq(optarg, "yes");
+    config->http.forwarded.strip_incoming = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_FORWARDED_BY:
@@ -2430,7 +2878,7 @@ int parse_config(const char *opt, const char *optarg,
       return -1;
     }
 
-    auto &fwdconf = mod_config()->http.forwarded;
+    auto &fwdconf = config->http.forwarded;
 
     switch (optid) {
     case SHRPX_OPTID_FORWARDED_BY:
@@ -2449,7 +2897,7 @@ int parse_config(const char *opt, const char *optarg,
     return 0;
   }
   case SHRPX_OPTID_NO_HTTP2_CIPHER_BLACK_LIST:
-    mod_config()->tls.no_http2_cipher_black_list = util::strieq(optarg, "yes");
+    config->tls.no_http2_cipher_black_list = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_BACKEND_HTTP1_TLS:
@@ -2457,50 +2905,49 @@ int parse_config(const char *opt, const char *optarg,
               << " instead.";
   // fall through
   case SHRPX_OPTID_BACKEND_TLS:
-    mod_config()->conn.downstream.no_tls = !util::strieq(optarg, "yes");
+    config->conn.downstream.no_tls = !util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_TLS:
-    mod_config()->tls.session_cache.memcached.tls = util::strieq(optarg, "yes");
+    config->tls.session_cache.memcached.tls = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_CERT_FILE:
-    mod_config()->tls.session_cache.memcached.cert_file = optarg;
+    config->tls.session_cache.memcached.cert_file = optarg;
 
     return 0;
   case SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_PRIVATE_KEY_FILE:
-    mod_config()->tls.session_cache.memcached.private_key_file = optarg;
+    config->tls.session_cache.memcached.private_key_file = optarg;
 
     return 0;
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_TLS:
-    mod_config()->tls.ticket.memcached.tls = util::strieq(optarg, "yes");
+    config->tls.ticket.memcached.tls = util::strieq(optarg, "yes");
 
     return 0;
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_CERT_FILE:
-    mod_config()->tls.ticket.memcached.cert_file = optarg;
+    config->tls.ticket.memcached.cert_file = optarg;
 
     return 0;
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_PRIVATE_KEY_FILE:
-    mod_config()->tls.ticket.memcached.private_key_file = optarg;
+    config->tls.ticket.memcached.private_key_file = optarg;
 
     return 0;
   case SHRPX_OPTID_TLS_TICKET_KEY_MEMCACHED_ADDRESS_FAMILY:
-    return parse_address_family(&mod_config()->tls.ticket.memcached.family, opt,
+    return parse_address_family(&config->tls.ticket.memcached.family, opt,
                                 optarg);
   case SHRPX_OPTID_TLS_SESSION_CACHE_MEMCACHED_ADDRESS_FAMILY:
     return parse_address_family(
-        &mod_config()->tls.session_cache.memcached.family, opt, optarg);
+        &config->tls.session_cache.memcached.family, opt, optarg);
   case SHRPX_OPTID_BACKEND_ADDRESS_FAMILY:
-    return parse_address_family(&mod_config()->conn.downstream.family, opt,
-                                optarg);
+    return parse_address_family(&config->conn.downstream.family, opt, optarg);
   case SHRPX_OPTID_FRONTEND_HTTP2_MAX_CONCURRENT_STREAMS:
-    return parse_uint(&mod_config()->http2.upstream.max_concurrent_streams, opt,
+    return parse_uint(&config->http2.upstream.max_concurrent_streams, opt,
                       optarg);
   case SHRPX_OPTID_BACKEND_HTTP2_MAX_CONCURRENT_STREAMS:
-    return parse_uint(&mod_config()->http2.downstream.max_concurrent_streams,
+    return parse_uint(&config->http2.downstream.max_concurrent_streams,
                       opt, optarg);
   case SHRPX_OPTID_ERROR_PAGE:
-    return parse_error_page(mod_config()->http.error_pages, opt, optarg);
+    return parse_error_page(config->http.error_pages, opt, optarg);
   case SHRPX_OPTID_CONF:
     LOG(WARN) << "conf: ignored";
 
@@ -2512,7 +2959,8 @@ int parse_config(const char *opt, const char *optarg,
   return -1;
 }
 
-int load_config(const char *filename, std::set<std::string> &include_set) {
+int load_config(Config *config, const char *filename,
+                std::set<std::string> &include_set) {
   std::ifstream in(filename, std::ios::binary);
   if (!in) {
     LOG(ERROR) << "Could not open config file " << filename;
@@ -2536,13 +2984,249 @@ int load_config(const char *filename, std::set<std::string> &include_set) {
     }
     line[i] = '\0';
     auto s = line.c_str();
-    if (parse_config(s, s + i + 1, include_set) == -1) {
+    if (parse_config(config, s, s + i + 1, include_set) == -1) {
       return -1;
     }
   }
   return 0;
 }
 
+bool conf_exists(const char *path) {
+  struct stat buf;
+  int rv = stat(path, &buf);
+  return rv == 0 && (buf.st_mode & (S_IFREG | S_IFLNK));
+}
+
+int resolve_hostname(Address *addr, const char *hostname, uint16_t port,
+                     int family) {
+  int rv;
+
+  auto service = util::utos(port);
+
+  addrinfo hints{};
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags |= AI_ADDRCONFIG;
+#endif // AI_ADDRCONFIG
+  addrinfo *res;
+
+  rv = getaddrinfo(hostname, service.c_str(), &hints, &res);
+  if (rv != 0) {
+    LOG(ERROR) << "Unable to resolve address for " << hostname << ": "
+               << gai_strerror(rv);
+    return -1;
+  }
+
+  auto res_d = defer(freeaddrinfo, res);
+
+  char host[NI_MAXHOST];
+  rv = getnameinfo(res->ai_addr, res->ai_addrlen, host, sizeof(host), nullptr,
+                   0, NI_NUMERICHOST);
+  if (rv != 0) {
+    LOG(ERROR) << "Address resolution for " << hostname
+               << " failed: " << gai_strerror(rv);
+
+    return -1;
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Address resolution for " << hostname
+              << " succeeded: " << host;
+  }
+
+  memcpy(&addr->su, res->ai_addr, res->ai_addrlen);
+  addr->len = res->ai_addrlen;
+
+  return 0;
+}
+
+int configure_downstream_group(DownstreamRoutingConfig &routing,
+                               bool http2_proxy, int family) {
+  auto &addr_groups = routing.addr_groups;
+
+  if (addr_groups.empty()) {
+    DownstreamAddrConfig addr{};
+    addr.host = ImmutableString::from_lit(DEFAULT_DOWNSTREAM_HOST);
+    addr.port = DEFAULT_DOWNSTREAM_PORT;
+    addr.weight = 1;
+
+    DownstreamAddrGroupConfig g(StringRef::from_lit("/"));
+    g.proto = PROTO_HTTP1;
+    g.addrs.push_back(std::move(addr));
+    routing.router.router.add_route(StringRef{g.pattern}, addr_groups.size());
+    addr_groups.push_back(std::move(g));
+  } else if (http2_proxy) {
+    // We don't support host mapping in these cases.  Move all
+    // non-catch-all patterns to catch-all pattern.
+    DownstreamAddrGroupConfig catch_all(StringRef::from_lit("/"));
+    auto proto = PROTO_NONE;
+    for (auto &g : addr_groups) {
+      if (proto == PROTO_NONE) {
+        proto = g.proto;
+      } else if (proto != g.proto) {
+        LOG(ERROR) << SHRPX_OPT_BACKEND << ": <PATTERN> was ignored with "
+                                           "--http2-proxy, and protocol must "
+                                           "be the same for all backends.";
+        return -1;
+      }
+      std::move(std::begin(g.addrs), std::end(g.addrs),
+                std::back_inserter(catch_all.addrs));
+    }
+    catch_all.proto = proto;
+    std::vector<DownstreamAddrGroupConfig>().swap(addr_groups);
+    std::vector<WildcardPattern>().swap(routing.router.wildcard_patterns);
+    // maybe not necessary?
+    routing.router.router = Router();
+    routing.router.router.add_route(StringRef{catch_all.pattern},
+                                    addr_groups.size());
+    addr_groups.push_back(std::move(catch_all));
+  }
+
+  {
+    // Compile routers.  After this, they are not modified.
+    auto &routerconf = routing.router;
+    auto &wildcard_patterns = routerconf.wildcard_patterns;
+
+    // Reversed hosts must be alive until compile() copies them.
+    std::vector<std::string> rev_hosts;
+    rev_hosts.reserve(wildcard_patterns.size());
+
+    for (size_t i = 0; i < wildcard_patterns.size(); ++i) {
+      auto &wp = wildcard_patterns[i];
+
+      rev_hosts.emplace_back(wp.host.rbegin(), wp.host.rend());
+      routerconf.rev_wildcard_router.add_route(StringRef{rev_hosts.back()}, i);
+
+      wp.router.compile();
+    }
+
+    routerconf.router.compile();
+    routerconf.rev_wildcard_router.compile();
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Resolving backend address";
+  }
+
+  ssize_t catch_all_group = -1;
+  for (size_t i = 0; i < addr_groups.size(); ++i) {
+    auto &g = addr_groups[i];
+    if (g.pattern == "/") {
+      catch_all_group = i;
+    }
+    if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "Host-path pattern: group " << i << ": '" << g.pattern
+                << "', proto=" << strproto(g.proto);
+      for (auto &addr : g.addrs) {
+        LOG(INFO) << "group " << i << " -> " << addr.host.c_str()
+                  << (addr.host_unix ? "" : ":" + util::utos(addr.port));
+      }
+    }
+  }
+
+  if (catch_all_group == -1) {
+    LOG(ERROR) << "backend: No catch-all backend address is configured";
+    return -1;
+  }
+
+  routing.addr_group_catch_all = catch_all_group;
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Catch-all pattern is group " << catch_all_group;
+  }
+
+  for (auto &g : addr_groups) {
+    for (auto &addr : g.addrs) {
+
+      if (addr.host_unix) {
+        // for AF_UNIX socket, we use "localhost" as host for backend
+        // hostport.  This is used as Host header field to backend and
+        // not going to be passed to any syscalls.
+        addr.hostport = "localhost";
+
+        auto path = addr.host.c_str();
+        auto pathlen = addr.host.size();
+
+        if (pathlen + 1 > sizeof(addr.addr.su.un.sun_path)) {
+          LOG(ERROR) << "UNIX domain socket path " << path << " is too long > "
+                     << sizeof(addr.addr.su.un.sun_path);
+          return -1;
+        }
+
+        if (LOG_ENABLED(INFO)) {
+          LOG(INFO) << "Use UNIX domain socket path " << path
+                    << " for backend connection";
+        }
+
+        addr.addr.su.un.sun_family = AF_UNIX;
+        // copy path including terminal NULL
+        std::copy_n(path, pathlen + 1, addr.addr.su.un.sun_path);
+        addr.addr.len = sizeof(addr.addr.su.un);
+
+        continue;
+      }
+
+      addr.hostport = ImmutableString(
+          util::make_http_hostport(StringRef(addr.host), addr.port));
+
+      auto hostport = util::make_hostport(StringRef{addr.host}, addr.port);
+
+      if (resolve_hostname(&addr.addr, addr.host.c_str(), addr.port,
+                           family) == -1) {
+        LOG(ERROR) << "Resolving backend address failed: " << hostport;
+        return -1;
+      }
+      LOG(NOTICE) << "Resolved backend address: " << hostport << " -> "
+                  << util::to_numeric_addr(&addr.addr);
+    }
+  }
+
+
+  return 0;
+}
+
+std::shared_ptr<DownstreamRoutingConfig> reload_downstream_routing_config() {
+  // Options are parsed into the scratch Config object, since workers
+  // keep reading the current one.  Only backend configuration is
+  // taken from it.
+  auto config = make_unique<Config>();
+  auto routing = std::make_shared<DownstreamRoutingConfig>();
+  config->conn.downstream.routing = routing;
+  config->backend_only = true;
+
+  auto conf_path = get_config()->conf_path.c_str();
+
+  if (conf_exists(conf_path)) {
+    std::set<std::string> include_set;
+    if (load_config(config.get(), conf_path, include_set) == -1) {
+      LOG(ERROR) << "Failed to load configuration from " << conf_path;
+      return nullptr;
+    }
+  }
+
+  {
+    std::set<std::string> include_set;
+
+    for (auto &cmdcfg : get_config()->cmdcfgs) {
+      if (parse_config(config.get(), cmdcfg.first, cmdcfg.second,
+                       include_set) == -1) {
+        LOG(ERROR) << "Failed to parse command-line argument.";
+        return nullptr;
+      }
+    }
+  }
+
+  auto &downstreamconf = get_config()->conn.downstream;
+
+  if (configure_downstream_group(*routing, get_config()->http2_proxy,
+                                 downstreamconf.family) != 0) {
+    return nullptr;
+  }
+
+  return routing;
+}
+
 const char *str_syslog_facility(int facility) {
   switch (facility) {
   case (LOG_AUTH):
@@ -2680,6 +3364,75 @@ int int_syslog_facility(const char *strfacility) {
   return -1;
 }
 
+// EVBACKEND_IOURING is an enumerator, not a macro, so we have to check
+// libev version.
+#if EV_VERSION_MAJOR > 4 || (EV_VERSION_MAJOR == 4 && EV_VERSION_MINOR >= 31)
+#define SHRPX_HAVE_EVBACKEND_IOURING 1
+#endif // libev >= 4.31
+
+const char *str_event_backend(unsigned int flags) {
+#ifdef SHRPX_HAVE_EVBACKEND_IOURING
+  if (flags & EVBACKEND_IOURING) {
+    return "io_uring";
+  }
+#endif // SHRPX_HAVE_EVBACKEND_IOURING
+
+  switch (flags & EVBACKEND_MASK) {
+  case 0:
+    return "auto";
+  case EVBACKEND_SELECT:
+    return "select";
+  case EVBACKEND_POLL:
+    return "poll";
+  case EVBACKEND_EPOLL:
+    return "epoll";
+  case EVBACKEND_KQUEUE:
+    return "kqueue";
+  case EVBACKEND_PORT:
+    return "port";
+  default:
+    return "(unknown)";
+  }
+}
+
+int int_event_backend(const char *strbackend) {
+  if (util::strieq(strbackend, "auto")) {
+    return 0;
+  }
+
+  if (util::strieq(strbackend, "io_uring")) {
+#ifdef SHRPX_HAVE_EVBACKEND_IOURING
+    // libev tries io_uring first, and if it is not available on the
+    // running kernel, falls back to the other recommended backends.
+    return EVBACKEND_IOURING | ev_recommended_backends();
+#else  // !SHRPX_HAVE_EVBACKEND_IOURING
+    return -1;
+#endif // !SHRPX_HAVE_EVBACKEND_IOURING
+  }
+
+  unsigned int flags;
+
+  if (util::strieq(strbackend, "select")) {
+    flags = EVBACKEND_SELECT;
+  } else if (util::strieq(strbackend, "poll")) {
+    flags = EVBACKEND_POLL;
+  } else if (util::strieq(strbackend, "epoll")) {
+    flags = EVBACKEND_EPOLL;
+  } else if (util::strieq(strbackend, "kqueue")) {
+    flags = EVBACKEND_KQUEUE;
+  } else if (util::strieq(strbackend, "port")) {
+    flags = EVBACKEND_PORT;
+  } else {
+    return -1;
+  }
+
+  if ((ev_supported_backends() & flags) == 0) {
+    return -1;
+  }
+
+  return flags;
+}
+
 StringRef strproto(shrpx_proto proto) {
   switch (proto) {
   case PROTO_NONE:
@@ -2696,4 +3449,20 @@ StringRef strproto(shrpx_proto proto) {
   assert(0);
 }
 
+StringRef strlbpolicy(shrpx_lb_policy policy) {
+  switch (policy) {
+  case LB_ROUND_ROBIN:
+    return StringRef::from_lit("round-robin");
+  case LB_LEAST_OUTSTANDING:
+    return StringRef::from_lit("least-outstanding");
+  case LB_PEAK_EWMA:
+    return StringRef::from_lit("peak-ewma");
+  case LB_P2C:
+    return StringRef::from_lit("p2c");
+  }
+
+  // gcc needs this.
+  assert(0);
+}
+
 } // namespace shrpx
@@ -43,6 +43,7 @@
 #include <vector>
 #include <memory>
 #include <set>
+#include <atomic>
 
 #include <openssl/ssl.h>
 
@@ -62,6 +63,8 @@ namespace shrpx {
 struct LogFragment;
 class ConnectBlocker;
 class Http2Session;
+class ShmSessionCache;
+class PrivateKeyPool;
 
 namespace ssl {
 
@@ -238,11 +241,88 @@ constexpr char SHRPX_OPT_BACKEND_TLS[] = "backend-tls";
 constexpr char SHRPX_OPT_BACKEND_CONNECTIONS_PER_HOST[] =
     "backend-connections-per-host";
 constexpr char SHRPX_OPT_ERROR_PAGE[] = "error-page";
+constexpr char SHRPX_OPT_TLS_DYN_REC_ADAPTIVE[] = "tls-dyn-rec-adaptive";
+constexpr char SHRPX_OPT_FRONTEND_TCP_NOTSENT_LOWAT[] =
+    "frontend-tcp-notsent-lowat";
+constexpr char SHRPX_OPT_EVENT_BACKEND[] = "event-backend";
+constexpr char SHRPX_OPT_BACKEND_HTTP2_COALESCE[] = "backend-http2-coalesce";
+constexpr char SHRPX_OPT_BACKEND_HEALTH_CHECK_INTERVAL[] =
+    "backend-health-check-interval";
+constexpr char SHRPX_OPT_BACKEND_HEALTH_CHECK_TIMEOUT[] =
+    "backend-health-check-timeout";
+constexpr char SHRPX_OPT_BACKEND_CACHE_COLLAPSE_TIMEOUT[] =
+    "backend-cache-collapse-timeout";
+constexpr char SHRPX_OPT_BACKEND_HTTP2_WARM_CONNECTIONS[] =
+    "backend-http2-warm-connections";
+constexpr char SHRPX_OPT_BACKEND_LIMIT_QUEUE_TIMEOUT[] =
+    "backend-limit-queue-timeout";
+constexpr char SHRPX_OPT_ACCESSLOG_BUFFER[] = "accesslog-buffer";
+constexpr char SHRPX_OPT_ACCESSLOG_OVERFLOW[] = "accesslog-overflow";
+constexpr char SHRPX_OPT_ACCESSLOG_BINARY[] = "accesslog-binary";
+constexpr char SHRPX_OPT_METRICS_FRONTEND[] = "metrics-frontend";
+constexpr char SHRPX_OPT_TLS_SESSION_CACHE_SHM_SIZE[] =
+    "tls-session-cache-shm-size";
+constexpr char SHRPX_OPT_FETCH_OCSP_RESPONSE_BUILTIN[] =
+    "fetch-ocsp-response-builtin";
+constexpr char SHRPX_OPT_FETCH_OCSP_RESPONSE_CONCURRENCY[] =
+    "fetch-ocsp-response-concurrency";
+constexpr char SHRPX_OPT_OCSP_RESPONDER[] = "ocsp-responder";
+constexpr char SHRPX_OPT_SUBCERT_LAZY_CACHE_SIZE[] =
+    "subcert-lazy-cache-size";
+constexpr char SHRPX_OPT_PRIVATE_KEY_THREADS[] = "private-key-threads";
 
 constexpr size_t SHRPX_OBFUSCATED_NODE_LENGTH = 8;
 
+constexpr char DEFAULT_DOWNSTREAM_HOST[] = "127.0.0.1";
+constexpr int16_t DEFAULT_DOWNSTREAM_PORT = 80;
+
 enum shrpx_proto { PROTO_NONE, PROTO_HTTP1, PROTO_HTTP2, PROTO_MEMCACHED };
 
+// Policy to select backend address in a group.
+enum shrpx_lb_policy {
+  // Select addresses in turn.
+  LB_ROUND_ROBIN,
+  // Select the address which has the least number of requests in
+  // flight.
+  LB_LEAST_OUTSTANDING,
+  // Select the address which has the least peak EWMA response latency
+  // multiplied by the number of requests in flight.
+  LB_PEAK_EWMA,
+  // Select the better one of 2 randomly chosen addresses, using the
+  // same cost as LB_PEAK_EWMA.
+  LB_P2C,
+};
+
+// Source of the key which pins requests to a backend address.
+enum shrpx_affinity {
+  AFFINITY_NONE,
+  // Client IP address
+  AFFINITY_IP,
+  // Value of request header field
+  AFFINITY_HEADER,
+  // Value of cookie
+  AFFINITY_COOKIE,
+};
+
+// What to do when the buffer of asynchronous access log is full.
+enum shrpx_accesslog_overflow {
+  // Drop the line if the buffer is full.
+  ACCESSLOG_OVERFLOW_DROP,
+  // Block the worker until the buffer has enough space.
+  ACCESSLOG_OVERFLOW_BLOCK,
+};
+
+// Type of active health check for backend address.
+enum shrpx_health_check {
+  HEALTH_CHECK_NONE,
+  // Healthy if TCP connection (and TLS handshake if enabled) is
+  // established.
+  HEALTH_CHECK_TCP,
+  // Healthy if GET request gets the expected response status code.
+  // The request is made in the protocol of the backend address.
+  HEALTH_CHECK_HTTP,
+};
+
 enum shrpx_forwarded_param {
   FORWARDED_NONE = 0,
   FORWARDED_BY = 0x1,
@@ -300,16 +380,60 @@ struct DownstreamAddrConfig {
   uint16_t port;
   // true if |host| contains UNIX domain socket path.
   bool host_unix;
+  shrpx_health_check health_check;
+  // Request path used by HEALTH_CHECK_HTTP.
+  ImmutableString health_check_path;
+  // Response status code expected by HEALTH_CHECK_HTTP.  0 means
+  // that any 2xx or 3xx status code is accepted.
+  unsigned int health_check_status;
+  // Relative weight of this address in load balancing.
+  size_t weight;
+  // Health state published by HealthMonitor, or nullptr if active
+  // health check is disabled for this address.  This is set after
+  // configuration is loaded.
+  std::shared_ptr<const std::atomic<bool>> healthy;
 };
 
 struct DownstreamAddrGroupConfig {
   DownstreamAddrGroupConfig(const StringRef &pattern)
-      : pattern(pattern.c_str(), pattern.size()), proto(PROTO_HTTP1) {}
+      : pattern(pattern.c_str(), pattern.size()),
+        proto(PROTO_HTTP1),
+        lb_policy(LB_ROUND_ROBIN),
+        affinity(AFFINITY_NONE),
+        cache_size(0),
+        retry(0),
+        hedge(0),
+        cache_collapse(false),
+        adaptive_limit(false) {}
 
   ImmutableString pattern;
   std::vector<DownstreamAddrConfig> addrs;
   // Application protocol used in this group
   shrpx_proto proto;
+  // Policy to select backend address in this group
+  shrpx_lb_policy lb_policy;
+  // Session affinity.  If this is not AFFINITY_NONE, it takes
+  // precedence over |lb_policy|.
+  shrpx_affinity affinity;
+  // Lower cased header field name for AFFINITY_HEADER, or cookie name
+  // for AFFINITY_COOKIE.
+  ImmutableString affinity_name;
+  // The maximum size of response cache per worker in bytes.  0 means
+  // that response cache is disabled.
+  size_t cache_size;
+  // The maximum number of times an idempotent request is retried on
+  // another address after the backend failed before response header.
+  size_t retry;
+  // Percentile of recent response latency after which a slow
+  // idempotent request is re-sent to another address.  0 means that
+  // hedging is disabled.
+  unsigned int hedge;
+  // true if concurrent requests which miss the cache for the same
+  // key are collapsed into one backend request.
+  bool cache_collapse;
+  // true if the number of concurrent requests to this group is
+  // limited adaptively based on response latency.
+  bool adaptive_limit;
 };
 
 struct TicketKey {
@@ -387,19 +511,39 @@ struct TLSConfig {
       int family;
       bool tls;
     } memcached;
+    struct {
+      // Session cache in shared memory created by master process.
+      // nullptr if it is disabled.
+      ShmSessionCache *cache;
+      // The size of shared memory.  0 disables shared memory session
+      // cache.
+      size_t size;
+    } shm;
   } session_cache;
 
   // Dynamic record sizing configurations
   struct {
     size_t warmup_threshold;
     ev_tstamp idle_timeout;
+    // true if TLS record size is derived from the congestion window
+    // and RTT reported by TCP_INFO.
+    bool adaptive;
   } dyn_rec;
 
   // OCSP realted configurations
   struct {
     ev_tstamp update_interval;
     ImmutableString fetch_ocsp_response_file;
+    // OCSP responder URI used instead of the one in certificate.
+    // Only used by builtin OCSP client.
+    ImmutableString responder;
+    // The maximum number of concurrent OCSP queries made by builtin
+    // OCSP client.
+    size_t fetch_concurrency;
     bool disabled;
+    // true if OCSP responses are fetched by builtin client instead of
+    // fetch-ocsp-response script.
+    bool fetch_builtin;
   } ocsp;
 
   // Client verification configurations
@@ -418,6 +562,10 @@ struct TLSConfig {
 
   // The list of (private key file, certificate file) pair
   std::vector<std::pair<std::string, std::string>> subcerts;
+  // The maximum number of SSL_CTX for subcerts which are loaded on
+  // demand and kept in memory.  0 means that all of them are loaded
+  // at startup.
+  size_t subcert_lazy_cache_size;
   std::vector<unsigned char> alpn_prefs;
   // list of supported NPN/ALPN protocol strings in the order of
   // preference.
@@ -431,6 +579,11 @@ struct TLSConfig {
   std::chrono::seconds session_timeout;
   ImmutableString private_key_file;
   ImmutableString private_key_passwd;
+  // Performs private key operations of server SSL_CTX in dedicated
+  // threads.  Created in worker process.  nullptr if it is disabled.
+  PrivateKeyPool *private_key_pool;
+  // The number of threads in private_key_pool.  0 disables it.
+  size_t private_key_threads;
   ImmutableString cert_file;
   ImmutableString dh_param_file;
   ImmutableString ciphers;
@@ -504,6 +657,13 @@ struct Http2Config {
     size_t window_bits;
     size_t connection_window_bits;
     size_t max_concurrent_streams;
+    // The number of HTTP/2 sessions each worker opens to each
+    // backend address in advance.  0 means that sessions are opened
+    // on demand.
+    size_t warm_connections;
+    // true if a new backend HTTP/2 session is created only when all
+    // existing sessions in a group are saturated.
+    bool coalesce;
   } downstream;
   struct {
     ev_tstamp stream_read;
@@ -517,8 +677,15 @@ struct LoggingConfig {
   struct {
     std::vector<LogFragment> format;
     ImmutableString file;
+    // The size of per-worker buffer for asynchronous access log
+    // writer.  0 means that access log is written synchronously.
+    size_t buffer_size;
+    // What to do when the buffer is full.
+    shrpx_accesslog_overflow overflow;
     // Send accesslog to syslog, ignoring accesslog_file.
     bool syslog;
+    // Write accesslog in binary format.
+    bool binary;
   } access;
   struct {
     ImmutableString file;
@@ -526,6 +693,8 @@ struct LoggingConfig {
     bool syslog;
   } error;
   int syslog_facility;
+  // The minimum severity of log messages to be written.
+  int severity;
 };
 
 struct RateLimitConfig {
@@ -533,6 +702,8 @@ struct RateLimitConfig {
   size_t burst;
 };
 
+struct DownstreamRoutingConfig;
+
 struct ConnectionConfig {
   struct {
     struct {
@@ -540,6 +711,9 @@ struct ConnectionConfig {
     } timeout;
     // address of frontend acceptors
     std::vector<UpstreamAddr> addrs;
+    // address of acceptors which serve metrics in Prometheus text
+    // format.
+    std::vector<UpstreamAddr> metrics_addrs;
     int backlog;
     // TCP fastopen.  If this is positive, it is passed to
     // setsockopt() along with TCP_FASTOPEN.
@@ -557,6 +731,10 @@ struct ConnectionConfig {
       RateLimitConfig write;
     } ratelimit;
     size_t worker_connections;
+    // The value passed to setsockopt() along with TCP_NOTSENT_LOWAT
+    // for each accepted frontend connection.  0 means that the
+    // option is not set.
+    size_t tcp_notsent_lowat;
     bool no_tls;
     bool accept_proxy_protocol;
   } upstream;
@@ -567,9 +745,21 @@ struct ConnectionConfig {
       ev_tstamp write;
       ev_tstamp idle_read;
     } timeout;
-    std::vector<DownstreamAddrGroupConfig> addr_groups;
-    // The index of catch-all group in downstream_addr_groups.
-    size_t addr_group_catch_all;
+    struct {
+      // Interval between active health checks of a backend address
+      ev_tstamp interval;
+      ev_tstamp timeout;
+    } health_check;
+    // The maximum time a collapsed request waits for the response
+    // to the identical request in flight.
+    ev_tstamp cache_collapse_timeout;
+    // The maximum time a request waits for the concurrency limit of
+    // backend group.  0 means that the request is rejected
+    // immediately.
+    ev_tstamp limit_queue_timeout;
+    // Backend address groups and the router to select one of them.
+    // Workers replace their copy when configuration is reloaded.
+    std::shared_ptr<DownstreamRoutingConfig> routing;
     size_t connections_per_host;
     size_t connections_per_frontend;
     size_t request_buffer_size;
@@ -591,9 +781,24 @@ struct WildcardPattern {
   Router router;
 };
 
-struct Config {
+struct RouterConfig {
   Router router;
+  // Router for reversed wildcard hosts.  Since the left most '*' must
+  // match at least one character, it should be queried with reversed
+  // host without its first character.  The index stored in this
+  // router is the index of wildcard_patterns.
+  Router rev_wildcard_router;
   std::vector<WildcardPattern> wildcard_patterns;
+};
+
+struct DownstreamRoutingConfig {
+  RouterConfig router;
+  std::vector<DownstreamAddrGroupConfig> addr_groups;
+  // The index of catch-all group in addr_groups.
+  size_t addr_group_catch_all;
+};
+
+struct Config {
   HttpProxy downstream_http_proxy;
   HttpConfig http;
   Http2Config http2;
@@ -604,12 +809,19 @@ struct Config {
   ImmutableString conf_path;
   ImmutableString user;
   ImmutableString mruby_file;
+  // Options given in command-line.  They are applied after the
+  // configuration file, and applied again when configuration is
+  // reloaded.
+  std::vector<std::pair<const char *, const char *>> cmdcfgs;
   char **original_argv;
   char **argv;
   char *cwd;
   size_t num_worker;
   size_t padding;
   size_t rlimit_nofile;
+  // libev backend flags passed to ev_default_loop() and
+  // ev_loop_new().  0 lets libev choose the backend.
+  unsigned int ev_loop_flags;
   int argc;
   uid_t uid;
   gid_t gid;
@@ -617,6 +829,11 @@ struct Config {
   bool verbose;
   bool daemon;
   bool http2_proxy;
+  // true if options other than backend and include are ignored.
+  // This is used when backend configuration is reloaded, so that
+  // options which read files possibly not accessible after dropping
+  // privileges are not processed again.
+  bool backend_only;
 };
 
 const Config *get_config();
@@ -624,17 +841,42 @@ Config *mod_config();
 void create_config();
 
 // Parses option name |opt| and value |optarg|.  The results are
-// stored into statically allocated Config object. This function
-// returns 0 if it succeeds, or -1.  The |included_set| contains the
-// all paths already included while processing this configuration, to
-// avoid loop in --include option.
-int parse_config(const char *opt, const char *optarg,
+// stored into |config|.  This function returns 0 if it succeeds, or
+// -1.  The |included_set| contains the all paths already included
+// while processing this configuration, to avoid loop in --include
+// option.
+int parse_config(Config *config, const char *opt, const char *optarg,
                  std::set<std::string> &included_set);
 
-// Loads configurations from |filename| and stores them in statically
-// allocated Config object. This function returns 0 if it succeeds, or
-// -1.  See parse_config() for |include_set|.
-int load_config(const char *filename, std::set<std::string> &include_set);
+// Loads configurations from |filename| and stores them in |config|.
+// This function returns 0 if it succeeds, or -1.  See parse_config()
+// for |include_set|.
+int load_config(Config *config, const char *filename,
+                std::set<std::string> &include_set);
+
+// Returns true if regular file or symbolic link |path| exists.
+bool conf_exists(const char *path);
+
+// Resolves |hostname| and |port| using address |family|, and stores
+// the first address in |addr|.  This function returns 0 if it
+// succeeds, or -1.
+int resolve_hostname(Address *addr, const char *hostname, uint16_t port,
+                     int family);
+
+// Finishes backend configuration |routing| after all backend options
+// are parsed.  The default backend is added if no backend is
+// configured.  If |http2_proxy| is true, all backend addresses are
+// moved to the catch-all group.  Routers are compiled, and backend
+// addresses are resolved using address |family|.  This function
+// returns 0 if it succeeds, or -1.
+int configure_downstream_group(DownstreamRoutingConfig &routing,
+                               bool http2_proxy, int family);
+
+// Loads the configuration file and the options in command-line in
+// the same way as startup, and returns new backend configuration
+// built from them.  Options other than backend are parsed, but
+// discarded.  This function returns nullptr if it fails.
+std::shared_ptr<DownstreamRoutingConfig> reload_downstream_routing_config();
 
 // Read passwd from |filename|
 std::string read_passwd_from_file(const char *filename);
@@ -653,6 +895,14 @@ const char *str_syslog_facility(int facility);
 // Returns integer value of syslog |facility| string.
 int int_syslog_facility(const char *strfacility);
 
+// Returns string for libev backend |flags|.
+const char *str_event_backend(unsigned int flags);
+
+// Returns libev backend flags for |strbackend| string, or -1 if
+// |strbackend| is unknown or not supported by libev we are linked
+// to.
+int int_event_backend(const char *strbackend);
+
 FILE *open_file_for_write(const char *filename);
 
 // Reads TLS ticket key file in |files| and returns TicketKey which
@@ -666,6 +916,9 @@ read_tls_ticket_key_file(const std::vector<std::string> &files,
 // Returns string representation of |proto|.
 StringRef strproto(shrpx_proto proto);
 
+// Returns string representation of |policy|.
+StringRef strlbpolicy(shrpx_lb_policy policy);
+
 } // namespace shrpx
 
 #endif // SHRPX_CONFIG_H
@@ -238,4 +238,82 @@ void test_shrpx_config_read_tls_ticket_key_file_aes_256(void) {
                        "a..............................b"));
 }
 
+void test_shrpx_config_configure_downstream_group(void) {
+  std::set<std::string> include_set;
+
+  {
+    // Default backend is used if no backend is configured.
+    DownstreamRoutingConfig routing{};
+
+    CU_ASSERT(0 == configure_downstream_group(routing, false, AF_UNSPEC));
+    CU_ASSERT(1 == routing.addr_groups.size());
+    CU_ASSERT(0 == routing.addr_group_catch_all);
+    CU_ASSERT("127.0.0.1" == routing.addr_groups[0].addrs[0].host);
+    CU_ASSERT(80 == routing.addr_groups[0].addrs[0].port);
+  }
+
+  {
+    Config config{};
+    auto routing = std::make_shared<DownstreamRoutingConfig>();
+    config.conn.downstream.routing = routing;
+
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND,
+                                "127.0.0.1,8080;/alpha", include_set));
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND, "127.0.0.1,8081",
+                                include_set));
+
+    CU_ASSERT(0 == configure_downstream_group(*routing, false, AF_UNSPEC));
+    CU_ASSERT(2 == routing->addr_groups.size());
+    CU_ASSERT(1 == routing->addr_group_catch_all);
+    CU_ASSERT("/alpha" == routing->addr_groups[0].pattern);
+    CU_ASSERT("127.0.0.1:8080" == routing->addr_groups[0].addrs[0].hostport);
+    CU_ASSERT(0 < routing->addr_groups[0].addrs[0].addr.len);
+  }
+
+  {
+    // Patterns are merged into catch-all group with --http2-proxy.
+    Config config{};
+    auto routing = std::make_shared<DownstreamRoutingConfig>();
+    config.conn.downstream.routing = routing;
+
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND,
+                                "127.0.0.1,8080;/alpha", include_set));
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND,
+                                "127.0.0.1,8081;/bravo", include_set));
+
+    CU_ASSERT(0 == configure_downstream_group(*routing, true, AF_UNSPEC));
+    CU_ASSERT(1 == routing->addr_groups.size());
+    CU_ASSERT(0 == routing->addr_group_catch_all);
+    CU_ASSERT(2 == routing->addr_groups[0].addrs.size());
+  }
+
+  {
+    // No catch-all group
+    Config config{};
+    auto routing = std::make_shared<DownstreamRoutingConfig>();
+    config.conn.downstream.routing = routing;
+
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND,
+                                "127.0.0.1,8080;/alpha", include_set));
+
+    CU_ASSERT(-1 == configure_downstream_group(*routing, false, AF_UNSPEC));
+  }
+
+  {
+    // Options other than backend are ignored when reloading backend
+    // configuration.
+    Config config{};
+    config.conn.downstream.routing =
+        std::make_shared<DownstreamRoutingConfig>();
+    config.backend_only = true;
+
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_PRIVATE_KEY_PASSWD_FILE,
+                                "/nonexistent", include_set));
+    CU_ASSERT(0 == parse_config(&config, SHRPX_OPT_BACKEND, "127.0.0.1,8080",
+                                include_set));
+    CU_ASSERT(1 == config.conn.downstream.routing->addr_groups.size());
+    CU_ASSERT(-1 == parse_config(&config, "no-such-option", "", include_set));
+  }
+}
+
 } // namespace shrpx
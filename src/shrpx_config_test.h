@@ -35,6 +35,7 @@ void test_shrpx_config_parse_header(void);
 void test_shrpx_config_parse_log_format(void);
 void test_shrpx_config_read_tls_ticket_key_file(void);
 void test_shrpx_config_read_tls_ticket_key_file_aes_256(void);
+void test_shrpx_config_configure_downstream_group(void);
 void test_shrpx_config_match_downstream_addr_group(void);
 
 } // namespace shrpx
@@ -23,6 +23,7 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include "shrpx_connect_blocker.h"
+#include "shrpx_metrics.h"
 
 namespace shrpx {
 
@@ -34,8 +35,9 @@ void connect_blocker_cb(struct ev_loop *loop, ev_timer *w, int revents) {
 }
 } // namespace
 
-ConnectBlocker::ConnectBlocker(std::mt19937 &gen, struct ev_loop *loop)
-    : gen_(gen), loop_(loop), fail_count_(0) {
+ConnectBlocker::ConnectBlocker(std::mt19937 &gen, struct ev_loop *loop,
+                               WorkerMetrics *metrics)
+    : gen_(gen), loop_(loop), metrics_(metrics), fail_count_(0) {
   ev_timer_init(&timer_, connect_blocker_cb, 0., 0.);
 }
 
@@ -65,6 +67,10 @@ void ConnectBlocker::on_failure() {
 
   ev_timer_set(&timer_, backoff, 0.);
   ev_timer_start(loop_, &timer_);
+
+  if (metrics_) {
+    metrics_->connect_blocker_trips.add();
+  }
 }
 
 } // namespace shrpx
@@ -33,9 +33,14 @@
 
 namespace shrpx {
 
+struct WorkerMetrics;
+
 class ConnectBlocker {
 public:
-  ConnectBlocker(std::mt19937 &gen, struct ev_loop *loop);
+  // If |metrics| is not nullptr, the number of times this object
+  // starts blocking is counted in it.
+  ConnectBlocker(std::mt19937 &gen, struct ev_loop *loop,
+                 WorkerMetrics *metrics = nullptr);
   ~ConnectBlocker();
 
   // Returns true if making connection is not allowed.
@@ -52,6 +57,7 @@ private:
   std::mt19937 gen_;
   ev_timer timer_;
   struct ev_loop *loop_;
+  WorkerMetrics *metrics_;
   // The number of consecutive connection failure.  Reset to 0 on
   // success.
   size_t fail_count_;
@@ -27,6 +27,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif // HAVE_UNISTD_H
+#include <netinet/tcp.h>
 
 #include <limits>
 
@@ -36,10 +37,25 @@
 #include "shrpx_memcached_request.h"
 #include "memchunk.h"
 #include "util.h"
+#include "ssl_compat.h"
 
 using namespace nghttp2;
 
 namespace shrpx {
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+namespace {
+void asynccb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+
+  ev_io_stop(loop, w);
+
+  // Resume handshake as if data arrived.
+  conn->readcb(loop, &conn->rev, EV_READ);
+}
+} // namespace
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
 Connection::Connection(struct ev_loop *loop, int fd, SSL *ssl,
                        MemchunkPool *mcpool, ev_tstamp write_timeout,
                        ev_tstamp read_timeout,
@@ -47,7 +63,8 @@ Connection::Connection(struct ev_loop *loop, int fd, SSL *ssl,
                        const RateLimitConfig &read_limit, IOCb writecb,
                        IOCb readcb, TimerCb timeoutcb, void *data,
                        size_t tls_dyn_rec_warmup_threshold,
-                       ev_tstamp tls_dyn_rec_idle_timeout, shrpx_proto proto)
+                       ev_tstamp tls_dyn_rec_idle_timeout,
+                       bool tls_dyn_rec_adaptive, shrpx_proto proto)
     : tls{DefaultMemchunks(mcpool), DefaultPeekMemchunks(mcpool)},
       wlimit(loop, &wev, write_limit.rate, write_limit.burst),
       rlimit(loop, &rev, read_limit.rate, read_limit.burst, this),
@@ -59,6 +76,7 @@ Connection::Connection(struct ev_loop *loop, int fd, SSL *ssl,
       fd(fd),
       tls_dyn_rec_warmup_threshold(tls_dyn_rec_warmup_threshold),
       tls_dyn_rec_idle_timeout(tls_dyn_rec_idle_timeout),
+      tls_dyn_rec_adaptive(tls_dyn_rec_adaptive),
       proto(proto) {
 
   ev_io_init(&wev, writecb, fd, EV_WRITE);
@@ -73,8 +91,14 @@ Connection::Connection(struct ev_loop *loop, int fd, SSL *ssl,
   wt.data = this;
   rt.data = this;
 
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  ev_io_init(&tls.asyncev, asynccb, -1, EV_READ);
+  tls.asyncev.data = this;
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
   // set 0. to double field explicitly just in case
   tls.last_write_idle = 0.;
+  tls.tcp_info_next_update = 0.;
 
   if (ssl) {
     set_ssl(ssl);
@@ -90,6 +114,18 @@ Connection::~Connection() {
 }
 
 void Connection::disconnect() {
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  ev_io_stop(loop, &tls.asyncev);
+
+  if (tls.ssl && SSL_waiting_for_async(tls.ssl)) {
+    // Resume the job paused for private key operation.  The operation
+    // fails, and the job finishes, so that it does not hold
+    // tls.async_ctx, and its resources are released.
+    tls.async_ctx.cancel();
+    SSL_do_handshake(tls.ssl);
+  }
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
   if (tls.ssl) {
     SSL_set_shutdown(tls.ssl, SSL_RECEIVED_SHUTDOWN);
     ERR_clear_error();
@@ -99,6 +135,11 @@ void Connection::disconnect() {
       tls.cached_session = nullptr;
     }
 
+    if (tls.loaded_ssl_ctx) {
+      SSL_CTX_free(tls.loaded_ssl_ctx);
+      tls.loaded_ssl_ctx = nullptr;
+    }
+
     if (tls.cached_session_lookup_req) {
       tls.cached_session_lookup_req->canceled = true;
       tls.cached_session_lookup_req = nullptr;
@@ -111,10 +152,17 @@ void Connection::disconnect() {
       tls.ssl = nullptr;
     }
 
+    if (tls.wstage) {
+      tls.wbuf.pool->recycle(tls.wstage);
+      tls.wstage = nullptr;
+    }
+
     tls.wbuf.reset();
     tls.rbuf.reset();
     tls.last_write_idle = 0.;
+    tls.tcp_info_next_update = 0.;
     tls.warmup_writelen = 0;
+    tls.tcp_info_write_limit = 0;
     tls.last_writelen = 0;
     tls.last_readlen = 0;
     tls.handshake_state = 0;
@@ -141,6 +189,20 @@ void Connection::prepare_client_handshake() { SSL_set_connect_state(tls.ssl); }
 
 void Connection::prepare_server_handshake() { SSL_set_accept_state(tls.ssl); }
 
+#if !OPENSSL_1_1_API
+namespace {
+void *BIO_get_data(BIO *bio) { return bio->ptr; }
+} // namespace
+
+namespace {
+void BIO_set_data(BIO *bio, void *ptr) { bio->ptr = ptr; }
+} // namespace
+
+namespace {
+void BIO_set_init(BIO *bio, int init) { bio->init = init; }
+} // namespace
+#endif // !OPENSSL_1_1_API
+
 // BIO implementation is inspired by openldap implementation:
 // http://www.openldap.org/devel/cvsweb.cgi/~checkout~/libraries/libldap/tls_o.c
 namespace {
@@ -149,7 +211,7 @@ int shrpx_bio_write(BIO *b, const char *buf, int len) {
     return 0;
   }
 
-  auto conn = static_cast<Connection *>(b->ptr);
+  auto conn = static_cast<Connection *>(BIO_get_data(b));
   auto &wbuf = conn->tls.wbuf;
 
   BIO_clear_retry_flags(b);
@@ -190,7 +252,7 @@ int shrpx_bio_read(BIO *b, char *buf, int len) {
     return 0;
   }
 
-  auto conn = static_cast<Connection *>(b->ptr);
+  auto conn = static_cast<Connection *>(BIO_get_data(b));
   auto &rbuf = conn->tls.rbuf;
 
   BIO_clear_retry_flags(b);
@@ -239,10 +301,8 @@ long shrpx_bio_ctrl(BIO *b, int cmd, long num, void *ptr) {
 
 namespace {
 int shrpx_bio_create(BIO *b) {
-  b->init = 1;
-  b->num = 0;
-  b->ptr = nullptr;
-  b->flags = 0;
+  BIO_set_init(b, 1);
+  BIO_set_data(b, nullptr);
   return 1;
 }
 } // namespace
@@ -253,26 +313,46 @@ int shrpx_bio_destroy(BIO *b) {
     return 0;
   }
 
-  b->ptr = nullptr;
-  b->init = 0;
-  b->flags = 0;
+  BIO_set_data(b, nullptr);
+  BIO_set_init(b, 0);
 
   return 1;
 }
 } // namespace
 
 namespace {
-BIO_METHOD shrpx_bio_method = {
-    BIO_TYPE_FD,    "nghttpx-bio",    shrpx_bio_write,
-    shrpx_bio_read, shrpx_bio_puts,   shrpx_bio_gets,
-    shrpx_bio_ctrl, shrpx_bio_create, shrpx_bio_destroy,
-};
+BIO_METHOD *create_bio_method() {
+#if OPENSSL_1_1_API
+  auto meth = BIO_meth_new(BIO_TYPE_FD, "nghttpx-bio");
+  BIO_meth_set_write(meth, shrpx_bio_write);
+  BIO_meth_set_read(meth, shrpx_bio_read);
+  BIO_meth_set_puts(meth, shrpx_bio_puts);
+  BIO_meth_set_gets(meth, shrpx_bio_gets);
+  BIO_meth_set_ctrl(meth, shrpx_bio_ctrl);
+  BIO_meth_set_create(meth, shrpx_bio_create);
+  BIO_meth_set_destroy(meth, shrpx_bio_destroy);
+
+  return meth;
+#else  // !OPENSSL_1_1_API
+  static BIO_METHOD meth = {
+      BIO_TYPE_FD,    "nghttpx-bio",    shrpx_bio_write,
+      shrpx_bio_read, shrpx_bio_puts,   shrpx_bio_gets,
+      shrpx_bio_ctrl, shrpx_bio_create, shrpx_bio_destroy,
+  };
+
+  return &meth;
+#endif // !OPENSSL_1_1_API
+}
 } // namespace
 
 void Connection::set_ssl(SSL *ssl) {
+  // BIO_METHOD is shared by all connections in all threads, and never
+  // freed.
+  static auto bio_method = create_bio_method();
+
   tls.ssl = ssl;
-  auto bio = BIO_new(&shrpx_bio_method);
-  bio->ptr = this;
+  auto bio = BIO_new(bio_method);
+  BIO_set_data(bio, this);
   SSL_set_bio(tls.ssl, bio, bio);
   SSL_set_app_data(tls.ssl, this);
 }
@@ -312,8 +392,18 @@ int Connection::tls_handshake() {
 
   switch (tls.handshake_state) {
   case TLS_CONN_WAIT_FOR_SESSION_CACHE:
+  case TLS_CONN_WAIT_FOR_CERT:
     return SHRPX_ERR_INPROGRESS;
-  case TLS_CONN_GOT_SESSION_CACHE: {
+  case TLS_CONN_GOT_SESSION_CACHE:
+  case TLS_CONN_GOT_CERT: {
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+    if (SSL_waiting_for_async(tls.ssl)) {
+      // Let the private key operation finish before freeing tls.ssl.
+      // Client hello is replayed after that.
+      break;
+    }
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
     // Use the same trick invented by @kazuho in h2o project.
 
     // Discard all outgoing data.
@@ -345,7 +435,15 @@ int Connection::tls_handshake() {
     break;
   }
 
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  ev_io_stop(loop, &tls.asyncev);
+
+  AsyncPrivateKeyContext::set_current(&tls.async_ctx);
+  auto rv = SSL_do_handshake(tls.ssl);
+  AsyncPrivateKeyContext::set_current(nullptr);
+#else  // !SHRPX_ASYNC_PRIVATE_KEY
   auto rv = SSL_do_handshake(tls.ssl);
+#endif // !SHRPX_ASYNC_PRIVATE_KEY
 
   if (rv <= 0) {
     auto err = SSL_get_error(tls.ssl, rv);
@@ -360,6 +458,23 @@ int Connection::tls_handshake() {
       break;
     case SSL_ERROR_WANT_WRITE:
       break;
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+    case SSL_ERROR_WANT_ASYNC: {
+      // Private key operation is in progress in PrivateKeyPool.
+      auto afd = tls.async_ctx.get_fd();
+      if (afd == -1) {
+        if (LOG_ENABLED(INFO)) {
+          LOG(INFO) << "tls: async job was paused by unknown operation";
+        }
+        return -1;
+      }
+
+      ev_io_set(&tls.asyncev, afd, EV_READ);
+      ev_io_start(loop, &tls.asyncev);
+
+      return SHRPX_ERR_INPROGRESS;
+    }
+#endif // SHRPX_ASYNC_PRIVATE_KEY
     case SSL_ERROR_SSL:
       if (LOG_ENABLED(INFO)) {
         LOG(INFO) << "tls: handshake libssl error: "
@@ -374,13 +489,20 @@ int Connection::tls_handshake() {
     }
   }
 
-  if (tls.handshake_state == TLS_CONN_WAIT_FOR_SESSION_CACHE) {
+  if (tls.handshake_state == TLS_CONN_WAIT_FOR_SESSION_CACHE ||
+      tls.handshake_state == TLS_CONN_WAIT_FOR_CERT) {
     if (LOG_ENABLED(INFO)) {
       LOG(INFO) << "tls: handshake is still in progress";
     }
     return SHRPX_ERR_INPROGRESS;
   }
 
+  if (tls.handshake_state == TLS_CONN_GOT_SESSION_CACHE ||
+      tls.handshake_state == TLS_CONN_GOT_CERT) {
+    // Replay was deferred until the private key operation finished.
+    return tls_handshake();
+  }
+
   // Don't send handshake data if handshake was completed in OpenSSL
   // routine.  We have to check HTTP/2 requirement if HTTP/2 was
   // negotiated before sending finished message to the peer.
@@ -432,6 +554,13 @@ int Connection::tls_handshake() {
 
   tls.initial_handshake_done = true;
 
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  // Private key is only used in handshake.  Without this, OpenSSL
+  // runs every following SSL_read and SSL_write inside async job.
+  SSL_clear_mode(tls.ssl, SSL_MODE_ASYNC);
+  tls.async_ctx.release();
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
   return write_tls_pending_handshake();
 }
 
@@ -509,14 +638,94 @@ int Connection::check_http2_requirement() {
 
 namespace {
 const size_t SHRPX_SMALL_WRITE_LIMIT = 1300;
+// The maximum TLS record payload size
+const size_t SHRPX_MAX_TLS_RECORD_SIZE = 16_k;
 } // namespace
 
+size_t compute_tcp_info_write_limit(uint32_t snd_cwnd, uint32_t unacked,
+                                    uint32_t snd_mss) {
+  // Once congestion window can carry a full sized record, keep using
+  // full sized records even if the window is full at the moment.
+  // The record is sent as soon as ACK arrives, and splitting it just
+  // adds overhead to bulk transfer.
+  if (static_cast<size_t>(snd_cwnd) * snd_mss >= SHRPX_MAX_TLS_RECORD_SIZE) {
+    return std::numeric_limits<ssize_t>::max();
+  }
+
+  // Congestion window is small, which happens at slow start or after
+  // idle period.  TLS record which does not fit in the remaining
+  // congestion window cannot be decrypted by the peer until another
+  // round trip completes.
+  size_t avail = 0;
+  if (snd_cwnd > unacked) {
+    avail = static_cast<size_t>(snd_cwnd - unacked) * snd_mss;
+  }
+
+  return std::max(avail, SHRPX_SMALL_WRITE_LIMIT);
+}
+
+size_t Connection::get_tcp_info_write_limit() {
+#if defined(__linux__) && defined(TCP_INFO)
+  auto t = ev_now(loop);
+
+  if (t < tls.tcp_info_next_update) {
+    return tls.tcp_info_write_limit;
+  }
+
+  struct tcp_info tcp_info;
+  socklen_t tcp_info_len = sizeof(tcp_info);
+
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tcp_info, &tcp_info_len) != 0) {
+    // Not a TCP socket (e.g., UNIX domain socket).  Never try again
+    // for this connection.
+    tls.tcp_info_write_limit = 0;
+    tls.tcp_info_next_update = std::numeric_limits<double>::infinity();
+    return 0;
+  }
+
+  tls.tcp_info_write_limit = compute_tcp_info_write_limit(
+      tcp_info.tcpi_snd_cwnd, tcp_info.tcpi_unacked, tcp_info.tcpi_snd_mss);
+
+  // tcpi_rtt is in microseconds.  Use 1ms floor so that we do not
+  // call getsockopt() for every write on loopback connection.
+  tls.tcp_info_next_update =
+      t + std::max(static_cast<ev_tstamp>(tcp_info.tcpi_rtt) / 1000000., 0.001);
+
+  return tls.tcp_info_write_limit;
+#else  // !(defined(__linux__) && defined(TCP_INFO))
+  return 0;
+#endif // !(defined(__linux__) && defined(TCP_INFO))
+}
+
+void Connection::update_tcp_info_write_limit(size_t n) {
+  if (tls.tcp_info_write_limit == 0 ||
+      tls.tcp_info_write_limit ==
+          static_cast<size_t>(std::numeric_limits<ssize_t>::max())) {
+    return;
+  }
+
+  // The remaining congestion window shrinks by the bytes written
+  // until TCP_INFO is obtained again.
+  if (tls.tcp_info_write_limit > n + SHRPX_SMALL_WRITE_LIMIT) {
+    tls.tcp_info_write_limit -= n;
+  } else {
+    tls.tcp_info_write_limit = SHRPX_SMALL_WRITE_LIMIT;
+  }
+}
+
 size_t Connection::get_tls_write_limit() {
 
   if (tls_dyn_rec_warmup_threshold == 0) {
     return std::numeric_limits<ssize_t>::max();
   }
 
+  if (tls_dyn_rec_adaptive) {
+    auto limit = get_tcp_info_write_limit();
+    if (limit) {
+      return limit;
+    }
+  }
+
   auto t = ev_now(loop);
 
   if (tls.last_write_idle >= 0. &&
@@ -597,6 +806,46 @@ ssize_t Connection::write_tls(const void *data, size_t len) {
   wlimit.drain(rv);
 
   update_tls_warmup_writelen(rv);
+  update_tcp_info_write_limit(rv);
+
+  return rv;
+}
+
+ssize_t Connection::writev_tls(const struct iovec *iov, int iovcnt) {
+  assert(iovcnt > 0);
+
+  // OpenSSL has no gather variant of SSL_write.  If the first buffer
+  // would produce a short record, copy enough data into a staging
+  // buffer to fill up a record.  Once SSL_write blocks, we must keep
+  // passing the same buffer until it completes, so staging is only
+  // started when there is no pending write.
+  if (tls.last_writelen == 0 && iovcnt > 1 &&
+      iov[0].iov_len < Memchunk16K::size) {
+    auto len = std::min(wlimit.avail(), get_tls_write_limit());
+    if (iov[0].iov_len < len) {
+      tls.wstage = tls.wbuf.pool->get();
+      auto m = tls.wstage;
+      for (int i = 0; i < iovcnt && len > 0 && m->left() > 0; ++i) {
+        auto n = std::min(iov[i].iov_len, std::min(len, m->left()));
+        m->last = std::copy_n(static_cast<uint8_t *>(iov[i].iov_base), n,
+                              m->last);
+        len -= n;
+      }
+    }
+  }
+
+  if (!tls.wstage) {
+    return write_tls(iov[0].iov_base, iov[0].iov_len);
+  }
+
+  auto rv = write_tls(tls.wstage->pos, tls.wstage->len());
+
+  if (tls.last_writelen == 0) {
+    // Write completed or failed.  Either way, staging buffer is no
+    // longer needed.
+    tls.wbuf.pool->recycle(tls.wstage);
+    tls.wstage = nullptr;
+  }
 
   return rv;
 }
@@ -35,6 +35,7 @@
 
 #include "shrpx_rate_limit.h"
 #include "shrpx_error.h"
+#include "shrpx_private_key_pool.h"
 #include "memchunk.h"
 
 namespace shrpx {
@@ -47,6 +48,9 @@ enum {
   TLS_CONN_GOT_SESSION_CACHE,
   TLS_CONN_CANCEL_SESSION_CACHE,
   TLS_CONN_WRITE_STARTED,
+  // SSL_CTX selected by SNI is being loaded.
+  TLS_CONN_WAIT_FOR_CERT,
+  TLS_CONN_GOT_CERT,
 };
 
 struct TLSConnection {
@@ -55,12 +59,34 @@ struct TLSConnection {
   SSL *ssl;
   SSL_SESSION *cached_session;
   MemcachedRequest *cached_session_lookup_req;
+  // SSL_CTX selected by SNI which was loaded while the handshake was
+  // suspended.  It is used when client hello is replayed.
+  SSL_CTX *loaded_ssl_ctx;
+  // Buffer which gathers data passed to writev_tls() into a single
+  // TLS record.  This is taken from memchunk pool only while the
+  // write is in progress, and nullptr otherwise.
+  Memchunk16K *wstage;
   ev_tstamp last_write_idle;
+  // The time when the record size limit derived from TCP_INFO must
+  // be recomputed.  This is only used in adaptive dynamic record
+  // sizing.
+  ev_tstamp tcp_info_next_update;
   size_t warmup_writelen;
+  // The record size limit derived from TCP_INFO last time, reduced by
+  // the bytes written since then.  0 means that TCP_INFO is not
+  // available for this connection.
+  size_t tcp_info_write_limit;
   // length passed to SSL_write and SSL_read last time.  This is
   // required since these functions require the exact same parameters
   // on non-blocking I/O.
   size_t last_writelen, last_readlen;
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  // The private key operation performed in PrivateKeyPool.
+  AsyncPrivateKeyContext async_ctx;
+  // Watches the file descriptor which becomes readable when the
+  // paused async job can be resumed.
+  ev_io asyncev;
+#endif // SHRPX_ASYNC_PRIVATE_KEY
   int handshake_state;
   bool initial_handshake_done;
   bool reneg_started;
@@ -77,7 +103,8 @@ struct Connection {
              const RateLimitConfig &write_limit,
              const RateLimitConfig &read_limit, IOCb writecb, IOCb readcb,
              TimerCb timeoutcb, void *data, size_t tls_dyn_rec_warmup_threshold,
-             ev_tstamp tls_dyn_rec_idle_timeout, shrpx_proto proto);
+             ev_tstamp tls_dyn_rec_idle_timeout, bool tls_dyn_rec_adaptive,
+             shrpx_proto proto);
   ~Connection();
 
   void disconnect();
@@ -101,9 +128,22 @@ struct Connection {
   // returned in case of EOF and no data was read.  Otherwise
   // SHRPX_ERR_NETWORK is return in case of error.
   ssize_t write_tls(const void *data, size_t len);
+  // Writes data in |iov| of length |iovcnt|.  If the first buffer is
+  // shorter than the current TLS record size limit, data from the
+  // following buffers are gathered so that a full sized record is
+  // produced.  Just like write_tls(), the caller must pass the same
+  // data again if this function returned 0.
+  ssize_t writev_tls(const struct iovec *iov, int iovcnt);
   ssize_t read_tls(void *data, size_t len);
 
   size_t get_tls_write_limit();
+  // Returns the TLS record size limit computed from congestion window
+  // and RTT obtained by TCP_INFO.  This function returns 0 if
+  // TCP_INFO is not available.
+  size_t get_tcp_info_write_limit();
+  // Reduces the record size limit obtained by
+  // get_tcp_info_write_limit() by |n| bytes written.
+  void update_tcp_info_write_limit(size_t n);
   // Updates the number of bytes written in warm up period.
   void update_tls_warmup_writelen(size_t n);
   // Tells there is no immediate write now.  This triggers timer to
@@ -133,12 +173,21 @@ struct Connection {
   int fd;
   size_t tls_dyn_rec_warmup_threshold;
   ev_tstamp tls_dyn_rec_idle_timeout;
+  bool tls_dyn_rec_adaptive;
   // Application protocol used over the connection.  This field is not
   // used in this object at the moment.  The rest of the program may
   // use this value when it is useful.
   shrpx_proto proto;
 };
 
+// Returns the TLS record size limit for the congestion window
+// |snd_cwnd| with |unacked| segments in flight, both in the unit of
+// |snd_mss| bytes.  std::numeric_limits<ssize_t>::max() is returned
+// if the congestion window is large enough to carry a full sized
+// record.
+size_t compute_tcp_info_write_limit(uint32_t snd_cwnd, uint32_t unacked,
+                                    uint32_t snd_mss);
+
 } // namespace shrpx
 
 #endif // SHRPX_CONNECTION_H
@@ -44,6 +44,13 @@
 #include "shrpx_accept_handler.h"
 #include "shrpx_memcached_dispatcher.h"
 #include "shrpx_signal.h"
+#include "shrpx_health_monitor.h"
+#include "shrpx_accesslog_writer.h"
+#include "shrpx_metrics.h"
+#include "shrpx_metrics_server.h"
+#include "shrpx_ocsp.h"
+#include "shrpx_ssl_context_pool.h"
+#include "shrpx_log_config.h"
 #include "util.h"
 #include "template.h"
 
@@ -102,6 +109,14 @@ void thread_join_async_cb(struct ev_loop *loop, ev_async *w, int revent) {
 }
 } // namespace
 
+namespace {
+void reload_async_cb(struct ev_loop *loop, ev_async *w, int revent) {
+  auto h = static_cast<ConnectionHandler *>(w->data);
+
+  h->handle_reload_config_complete();
+}
+} // namespace
+
 namespace {
 std::random_device rd;
 } // namespace
@@ -113,7 +128,8 @@ ConnectionHandler::ConnectionHandler(struct ev_loop *loop)
       tls_ticket_key_memcached_get_retry_count_(0),
       tls_ticket_key_memcached_fail_count_(0),
       worker_round_robin_cnt_(0),
-      graceful_shutdown_(false) {
+      graceful_shutdown_(false),
+      reload_pending_(false) {
   ev_timer_init(&disable_acceptor_timer_, acceptor_disable_cb, 0., 0.);
   disable_acceptor_timer_.data = this;
 
@@ -125,6 +141,9 @@ ConnectionHandler::ConnectionHandler(struct ev_loop *loop)
 
   ev_async_init(&thread_join_asyncev_, thread_join_async_cb);
 
+  ev_async_init(&reload_asyncev_, reload_async_cb);
+  reload_asyncev_.data = this;
+
   ev_child_init(&ocsp_.chldev, ocsp_chld_cb, 0, 0);
   ocsp_.chldev.data = this;
 
@@ -135,12 +154,22 @@ ConnectionHandler::ConnectionHandler(struct ev_loop *loop)
 }
 
 ConnectionHandler::~ConnectionHandler() {
+#ifndef NOTHREADS
+  if (reload_fut_.valid()) {
+    reload_fut_.wait();
+  }
+#endif // NOTHREADS
+
   ev_child_stop(loop_, &ocsp_.chldev);
   ev_async_stop(loop_, &thread_join_asyncev_);
+  ev_async_stop(loop_, &reload_asyncev_);
   ev_io_stop(loop_, &ocsp_.rev);
   ev_timer_stop(loop_, &ocsp_timer_);
   ev_timer_stop(loop_, &disable_acceptor_timer_);
 
+  // Stop loading SSL_CTX before workers are freed.
+  ssl_ctx_pool_.reset();
+
   for (auto ssl_ctx : all_ssl_ctx_) {
     auto tls_ctx_data =
         static_cast<ssl::TLSContextData *>(SSL_CTX_get_app_data(ssl_ctx));
@@ -177,12 +206,20 @@ void ConnectionHandler::worker_reopen_log_files() {
 
 int ConnectionHandler::create_single_worker() {
   auto cert_tree = ssl::create_cert_lookup_tree();
-  auto sv_ssl_ctx = ssl::setup_server_ssl_context(all_ssl_ctx_, cert_tree
+  ssl_ctx_pool_ =
+      make_unique<SSLContextPool>(get_config()->tls.subcert_lazy_cache_size
 #ifdef HAVE_NEVERBLEED
-                                                  ,
-                                                  nb_.get()
+                                  ,
+                                  nb_.get()
 #endif // HAVE_NEVERBLEED
-                                                      );
+                                      );
+  auto sv_ssl_ctx = ssl::setup_server_ssl_context(
+      all_ssl_ctx_, cert_tree, ssl_ctx_pool_.get()
+#ifdef HAVE_NEVERBLEED
+                                   ,
+      nb_.get()
+#endif // HAVE_NEVERBLEED
+          );
   auto cl_ssl_ctx = ssl::setup_downstream_client_ssl_context(
 #ifdef HAVE_NEVERBLEED
       nb_.get()
@@ -193,6 +230,9 @@ int ConnectionHandler::create_single_worker() {
     all_ssl_ctx_.push_back(cl_ssl_ctx);
   }
 
+  health_monitor_ = make_unique<HealthMonitor>(
+      loop_, cl_ssl_ctx, *get_config()->conn.downstream.routing);
+
   auto &tlsconf = get_config()->tls;
   auto &memcachedconf = get_config()->tls.session_cache.memcached;
 
@@ -209,13 +249,31 @@ int ConnectionHandler::create_single_worker() {
 
   single_worker_ =
       make_unique<Worker>(loop_, sv_ssl_ctx, cl_ssl_ctx, session_cache_ssl_ctx,
-                          cert_tree, ticket_keys_);
+                          cert_tree, ssl_ctx_pool_.get(), ticket_keys_);
 #ifdef HAVE_MRUBY
   if (single_worker_->create_mruby_context() != 0) {
     return -1;
   }
 #endif // HAVE_MRUBY
 
+#ifndef NOTHREADS
+  auto &accessconf = get_config()->logging.access;
+  if (accessconf.buffer_size) {
+    accesslog_writer_ = make_unique<AccessLogWriter>(accessconf.buffer_size,
+                                                     accessconf.overflow);
+
+    // The worker runs in this thread.
+    auto lgconf = log_config();
+    lgconf->accesslog_writer = accesslog_writer_.get();
+    lgconf->accesslog_buffer = accesslog_writer_->add_buffer();
+
+    // Give access log file to the writer thread.
+    util::close_log_file(lgconf->accesslog_fd);
+
+    accesslog_writer_->run();
+  }
+#endif // !NOTHREADS
+
   return 0;
 }
 
@@ -224,12 +282,20 @@ int ConnectionHandler::create_worker_thread(size_t num) {
   assert(workers_.size() == 0);
 
   auto cert_tree = ssl::create_cert_lookup_tree();
-  auto sv_ssl_ctx = ssl::setup_server_ssl_context(all_ssl_ctx_, cert_tree
+  ssl_ctx_pool_ =
+      make_unique<SSLContextPool>(get_config()->tls.subcert_lazy_cache_size
 #ifdef HAVE_NEVERBLEED
-                                                  ,
-                                                  nb_.get()
+                                  ,
+                                  nb_.get()
 #endif // HAVE_NEVERBLEED
-                                                      );
+                                      );
+  auto sv_ssl_ctx = ssl::setup_server_ssl_context(
+      all_ssl_ctx_, cert_tree, ssl_ctx_pool_.get()
+#ifdef HAVE_NEVERBLEED
+                                   ,
+      nb_.get()
+#endif // HAVE_NEVERBLEED
+          );
   auto cl_ssl_ctx = ssl::setup_downstream_client_ssl_context(
 #ifdef HAVE_NEVERBLEED
       nb_.get()
@@ -240,11 +306,26 @@ int ConnectionHandler::create_worker_thread(size_t num) {
     all_ssl_ctx_.push_back(cl_ssl_ctx);
   }
 
+  health_monitor_ = make_unique<HealthMonitor>(
+      loop_, cl_ssl_ctx, *get_config()->conn.downstream.routing);
+
   auto &tlsconf = get_config()->tls;
   auto &memcachedconf = get_config()->tls.session_cache.memcached;
 
+  auto &accessconf = get_config()->logging.access;
+  if (accessconf.buffer_size) {
+    accesslog_writer_ = make_unique<AccessLogWriter>(accessconf.buffer_size,
+                                                     accessconf.overflow);
+  }
+
   for (size_t i = 0; i < num; ++i) {
-    auto loop = ev_loop_new(0);
+    auto loop = ev_loop_new(get_config()->ev_loop_flags);
+    if (!loop) {
+      LLOG(WARN, this) << "Could not initialize event backend "
+                       << str_event_backend(get_config()->ev_loop_flags)
+                       << ", falling back to auto";
+      loop = ev_loop_new(0);
+    }
 
     SSL_CTX *session_cache_ssl_ctx = nullptr;
     if (memcachedconf.tls) {
@@ -258,19 +339,28 @@ int ConnectionHandler::create_worker_thread(size_t num) {
     }
     auto worker =
         make_unique<Worker>(loop, sv_ssl_ctx, cl_ssl_ctx, session_cache_ssl_ctx,
-                            cert_tree, ticket_keys_);
+                            cert_tree, ssl_ctx_pool_.get(), ticket_keys_);
 #ifdef HAVE_MRUBY
     if (worker->create_mruby_context() != 0) {
       return -1;
     }
 #endif // HAVE_MRUBY
 
+    if (accesslog_writer_) {
+      worker->set_accesslog_buffer(accesslog_writer_.get(),
+                                   accesslog_writer_->add_buffer());
+    }
+
     workers_.push_back(std::move(worker));
     worker_loops_.push_back(loop);
 
     LLOG(NOTICE, this) << "Created worker thread #" << workers_.size() - 1;
   }
 
+  if (accesslog_writer_) {
+    accesslog_writer_->run();
+  }
+
   for (auto &worker : workers_) {
     worker->run_async();
   }
@@ -326,6 +416,89 @@ void ConnectionHandler::graceful_shutdown_worker() {
 #endif // NOTHREADS
 }
 
+void ConnectionHandler::reload_config() {
+#ifndef NOTHREADS
+  if (reload_fut_.valid()) {
+    // Reload again after the current one finishes, so that the latest
+    // configuration file is used.
+    reload_pending_ = true;
+    return;
+  }
+
+  // The reloading thread writes error log to the same file.
+  auto lgconf = log_config();
+  auto errorlog_fd =
+      lgconf->errorlog_fd == -1 ? -1 : dup(lgconf->errorlog_fd);
+  auto errorlog_tty = lgconf->errorlog_tty;
+
+  ev_async_start(loop_, &reload_asyncev_);
+
+  // Resolving backend addresses may block, so that it is done in
+  // another thread.
+  reload_fut_ = std::async(std::launch::async, [this, errorlog_fd,
+                                                errorlog_tty]() {
+    auto lgconf = log_config();
+    lgconf->errorlog_fd = errorlog_fd;
+    lgconf->errorlog_tty = errorlog_tty;
+
+    auto routing = reload_downstream_routing_config();
+
+    if (errorlog_fd != -1) {
+      close(errorlog_fd);
+    }
+    delete_log_config();
+
+    ev_async_send(loop_, &reload_asyncev_);
+
+    return routing;
+  });
+#else  // NOTHREADS
+  replace_downstream_routing(reload_downstream_routing_config());
+#endif // NOTHREADS
+}
+
+void ConnectionHandler::handle_reload_config_complete() {
+#ifndef NOTHREADS
+  ev_async_stop(loop_, &reload_asyncev_);
+
+  replace_downstream_routing(reload_fut_.get());
+
+  if (reload_pending_) {
+    reload_pending_ = false;
+    reload_config();
+  }
+#endif // NOTHREADS
+}
+
+void ConnectionHandler::replace_downstream_routing(
+    std::shared_ptr<DownstreamRoutingConfig> routing) {
+  if (!routing) {
+    LLOG(ERROR, this) << "Failed to reload backend configuration.  The "
+                         "current configuration is kept.";
+    return;
+  }
+
+  if (graceful_shutdown_) {
+    return;
+  }
+
+  health_monitor_->update(*routing);
+
+  if (single_worker_) {
+    single_worker_->replace_downstream_routing(std::move(routing));
+  } else {
+    WorkerEvent wev{};
+    wev.type = REPLACE_DOWNSTREAM;
+    wev.routing = std::move(routing);
+
+    for (auto &worker : workers_) {
+      worker->send(wev);
+    }
+  }
+
+  LLOG(NOTICE, this) << "Backend configuration was reloaded";
+}
+
 int ConnectionHandler::handle_connection(int fd, sockaddr *addr, int addrlen,
                                          const UpstreamAddr *faddr) {
   if (LOG_ENABLED(INFO)) {
@@ -383,6 +556,33 @@ Worker *ConnectionHandler::get_single_worker() const {
   return single_worker_.get();
 }
 
+void ConnectionHandler::set_metrics_server(
+    std::unique_ptr<MetricsServer> server) {
+  metrics_server_ = std::move(server);
+}
+
+MetricsServer *ConnectionHandler::get_metrics_server() const {
+  return metrics_server_.get();
+}
+
+MetricsSnapshot ConnectionHandler::collect_metrics() const {
+  MetricsSnapshot snap;
+
+  if (single_worker_) {
+    single_worker_->get_metrics()->accumulate(snap);
+  }
+
+  for (auto &worker : workers_) {
+    worker->get_metrics()->accumulate(snap);
+  }
+
+  if (accesslog_writer_) {
+    snap.accesslog_dropped = accesslog_writer_->get_num_dropped();
+  }
+
+  return snap;
+}
+
 void ConnectionHandler::add_acceptor(std::unique_ptr<AcceptHandler> h) {
   acceptors_.push_back(std::move(h));
 }
@@ -440,6 +640,10 @@ bool ConnectionHandler::get_graceful_shutdown() const {
 }
 
 void ConnectionHandler::cancel_ocsp_update() {
+  if (ocsp_updater_) {
+    ocsp_updater_->cancel();
+  }
+
   if (ocsp_.pid == 0) {
     return;
   }
@@ -615,15 +819,7 @@ void ConnectionHandler::handle_ocsp_complete() {
               << " finished successfully";
   }
 
-#ifndef OPENSSL_IS_BORINGSSL
-  {
-    std::lock_guard<std::mutex> g(tls_ctx_data->mu);
-    tls_ctx_data->ocsp_data =
-        std::make_shared<std::vector<uint8_t>>(std::move(ocsp_.resp));
-  }
-#else  // OPENSSL_IS_BORINGSSL
-  SSL_CTX_set_ocsp_response(ssl_ctx, ocsp_.resp.data(), ocsp_.resp.size());
-#endif // OPENSSL_IS_BORINGSSL
+  ssl::update_ocsp_response(ssl_ctx, std::move(ocsp_.resp));
 
   ++ocsp_.next;
   proceed_next_cert_ocsp();
@@ -641,6 +837,19 @@ void ConnectionHandler::reset_ocsp() {
 }
 
 void ConnectionHandler::proceed_next_cert_ocsp() {
+  if (get_config()->tls.ocsp.fetch_builtin) {
+    if (!ocsp_updater_) {
+      ocsp_updater_ = make_unique<OCSPUpdater>(loop_);
+    }
+
+    ocsp_updater_->start(all_ssl_ctx_, [this]() {
+      ev_timer_set(&ocsp_timer_, get_config()->tls.ocsp.update_interval, 0.);
+      ev_timer_start(loop_, &ocsp_timer_);
+    });
+
+    return;
+  }
+
   for (;;) {
     reset_ocsp();
     if (ocsp_.next == all_ssl_ctx_.size()) {
@@ -783,4 +992,11 @@ neverbleed_t *ConnectionHandler::get_neverbleed() const { return nb_.get(); }
 
 #endif // HAVE_NEVERBLEED
 
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+void ConnectionHandler::set_private_key_pool(
+    std::unique_ptr<PrivateKeyPool> pool) {
+  private_key_pool_ = std::move(pool);
+}
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
 } // namespace shrpx
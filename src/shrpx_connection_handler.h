@@ -48,6 +48,7 @@
 #endif // HAVE_NEVERBLEED
 
 #include "shrpx_downstream_connection_pool.h"
+#include "shrpx_private_key_pool.h"
 
 namespace shrpx {
 
@@ -58,7 +59,14 @@ class Worker;
 struct WorkerStat;
 struct TicketKeys;
 class MemcachedDispatcher;
+class HealthMonitor;
+class AccessLogWriter;
+class MetricsServer;
+struct MetricsSnapshot;
+class OCSPUpdater;
+class SSLContextPool;
 struct UpstreamAddr;
+struct DownstreamRoutingConfig;
 
 struct OCSPUpdateContext {
   // ocsp response buffer
@@ -104,6 +112,24 @@ public:
   bool get_graceful_shutdown() const;
   void join_worker();
 
+  // Reloads backend configuration from configuration file and
+  // command-line in the background, and passes it to workers.
+  void reload_config();
+  // Called when background reload started by reload_config()
+  // finished.
+  void handle_reload_config_complete();
+  // Makes HealthMonitor and workers use reloaded backend
+  // configuration |routing|.  If |routing| is nullptr, reload failed,
+  // and nothing is done.
+  void
+  replace_downstream_routing(std::shared_ptr<DownstreamRoutingConfig> routing);
+
+  void set_metrics_server(std::unique_ptr<MetricsServer> server);
+  MetricsServer *get_metrics_server() const;
+  // Returns the sum of metrics of all workers.  This function does
+  // not block workers.
+  MetricsSnapshot collect_metrics() const;
+
   // Cancels ocsp update process
   void cancel_ocsp_update();
   // Starts ocsp update for certficate |cert_file|.
@@ -136,13 +162,29 @@ public:
   neverbleed_t *get_neverbleed() const;
 #endif // HAVE_NEVERBLEED
 
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  void set_private_key_pool(std::unique_ptr<PrivateKeyPool> pool);
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
 private:
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  // Performs private key operations of SSL_CTX in all_ssl_ctx_.
+  // This must be declared before all_ssl_ctx_, so that it outlives
+  // them.
+  std::unique_ptr<PrivateKeyPool> private_key_pool_;
+#endif // SHRPX_ASYNC_PRIVATE_KEY
   // Stores all SSL_CTX objects.
   std::vector<SSL_CTX *> all_ssl_ctx_;
   OCSPUpdateContext ocsp_;
   std::mt19937 gen_;
   // ev_loop for each worker
   std::vector<struct ev_loop *> worker_loops_;
+  // Asynchronous access log writer.  nullptr if it is disabled.
+  // This must be declared before workers, so that it outlives them.
+  std::unique_ptr<AccessLogWriter> accesslog_writer_;
+  // Active health checker of backend addresses.  This must be
+  // declared before workers, so that it outlives them.
+  std::unique_ptr<HealthMonitor> health_monitor_;
   // Worker instances when multi threaded mode (-nN, N >= 2) is used.
   std::vector<std::unique_ptr<Worker>> workers_;
   // Worker instance used when single threaded mode (-n1) is used.
@@ -155,19 +197,34 @@ private:
   std::shared_ptr<TicketKeys> ticket_keys_;
   struct ev_loop *loop_;
   std::vector<std::unique_ptr<AcceptHandler>> acceptors_;
+  // Serves metrics of workers.  This must be declared after workers,
+  // so that it is destroyed before them.
+  std::unique_ptr<MetricsServer> metrics_server_;
+  // Builtin OCSP client.  nullptr unless fetch-ocsp-response-builtin
+  // is enabled.
+  std::unique_ptr<OCSPUpdater> ocsp_updater_;
+  // Maps CertLookupTree index to server SSL_CTX, shared by all
+  // workers.
+  std::unique_ptr<SSLContextPool> ssl_ctx_pool_;
 #ifdef HAVE_NEVERBLEED
   std::unique_ptr<neverbleed_t> nb_;
 #endif // HAVE_NEVERBLEED
   ev_timer disable_acceptor_timer_;
   ev_timer ocsp_timer_;
   ev_async thread_join_asyncev_;
+  ev_async reload_asyncev_;
 #ifndef NOTHREADS
   std::future<void> thread_join_fut_;
+  // Result of background configuration reload
+  std::future<std::shared_ptr<DownstreamRoutingConfig>> reload_fut_;
 #endif // NOTHREADS
   size_t tls_ticket_key_memcached_get_retry_count_;
   size_t tls_ticket_key_memcached_fail_count_;
   unsigned int worker_round_robin_cnt_;
   bool graceful_shutdown_;
+  // true if configuration reload was requested while another reload
+  // was in progress.
+  bool reload_pending_;
 };
 
 } // namespace shrpx
@@ -0,0 +1,58 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_connection_test.h"
+
+#include <limits>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_connection.h"
+
+namespace shrpx {
+
+void test_shrpx_connection_compute_tcp_info_write_limit(void) {
+  constexpr size_t unlimited = std::numeric_limits<ssize_t>::max();
+
+  // Initial congestion window of 10 segments cannot carry full sized
+  // record.  The limit is the remaining window.
+  CU_ASSERT(14480 == compute_tcp_info_write_limit(10, 0, 1448));
+  CU_ASSERT(5792 == compute_tcp_info_write_limit(10, 6, 1448));
+
+  // Small limit is used if the small window is full.
+  CU_ASSERT(1300 == compute_tcp_info_write_limit(10, 10, 1448));
+  CU_ASSERT(1300 == compute_tcp_info_write_limit(10, 12, 1448));
+  CU_ASSERT(1300 == compute_tcp_info_write_limit(10, 10, 0));
+
+  // Large congestion window is not limited even if it is full, which
+  // is normal during bulk transfer.
+  CU_ASSERT(unlimited == compute_tcp_info_write_limit(100, 0, 1448));
+  CU_ASSERT(unlimited == compute_tcp_info_write_limit(100, 100, 1448));
+  CU_ASSERT(unlimited == compute_tcp_info_write_limit(12, 12, 1448));
+
+  // Loopback has large MSS.
+  CU_ASSERT(unlimited == compute_tcp_info_write_limit(10, 10, 65483));
+}
+
+} // namespace shrpx
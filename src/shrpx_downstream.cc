@@ -29,6 +29,7 @@
 #include "http-parser/http_parser.h"
 
 #include "shrpx_upstream.h"
+#include "shrpx_hedge_upstream.h"
 #include "shrpx_client_handler.h"
 #include "shrpx_config.h"
 #include "shrpx_error.h"
@@ -36,6 +37,8 @@
 #include "shrpx_downstream_queue.h"
 #include "shrpx_worker.h"
 #include "shrpx_http2_session.h"
+#include "shrpx_cache.h"
+#include "shrpx_concurrency_limiter.h"
 #ifdef HAVE_MRUBY
 #include "shrpx_mruby.h"
 #endif // HAVE_MRUBY
@@ -110,6 +113,18 @@ void downstream_wtimeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
 }
 } // namespace
 
+namespace {
+void hedgecb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto downstream = static_cast<Downstream *>(w->data);
+
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, downstream) << "No response within hedge delay";
+  }
+
+  downstream->send_hedged_request();
+}
+} // namespace
+
 // upstream could be nullptr for unittests
 Downstream::Downstream(Upstream *upstream, MemchunkPool *mcpool,
                        int32_t stream_id)
@@ -123,20 +138,27 @@ Downstream::Downstream(Upstream *upstream, MemchunkPool *mcpool,
       request_buf_(mcpool),
       response_buf_(mcpool),
       upstream_(upstream),
+      hedge_origin_(nullptr),
+      cache_lock_(nullptr),
       blocked_link_(nullptr),
       num_retry_(0),
+      num_addr_retry_(0),
       stream_id_(stream_id),
       assoc_stream_id_(-1),
       downstream_stream_id_(-1),
       response_rst_stream_error_code_(NGHTTP2_NO_ERROR),
+      affinity_hash_(0),
       request_state_(INITIAL),
       response_state_(INITIAL),
       dispatch_state_(DISPATCH_NONE),
+      cache_lock_state_(CACHE_LOCK_NONE),
+      limit_state_(LIMIT_NONE),
       upgraded_(false),
       chunked_request_(false),
       chunked_response_(false),
       expect_final_response_(false),
-      request_pending_(false) {
+      request_pending_(false),
+      hedged_(false) {
 
   auto &timeoutconf = get_config()->http2.timeout;
 
@@ -148,11 +170,13 @@ Downstream::Downstream(Upstream *upstream, MemchunkPool *mcpool,
                 timeoutconf.stream_read);
   ev_timer_init(&downstream_wtimer_, &downstream_wtimeoutcb, 0.,
                 timeoutconf.stream_write);
+  ev_timer_init(&hedgetimer_, &hedgecb, 0., 0.);
 
   upstream_rtimer_.data = this;
   upstream_wtimer_.data = this;
   downstream_rtimer_.data = this;
   downstream_wtimer_.data = this;
+  hedgetimer_.data = this;
 }
 
 Downstream::~Downstream() {
@@ -168,6 +192,7 @@ Downstream::~Downstream() {
     ev_timer_stop(loop, &upstream_wtimer_);
     ev_timer_stop(loop, &downstream_rtimer_);
     ev_timer_stop(loop, &downstream_wtimer_);
+    ev_timer_stop(loop, &hedgetimer_);
 
 #ifdef HAVE_MRUBY
     auto handler = upstream_->get_client_handler();
@@ -178,6 +203,18 @@ Downstream::~Downstream() {
 #endif // HAVE_MRUBY
   }
 
+  if (response_cache_) {
+    response_cache_->unlock(this);
+    response_cache_->remove_waiter(this);
+  }
+
+  if (concurrency_limiter_) {
+    concurrency_limiter_->release(this);
+  }
+
+  // hedge_ refers to hedge_upstream_ and this object.
+  hedge_.reset();
+
   // DownstreamConnection may refer to this object.  Delete it now
   // explicitly.
   dconn_.reset();
@@ -220,6 +257,8 @@ DownstreamConnection *Downstream::get_downstream_connection() {
 }
 
 std::unique_ptr<DownstreamConnection> Downstream::pop_downstream_connection() {
+  cancel_hedged_request();
+
   return std::unique_ptr<DownstreamConnection>(dconn_.release());
 }
 
@@ -517,7 +556,21 @@ int Downstream::push_request_headers() {
     DLOG(INFO, this) << "dconn_ is NULL";
     return -1;
   }
-  return dconn_->push_request_headers();
+  if (dconn_->push_request_headers() != 0) {
+    return -1;
+  }
+
+  if (!hedged_ && !ev_is_active(&hedgetimer_) && upstream_ &&
+      can_retry_on_another_addr()) {
+    auto group = dconn_->get_downstream_addr_group();
+    if (group && group->shared_addr->hedge_delay > 0.) {
+      auto loop = upstream_->get_client_handler()->get_loop();
+      ev_timer_set(&hedgetimer_, group->shared_addr->hedge_delay, 0.);
+      ev_timer_start(loop, &hedgetimer_);
+    }
+  }
+
+  return 0;
 }
 
 int Downstream::push_upload_data_chunk(const uint8_t *data, size_t datalen) {
@@ -919,4 +972,315 @@ void Downstream::add_rcbuf(nghttp2_rcbuf *rcbuf) {
   rcbufs_.push_back(rcbuf);
 }
 
+void Downstream::set_response_cache(std::shared_ptr<ResponseCache> cache) {
+  response_cache_ = std::move(cache);
+}
+
+void Downstream::prepare_response_cache_store() {
+  if (!response_cache_ || get_non_final_response()) {
+    return;
+  }
+
+  auto loop = upstream_->get_client_handler()->get_loop();
+
+  response_cache_entry_ =
+      response_cache_->prepare_store(req_, resp_, ev_now(loop));
+
+  if (!response_cache_entry_) {
+    // The requests waiting for this response have to go to backend.
+    response_cache_->unlock(this);
+  }
+}
+
+void Downstream::add_response_cache_body(const uint8_t *data, size_t len) {
+  if (!response_cache_entry_) {
+    return;
+  }
+
+  if (response_cache_->append_body(response_cache_entry_.get(), data, len) !=
+      0) {
+    response_cache_entry_.reset();
+    response_cache_->unlock(this);
+  }
+}
+
+void Downstream::finish_response_cache_store() {
+  if (!response_cache_entry_) {
+    return;
+  }
+
+  response_cache_->store(std::move(response_cache_entry_));
+  response_cache_->unlock(this);
+}
+
+void Downstream::set_cache_lock(CacheLock *lk, int state) {
+  cache_lock_ = lk;
+  cache_lock_state_ = state;
+}
+
+CacheLock *Downstream::get_cache_lock() const { return cache_lock_; }
+
+int Downstream::get_cache_lock_state() const { return cache_lock_state_; }
+
+bool Downstream::cache_lock_waiting() const {
+  return cache_lock_state_ == CACHE_LOCK_WAIT ||
+         cache_lock_state_ == CACHE_LOCK_READY;
+}
+
+void Downstream::set_affinity_hash(uint32_t hash) { affinity_hash_ = hash; }
+
+uint32_t Downstream::get_affinity_hash() const { return affinity_hash_; }
+
+namespace {
+bool idempotent_method(int method) {
+  switch (method) {
+  case HTTP_GET:
+  case HTTP_HEAD:
+  case HTTP_OPTIONS:
+  case HTTP_TRACE:
+  case HTTP_PUT:
+  case HTTP_DELETE:
+    return true;
+  default:
+    return false;
+  }
+}
+} // namespace
+
+bool Downstream::can_retry_on_another_addr() const {
+  // Request body is not kept after it is sent to backend, so we
+  // cannot send it again.  The hedged request is not retried; the
+  // original request is.
+  return dconn_ && !hedge_origin_ && idempotent_method(req_.method) &&
+         response_state_ == INITIAL && !upgraded_ && !req_.upgrade_request &&
+         !req_.http2_expect_body && req_.recv_body_length == 0 &&
+         (request_state_ == HEADER_COMPLETE || request_state_ == MSG_COMPLETE);
+}
+
+int Downstream::retry_on_another_addr() {
+  if (!can_retry_on_another_addr()) {
+    return 1;
+  }
+
+  if (hedge_ && hedge_->get_response_state() == INITIAL) {
+    if (LOG_ENABLED(INFO)) {
+      DLOG(INFO, this) << "Hedged request takes over the failed request";
+    }
+
+    adopt_hedged_request();
+
+    return 0;
+  }
+
+  auto addr = dconn_->get_addr();
+  auto group = dconn_->get_downstream_addr_group();
+  if (!addr || !group) {
+    return 1;
+  }
+
+  auto shared_addr = group->shared_addr.get();
+
+  if (num_addr_retry_ >= shared_addr->retry) {
+    return 1;
+  }
+
+  tried_addrs_.push_back(addr);
+
+  if (!select_retry_downstream_addr(shared_addr, tried_addrs_)) {
+    if (LOG_ENABLED(INFO)) {
+      DLOG(INFO, this) << "No backend address is left to retry request";
+    }
+    tried_addrs_.pop_back();
+    return 1;
+  }
+
+  ++num_addr_retry_;
+
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, this) << "Retry request on another backend address; tried "
+                     << tried_addrs_.size() << " address(es)";
+  }
+
+  auto handler = upstream_->get_client_handler();
+
+  // Deleting the current downstream connection cancels the request;
+  // RST_STREAM is sent to HTTP/2 backend, and HTTP/1 backend
+  // connection is closed.
+  dconn_.reset();
+
+  downstream_stream_id_ = -1;
+  response_rst_stream_error_code_ = NGHTTP2_NO_ERROR;
+  request_pending_ = false;
+
+  if (attach_downstream_connection(handler->get_downstream_connection(this)) !=
+          0 ||
+      push_request_headers() != 0 ||
+      (request_state_ == MSG_COMPLETE && end_upload_data() != 0)) {
+    dconn_.reset();
+
+    return upstream_->on_downstream_abort_request(this, 502);
+  }
+
+  return 0;
+}
+
+const std::vector<DownstreamAddr *> &Downstream::get_tried_addrs() const {
+  return tried_addrs_;
+}
+
+void Downstream::send_hedged_request() {
+  // Request body might not be received yet if request_state_ is
+  // HEADER_COMPLETE.  Since the end of request is only notified to
+  // dconn_, we do not hedge such request.
+  if (hedged_ || request_state_ != MSG_COMPLETE ||
+      !can_retry_on_another_addr()) {
+    return;
+  }
+
+  auto addr = dconn_->get_addr();
+  auto group = dconn_->get_downstream_addr_group();
+  if (!addr || !group) {
+    return;
+  }
+
+  hedged_ = true;
+
+  auto tried_addrs = tried_addrs_;
+  tried_addrs.push_back(addr);
+
+  if (!select_retry_downstream_addr(group->shared_addr.get(), tried_addrs)) {
+    if (LOG_ENABLED(INFO)) {
+      DLOG(INFO, this) << "No backend address is left to hedge request";
+    }
+    return;
+  }
+
+  if (!hedge_upstream_) {
+    hedge_upstream_ = make_unique<HedgeUpstream>(this);
+  }
+
+  auto handler = upstream_->get_client_handler();
+
+  auto hedge = make_unique<Downstream>(hedge_upstream_.get(),
+                                       handler->get_mcpool(), stream_id_);
+
+  hedge->hedge_origin_ = this;
+
+  // The header fields refer to the memory owned by this object,
+  // which outlives hedge.
+  auto &req = hedge->req_;
+  req.fs.headers() = req_.fs.headers();
+  req.fs.content_length = req_.fs.content_length;
+  req.scheme = req_.scheme;
+  req.authority = req_.authority;
+  req.path = req_.path;
+  req.method = req_.method;
+  req.http_major = req_.http_major;
+  req.http_minor = req_.http_minor;
+  req.connection_close = req_.connection_close;
+  req.no_authority = req_.no_authority;
+
+  hedge->request_start_time_ = request_start_time_;
+  hedge->affinity_hash_ = affinity_hash_;
+  hedge->tried_addrs_ = std::move(tried_addrs);
+  hedge->request_state_ = MSG_COMPLETE;
+
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, this) << "Send hedged request DOWNSTREAM:" << hedge.get()
+                     << " to another backend address";
+  }
+
+  if (hedge->attach_downstream_connection(
+          handler->get_downstream_connection(hedge.get())) != 0 ||
+      hedge->push_request_headers() != 0 || hedge->end_upload_data() != 0) {
+    if (LOG_ENABLED(INFO)) {
+      DLOG(INFO, this) << "Could not send hedged request";
+    }
+    return;
+  }
+
+  hedge_ = std::move(hedge);
+}
+
+void Downstream::cancel_hedged_request() {
+  if (!hedge_) {
+    return;
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, this) << "Cancel hedged request DOWNSTREAM:" << hedge_.get();
+  }
+
+  // Deleting the downstream connection cancels the request;
+  // RST_STREAM is sent to HTTP/2 backend, and HTTP/1 backend
+  // connection is closed.
+  hedge_.reset();
+}
+
+Downstream *Downstream::claim_response() {
+  ev_timer_stop(upstream_->get_client_handler()->get_loop(), &hedgetimer_);
+
+  if (!hedge_origin_) {
+    cancel_hedged_request();
+    return this;
+  }
+
+  auto origin = hedge_origin_;
+
+  assert(origin->hedge_.get() == this);
+
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, origin) << "Hedged request DOWNSTREAM:" << this
+                       << " got response first";
+  }
+
+  origin->adopt_hedged_request();
+  // This object was deleted.
+
+  return origin;
+}
+
+void Downstream::adopt_hedged_request() {
+  auto hedge = std::move(hedge_);
+
+  // Deleting the current downstream connection cancels the request.
+  // It refers to downstream_stream_id_ to cancel HTTP/2 stream, so
+  // delete it before taking over that of hedge.
+  dconn_.reset();
+
+  auto dconn = std::move(hedge->dconn_);
+  dconn->reattach_downstream(this);
+  dconn_ = std::move(dconn);
+
+  downstream_stream_id_ = hedge->downstream_stream_id_;
+  response_rst_stream_error_code_ = NGHTTP2_NO_ERROR;
+  request_pending_ = hedge->request_pending_;
+  chunked_request_ = hedge->chunked_request_;
+  request_downstream_host_ = hedge->request_downstream_host_;
+  // The request which has not been written to HTTP/1 backend yet.
+  request_buf_ = std::move(hedge->request_buf_);
+  tried_addrs_ = std::move(hedge->tried_addrs_);
+
+  if (ev_is_active(&hedge->downstream_rtimer_)) {
+    reset_downstream_rtimer();
+  }
+  if (ev_is_active(&hedge->downstream_wtimer_)) {
+    reset_downstream_wtimer();
+  }
+}
+
+void Downstream::set_concurrency_limiter(
+    std::shared_ptr<ConcurrencyLimiter> limiter) {
+  concurrency_limiter_ = std::move(limiter);
+}
+
+void Downstream::set_limit_state(int state) { limit_state_ = state; }
+
+int Downstream::get_limit_state() const { return limit_state_; }
+
+bool Downstream::concurrency_limit_waiting() const {
+  return limit_state_ == LIMIT_WAIT || limit_state_ == LIMIT_READY ||
+         limit_state_ == LIMIT_REJECTED;
+}
+
 } // namespace shrpx
@@ -47,8 +47,14 @@ using namespace nghttp2;
 namespace shrpx {
 
 class Upstream;
+class HedgeUpstream;
+class ResponseCache;
+class ConcurrencyLimiter;
+struct CacheEntry;
+struct CacheLock;
 class DownstreamConnection;
 struct BlockedLink;
+struct DownstreamAddr;
 
 class FieldStore {
 public:
@@ -224,7 +230,8 @@ public:
   int attach_downstream_connection(std::unique_ptr<DownstreamConnection> dconn);
   void detach_downstream_connection();
   DownstreamConnection *get_downstream_connection();
-  // Returns dconn_ and nullifies dconn_.
+  // Returns dconn_ and nullifies dconn_.  The hedged request, if
+  // any, is canceled.
   std::unique_ptr<DownstreamConnection> pop_downstream_connection();
 
   // Returns true if output buffer is full. If underlying dconn_ is
@@ -376,6 +383,80 @@ public:
 
   void add_rcbuf(nghttp2_rcbuf *rcbuf);
 
+  // Sets the cache which the response to this request may be stored
+  // in.
+  void set_response_cache(std::shared_ptr<ResponseCache> cache);
+  // Prepares to store the response in the response cache, if it has
+  // been set and the response is cacheable.  This must be called
+  // when the response header fields have been received.
+  void prepare_response_cache_store();
+  // Appends response body to the pending cache entry.  If the body
+  // becomes too large, the entry is abandoned.
+  void add_response_cache_body(const uint8_t *data, size_t len);
+  // Stores the pending cache entry in the response cache.  This must
+  // be called when the response body has been received completely.
+  void finish_response_cache_store();
+
+  // Sets the lock of response cache which this request owns or waits
+  // for, and the state of this request regarding it.  The state is
+  // one of CACHE_LOCK_*.
+  void set_cache_lock(CacheLock *lk, int state);
+  CacheLock *get_cache_lock() const;
+  int get_cache_lock_state() const;
+  // Returns true if this request is waiting for the response to the
+  // identical request, and it has not been forwarded to backend.
+  bool cache_lock_waiting() const;
+
+  // Sets the hash of session affinity key of this request.
+  void set_affinity_hash(uint32_t hash);
+  uint32_t get_affinity_hash() const;
+
+  // Returns true if this request can be sent to another backend
+  // address: it is idempotent, it has no request body, and no
+  // response header has been received.
+  bool can_retry_on_another_addr() const;
+  // Cancels the request sent over the current downstream connection,
+  // and sends it again to another backend address.  If the hedged
+  // request is in flight, it takes over the request instead.  This
+  // function returns 0 if the request has been re-sent, or error
+  // response has been sent because it could not be re-sent.  It
+  // returns 1 if the request is not eligible for retry, leaving the
+  // downstream connection intact.  It returns -1 if a fatal error
+  // occurred.
+  int retry_on_another_addr();
+  // Returns the backend addresses this request has been sent to,
+  // excluding the current one.
+  const std::vector<DownstreamAddr *> &get_tried_addrs() const;
+
+  // Sends the copy of the request to another backend address, while
+  // keeping the current request in flight.  The request which gets
+  // response first is used, and the other one is canceled.  This is
+  // done at most once per request, and does nothing if the request is
+  // not eligible for retry.
+  void send_hedged_request();
+  // Cancels the hedged request sent by send_hedged_request(), if it
+  // is in flight.
+  void cancel_hedged_request();
+  // Called when response to this request starts to arrive.  If this
+  // is the hedged request, the original request takes over its
+  // downstream connection, cancels its own request, and deletes this
+  // object.  Otherwise, the hedged request, if any, is canceled.
+  // This function returns the Downstream object which receives the
+  // response.
+  Downstream *claim_response();
+
+  // Sets the concurrency limiter of the backend group this request
+  // is forwarded to.  The slot acquired from it is released when
+  // this object is deleted.
+  void set_concurrency_limiter(std::shared_ptr<ConcurrencyLimiter> limiter);
+  // Sets the state of this request regarding concurrency limiter.
+  // The state is one of LIMIT_*.
+  void set_limit_state(int state);
+  int get_limit_state() const;
+  // Returns true if this request is queued by concurrency limiter,
+  // and it has not been forwarded to backend.
+  bool concurrency_limit_waiting() const;
+
   enum {
     EVENT_ERROR = 0x1,
     EVENT_TIMEOUT = 0x2,
@@ -389,12 +470,42 @@ public:
     DISPATCH_FAILURE,
   };
 
+  enum {
+    CACHE_LOCK_NONE,
+    // The request owns the lock, and it is forwarded to backend.
+    CACHE_LOCK_OWNER,
+    // The request waits for the owner's response.
+    CACHE_LOCK_WAIT,
+    // The lock has been released, and the request is going to be
+    // resumed.
+    CACHE_LOCK_READY,
+    // The request does not take part in locking any more.
+    CACHE_LOCK_DONE,
+  };
+
+  enum {
+    LIMIT_NONE,
+    // The request holds a slot of concurrency limiter.
+    LIMIT_ACQUIRED,
+    // The request is queued.
+    LIMIT_WAIT,
+    // The request has acquired a slot, and it is going to be resumed.
+    LIMIT_READY,
+    // The request timed out in the queue, and it is going to be
+    // rejected.
+    LIMIT_REJECTED,
+  };
+
   Downstream *dlnext, *dlprev;
 
   // the length of response body sent to upstream client
   int64_t response_sent_body_length;
 
 private:
+  // Takes over the downstream connection of hedge_, canceling the
+  // request sent over dconn_.  hedge_ is deleted.
+  void adopt_hedged_request();
+
   BlockAllocator balloc_;
 
   std::vector<nghttp2_rcbuf *> rcbufs_;
@@ -418,13 +529,39 @@ private:
   ev_timer downstream_rtimer_;
   ev_timer downstream_wtimer_;
 
+  ev_timer hedgetimer_;
+
   Upstream *upstream_;
   std::unique_ptr<DownstreamConnection> dconn_;
 
+  // The upstream of hedge_.  This is created when the request is
+  // hedged, and lives as long as this object.
+  std::unique_ptr<HedgeUpstream> hedge_upstream_;
+  // The copy of this request sent to another backend address.  This
+  // is nullptr if the request is not hedged, or the hedged request
+  // has been canceled or taken over.
+  std::unique_ptr<Downstream> hedge_;
+  // The Downstream object which sent this request as the hedged
+  // request, or nullptr if this is not a hedged request.
+  Downstream *hedge_origin_;
+
+  std::shared_ptr<ResponseCache> response_cache_;
+  // The entry to store the response in response_cache_.
+  std::unique_ptr<CacheEntry> response_cache_entry_;
+  // The lock of response_cache_ which this request owns or waits
+  // for.
+  CacheLock *cache_lock_;
+
+  std::shared_ptr<ConcurrencyLimiter> concurrency_limiter_;
+
   // only used by HTTP/2 or SPDY upstream
   BlockedLink *blocked_link_;
   // How many times we tried in backend connection
   size_t num_retry_;
+  // Backend addresses the request was sent to, but failed.
+  std::vector<DownstreamAddr *> tried_addrs_;
+  // How many times the request was retried on another address.
+  size_t num_addr_retry_;
   // The stream ID in frontend connection
   int32_t stream_id_;
   // The associated stream ID in frontend connection if this is pushed
@@ -434,12 +571,17 @@ private:
   int32_t downstream_stream_id_;
   // RST_STREAM error_code from downstream HTTP2 connection
   uint32_t response_rst_stream_error_code_;
+  // Hash of session affinity key.  This is meaningful only if
+  // session affinity is enabled in the backend group.
+  uint32_t affinity_hash_;
   // request state
   int request_state_;
   // response state
   int response_state_;
   // only used by HTTP/2 or SPDY upstream
   int dispatch_state_;
+  int cache_lock_state_;
+  int limit_state_;
   // true if the connection is upgraded (HTTP Upgrade or CONNECT),
   // excluding upgrade to HTTP/2.
   bool upgraded_;
@@ -453,6 +595,8 @@ private:
   // has not been established or should be checked before use;
   // currently used only with HTTP/2 connection.
   bool request_pending_;
+  // true if the request has been hedged.
+  bool hedged_;
 };
 
 } // namespace shrpx
@@ -26,13 +26,18 @@
 
 #include "shrpx_client_handler.h"
 #include "shrpx_downstream.h"
+#include "shrpx_worker.h"
+#include "shrpx_concurrency_limiter.h"
 
 namespace shrpx {
 
 DownstreamConnection::DownstreamConnection()
-    : client_handler_(nullptr), downstream_(nullptr) {}
+    : client_handler_(nullptr),
+      downstream_(nullptr),
+      tracked_addr_(nullptr),
+      request_sent_time_(0.) {}
 
-DownstreamConnection::~DownstreamConnection() {}
+DownstreamConnection::~DownstreamConnection() { finish_request_tracking(); }
 
 void DownstreamConnection::set_client_handler(ClientHandler *handler) {
   client_handler_ = handler;
@@ -44,4 +49,60 @@ ClientHandler *DownstreamConnection::get_client_handler() {
 
 Downstream *DownstreamConnection::get_downstream() { return downstream_; }
 
+void DownstreamConnection::reattach_downstream(Downstream *downstream) {
+  downstream_ = downstream;
+}
+
+void DownstreamConnection::start_request_tracking(DownstreamAddr *addr,
+                                                  ev_tstamp now) {
+  finish_request_tracking();
+
+  if (!addr) {
+    return;
+  }
+
+  tracked_addr_ = addr;
+  request_sent_time_ = now;
+
+  ++addr->num_outstanding;
+  ++addr->num_requests;
+}
+
+void DownstreamConnection::record_response_latency(ev_tstamp now) {
+  if (!tracked_addr_ || request_sent_time_ == 0.) {
+    return;
+  }
+
+  auto latency = now - request_sent_time_;
+
+  client_handler_->get_worker()->get_metrics()->backend_ttfb.observe_seconds(
+      latency);
+
+  update_downstream_addr_latency(tracked_addr_, latency, now);
+
+  auto group = get_downstream_addr_group();
+  if (group) {
+    auto &shared_addr = group->shared_addr;
+    if (shared_addr->hedge) {
+      add_downstream_latency_sample(shared_addr.get(), latency);
+    }
+    if (shared_addr->limiter) {
+      shared_addr->limiter->update(latency, now);
+    }
+  }
+
+  request_sent_time_ = 0.;
+}
+
+void DownstreamConnection::finish_request_tracking() {
+  if (!tracked_addr_) {
+    return;
+  }
+
+  --tracked_addr_->num_outstanding;
+
+  tracked_addr_ = nullptr;
+  request_sent_time_ = 0.;
+}
+
 } // namespace shrpx
@@ -35,6 +35,7 @@ class ClientHandler;
 class Upstream;
 class Downstream;
 struct DownstreamAddrGroup;
+struct DownstreamAddr;
 
 class DownstreamConnection {
 public:
@@ -42,6 +43,10 @@ public:
   virtual ~DownstreamConnection();
   virtual int attach_downstream(Downstream *downstream) = 0;
   virtual void detach_downstream(Downstream *downstream) = 0;
+  // Replaces the Downstream object this object is attached to with
+  // |downstream|, while the request is in flight.  This is used when
+  // the hedged request gets response first.
+  virtual void reattach_downstream(Downstream *downstream);
 
   virtual int push_request_headers() = 0;
   virtual int push_upload_data_chunk(const uint8_t *data, size_t datalen) = 0;
@@ -61,14 +66,33 @@ public:
   virtual bool poolable() const = 0;
 
   virtual DownstreamAddrGroup *get_downstream_addr_group() const = 0;
+  // Returns backend address this object is connected to, or nullptr
+  // if it has not been selected yet.
+  virtual DownstreamAddr *get_addr() const = 0;
 
   void set_client_handler(ClientHandler *client_handler);
   ClientHandler *get_client_handler();
   Downstream *get_downstream();
 
+  // Counts a request sent to |addr| at the time |now| as outstanding
+  // until finish_request_tracking() is called.
+  void start_request_tracking(DownstreamAddr *addr, ev_tstamp now);
+  // Feeds the latency to the response header of the tracked request
+  // to the backend address.  This function does nothing if it has
+  // already been called for the current request.
+  void record_response_latency(ev_tstamp now);
+  // Stops counting the tracked request as outstanding.  It is safe to
+  // call this function even if no request is tracked.
+  void finish_request_tracking();
+
 protected:
   ClientHandler *client_handler_;
   Downstream *downstream_;
+  // Backend address the current request is sent to, or nullptr.
+  DownstreamAddr *tracked_addr_;
+  // The time when the current request was sent, or 0 if its response
+  // latency has been recorded.
+  ev_tstamp request_sent_time_;
 };
 
 } // namespace shrpx
@@ -25,12 +25,21 @@
 #include "shrpx_downstream_connection_pool.h"
 #include "shrpx_downstream_connection.h"
 
+#include <algorithm>
+
 namespace shrpx {
 
 DownstreamConnectionPool::DownstreamConnectionPool() {}
 
-DownstreamConnectionPool::~DownstreamConnectionPool() {
-  for (auto dconn : pool_) {
+DownstreamConnectionPool::~DownstreamConnectionPool() { remove_all(); }
+
+void DownstreamConnectionPool::remove_all() {
+  // Deleting connection may release the last reference to this
+  // object, so that pool_ is moved out first.
+  auto pool = std::move(pool_);
+  pool_.clear();
+
+  for (auto dconn : pool) {
     delete dconn;
   }
 }
@@ -53,6 +62,23 @@ DownstreamConnectionPool::pop_downstream_connection() {
   return dconn;
 }
 
+std::unique_ptr<DownstreamConnection>
+DownstreamConnectionPool::pop_downstream_connection(
+    const DownstreamAddr *addr) {
+  auto it = std::find_if(std::begin(pool_), std::end(pool_),
+                         [addr](DownstreamConnection *dconn) {
+                           return dconn->get_addr() == addr;
+                         });
+  if (it == std::end(pool_)) {
+    return nullptr;
+  }
+
+  auto dconn = std::unique_ptr<DownstreamConnection>(*it);
+  pool_.erase(it);
+
+  return dconn;
+}
+
 void DownstreamConnectionPool::remove_downstream_connection(
     DownstreamConnection *dconn) {
   pool_.erase(dconn);
@@ -33,6 +33,7 @@
 namespace shrpx {
 
 class DownstreamConnection;
+struct DownstreamAddr;
 
 class DownstreamConnectionPool {
 public:
@@ -41,7 +42,13 @@ public:
 
   void add_downstream_connection(std::unique_ptr<DownstreamConnection> dconn);
   std::unique_ptr<DownstreamConnection> pop_downstream_connection();
+  // Pops the connection to the backend address |addr|.  Returns
+  // nullptr if there is no such connection.
+  std::unique_ptr<DownstreamConnection>
+  pop_downstream_connection(const DownstreamAddr *addr);
   void remove_downstream_connection(DownstreamConnection *dconn);
+  // Deletes all pooled connections.
+  void remove_all();
 
 private:
   std::set<DownstreamConnection *> pool_;
@@ -0,0 +1,786 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_health_monitor.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif // HAVE_UNISTD_H
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <openssl/err.h>
+
+#include "shrpx_log.h"
+#include "shrpx_ssl.h"
+#include "shrpx_error.h"
+#include "http2.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+// The number of consecutive results required to change health
+// state.
+constexpr size_t HEALTH_CHECK_THRESHOLD = 2;
+} // namespace
+
+namespace {
+void timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+  auto hc = static_cast<HealthChecker *>(conn->data);
+
+  if (LOG_ENABLED(INFO)) {
+    HCLOG(INFO, hc) << "Time out";
+  }
+
+  hc->on_check_done(false);
+}
+} // namespace
+
+namespace {
+void timercb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto hc = static_cast<HealthChecker *>(w->data);
+
+  if (hc->get_check_running()) {
+    if (LOG_ENABLED(INFO)) {
+      HCLOG(INFO, hc) << "Health check timed out";
+    }
+
+    hc->on_check_done(false);
+
+    return;
+  }
+
+  hc->check();
+}
+} // namespace
+
+namespace {
+void handle_result(HealthChecker *hc, int rv) {
+  if (rv < 0) {
+    hc->on_check_done(false);
+    return;
+  }
+
+  if (rv > 0) {
+    hc->on_check_done(true);
+  }
+}
+} // namespace
+
+namespace {
+void readcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+  auto hc = static_cast<HealthChecker *>(conn->data);
+
+  handle_result(hc, hc->on_read());
+}
+} // namespace
+
+namespace {
+void writecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+  auto hc = static_cast<HealthChecker *>(conn->data);
+
+  handle_result(hc, hc->on_write());
+}
+} // namespace
+
+namespace {
+void connectcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+  auto hc = static_cast<HealthChecker *>(conn->data);
+
+  handle_result(hc, hc->connected());
+}
+} // namespace
+
+namespace {
+int htp_hdrs_completecb(http_parser *htp) {
+  auto hc = static_cast<HealthChecker *>(htp->data);
+
+  // Skip non-final response.
+  if (htp->status_code / 100 == 1) {
+    return 0;
+  }
+
+  hc->set_status_code(htp->status_code);
+
+  // We do not need response body.
+  return 1;
+}
+} // namespace
+
+namespace {
+http_parser_settings htp_hooks = {
+    nullptr,             // http_cb on_message_begin;
+    nullptr,             // http_data_cb on_url;
+    nullptr,             // http_data_cb on_status;
+    nullptr,             // http_data_cb on_header_field;
+    nullptr,             // http_data_cb on_header_value;
+    htp_hdrs_completecb, // http_cb      on_headers_complete;
+    nullptr,             // http_data_cb on_body;
+    nullptr              // http_cb      on_message_complete;
+};
+} // namespace
+
+namespace {
+int on_header_callback(nghttp2_session *session, const nghttp2_frame *frame,
+                       const uint8_t *name, size_t namelen,
+                       const uint8_t *value, size_t valuelen, uint8_t flags,
+                       void *user_data) {
+  auto hc = static_cast<HealthChecker *>(user_data);
+
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->hd.stream_id != hc->get_stream_id() ||
+      !util::streq_l(":status", name, namelen)) {
+    return 0;
+  }
+
+  auto status_code = http2::parse_http_status_code(StringRef{value, valuelen});
+  if (status_code == -1) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+
+  // Skip non-final response.
+  if (status_code / 100 != 1) {
+    hc->set_status_code(status_code);
+  }
+
+  return 0;
+}
+} // namespace
+
+namespace {
+int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
+                             uint32_t error_code, void *user_data) {
+  auto hc = static_cast<HealthChecker *>(user_data);
+
+  if (stream_id != hc->get_stream_id() || hc->get_status_code() != 0) {
+    return 0;
+  }
+
+  // Stream was closed without final response.
+  return NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+} // namespace
+
+HealthChecker::HealthChecker(struct ev_loop *loop, SSL_CTX *ssl_ctx,
+                             MemchunkPool *mcpool,
+                             const DownstreamAddrConfig &addr,
+                             shrpx_proto proto)
+    : conn_(loop, -1, nullptr, mcpool,
+            get_config()->conn.downstream.health_check.timeout,
+            get_config()->conn.downstream.health_check.timeout, {}, {},
+            connectcb, readcb, timeoutcb, this, 0, 0., false, proto),
+      healthy_(std::make_shared<std::atomic<bool>>(true)),
+      do_read_(&HealthChecker::noop),
+      do_write_(&HealthChecker::noop),
+      addr_(addr),
+      ssl_ctx_(ssl_ctx),
+      session_(nullptr),
+      proto_(proto),
+      fail_count_(0),
+      success_count_(0),
+      stream_id_(-1),
+      status_code_(0) {
+  ev_timer_init(&timer_, timercb, 0., 0.);
+  timer_.data = this;
+}
+
+HealthChecker::~HealthChecker() {
+  disconnect();
+
+  ev_timer_stop(conn_.loop, &timer_);
+}
+
+void HealthChecker::start() { ev_timer_start(conn_.loop, &timer_); }
+
+bool HealthChecker::get_check_running() const { return conn_.fd != -1; }
+
+void HealthChecker::check() {
+  if (initiate_connection() != 0) {
+    on_check_done(false);
+    return;
+  }
+
+  ev_timer_set(&timer_, get_config()->conn.downstream.health_check.timeout,
+               0.);
+  ev_timer_start(conn_.loop, &timer_);
+}
+
+void HealthChecker::on_check_done(bool success) {
+  disconnect();
+
+  if (success) {
+    fail_count_ = 0;
+
+    if (!healthy_->load(std::memory_order_relaxed) &&
+        ++success_count_ >= HEALTH_CHECK_THRESHOLD) {
+      success_count_ = 0;
+      healthy_->store(true, std::memory_order_relaxed);
+
+      HCLOG(NOTICE, this) << "Backend " << util::to_numeric_addr(&addr_.addr)
+                          << " is healthy";
+    }
+  } else {
+    success_count_ = 0;
+
+    if (healthy_->load(std::memory_order_relaxed) &&
+        ++fail_count_ >= HEALTH_CHECK_THRESHOLD) {
+      fail_count_ = 0;
+      healthy_->store(false, std::memory_order_relaxed);
+
+      HCLOG(WARN, this) << "Backend " << util::to_numeric_addr(&addr_.addr)
+                        << " is unhealthy";
+    }
+  }
+
+  ev_timer_stop(conn_.loop, &timer_);
+  ev_timer_set(&timer_, get_config()->conn.downstream.health_check.interval,
+               0.);
+  ev_timer_start(conn_.loop, &timer_);
+}
+
+void HealthChecker::disconnect() {
+  if (session_) {
+    nghttp2_session_del(session_);
+    session_ = nullptr;
+  }
+
+  conn_.disconnect();
+
+  wb_.reset();
+
+  stream_id_ = -1;
+  status_code_ = 0;
+
+  do_read_ = do_write_ = &HealthChecker::noop;
+}
+
+int HealthChecker::initiate_connection() {
+  assert(conn_.fd == -1);
+
+  if (ssl_ctx_ && !conn_.tls.ssl) {
+    auto ssl = ssl::create_ssl(ssl_ctx_);
+    if (!ssl) {
+      return -1;
+    }
+
+    switch (proto_) {
+    case PROTO_HTTP1:
+      ssl::setup_downstream_http1_alpn(ssl);
+      break;
+    case PROTO_HTTP2:
+      ssl::setup_downstream_http2_alpn(ssl);
+      break;
+    default:
+      assert(0);
+    }
+
+    conn_.set_ssl(ssl);
+  }
+
+  conn_.fd = util::create_nonblock_socket(addr_.addr.su.storage.ss_family);
+
+  if (conn_.fd == -1) {
+    auto error = errno;
+    HCLOG(WARN, this) << "socket() failed; errno=" << error;
+
+    return -1;
+  }
+
+  int rv;
+  rv = connect(conn_.fd, &addr_.addr.su.sa, addr_.addr.len);
+  if (rv != 0 && errno != EINPROGRESS) {
+    auto error = errno;
+    if (LOG_ENABLED(INFO)) {
+      HCLOG(INFO, this) << "connect() failed; errno=" << error;
+    }
+
+    close(conn_.fd);
+    conn_.fd = -1;
+
+    return -1;
+  }
+
+  if (ssl_ctx_) {
+    auto &tlsconf = get_config()->tls;
+    auto sni_name = !tlsconf.backend_sni_name.empty()
+                        ? StringRef(tlsconf.backend_sni_name)
+                        : StringRef(addr_.host);
+    if (!util::numeric_host(sni_name.c_str())) {
+      SSL_set_tlsext_host_name(conn_.tls.ssl, sni_name.c_str());
+    }
+
+    conn_.prepare_client_handshake();
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    HCLOG(INFO, this) << "Connecting to backend "
+                      << util::to_numeric_addr(&addr_.addr);
+  }
+
+  ev_io_set(&conn_.wev, conn_.fd, EV_WRITE);
+  ev_io_set(&conn_.rev, conn_.fd, EV_READ);
+
+  ev_set_cb(&conn_.wev, connectcb);
+
+  conn_.wlimit.startw();
+  ev_timer_again(conn_.loop, &conn_.wt);
+
+  return 0;
+}
+
+int HealthChecker::connected() {
+  if (!util::check_socket_connected(conn_.fd)) {
+    conn_.wlimit.stopw();
+
+    if (LOG_ENABLED(INFO)) {
+      HCLOG(INFO, this) << "Backend connect failed";
+    }
+
+    return -1;
+  }
+
+  conn_.rlimit.startw();
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  ev_set_cb(&conn_.wev, writecb);
+
+  if (conn_.tls.ssl) {
+    do_read_ = &HealthChecker::tls_handshake;
+    do_write_ = &HealthChecker::tls_handshake;
+
+    return do_write_(*this);
+  }
+
+  do_read_ = &HealthChecker::read_clear;
+  do_write_ = &HealthChecker::write_clear;
+
+  return on_connection_established();
+}
+
+int HealthChecker::on_read() { return do_read_(*this); }
+
+int HealthChecker::on_write() { return do_write_(*this); }
+
+int HealthChecker::tls_handshake() {
+  ERR_clear_error();
+
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  auto rv = conn_.tls_handshake();
+  if (rv == SHRPX_ERR_INPROGRESS) {
+    return 0;
+  }
+
+  if (rv < 0) {
+    return -1;
+  }
+
+  auto &tlsconf = get_config()->tls;
+  auto sni_name = !tlsconf.backend_sni_name.empty()
+                      ? StringRef(tlsconf.backend_sni_name)
+                      : StringRef(addr_.host);
+
+  if (!tlsconf.insecure &&
+      ssl::check_cert(conn_.tls.ssl, &addr_.addr, sni_name) != 0) {
+    return -1;
+  }
+
+  if (proto_ == PROTO_HTTP2 && !h2_negotiated()) {
+    if (LOG_ENABLED(INFO)) {
+      HCLOG(INFO, this) << "h2 was not negotiated";
+    }
+    return -1;
+  }
+
+  do_read_ = &HealthChecker::read_tls;
+  do_write_ = &HealthChecker::write_tls;
+
+  return on_connection_established();
+}
+
+bool HealthChecker::h2_negotiated() const {
+  const unsigned char *next_proto = nullptr;
+  unsigned int next_proto_len;
+  SSL_get0_next_proto_negotiated(conn_.tls.ssl, &next_proto, &next_proto_len);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (!next_proto) {
+    SSL_get0_alpn_selected(conn_.tls.ssl, &next_proto, &next_proto_len);
+  }
+#endif // OPENSSL_VERSION_NUMBER >= 0x10002000L
+
+  return next_proto && util::check_h2_is_selected(next_proto, next_proto_len);
+}
+
+int HealthChecker::on_connection_established() {
+  if (addr_.health_check == HEALTH_CHECK_TCP) {
+    return 1;
+  }
+
+  if (proto_ == PROTO_HTTP2) {
+    nghttp2_session_callbacks *callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+      return -1;
+    }
+
+    auto cb_del = defer(nghttp2_session_callbacks_del, callbacks);
+
+    nghttp2_session_callbacks_set_on_header_callback(callbacks,
+                                                     on_header_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(
+        callbacks, on_stream_close_callback);
+
+    if (nghttp2_session_client_new(&session_, callbacks, this) != 0) {
+      return -1;
+    }
+
+    if (nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, nullptr, 0) !=
+        0) {
+      return -1;
+    }
+
+    auto scheme = ssl_ctx_ ? StringRef::from_lit("https")
+                           : StringRef::from_lit("http");
+
+    auto nva = std::array<nghttp2_nv, 4>{
+        {http2::make_nv_ll(":method", "GET"),
+         http2::make_nv_ls_nocopy(":scheme", scheme),
+         http2::make_nv_ls_nocopy(":authority", StringRef{addr_.hostport}),
+         http2::make_nv_ls_nocopy(":path",
+                                  StringRef{addr_.health_check_path})}};
+
+    stream_id_ = nghttp2_submit_request(session_, nullptr, nva.data(),
+                                        nva.size(), nullptr, nullptr);
+    if (stream_id_ < 0) {
+      return -1;
+    }
+  } else {
+    http_parser_init(&htp_, HTTP_RESPONSE);
+    htp_.data = this;
+
+    std::string req = "GET ";
+    req += addr_.health_check_path;
+    req += " HTTP/1.1\r\nHost: ";
+    req += addr_.hostport;
+    req += "\r\nConnection: close\r\n\r\n";
+
+    if (wb_.write(req.c_str(), req.size()) != req.size()) {
+      HCLOG(WARN, this) << "Health check request is too large";
+      return -1;
+    }
+  }
+
+  conn_.wlimit.startw();
+
+  return on_write();
+}
+
+int HealthChecker::on_response_data(const uint8_t *data, size_t len) {
+  if (addr_.health_check == HEALTH_CHECK_TCP) {
+    return 0;
+  }
+
+  if (session_) {
+    auto rv = nghttp2_session_mem_recv(session_, data, len);
+    if (rv < 0) {
+      if (LOG_ENABLED(INFO)) {
+        HCLOG(INFO, this) << "nghttp2_session_mem_recv() failed: "
+                          << nghttp2_strerror(rv);
+      }
+      return -1;
+    }
+
+    if (nghttp2_session_want_write(session_)) {
+      conn_.wlimit.startw();
+    }
+  } else {
+    auto nread = http_parser_execute(&htp_, &htp_hooks,
+                                     reinterpret_cast<const char *>(data), len);
+    if (status_code_ == 0) {
+      auto htperr = HTTP_PARSER_ERRNO(&htp_);
+      if (htperr != HPE_OK || nread != len) {
+        if (LOG_ENABLED(INFO)) {
+          HCLOG(INFO, this) << "HTTP parse failure: "
+                            << "(" << http_errno_name(htperr) << ") "
+                            << http_errno_description(htperr);
+        }
+        return -1;
+      }
+    }
+  }
+
+  if (status_code_ == 0) {
+    return 0;
+  }
+
+  if (!status_code_ok(status_code_)) {
+    if (LOG_ENABLED(INFO)) {
+      HCLOG(INFO, this) << "Unexpected response status code "
+                        << status_code_;
+    }
+    return -1;
+  }
+
+  return 1;
+}
+
+int HealthChecker::fill_write_buffer() {
+  if (!session_) {
+    return 0;
+  }
+
+  for (;;) {
+    const uint8_t *data;
+    auto datalen = nghttp2_session_mem_send(session_, &data);
+    if (datalen < 0) {
+      return -1;
+    }
+
+    if (datalen == 0) {
+      return 0;
+    }
+
+    if (wb_.write(data, datalen) != static_cast<size_t>(datalen)) {
+      HCLOG(WARN, this) << "HTTP/2 output buffer overflow";
+      return -1;
+    }
+  }
+}
+
+int HealthChecker::read_clear() {
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  std::array<uint8_t, 8_k> buf;
+
+  for (;;) {
+    auto nread = conn_.read_clear(buf.data(), buf.size());
+
+    if (nread == 0) {
+      return 0;
+    }
+
+    if (nread < 0) {
+      return -1;
+    }
+
+    auto rv = on_response_data(buf.data(), nread);
+    if (rv != 0) {
+      return rv;
+    }
+  }
+}
+
+int HealthChecker::write_clear() {
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  for (;;) {
+    if (wb_.rleft() == 0) {
+      wb_.reset();
+
+      if (fill_write_buffer() != 0) {
+        return -1;
+      }
+
+      if (wb_.rleft() == 0) {
+        break;
+      }
+    }
+
+    auto nwrite = conn_.write_clear(wb_.pos, wb_.rleft());
+    if (nwrite < 0) {
+      return -1;
+    }
+
+    if (nwrite == 0) {
+      return 0;
+    }
+
+    wb_.drain(nwrite);
+  }
+
+  conn_.wlimit.stopw();
+  ev_timer_stop(conn_.loop, &conn_.wt);
+
+  return 0;
+}
+
+int HealthChecker::read_tls() {
+  ERR_clear_error();
+
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  std::array<uint8_t, 8_k> buf;
+
+  for (;;) {
+    auto nread = conn_.read_tls(buf.data(), buf.size());
+
+    if (nread == 0) {
+      return 0;
+    }
+
+    if (nread < 0) {
+      return -1;
+    }
+
+    auto rv = on_response_data(buf.data(), nread);
+    if (rv != 0) {
+      return rv;
+    }
+  }
+}
+
+int HealthChecker::write_tls() {
+  ERR_clear_error();
+
+  ev_timer_again(conn_.loop, &conn_.rt);
+
+  for (;;) {
+    if (wb_.rleft() == 0) {
+      wb_.reset();
+
+      if (fill_write_buffer() != 0) {
+        return -1;
+      }
+
+      if (wb_.rleft() == 0) {
+        break;
+      }
+    }
+
+    auto nwrite = conn_.write_tls(wb_.pos, wb_.rleft());
+    if (nwrite < 0) {
+      return -1;
+    }
+
+    if (nwrite == 0) {
+      return 0;
+    }
+
+    wb_.drain(nwrite);
+  }
+
+  conn_.wlimit.stopw();
+  ev_timer_stop(conn_.loop, &conn_.wt);
+
+  return 0;
+}
+
+void HealthChecker::set_status_code(unsigned int status_code) {
+  status_code_ = status_code;
+}
+
+unsigned int HealthChecker::get_status_code() const { return status_code_; }
+
+bool HealthChecker::status_code_ok(unsigned int status_code) const {
+  if (addr_.health_check_status) {
+    return status_code == addr_.health_check_status;
+  }
+
+  return 200 <= status_code && status_code < 400;
+}
+
+int HealthChecker::noop() { return 0; }
+
+const std::shared_ptr<std::atomic<bool>> &HealthChecker::get_health() const {
+  return healthy_;
+}
+
+const DownstreamAddrConfig *HealthChecker::get_addr() const { return &addr_; }
+
+shrpx_proto HealthChecker::get_proto() const { return proto_; }
+
+int32_t HealthChecker::get_stream_id() const { return stream_id_; }
+
+HealthMonitor::HealthMonitor(struct ev_loop *loop, SSL_CTX *ssl_ctx,
+                             DownstreamRoutingConfig &routing)
+    : loop_(loop), ssl_ctx_(ssl_ctx) {
+  update(routing);
+}
+
+HealthMonitor::~HealthMonitor() {}
+
+namespace {
+// Returns true if |hc| checks |addr| of application protocol |proto|
+// in the same way.
+bool match_health_checker(const HealthChecker &hc,
+                          const DownstreamAddrConfig &addr,
+                          shrpx_proto proto) {
+  auto a = hc.get_addr();
+  return a->host == addr.host && a->port == addr.port &&
+         a->host_unix == addr.host_unix &&
+         a->health_check == addr.health_check &&
+         a->health_check_path == addr.health_check_path &&
+         a->health_check_status == addr.health_check_status &&
+         hc.get_proto() == proto && a->addr.len == addr.addr.len &&
+         memcmp(&a->addr.su, &addr.addr.su, addr.addr.len) == 0;
+}
+} // namespace
+
+void HealthMonitor::update(DownstreamRoutingConfig &routing) {
+  std::vector<std::unique_ptr<HealthChecker>> checkers;
+
+  for (auto &group : routing.addr_groups) {
+    for (auto &addr : group.addrs) {
+      if (addr.health_check == HEALTH_CHECK_NONE) {
+        continue;
+      }
+
+      auto matcher = [&addr,
+                      &group](const std::unique_ptr<HealthChecker> &hc) {
+        return hc && match_health_checker(*hc, addr, group.proto);
+      };
+
+      auto it = std::find_if(std::begin(checkers), std::end(checkers), matcher);
+
+      if (it == std::end(checkers)) {
+        auto old_it =
+            std::find_if(std::begin(checkers_), std::end(checkers_), matcher);
+
+        if (old_it == std::end(checkers_)) {
+          auto hc = make_unique<HealthChecker>(loop_, ssl_ctx_, &mcpool_, addr,
+                                               group.proto);
+          hc->start();
+          checkers.push_back(std::move(hc));
+        } else {
+          checkers.push_back(std::move(*old_it));
+        }
+
+        it = std::end(checkers) - 1;
+      }
+
+      addr.healthy = (*it)->get_health();
+    }
+  }
+
+  checkers_ = std::move(checkers);
+}
+
+} // namespace shrpx
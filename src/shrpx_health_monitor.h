@@ -0,0 +1,159 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_HEALTH_MONITOR_H
+#define SHRPX_HEALTH_MONITOR_H
+
+#include "shrpx.h"
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include <ev.h>
+
+#include <openssl/ssl.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include "http-parser/http_parser.h"
+
+#include "shrpx_config.h"
+#include "shrpx_connection.h"
+#include "buffer.h"
+#include "memchunk.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+// HealthChecker checks the health of a backend address periodically,
+// and publishes the result to workers.  It runs in the event loop of
+// the main thread.
+class HealthChecker {
+public:
+  // |ssl_ctx| is used to make TLS connection, and may be nullptr.
+  // |proto| is the application protocol of the backend address
+  // |addr|.
+  HealthChecker(struct ev_loop *loop, SSL_CTX *ssl_ctx, MemchunkPool *mcpool,
+                const DownstreamAddrConfig &addr, shrpx_proto proto);
+  ~HealthChecker();
+
+  // Starts periodic health check.  The first check is done
+  // immediately.
+  void start();
+  // Starts one health check.
+  void check();
+  // Returns true if health check is in progress.
+  bool get_check_running() const;
+  // Called when one health check finished.  |success| is true if the
+  // check succeeded.
+  void on_check_done(bool success);
+  void disconnect();
+
+  int initiate_connection();
+  int connected();
+  int on_read();
+  int on_write();
+
+  int tls_handshake();
+  int read_clear();
+  int write_clear();
+  int read_tls();
+  int write_tls();
+
+  // Returns true if h2 was negotiated in TLS handshake.
+  bool h2_negotiated() const;
+  // Called when connection, including TLS handshake, is established.
+  int on_connection_established();
+  // Processes response bytes received.  Returns 1 if check succeeded,
+  // 0 if more bytes are needed, or -1 if check failed.
+  int on_response_data(const uint8_t *data, size_t len);
+  // Fills wb_ with the bytes to send.
+  int fill_write_buffer();
+  void set_status_code(unsigned int status_code);
+  unsigned int get_status_code() const;
+  // Returns true if |status_code| is the expected response status
+  // code.
+  bool status_code_ok(unsigned int status_code) const;
+
+  int noop();
+
+  const std::shared_ptr<std::atomic<bool>> &get_health() const;
+  const DownstreamAddrConfig *get_addr() const;
+  shrpx_proto get_proto() const;
+  int32_t get_stream_id() const;
+
+private:
+  Connection conn_;
+  // true if backend address is healthy.  This is only written by
+  // this object, and read by workers.  Workers may keep it after this
+  // object is removed by configuration reload.
+  std::shared_ptr<std::atomic<bool>> healthy_;
+  // Timer to start next check, or to time out the current check.
+  ev_timer timer_;
+  std::function<int(HealthChecker &)> do_read_, do_write_;
+  Buffer<16_k> wb_;
+  http_parser htp_;
+  DownstreamAddrConfig addr_;
+  SSL_CTX *ssl_ctx_;
+  // HTTP/2 session for HTTP/2 backend.  nullptr otherwise.
+  nghttp2_session *session_;
+  shrpx_proto proto_;
+  // The number of consecutive failures, and successes.
+  size_t fail_count_, success_count_;
+  // HTTP/2 stream ID of health check request.
+  int32_t stream_id_;
+  // Response status code.  0 if it has not been received yet.
+  unsigned int status_code_;
+};
+
+// HealthMonitor owns HealthChecker objects for all backend addresses
+// which enable active health check.
+class HealthMonitor {
+public:
+  // Creates HealthChecker for each backend address in |routing|.
+  // See update().
+  HealthMonitor(struct ev_loop *loop, SSL_CTX *ssl_ctx,
+                DownstreamRoutingConfig &routing);
+  ~HealthMonitor();
+  // Makes HealthChecker objects check backend addresses in
+  // |routing|, and sets their health state to
+  // DownstreamAddrConfig::healthy.  The same address shares one
+  // HealthChecker if the parameters are the same.  Existing
+  // HealthChecker is reused for such address, and the ones which no
+  // address uses are removed.
+  void update(DownstreamRoutingConfig &routing);
+
+private:
+  MemchunkPool mcpool_;
+  std::vector<std::unique_ptr<HealthChecker>> checkers_;
+  struct ev_loop *loop_;
+  SSL_CTX *ssl_ctx_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_HEALTH_MONITOR_H
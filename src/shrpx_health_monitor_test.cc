@@ -0,0 +1,416 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_health_monitor_test.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <array>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CUnit/CUnit.h>
+
+#include <openssl/ssl.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include "shrpx_health_monitor.h"
+#include "shrpx_config.h"
+#include "http2.h"
+#include "util.h"
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+namespace {
+// Creates server SSL_CTX with newly generated private key and
+// self-signed certificate.  If |h2| is true, h2 is selected by ALPN.
+SSL_CTX *create_server_ssl_ctx(bool h2) {
+  auto ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  auto ctx_del = defer(EVP_PKEY_CTX_free, ctx);
+
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_keygen_init(ctx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+  EVP_PKEY_keygen(ctx, &pkey);
+  auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+  auto cert = X509_new();
+  auto cert_del = defer(X509_free, cert);
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+
+  auto name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, pkey);
+  X509_sign(cert, pkey, EVP_sha256());
+
+  auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL_CTX_use_certificate(ssl_ctx, cert);
+  SSL_CTX_use_PrivateKey(ssl_ctx, pkey);
+
+#ifdef SSL_OP_NO_TLSv1_3
+  // Backend connection uses HTTP/2 only over TLSv1.2.
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TLSv1_3);
+#endif // SSL_OP_NO_TLSv1_3
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (h2) {
+    SSL_CTX_set_alpn_select_cb(
+        ssl_ctx,
+        [](SSL *ssl, const unsigned char **out, unsigned char *outlen,
+           const unsigned char *in, unsigned int inlen, void *arg) {
+          if (nghttp2_select_next_protocol(const_cast<unsigned char **>(out),
+                                           outlen, in, inlen) != 1) {
+            return SSL_TLSEXT_ERR_NOACK;
+          }
+          return SSL_TLSEXT_ERR_OK;
+        },
+        nullptr);
+  }
+#endif // OPENSSL_VERSION_NUMBER >= 0x10002000L
+
+  return ssl_ctx;
+}
+} // namespace
+
+namespace {
+ssize_t recv_data(int fd, SSL *ssl, uint8_t *buf, size_t len) {
+  if (ssl) {
+    return SSL_read(ssl, buf, len);
+  }
+  return read(fd, buf, len);
+}
+} // namespace
+
+namespace {
+bool send_data(int fd, SSL *ssl, const uint8_t *data, size_t len) {
+  while (len) {
+    auto nwrite = ssl ? SSL_write(ssl, data, len) : write(fd, data, len);
+    if (nwrite <= 0) {
+      return false;
+    }
+    data += nwrite;
+    len -= nwrite;
+  }
+  return true;
+}
+} // namespace
+
+namespace {
+void serve_http1(int fd, SSL *ssl, unsigned int status_code) {
+  std::string req;
+  std::array<uint8_t, 4_k> buf;
+
+  while (req.find("\r\n\r\n") == std::string::npos) {
+    auto nread = recv_data(fd, ssl, buf.data(), buf.size());
+    if (nread <= 0) {
+      return;
+    }
+    req.append(std::begin(buf), std::begin(buf) + nread);
+  }
+
+  auto resp = "HTTP/1.1 " + util::utos(status_code) +
+              " Status\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+  send_data(fd, ssl, reinterpret_cast<const uint8_t *>(resp.c_str()),
+            resp.size());
+}
+} // namespace
+
+namespace {
+struct Http2Backend {
+  std::string status_code;
+  bool responded;
+};
+} // namespace
+
+namespace {
+int on_frame_recv_callback(nghttp2_session *session,
+                           const nghttp2_frame *frame, void *user_data) {
+  auto backend = static_cast<Http2Backend *>(user_data);
+
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+
+  auto nva = std::array<nghttp2_nv, 1>{
+      {http2::make_nv_ls(":status", backend->status_code)}};
+
+  if (nghttp2_submit_response(session, frame->hd.stream_id, nva.data(),
+                              nva.size(), nullptr) != 0) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+
+  backend->responded = true;
+
+  return 0;
+}
+} // namespace
+
+namespace {
+void serve_http2(int fd, SSL *ssl, unsigned int status_code) {
+  Http2Backend backend{util::utos(status_code), false};
+
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_session_callbacks_new(&callbacks);
+  auto cb_del = defer(nghttp2_session_callbacks_del, callbacks);
+
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+                                                       on_frame_recv_callback);
+
+  nghttp2_session *session;
+  nghttp2_session_server_new(&session, callbacks, &backend);
+  auto session_del = defer(nghttp2_session_del, session);
+
+  nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, nullptr, 0);
+
+  std::array<uint8_t, 4_k> buf;
+
+  for (;;) {
+    for (;;) {
+      const uint8_t *data;
+      auto datalen = nghttp2_session_mem_send(session, &data);
+      if (datalen < 0) {
+        return;
+      }
+      if (datalen == 0) {
+        break;
+      }
+      if (!send_data(fd, ssl, data, datalen)) {
+        return;
+      }
+    }
+
+    if (backend.responded) {
+      return;
+    }
+
+    auto nread = recv_data(fd, ssl, buf.data(), buf.size());
+    if (nread <= 0) {
+      return;
+    }
+
+    if (nghttp2_session_mem_recv(session, buf.data(), nread) < 0) {
+      return;
+    }
+  }
+}
+} // namespace
+
+namespace {
+// Stand-in backend.  It accepts one connection from |lfd| for each
+// of |status_codes|, and responds to the health check request with
+// it.  If |ssl_ctx| is not nullptr, TLS is used.
+void serve(int lfd, SSL_CTX *ssl_ctx, shrpx_proto proto,
+           std::vector<unsigned int> status_codes) {
+  for (auto status_code : status_codes) {
+    auto fd = accept(lfd, nullptr, nullptr);
+    if (fd == -1) {
+      return;
+    }
+
+    auto fd_del = defer(close, fd);
+
+    SSL *ssl = nullptr;
+
+    if (ssl_ctx) {
+      ssl = SSL_new(ssl_ctx);
+      SSL_set_fd(ssl, fd);
+    }
+
+    auto ssl_del = defer([ssl]() {
+      if (ssl) {
+        SSL_free(ssl);
+      }
+    });
+
+    if (ssl && SSL_accept(ssl) != 1) {
+      continue;
+    }
+
+    if (proto == PROTO_HTTP2) {
+      serve_http2(fd, ssl, status_code);
+    } else {
+      serve_http1(fd, ssl, status_code);
+    }
+
+    // Wait for the client to close the connection.  Closing it with
+    // unread data resets the connection, and the client might lose
+    // the response.
+    std::array<uint8_t, 4_k> buf;
+    while (recv_data(fd, ssl, buf.data(), buf.size()) > 0)
+      ;
+  }
+}
+} // namespace
+
+namespace {
+// Performs health check against the stand-in backend which responds
+// with |status_codes| in order, and returns the health state after
+// each check.
+std::vector<bool> check_backend(SSL_CTX *ssl_ctx, SSL_CTX *backend_ssl_ctx,
+                                shrpx_proto proto,
+                                const std::vector<unsigned int> &status_codes) {
+  auto lfd = socket(AF_INET, SOCK_STREAM, 0);
+  auto lfd_del = defer(close, lfd);
+
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t sinlen = sizeof(sin);
+
+  CU_ASSERT_FATAL(0 == bind(lfd, reinterpret_cast<sockaddr *>(&sin),
+                            sizeof(sin)));
+  CU_ASSERT_FATAL(0 == listen(lfd, 16));
+  CU_ASSERT_FATAL(0 == getsockname(lfd, reinterpret_cast<sockaddr *>(&sin),
+                                   &sinlen));
+
+  DownstreamAddrConfig addr{};
+  addr.addr.su.in = sin;
+  addr.addr.len = sizeof(sin);
+  addr.host = ImmutableString::from_lit("127.0.0.1");
+  addr.port = ntohs(sin.sin_port);
+  addr.hostport = ImmutableString(
+      util::make_hostport(StringRef{addr.host}, addr.port));
+  addr.health_check = HEALTH_CHECK_HTTP;
+  addr.health_check_path = ImmutableString::from_lit("/health");
+
+  auto backend =
+      std::thread(serve, lfd, backend_ssl_ctx, proto, status_codes);
+
+  auto loop = ev_loop_new(0);
+  auto loop_del = defer(ev_loop_destroy, loop);
+
+  MemchunkPool mcpool;
+
+  std::vector<bool> res;
+
+  {
+    HealthChecker hc(loop, ssl_ctx, &mcpool, addr, proto);
+
+    for (size_t i = 0; i < status_codes.size(); ++i) {
+      hc.check();
+
+      while (hc.get_check_running()) {
+        ev_run(loop, EVRUN_ONCE);
+      }
+
+      res.push_back(hc.get_health()->load());
+    }
+  }
+
+  backend.join();
+
+  return res;
+}
+} // namespace
+
+namespace {
+// Sets health check parameters so that the next check starts only
+// when the test tells to do.  Returns the function to restore them.
+std::function<void()> setup_config() {
+  auto config = mod_config();
+  auto health_check = config->conn.downstream.health_check;
+  auto insecure = config->tls.insecure;
+
+  config->conn.downstream.health_check.interval = 3600.;
+  config->conn.downstream.health_check.timeout = 10.;
+  config->tls.insecure = true;
+
+  return [config, health_check, insecure]() {
+    config->conn.downstream.health_check = health_check;
+    config->tls.insecure = insecure;
+  };
+}
+} // namespace
+
+void test_shrpx_health_monitor_http1(void) {
+  auto restore = setup_config();
+  auto restore_del = defer(restore);
+
+  // 2 consecutive failures make the address unhealthy, and 2
+  // consecutive successes make it healthy again.
+  CU_ASSERT((std::vector<bool>{true, false, false, true}) ==
+            check_backend(nullptr, nullptr, PROTO_HTTP1,
+                          {503, 503, 200, 200}));
+
+  // 3xx is also a success.
+  CU_ASSERT((std::vector<bool>{true, true}) ==
+            check_backend(nullptr, nullptr, PROTO_HTTP1, {302, 200}));
+}
+
+void test_shrpx_health_monitor_http2(void) {
+  auto restore = setup_config();
+  auto restore_del = defer(restore);
+
+  auto sigpipe = signal(SIGPIPE, SIG_IGN);
+  auto sigpipe_del = defer(signal, SIGPIPE, sigpipe);
+
+  CU_ASSERT((std::vector<bool>{true, false, false, true}) ==
+            check_backend(nullptr, nullptr, PROTO_HTTP2,
+                          {503, 503, 200, 200}));
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  auto ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+  auto h2_backend_ssl_ctx = create_server_ssl_ctx(true);
+  auto h2_backend_ssl_ctx_del = defer(SSL_CTX_free, h2_backend_ssl_ctx);
+
+  CU_ASSERT((std::vector<bool>{true, false, false, true}) ==
+            check_backend(ssl_ctx, h2_backend_ssl_ctx, PROTO_HTTP2,
+                          {503, 503, 200, 200}));
+
+  // Backend which does not negotiate h2 is unhealthy, even if it
+  // would respond with 200.
+  auto h1_backend_ssl_ctx = create_server_ssl_ctx(false);
+  auto h1_backend_ssl_ctx_del = defer(SSL_CTX_free, h1_backend_ssl_ctx);
+
+  CU_ASSERT((std::vector<bool>{true, false}) ==
+            check_backend(ssl_ctx, h1_backend_ssl_ctx, PROTO_HTTP2,
+                          {200, 200}));
+#endif // OPENSSL_VERSION_NUMBER >= 0x10002000L
+}
+
+} // namespace shrpx
@@ -0,0 +1,216 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_hedge_upstream.h"
+
+#include "shrpx_client_handler.h"
+#include "shrpx_downstream.h"
+#include "shrpx_downstream_connection.h"
+#include "shrpx_error.h"
+#include "shrpx_log.h"
+
+namespace shrpx {
+
+HedgeUpstream::HedgeUpstream(Downstream *downstream)
+    : downstream_(downstream) {}
+
+HedgeUpstream::~HedgeUpstream() {}
+
+int HedgeUpstream::on_read() { return 0; }
+
+int HedgeUpstream::on_write() { return 0; }
+
+int HedgeUpstream::on_downstream_abort_request(Downstream *downstream,
+                                               unsigned int status_code) {
+  if (LOG_ENABLED(INFO)) {
+    DLOG(INFO, downstream) << "Hedged request could not be sent";
+  }
+
+  // We may be called while Http2Session iterates its downstream
+  // connections, so do not delete the connection here.  It is
+  // deleted along with downstream_.
+  downstream->set_response_state(Downstream::MSG_RESET);
+
+  return 0;
+}
+
+int HedgeUpstream::downstream_read(DownstreamConnection *dconn) {
+  auto downstream = dconn->get_downstream();
+
+  switch (downstream->get_response_state()) {
+  case Downstream::MSG_RESET:
+  case Downstream::MSG_BAD_HEADER:
+    downstream_->cancel_hedged_request();
+    // dconn was deleted
+    return 0;
+  }
+
+  auto rv = dconn->on_read();
+
+  if (downstream_->get_downstream_connection() != dconn) {
+    if (rv != 0) {
+      if (LOG_ENABLED(INFO)) {
+        DCLOG(INFO, dconn) << "Hedged request failed";
+      }
+      downstream_->cancel_hedged_request();
+      // dconn was deleted
+    }
+
+    return 0;
+  }
+
+  // The response has started while reading, and downstream_ took
+  // over dconn.  Handle the rest just like its upstream does after
+  // reading.
+  auto upstream = downstream_->get_upstream();
+  auto handler = upstream->get_client_handler();
+
+  if (rv == SHRPX_ERR_EOF) {
+    return upstream->downstream_eof(dconn);
+  }
+
+  if (rv == SHRPX_ERR_DCONN_CANCELED) {
+    downstream_->pop_downstream_connection();
+    handler->signal_write();
+    return 0;
+  }
+
+  if (rv != 0) {
+    return upstream->downstream_error(dconn, Downstream::EVENT_ERROR);
+  }
+
+  if (downstream_->can_detach_downstream_connection()) {
+    // Keep-alive
+    downstream_->detach_downstream_connection();
+  }
+
+  handler->signal_write();
+
+  return 0;
+}
+
+int HedgeUpstream::downstream_write(DownstreamConnection *dconn) {
+  if (dconn->on_write() != 0) {
+    if (LOG_ENABLED(INFO)) {
+      DCLOG(INFO, dconn) << "Hedged request failed";
+    }
+    downstream_->cancel_hedged_request();
+    // dconn was deleted
+  }
+
+  return 0;
+}
+
+int HedgeUpstream::downstream_eof(DownstreamConnection *dconn) {
+  if (LOG_ENABLED(INFO)) {
+    DCLOG(INFO, dconn) << "EOF before response to hedged request";
+  }
+
+  downstream_->cancel_hedged_request();
+  // dconn was deleted
+
+  return 0;
+}
+
+int HedgeUpstream::downstream_error(DownstreamConnection *dconn, int events) {
+  if (LOG_ENABLED(INFO)) {
+    DCLOG(INFO, dconn) << "Hedged request failed; events=" << events;
+  }
+
+  downstream_->cancel_hedged_request();
+  // dconn was deleted
+
+  return 0;
+}
+
+ClientHandler *HedgeUpstream::get_client_handler() const {
+  return downstream_->get_upstream()->get_client_handler();
+}
+
+// The response is delivered to downstream_ after it takes over the
+// downstream connection, so the following functions are not called
+// for the hedged request.
+
+int HedgeUpstream::on_downstream_header_complete(Downstream *downstream) {
+  return -1;
+}
+
+int HedgeUpstream::on_downstream_body(Downstream *downstream,
+                                      const uint8_t *data, size_t len,
+                                      bool flush) {
+  return -1;
+}
+
+int HedgeUpstream::on_downstream_body_complete(Downstream *downstream) {
+  return -1;
+}
+
+void HedgeUpstream::on_handler_delete() {}
+
+int HedgeUpstream::on_downstream_reset(bool no_retry) { return 0; }
+
+void HedgeUpstream::pause_read(IOCtrlReason reason) {}
+
+int HedgeUpstream::resume_read(IOCtrlReason reason, Downstream *downstream,
+                               size_t consumed) {
+  return 0;
+}
+
+int HedgeUpstream::send_reply(Downstream *downstream, const struct iovec *iov,
+                              int iovcnt) {
+  return -1;
+}
+
+int HedgeUpstream::initiate_push(Downstream *downstream,
+                                 const StringRef &uri) {
+  return 0;
+}
+
+int HedgeUpstream::response_riovec(struct iovec *iov, int iovcnt) const {
+  return 0;
+}
+
+void HedgeUpstream::response_drain(size_t n) {}
+
+bool HedgeUpstream::response_empty() const { return true; }
+
+Downstream *
+HedgeUpstream::on_downstream_push_promise(Downstream *downstream,
+                                          int32_t promised_stream_id) {
+  return nullptr;
+}
+
+int HedgeUpstream::on_downstream_push_promise_complete(
+    Downstream *downstream, Downstream *promised_downstream) {
+  return -1;
+}
+
+bool HedgeUpstream::push_enabled() const { return false; }
+
+void HedgeUpstream::cancel_premature_downstream(
+    Downstream *promised_downstream) {}
+
+void HedgeUpstream::start_downstream(Downstream *downstream) {}
+
+} // namespace shrpx
@@ -465,6 +465,9 @@ int Http2DownstreamConnection::push_request_headers() {
     return -1;
   }
 
+  start_request_tracking(http2session_->get_addr(),
+                         ev_now(http2session_->get_loop()));
+
   downstream_->reset_downstream_wtimer();
 
   http2session_->signal_write();
@@ -573,4 +576,8 @@ Http2DownstreamConnection::get_downstream_addr_group() const {
   return http2session_->get_downstream_addr_group();
 }
 
+DownstreamAddr *Http2DownstreamConnection::get_addr() const {
+  return http2session_->get_addr();
+}
+
 } // namespace shrpx
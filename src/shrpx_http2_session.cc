@@ -166,19 +166,22 @@ void writecb(struct ev_loop *loop, ev_io *w, int revents) {
 } // namespace
 
 Http2Session::Http2Session(struct ev_loop *loop, SSL_CTX *ssl_ctx,
-                           Worker *worker, DownstreamAddrGroup *group)
+                           Worker *worker,
+                           const std::shared_ptr<DownstreamAddrGroup> &group)
     : dlnext(nullptr),
       dlprev(nullptr),
       conn_(loop, -1, nullptr, worker->get_mcpool(),
             get_config()->conn.downstream.timeout.write,
             get_config()->conn.downstream.timeout.read, {}, {}, writecb, readcb,
             timeoutcb, this, get_config()->tls.dyn_rec.warmup_threshold,
-            get_config()->tls.dyn_rec.idle_timeout, PROTO_HTTP2),
+            get_config()->tls.dyn_rec.idle_timeout,
+            get_config()->tls.dyn_rec.adaptive, PROTO_HTTP2),
       wb_(worker->get_mcpool()),
       worker_(worker),
       ssl_ctx_(ssl_ctx),
       group_(group),
       addr_(nullptr),
+      pinned_addr_(nullptr),
       session_(nullptr),
       state_(DISCONNECTED),
       connection_check_state_(CONNECTION_CHECK_NONE),
@@ -293,40 +296,22 @@ int Http2Session::initiate_connection() {
       return -1;
     }
 
-    auto &next_downstream = shared_addr->next;
-    auto end = next_downstream;
-
-    for (;;) {
-      auto &addr = addrs[next_downstream];
-
-      if (++next_downstream >= addrs.size()) {
-        next_downstream = 0;
-      }
-
-      auto &connect_blocker = addr.connect_blocker;
-
-      if (connect_blocker->blocked()) {
-        if (LOG_ENABLED(INFO)) {
-          SSLOG(INFO, this) << "Backend server "
-                            << util::to_numeric_addr(&addr.addr)
-                            << " was not available temporarily";
-        }
-
-        if (end == next_downstream) {
-          return -1;
-        }
-
-        continue;
-      }
-
+    if (pinned_addr_ && downstream_addr_available(*pinned_addr_)) {
+      addr_ = pinned_addr_;
+    } else {
+      addr_ = select_downstream_addr(shared_addr.get(), worker_->get_randgen(),
+                                     ev_now(conn_.loop));
+    }
+    if (!addr_) {
       if (LOG_ENABLED(INFO)) {
-        SSLOG(INFO, this) << "Using downstream address idx=" << next_downstream
-                          << " out of " << addrs.size();
+        SSLOG(INFO, this) << "No backend server is available";
       }
+      return -1;
+    }
 
-      addr_ = &addr;
-
-      break;
+    if (LOG_ENABLED(INFO)) {
+      SSLOG(INFO, this) << "Using downstream address idx="
+                        << addr_ - addrs.data() << " out of " << addrs.size();
     }
   }
 
@@ -353,6 +338,8 @@ int Http2Session::initiate_connection() {
 
     worker_blocker->on_success();
 
+    worker_->get_metrics()->backend_connects.add();
+
     rv = connect(conn_.fd, &proxy.addr.su.sa, proxy.addr.len);
     if (rv != 0 && errno != EINPROGRESS) {
       auto error = errno;
@@ -440,6 +427,8 @@ int Http2Session::initiate_connection() {
 
         worker_blocker->on_success();
 
+        worker_->get_metrics()->backend_connects.add();
+
         rv = connect(conn_.fd,
                      // TODO maybe not thread-safe?
                      const_cast<sockaddr *>(&addr_->addr.su.sa),
@@ -479,6 +468,8 @@ int Http2Session::initiate_connection() {
 
         worker_blocker->on_success();
 
+        worker_->get_metrics()->backend_connects.add();
+
         rv = connect(conn_.fd, const_cast<sockaddr *>(&addr_->addr.su.sa),
                      addr_->addr.len);
         if (rv != 0 && errno != EINPROGRESS) {
@@ -640,6 +631,17 @@ void Http2Session::remove_downstream_connection(
     SSLOG(INFO, this) << "Remove downstream";
   }
 
+  if (group_->shared_addr->retired) {
+    // Backend configuration was reloaded, and this session is not
+    // used for new requests.  Close it when the last request is
+    // done.
+    if (dconns_.empty() && state_ == CONNECTED &&
+        terminate_session(NGHTTP2_NO_ERROR) == 0) {
+      signal_write();
+    }
+    return;
+  }
+
   if (!in_freelist() && !max_concurrency_reached()) {
     if (LOG_ENABLED(INFO)) {
       SSLOG(INFO, this) << "Append to Http2Session freelist";
@@ -727,6 +729,30 @@ void call_downstream_readcb(Http2Session *http2session,
 }
 } // namespace
 
+namespace {
+// Sends the request of |downstream|, whose stream was closed before
+// response header was received, to another backend address.  This
+// function returns true if the request was handled, and the stream
+// must not be processed further.
+bool retry_closed_stream(Downstream *downstream) {
+  auto rv = downstream->retry_on_another_addr();
+  if (rv == 1) {
+    return false;
+  }
+
+  auto handler = downstream->get_upstream()->get_client_handler();
+
+  if (rv == -1) {
+    delete handler;
+    return true;
+  }
+
+  handler->signal_write();
+
+  return true;
+}
+} // namespace
+
 namespace {
 int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
                              uint32_t error_code, void *user_data) {
@@ -749,6 +775,8 @@ int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
     if (downstream && downstream->get_downstream_stream_id() == stream_id) {
       auto upstream = downstream->get_upstream();
 
+      dconn->finish_request_tracking();
+
       if (downstream->get_downstream_stream_id() % 2 == 0 &&
           downstream->get_request_state() == Downstream::INITIAL) {
         // Downstream is canceled in backend before it is submitted in
@@ -757,6 +785,10 @@ int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
         // This will avoid to send RST_STREAM to backend
         downstream->set_response_state(Downstream::MSG_RESET);
         upstream->cancel_premature_downstream(downstream);
+      } else if (downstream->get_response_state() == Downstream::INITIAL &&
+                 retry_closed_stream(downstream)) {
+        // The request was sent to another backend address, or the
+        // client handler was deleted.
       } else {
         if (downstream->get_upgraded() &&
             downstream->get_response_state() == Downstream::HEADER_COMPLETE) {
@@ -938,6 +970,9 @@ int on_begin_headers_callback(nghttp2_session *session,
                                       NGHTTP2_INTERNAL_ERROR);
       return 0;
     }
+    // If this is the response to the hedged request, the original
+    // request takes over sd->dconn.
+    downstream->claim_response();
     return 0;
   }
   case NGHTTP2_PUSH_PROMISE: {
@@ -1018,6 +1053,9 @@ int on_response_headers(Http2Session *http2session, Downstream *downstream,
     return 0;
   }
 
+  downstream->get_downstream_connection()->record_response_latency(
+      ev_now(http2session->get_loop()));
+
   downstream->set_response_state(Downstream::HEADER_COMPLETE);
   downstream->check_upgrade_fulfilled();
 
@@ -1920,13 +1958,13 @@ int Http2Session::write_tls() {
 
   ERR_clear_error();
 
-  struct iovec iov;
+  std::array<struct iovec, 2> iov;
 
   for (;;) {
     if (wb_.rleft() > 0) {
-      auto iovcnt = wb_.riovec(&iov, 1);
-      assert(iovcnt == 1);
-      auto nwrite = conn_.write_tls(iov.iov_base, iov.iov_len);
+      auto iovcnt = wb_.riovec(iov.data(), iov.size());
+      assert(iovcnt > 0);
+      auto nwrite = conn_.writev_tls(iov.data(), iovcnt);
 
       if (nwrite == 0) {
         return 0;
@@ -1970,6 +2008,14 @@ bool Http2Session::should_hard_fail() const {
 
 DownstreamAddr *Http2Session::get_addr() const { return addr_; }
 
+void Http2Session::set_pinned_addr(DownstreamAddr *addr) {
+  pinned_addr_ = addr;
+}
+
+DownstreamAddr *Http2Session::get_pinned_addr() const {
+  return pinned_addr_;
+}
+
 int Http2Session::handle_downstream_push_promise(Downstream *downstream,
                                                  int32_t promised_stream_id) {
   auto upstream = downstream->get_upstream();
@@ -2088,8 +2134,27 @@ bool Http2Session::max_concurrency_reached(size_t extra) const {
                  session_, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
 }
 
+size_t Http2Session::get_num_available_streams() const {
+  size_t max_streams;
+
+  if (!session_) {
+    max_streams = 100;
+  } else if (!nghttp2_session_check_request_allowed(session_)) {
+    return 0;
+  } else {
+    max_streams = nghttp2_session_get_remote_settings(
+        session_, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+  }
+
+  if (dconns_.size() >= max_streams) {
+    return 0;
+  }
+
+  return max_streams - dconns_.size();
+}
+
 DownstreamAddrGroup *Http2Session::get_downstream_addr_group() const {
-  return group_;
+  return group_.get();
 }
 
 } // namespace shrpx
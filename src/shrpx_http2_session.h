@@ -59,7 +59,7 @@ struct StreamData {
 class Http2Session {
 public:
   Http2Session(struct ev_loop *loop, SSL_CTX *ssl_ctx, Worker *worker,
-               DownstreamAddrGroup *group);
+               const std::shared_ptr<DownstreamAddrGroup> &group);
   ~Http2Session();
 
   // If hard is true, all pending requests are abandoned and
@@ -149,6 +149,13 @@ public:
 
   DownstreamAddr *get_addr() const;
 
+  // Sets the address this session should connect to, which is
+  // selected per request by session affinity or weighted load
+  // balancing.  If it is not available at connection time, the
+  // address is chosen by load balancing policy as usual.
+  void set_pinned_addr(DownstreamAddr *addr);
+  DownstreamAddr *get_pinned_addr() const;
+
   DownstreamAddrGroup *get_downstream_addr_group() const;
 
   int handle_downstream_push_promise(Downstream *downstream,
@@ -171,6 +178,9 @@ public:
   // number of current concurrent streams when comparing against
   // server initiated concurrency limit.
   bool max_concurrency_reached(size_t extra = 0) const;
+  // Returns the number of streams this session can accept in
+  // addition to the current ones.
+  size_t get_num_available_streams() const;
 
   enum {
     // Disconnected
@@ -221,9 +231,14 @@ private:
   Worker *worker_;
   // NULL if no TLS is configured
   SSL_CTX *ssl_ctx_;
-  DownstreamAddrGroup *group_;
+  // The group this session belongs to.  This keeps the group alive
+  // after backend configuration is reloaded.
+  std::shared_ptr<DownstreamAddrGroup> group_;
   // Address of remote endpoint
   DownstreamAddr *addr_;
+  // Address pinned by session affinity or weighted load balancing,
+  // or nullptr
+  DownstreamAddr *pinned_addr_;
   nghttp2_session *session_;
   int state_;
   int connection_check_state_;
@@ -239,6 +239,8 @@ int on_begin_headers_callback(nghttp2_session *session,
 
   auto handler = upstream->get_client_handler();
 
+  handler->get_worker()->get_metrics()->streams.add();
+
   auto downstream = make_unique<Downstream>(upstream, handler->get_mcpool(),
                                             frame->hd.stream_id);
   nghttp2_session_set_stream_user_data(session, frame->hd.stream_id,
@@ -367,6 +369,22 @@ int Http2Upstream::on_request_headers(Downstream *downstream,
     return 0;
   }
 
+  auto rv = handler_->lookup_response_cache(downstream);
+  if (rv != 0) {
+    if (rv == -1 && error_reply(downstream, 500) != 0) {
+      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
+  rv = handler_->acquire_concurrency_limit(downstream);
+  if (rv != 0) {
+    if (rv == -1 && error_reply(downstream, 503) != 0) {
+      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+
   start_downstream(downstream);
 
   return 0;
@@ -724,7 +742,8 @@ int send_data_callback(nghttp2_session *session, nghttp2_frame *frame,
   // data transferred.
   downstream->response_sent_body_length += length;
 
-  return wb->rleft() >= MAX_BUFFER_SIZE ? NGHTTP2_ERR_PAUSE : 0;
+  return wb->rleft() >= upstream->get_max_buffer_size() ? NGHTTP2_ERR_PAUSE
+                                                        : 0;
 }
 } // namespace
 
@@ -854,10 +873,19 @@ Http2Upstream::Http2Upstream(ClientHandler *handler)
           !get_config()->http2_proxy),
       handler_(handler),
       session_(nullptr),
+      max_buffer_size_(MAX_BUFFER_SIZE),
       shutdown_handled_(false) {
 
   int rv;
 
+  auto notsent_lowat = get_config()->conn.upstream.tcp_notsent_lowat;
+  if (notsent_lowat > 0) {
+    // Do not serialize more than the watermark ahead of the socket.
+    // Otherwise, frames are committed in our buffer and high priority
+    // streams cannot overtake them.
+    max_buffer_size_ = std::min(max_buffer_size_, notsent_lowat);
+  }
+
   auto &http2conf = get_config()->http2;
 
   rv = nghttp2_session_server_new2(&session_, http2conf.upstream.callbacks,
@@ -957,7 +985,7 @@ int Http2Upstream::on_read() {
 // After this function call, downstream may be deleted.
 int Http2Upstream::on_write() {
   for (;;) {
-    if (wb_.rleft() >= MAX_BUFFER_SIZE) {
+    if (wb_.rleft() >= max_buffer_size_) {
       return 0;
     }
 
@@ -988,6 +1016,8 @@ int Http2Upstream::on_write() {
 
 ClientHandler *Http2Upstream::get_client_handler() const { return handler_; }
 
+size_t Http2Upstream::get_max_buffer_size() const { return max_buffer_size_; }
+
 int Http2Upstream::downstream_read(DownstreamConnection *dconn) {
   auto downstream = dconn->get_downstream();
 
@@ -1060,6 +1090,18 @@ int Http2Upstream::downstream_eof(DownstreamConnection *dconn) {
     DCLOG(INFO, dconn) << "EOF. stream_id=" << downstream->get_stream_id();
   }
 
+  if (downstream->get_response_state() == Downstream::INITIAL) {
+    auto rv = downstream->retry_on_another_addr();
+    if (rv == -1) {
+      return -1;
+    }
+    if (rv == 0) {
+      // dconn was deleted
+      handler_->signal_write();
+      return 0;
+    }
+  }
+
   // Delete downstream connection. If we don't delete it here, it will
   // be pooled in on_stream_close_callback.
   downstream->pop_downstream_connection();
@@ -1104,6 +1146,18 @@ int Http2Upstream::downstream_error(DownstreamConnection *dconn, int events) {
     }
   }
 
+  if (downstream->get_response_state() == Downstream::INITIAL) {
+    auto rv = downstream->retry_on_another_addr();
+    if (rv == -1) {
+      return -1;
+    }
+    if (rv == 0) {
+      // dconn was deleted
+      handler_->signal_write();
+      return 0;
+    }
+  }
+
   // Delete downstream connection. If we don't delete it here, it will
   // be pooled in on_stream_close_callback.
   downstream->pop_downstream_connection();
@@ -1219,13 +1273,19 @@ ssize_t downstream_data_read_callback(nghttp2_session *session,
 }
 } // namespace
 
-int Http2Upstream::send_reply(Downstream *downstream, const uint8_t *body,
-                              size_t bodylen) {
+int Http2Upstream::send_reply(Downstream *downstream,
+                              const struct iovec *iov, int iovcnt) {
   int rv;
 
   nghttp2_data_provider data_prd, *data_prd_ptr = nullptr;
 
-  if (bodylen) {
+  auto buf = downstream->get_response_buf();
+
+  for (int i = 0; i < iovcnt; ++i) {
+    buf->append(iov[i].iov_base, iov[i].iov_len);
+  }
+
+  if (buf->rleft()) {
     data_prd.source.ptr = downstream;
     data_prd.read_callback = downstream_data_read_callback;
     data_prd_ptr = &data_prd;
@@ -1278,10 +1338,6 @@ int Http2Upstream::send_reply(Downstream *downstream, const uint8_t *body,
     return -1;
   }
 
-  auto buf = downstream->get_response_buf();
-
-  buf->append(body, bodylen);
-
   downstream->set_response_state(Downstream::MSG_COMPLETE);
 
   return 0;
@@ -1392,6 +1448,8 @@ int Http2Upstream::on_downstream_header_complete(Downstream *downstream) {
   }
 #endif // HAVE_MRUBY
 
+  downstream->prepare_response_cache_store();
+
   auto nva = std::vector<nghttp2_nv>();
   // 4 means :status and possible server, via and x-http2-push header
   // field.
@@ -1542,6 +1600,8 @@ int Http2Upstream::on_downstream_body(Downstream *downstream,
   auto body = downstream->get_response_buf();
   body->append(data, len);
 
+  downstream->add_response_cache_body(data, len);
+
   if (flush) {
     nghttp2_session_resume_data(session_, downstream->get_stream_id());
 
@@ -1628,6 +1688,8 @@ int Http2Upstream::on_downstream_body_complete(Downstream *downstream) {
     return 0;
   }
 
+  downstream->finish_response_cache_store();
+
   nghttp2_session_resume_data(session_, downstream->get_stream_id());
   downstream->ensure_upstream_wtimer();
 
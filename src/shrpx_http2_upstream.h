@@ -79,8 +79,8 @@ public:
 
   virtual void on_handler_delete();
   virtual int on_downstream_reset(bool no_retry);
-  virtual int send_reply(Downstream *downstream, const uint8_t *body,
-                         size_t bodylen);
+  virtual int send_reply(Downstream *downstream, const struct iovec *iov,
+                         int iovcnt);
   virtual int initiate_push(Downstream *downstream, const StringRef &uri);
   virtual int response_riovec(struct iovec *iov, int iovcnt) const;
   virtual void response_drain(size_t n);
@@ -93,6 +93,7 @@ public:
                                       Downstream *promised_downstream);
   virtual bool push_enabled() const;
   virtual void cancel_premature_downstream(Downstream *promised_downstream);
+  virtual void start_downstream(Downstream *downstream);
 
   bool get_flow_control() const;
   // Perform HTTP/2 upgrade from |upstream|. On success, this object
@@ -104,7 +105,6 @@ public:
   int consume(int32_t stream_id, size_t len);
   void log_response_headers(Downstream *downstream,
                             const std::vector<nghttp2_nv> &nva) const;
-  void start_downstream(Downstream *downstream);
   void initiate_downstream(Downstream *downstream);
 
   void submit_goaway();
@@ -118,6 +118,10 @@ public:
 
   DefaultMemchunks *get_response_buf();
 
+  // Returns the number of bytes we buffer in wb_ before we stop
+  // serializing frames from nghttp2 session.
+  size_t get_max_buffer_size() const;
+
   // Changes stream priority of |downstream|, which is assumed to be a
   // pushed stream.
   int adjust_pushed_stream_priority(Downstream *downstream);
@@ -131,6 +135,7 @@ private:
   ev_prepare prep_;
   ClientHandler *handler_;
   nghttp2_session *session_;
+  size_t max_buffer_size_;
   bool flow_control_;
   bool shutdown_handled_;
 };
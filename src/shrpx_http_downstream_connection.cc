@@ -102,7 +102,13 @@ void connectcb(struct ev_loop *loop, ev_io *w, int revents) {
   auto upstream = downstream->get_upstream();
   auto handler = upstream->get_client_handler();
   if (dconn->connected() != 0) {
-    if (upstream->on_downstream_abort_request(downstream, 503) != 0) {
+    auto rv = downstream->retry_on_another_addr();
+    if (rv == 0) {
+      // dconn was deleted
+      return;
+    }
+    if (rv == -1 ||
+        upstream->on_downstream_abort_request(downstream, 503) != 0) {
       delete handler;
     }
     return;
@@ -111,20 +117,22 @@ void connectcb(struct ev_loop *loop, ev_io *w, int revents) {
 }
 } // namespace
 
-HttpDownstreamConnection::HttpDownstreamConnection(DownstreamAddrGroup *group,
-                                                   struct ev_loop *loop,
-                                                   Worker *worker)
+HttpDownstreamConnection::HttpDownstreamConnection(
+    const std::shared_ptr<DownstreamAddrGroup> &group, struct ev_loop *loop,
+    Worker *worker)
     : conn_(loop, -1, nullptr, worker->get_mcpool(),
             get_config()->conn.downstream.timeout.write,
             get_config()->conn.downstream.timeout.read, {}, {}, connectcb,
             readcb, timeoutcb, this, get_config()->tls.dyn_rec.warmup_threshold,
-            get_config()->tls.dyn_rec.idle_timeout, PROTO_HTTP1),
+            get_config()->tls.dyn_rec.idle_timeout,
+            get_config()->tls.dyn_rec.adaptive, PROTO_HTTP1),
       do_read_(&HttpDownstreamConnection::noop),
       do_write_(&HttpDownstreamConnection::noop),
       worker_(worker),
       ssl_ctx_(worker->get_cl_ssl_ctx()),
       group_(group),
       addr_(nullptr),
+      pinned_addr_(nullptr),
       ioctrl_(&conn_.rlimit),
       response_htp_{0} {}
 
@@ -159,32 +167,27 @@ int HttpDownstreamConnection::attach_downstream(Downstream *downstream) {
     }
 
     auto &shared_addr = group_->shared_addr;
-    auto &addrs = shared_addr->addrs;
-    auto &next_downstream = shared_addr->next;
-    auto end = next_downstream;
     for (;;) {
-      auto &addr = addrs[next_downstream];
-
-      if (++next_downstream >= addrs.size()) {
-        next_downstream = 0;
+      DownstreamAddr *paddr;
+      if (pinned_addr_ && downstream_addr_available(*pinned_addr_)) {
+        paddr = pinned_addr_;
+      } else if (shared_addr->affinity != AFFINITY_NONE) {
+        paddr = select_affinity_downstream_addr(
+            shared_addr.get(), downstream->get_affinity_hash());
+      } else {
+        paddr = select_downstream_addr(
+            shared_addr.get(), worker_->get_randgen(), ev_now(conn_.loop));
       }
-
-      auto &connect_blocker = addr.connect_blocker;
-
-      if (connect_blocker->blocked()) {
+      if (!paddr) {
         if (LOG_ENABLED(INFO)) {
-          DCLOG(INFO, this) << "Backend server "
-                            << util::to_numeric_addr(&addr.addr)
-                            << " was not available temporarily";
-        }
-
-        if (end == next_downstream) {
-          return SHRPX_ERR_NETWORK;
+          DCLOG(INFO, this) << "No backend server is available";
         }
-
-        continue;
+        return SHRPX_ERR_NETWORK;
       }
 
+      auto &addr = *paddr;
+      auto &connect_blocker = addr.connect_blocker;
+
       conn_.fd = util::create_nonblock_socket(addr.addr.su.storage.ss_family);
 
       if (conn_.fd == -1) {
@@ -200,6 +203,8 @@ int HttpDownstreamConnection::attach_downstream(Downstream *downstream) {
 
       worker_blocker->on_success();
 
+      worker_->get_metrics()->backend_connects.add();
+
       int rv;
       rv = connect(conn_.fd, &addr.addr.su.sa, addr.addr.len);
       if (rv != 0 && errno != EINPROGRESS) {
@@ -208,14 +213,12 @@ int HttpDownstreamConnection::attach_downstream(Downstream *downstream) {
                           << util::to_numeric_addr(&addr.addr)
                           << ", errno=" << error;
 
+        // This makes |addr| blocked, so that it is not selected
+        // again.
         connect_blocker->on_failure();
         close(conn_.fd);
         conn_.fd = -1;
 
-        if (end == next_downstream) {
-          return SHRPX_ERR_NETWORK;
-        }
-
         // Try again with the next downstream server
         continue;
       }
@@ -456,6 +459,8 @@ int HttpDownstreamConnection::push_request_headers() {
                       << downstream_->get_stream_id() << "\n" << nhdrs;
   }
 
+  start_request_tracking(addr_, ev_now(conn_.loop));
+
   signal_write();
 
   return 0;
@@ -539,6 +544,8 @@ void HttpDownstreamConnection::detach_downstream(Downstream *downstream) {
   }
   downstream_ = nullptr;
 
+  finish_request_tracking();
+
   ev_set_cb(&conn_.rev, idle_readcb);
   ioctrl_.force_resume_read();
 
@@ -550,6 +557,15 @@ void HttpDownstreamConnection::detach_downstream(Downstream *downstream) {
   ev_timer_stop(conn_.loop, &conn_.wt);
 }
 
+void HttpDownstreamConnection::reattach_downstream(Downstream *downstream) {
+  if (LOG_ENABLED(INFO)) {
+    DCLOG(INFO, this) << "Reattaching to DOWNSTREAM:" << downstream;
+  }
+
+  downstream_ = downstream;
+  response_htp_.data = downstream_;
+}
+
 void HttpDownstreamConnection::pause_read(IOCtrlReason reason) {
   ioctrl_.pause_read(reason);
 }
@@ -576,6 +592,10 @@ int htp_msg_begincb(http_parser *htp) {
     return -1;
   }
 
+  // If this is the response to the hedged request, the original
+  // request takes over this connection, and htp->data is updated.
+  downstream->claim_response();
+
   return 0;
 }
 } // namespace
@@ -618,6 +638,10 @@ int htp_hdrs_completecb(http_parser *htp) {
     return 1;
   }
 
+  auto dconn = downstream->get_downstream_connection();
+  dconn->record_response_latency(
+      ev_now(dconn->get_client_handler()->get_loop()));
+
   resp.connection_close = !http_should_keep_alive(htp);
   downstream->set_response_state(Downstream::HEADER_COMPLETE);
   downstream->inspect_http1_response();
@@ -787,6 +811,7 @@ int htp_msg_completecb(http_parser *htp) {
   }
 
   downstream->set_response_state(Downstream::MSG_COMPLETE);
+  downstream->get_downstream_connection()->finish_request_tracking();
   // Block reading another response message from (broken?)
   // server. This callback is not called if the connection is
   // tunneled.
@@ -945,12 +970,12 @@ int HttpDownstreamConnection::write_tls() {
   auto upstream = downstream_->get_upstream();
   auto input = downstream_->get_request_buf();
 
-  struct iovec iov;
+  std::array<struct iovec, 2> iov;
 
   while (input->rleft() > 0) {
-    auto iovcnt = input->riovec(&iov, 1);
-    assert(iovcnt == 1);
-    auto nwrite = conn_.write_tls(iov.iov_base, iov.iov_len);
+    auto iovcnt = input->riovec(iov.data(), iov.size());
+    assert(iovcnt > 0);
+    auto nwrite = conn_.writev_tls(iov.data(), iovcnt);
 
     if (nwrite == 0) {
       return 0;
@@ -1098,7 +1123,13 @@ int HttpDownstreamConnection::noop() { return 0; }
 
 DownstreamAddrGroup *
 HttpDownstreamConnection::get_downstream_addr_group() const {
-  return group_;
+  return group_.get();
+}
+
+DownstreamAddr *HttpDownstreamConnection::get_addr() const { return addr_; }
+
+void HttpDownstreamConnection::set_pinned_addr(DownstreamAddr *addr) {
+  pinned_addr_ = addr;
 }
 
 } // namespace shrpx
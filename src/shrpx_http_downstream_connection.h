@@ -42,11 +42,12 @@ struct DownstreamAddr;
 
 class HttpDownstreamConnection : public DownstreamConnection {
 public:
-  HttpDownstreamConnection(DownstreamAddrGroup *group, struct ev_loop *loop,
-                           Worker *worker);
+  HttpDownstreamConnection(const std::shared_ptr<DownstreamAddrGroup> &group,
+                           struct ev_loop *loop, Worker *worker);
   virtual ~HttpDownstreamConnection();
   virtual int attach_downstream(Downstream *downstream);
   virtual void detach_downstream(Downstream *downstream);
+  virtual void reattach_downstream(Downstream *downstream);
 
   virtual int push_request_headers();
   virtual int push_upload_data_chunk(const uint8_t *data, size_t datalen);
@@ -64,6 +65,11 @@ public:
   virtual bool poolable() const { return true; }
 
   virtual DownstreamAddrGroup *get_downstream_addr_group() const;
+  virtual DownstreamAddr *get_addr() const;
+
+  // Sets the address to connect to, which is selected per request by
+  // session affinity or weighted load balancing.
+  void set_pinned_addr(DownstreamAddr *addr);
 
   int read_clear();
   int write_clear();
@@ -84,9 +90,13 @@ private:
   Worker *worker_;
   // nullptr if TLS is not used.
   SSL_CTX *ssl_ctx_;
-  DownstreamAddrGroup *group_;
+  // The group this connection belongs to.  This keeps the group
+  // alive after backend configuration is reloaded.
+  std::shared_ptr<DownstreamAddrGroup> group_;
   // Address of remote endpoint
   DownstreamAddr *addr_;
+  // Address to connect to first, or nullptr
+  DownstreamAddr *pinned_addr_;
   IOControl ioctrl_;
   http_parser response_htp_;
 };
@@ -394,6 +394,27 @@ int htp_hdrs_completecb(http_parser *htp) {
     return 0;
   }
 
+  rv = handler->lookup_response_cache(downstream);
+  if (rv == -1) {
+    downstream->response().http_status = 500;
+    return -1;
+  }
+  if (rv != 0) {
+    // The response has been sent from cache, or the request waits
+    // for the response to the identical request.
+    return 0;
+  }
+
+  rv = handler->acquire_concurrency_limit(downstream);
+  if (rv == -1) {
+    downstream->response().http_status = 503;
+    return -1;
+  }
+  if (rv != 0) {
+    // The request waits for a free slot of concurrency limiter.
+    return 0;
+  }
+
   rv = downstream->attach_downstream_connection(
       handler->get_downstream_connection(downstream));
 
@@ -441,6 +462,15 @@ int htp_msg_completecb(http_parser *htp) {
   auto handler = upstream->get_client_handler();
   auto downstream = upstream->get_downstream();
   downstream->set_request_state(Downstream::MSG_COMPLETE);
+
+  if (downstream->cache_lock_waiting() ||
+      downstream->concurrency_limit_waiting()) {
+    // The request will be forwarded to backend, or the response will
+    // be sent from cache or as an error later.
+    http_parser_pause(htp, 1);
+    return 0;
+  }
+
   rv = downstream->end_upload_data();
   if (rv != 0) {
     if (downstream->get_response_state() == Downstream::MSG_COMPLETE) {
@@ -732,6 +762,7 @@ int HttpsUpstream::downstream_write(DownstreamConnection *dconn) {
 
 int HttpsUpstream::downstream_eof(DownstreamConnection *dconn) {
   auto downstream = dconn->get_downstream();
+  int rv;
 
   if (LOG_ENABLED(INFO)) {
     DCLOG(INFO, dconn) << "EOF";
@@ -754,6 +785,15 @@ int HttpsUpstream::downstream_eof(DownstreamConnection *dconn) {
   }
 
   if (downstream->get_response_state() == Downstream::INITIAL) {
+    rv = downstream->retry_on_another_addr();
+    if (rv == -1) {
+      return -1;
+    }
+    if (rv == 0) {
+      // dconn was deleted
+      goto end;
+    }
+
     // we did not send any response headers, so we can reply error
     // message.
     if (LOG_ENABLED(INFO)) {
@@ -786,6 +826,16 @@ int HttpsUpstream::downstream_error(DownstreamConnection *dconn, int events) {
     return -1;
   }
 
+  auto rv = downstream->retry_on_another_addr();
+  if (rv == -1) {
+    return -1;
+  }
+  if (rv == 0) {
+    // dconn was deleted
+    handler_->signal_write();
+    return 0;
+  }
+
   unsigned int status;
   if (events & Downstream::EVENT_TIMEOUT) {
     status = 504;
@@ -800,8 +850,8 @@ int HttpsUpstream::downstream_error(DownstreamConnection *dconn, int events) {
   return 0;
 }
 
-int HttpsUpstream::send_reply(Downstream *downstream, const uint8_t *body,
-                              size_t bodylen) {
+int HttpsUpstream::send_reply(Downstream *downstream,
+                              const struct iovec *iov, int iovcnt) {
   const auto &req = downstream->request();
   auto &resp = downstream->response();
   auto &balloc = downstream->get_block_allocator();
@@ -854,9 +904,10 @@ int HttpsUpstream::send_reply(Downstream *downstream, const uint8_t *body,
 
   output->append("\r\n");
 
-  output->append(body, bodylen);
-
-  downstream->response_sent_body_length += bodylen;
+  for (int i = 0; i < iovcnt; ++i) {
+    output->append(iov[i].iov_base, iov[i].iov_len);
+    downstream->response_sent_body_length += iov[i].iov_len;
+  }
   downstream->set_response_state(Downstream::MSG_COMPLETE);
 
   return 0;
@@ -982,6 +1033,8 @@ int HttpsUpstream::on_downstream_header_complete(Downstream *downstream) {
         get_client_handler()->get_upstream_scheme());
   }
 
+  downstream->prepare_response_cache_store();
+
   http2::build_http1_headers_from_headers(buf, resp.fs.headers());
 
   if (downstream->get_non_final_response()) {
@@ -1110,6 +1163,8 @@ int HttpsUpstream::on_downstream_body(Downstream *downstream,
 
   downstream->response_sent_body_length += len;
 
+  downstream->add_response_cache_body(data, len);
+
   if (downstream->get_chunked_response()) {
     output->append("\r\n");
   }
@@ -1137,6 +1192,8 @@ int HttpsUpstream::on_downstream_body_complete(Downstream *downstream) {
 
   if (!downstream->validate_response_recv_body_length()) {
     resp.connection_close = true;
+  } else {
+    downstream->finish_response_cache_store();
   }
 
   if (req.connection_close || resp.connection_close) {
@@ -1253,4 +1310,31 @@ bool HttpsUpstream::push_enabled() const { return false; }
 void HttpsUpstream::cancel_premature_downstream(
     Downstream *promised_downstream) {}
 
+void HttpsUpstream::start_downstream(Downstream *downstream) {
+  int rv;
+
+  rv = downstream->attach_downstream_connection(
+      handler_->get_downstream_connection(downstream));
+  if (rv != 0) {
+    on_downstream_abort_request(downstream, 503);
+    return;
+  }
+
+  rv = downstream->push_request_headers();
+  if (rv != 0) {
+    on_downstream_abort_request(downstream, 503);
+    return;
+  }
+
+  if (downstream->get_request_state() != Downstream::MSG_COMPLETE) {
+    return;
+  }
+
+  rv = downstream->end_upload_data();
+  if (rv != 0) {
+    on_downstream_abort_request(downstream, 503);
+    return;
+  }
+}
+
 } // namespace shrpx
@@ -74,8 +74,8 @@ public:
 
   virtual void on_handler_delete();
   virtual int on_downstream_reset(bool no_retry);
-  virtual int send_reply(Downstream *downstream, const uint8_t *body,
-                         size_t bodylen);
+  virtual int send_reply(Downstream *downstream, const struct iovec *iov,
+                         int iovcnt);
   virtual int initiate_push(Downstream *downstream, const StringRef &uri);
   virtual int response_riovec(struct iovec *iov, int iovcnt) const;
   virtual void response_drain(size_t n);
@@ -88,6 +88,7 @@ public:
                                       Downstream *promised_downstream);
   virtual bool push_enabled() const;
   virtual void cancel_premature_downstream(Downstream *promised_downstream);
+  virtual void start_downstream(Downstream *downstream);
 
   void reset_current_header_length();
   void log_response_headers(DefaultMemchunks *buf) const;
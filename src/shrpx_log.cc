@@ -45,6 +45,8 @@
 
 #include "shrpx_config.h"
 #include "shrpx_downstream.h"
+#include "shrpx_accesslog_writer.h"
+#include "shrpx_accesslog_binary.h"
 #include "util.h"
 #include "template.h"
 
@@ -71,10 +73,18 @@ int Log::severity_thres_ = NOTICE;
 void Log::set_severity_level(int severity) { severity_thres_ = severity; }
 
 int Log::set_severity_level_by_name(const char *name) {
+  auto severity = get_severity_level_by_name(name);
+  if (severity == -1) {
+    return -1;
+  }
+  severity_thres_ = severity;
+  return 0;
+}
+
+int Log::get_severity_level_by_name(const char *name) {
   for (size_t i = 0, max = array_size(SEVERITY_STR); i < max; ++i) {
     if (strcmp(SEVERITY_STR[i], name) == 0) {
-      severity_thres_ = i;
-      return 0;
+      return i;
     }
   }
   return -1;
@@ -226,16 +236,10 @@ std::pair<OutputIterator, size_t> copy_hex_low(const uint8_t *src,
 }
 } // namespace
 
-void upstream_accesslog(const std::vector<LogFragment> &lfv,
+size_t format_accesslog(char *buf, size_t buflen,
+                        const std::vector<LogFragment> &lfv,
                         const LogSpec &lgsp) {
   auto lgconf = log_config();
-  auto &accessconf = get_config()->logging.access;
-
-  if (lgconf->accesslog_fd == -1 && !accessconf.syslog) {
-    return;
-  }
-
-  char buf[4_k];
 
   auto downstream = lgsp.downstream;
 
@@ -245,7 +249,7 @@ void upstream_accesslog(const std::vector<LogFragment> &lfv,
   }
 
   auto p = buf;
-  auto avail = sizeof(buf) - 2;
+  auto avail = buflen - 2;
 
   lgconf->update_tstamp(lgsp.time_now);
   auto &time_local = lgconf->time_local_str;
@@ -371,17 +375,57 @@ void upstream_accesslog(const std::vector<LogFragment> &lfv,
 
   *p = '\0';
 
-  if (accessconf.syslog) {
+  return p - buf;
+}
+
+namespace {
+// Writes access log record pointed by |data| of length |len| to
+// access log file, or to the buffer of asynchronous writer.
+void write_accesslog(LogConfig *lgconf, const uint8_t *data, size_t len) {
+  if (lgconf->accesslog_buffer) {
+    lgconf->accesslog_writer->write(lgconf->accesslog_buffer, data, len);
+    return;
+  }
+
+  while (write(lgconf->accesslog_fd, data, len) == -1 && errno == EINTR)
+    ;
+}
+} // namespace
+
+void upstream_accesslog(const std::vector<LogFragment> &lfv,
+                        const LogSpec &lgsp) {
+  auto lgconf = log_config();
+  auto &accessconf = get_config()->logging.access;
+
+  if (lgconf->accesslog_fd == -1 && !accessconf.syslog &&
+      !lgconf->accesslog_buffer) {
+    return;
+  }
+
+  if (accessconf.binary) {
+    uint8_t buf[4_k];
+
+    auto len = encode_accesslog_entry(buf, sizeof(buf), lfv, lgsp);
+    if (len) {
+      write_accesslog(lgconf, buf, len);
+    }
+
+    return;
+  }
+
+  char buf[4_k];
+
+  auto len = format_accesslog(buf, sizeof(buf), lfv, lgsp);
+
+  if (accessconf.syslog && !lgconf->accesslog_buffer) {
     syslog(LOG_INFO, "%s", buf);
 
     return;
   }
 
-  *p++ = '\n';
+  buf[len++] = '\n';
 
-  auto nwrite = p - buf;
-  while (write(lgconf->accesslog_fd, buf, nwrite) == -1 && errno == EINTR)
-    ;
+  write_accesslog(lgconf, reinterpret_cast<uint8_t *>(buf), len);
 }
 
 int reopen_log_files() {
@@ -393,12 +437,22 @@ int reopen_log_files() {
   auto &accessconf = get_config()->logging.access;
   auto &errorconf = get_config()->logging.error;
 
-  if (!accessconf.syslog && !accessconf.file.empty()) {
+  if (lgconf->accesslog_writer) {
+    // The writer thread owns access log file.
+    lgconf->accesslog_writer->reopen();
+  } else if (!accessconf.syslog && !accessconf.file.empty()) {
     new_accesslog_fd = util::open_log_file(accessconf.file.c_str());
 
     if (new_accesslog_fd == -1) {
       LOG(ERROR) << "Failed to open accesslog file " << accessconf.file;
       res = -1;
+    } else if (accessconf.binary) {
+      // Each binary access log file starts with schema, so that it
+      // can be decoded after rotation.
+      auto schema = encode_accesslog_schema(accessconf.format);
+      while (write(new_accesslog_fd, schema.c_str(), schema.size()) == -1 &&
+             errno == EINTR)
+        ;
     }
   }
 
@@ -82,6 +82,10 @@ using namespace nghttp2;
 #define MCLOG(SEVERITY, MCONN)                                                 \
   (shrpx::Log(SEVERITY, __FILE__, __LINE__) << "[MCONN:" << MCONN << "] ")
 
+// Backend health checker log
+#define HCLOG(SEVERITY, HC)                                                    \
+  (shrpx::Log(SEVERITY, __FILE__, __LINE__) << "[HEALTH:" << HC << "] ")
+
 namespace shrpx {
 
 class Downstream;
@@ -98,6 +102,7 @@ public:
   }
   static void set_severity_level(int severity);
   static int set_severity_level_by_name(const char *name);
+  static int get_severity_level_by_name(const char *name);
   static bool log_enabled(int severity) { return severity >= severity_thres_; }
 
 private:
@@ -158,6 +163,14 @@ struct LogSpec {
   pid_t pid;
 };
 
+// Formats access log line of |lgsp| following |lfv| into |buf| of
+// length |buflen|, and returns the length of the line.  The line is
+// NULL-terminated, and does not include newline.  At most |buflen| -
+// 2 bytes are used for the line, and it is truncated if it is longer.
+size_t format_accesslog(char *buf, size_t buflen,
+                        const std::vector<LogFragment> &lfv,
+                        const LogSpec &lgsp);
+
 void upstream_accesslog(const std::vector<LogFragment> &lf,
                         const LogSpec &lgsp);
 
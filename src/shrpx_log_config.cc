@@ -30,7 +30,11 @@ using namespace nghttp2;
 namespace shrpx {
 
 LogConfig::LogConfig()
-    : accesslog_fd(-1), errorlog_fd(-1), errorlog_tty(false) {}
+    : accesslog_writer(nullptr),
+      accesslog_buffer(nullptr),
+      accesslog_fd(-1),
+      errorlog_fd(-1),
+      errorlog_tty(false) {}
 
 #ifndef NOTHREADS
 static pthread_key_t lckey;
@@ -47,9 +51,17 @@ LogConfig *log_config(void) {
   }
   return config;
 }
+
+void delete_log_config(void) {
+  pthread_once(&lckey_once, make_key);
+  delete (LogConfig *)pthread_getspecific(lckey);
+  pthread_setspecific(lckey, nullptr);
+}
 #else
 static LogConfig *config = new LogConfig();
 LogConfig *log_config(void) { return config; }
+
+void delete_log_config(void) {}
 #endif // NOTHREADS
 
 void LogConfig::update_tstamp(
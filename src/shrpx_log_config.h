@@ -31,11 +31,18 @@
 
 namespace shrpx {
 
+class AccessLogWriter;
+class AccessLogBuffer;
+
 struct LogConfig {
   std::chrono::system_clock::time_point time_str_updated_;
   std::string time_local_str;
   std::string time_iso8601_str;
   std::string time_http_str;
+  // If asynchronous access log is enabled, the writer, and the
+  // buffer of this thread.  In this case, accesslog_fd is not used.
+  AccessLogWriter *accesslog_writer;
+  AccessLogBuffer *accesslog_buffer;
   int accesslog_fd;
   int errorlog_fd;
   // true if errorlog_fd is referring to a terminal.
@@ -49,6 +56,10 @@ struct LogConfig {
 // descriptor for log files.
 extern LogConfig *log_config(void);
 
+// Deletes LogConfig of the current thread, so that log_config()
+// creates new one if it is called again in this thread.
+extern void delete_log_config(void);
+
 } // namespace shrpx
 
 #endif // SHRPX_LOG_CONFIG_H
@@ -94,30 +94,36 @@ constexpr ev_tstamp read_timeout = 10.;
 MemcachedConnection::MemcachedConnection(const Address *addr,
                                          struct ev_loop *loop, SSL_CTX *ssl_ctx,
                                          const StringRef &sni_name,
-                                         MemchunkPool *mcpool)
+                                         MemchunkPool *mcpool,
+                                         MemcachedRequestPool *reqpool)
     : conn_(loop, -1, nullptr, mcpool, write_timeout, read_timeout, {}, {},
-            connectcb, readcb, timeoutcb, this, 0, 0., PROTO_MEMCACHED),
+            connectcb, readcb, timeoutcb, this, 0, 0., false,
+            PROTO_MEMCACHED),
       do_read_(&MemcachedConnection::noop),
       do_write_(&MemcachedConnection::noop),
       sni_name_(sni_name.str()),
       parse_state_{},
       addr_(addr),
       ssl_ctx_(ssl_ctx),
+      reqpool_(reqpool),
       sendsum_(0),
+      next_opaque_(0),
       connected_(false) {}
 
 MemcachedConnection::~MemcachedConnection() { disconnect(); }
 
-namespace {
-void clear_request(std::deque<std::unique_ptr<MemcachedRequest>> &q) {
+void MemcachedConnection::clear_request(
+    std::deque<std::unique_ptr<MemcachedRequest>> &q) {
   for (auto &req : q) {
-    if (req->cb) {
+    if (!req->canceled && req->cb) {
       req->cb(req.get(), MemcachedResult(MEMCACHED_ERR_EXT_NETWORK_ERROR));
     }
   }
+  for (auto &req : q) {
+    reqpool_->recycle(std::move(req));
+  }
   q.clear();
 }
-} // namespace
 
 void MemcachedConnection::disconnect() {
   clear_request(recvq_);
@@ -412,14 +418,6 @@ int MemcachedConnection::parse_packet() {
         return 0;
       }
 
-      if (recvq_.empty()) {
-        MCLOG(WARN, this)
-            << "Response received, but there is no in-flight request.";
-        return -1;
-      }
-
-      auto &req = recvq_.front();
-
       if (*in != MEMCACHED_RES_MAGIC) {
         MCLOG(WARN, this) << "Response has bad magic: "
                           << static_cast<uint32_t>(*in);
@@ -437,19 +435,54 @@ int MemcachedConnection::parse_packet() {
       in += 2;
       parse_state_.totalbody = util::get_uint32(in);
       in += 4;
-      // skip 4 bytes opaque
+      parse_state_.opaque = util::get_uint32(in);
       in += 4;
       parse_state_.cas = util::get_uint64(in);
       in += 8;
 
-      if (req->op != parse_state_.op) {
+      // memcached server processes requests in order, but does not
+      // respond to GETKQ which misses.  The GETs before the request
+      // which has the same opaque are therefore misses.
+      for (;;) {
+        if (recvq_.empty()) {
+          MCLOG(WARN, this)
+              << "Response received, but there is no in-flight request.";
+          return -1;
+        }
+
+        auto &front = recvq_.front();
+
+        if (front->opaque == parse_state_.opaque) {
+          break;
+        }
+
+        if (front->op != MEMCACHED_OP_GET) {
+          MCLOG(WARN, this) << "Response for opaque " << front->opaque
+                            << " is missing";
+          return -1;
+        }
+
+        auto req = std::move(front);
+        recvq_.pop_front();
+
+        if (!req->canceled && req->cb) {
+          req->cb(req.get(), MemcachedResult(MEMCACHED_ERR_KEY_NOT_FOUND));
+        }
+
+        reqpool_->recycle(std::move(req));
+      }
+
+      auto &req = recvq_.front();
+      auto op = req->op == MEMCACHED_OP_GET ? MEMCACHED_OP_GETKQ : req->op;
+
+      if (op != parse_state_.op) {
         MCLOG(WARN, this)
             << "opcode in response does not match to the request: want "
-            << static_cast<uint32_t>(req->op) << ", got " << parse_state_.op;
+            << static_cast<uint32_t>(op) << ", got " << parse_state_.op;
         return -1;
       }
 
-      if (parse_state_.keylen != 0) {
+      if (parse_state_.keylen != 0 && parse_state_.op != MEMCACHED_OP_GETKQ) {
         MCLOG(WARN, this) << "zero length keylen expected: got "
                           << parse_state_.keylen;
         return -1;
@@ -461,7 +494,7 @@ int MemcachedConnection::parse_packet() {
         return -1;
       }
 
-      if (parse_state_.op == MEMCACHED_OP_GET &&
+      if (parse_state_.op == MEMCACHED_OP_GETKQ &&
           parse_state_.status_code == 0 && parse_state_.extralen == 0) {
         MCLOG(WARN, this) << "response for GET does not have extra";
         return -1;
@@ -475,9 +508,9 @@ int MemcachedConnection::parse_packet() {
         return -1;
       }
 
-      if (parse_state_.extralen) {
+      if (parse_state_.extralen || parse_state_.keylen) {
         parse_state_.state = MEMCACHED_PARSE_EXTRA;
-        parse_state_.read_left = parse_state_.extralen;
+        parse_state_.read_left = parse_state_.extralen + parse_state_.keylen;
       } else {
         parse_state_.state = MEMCACHED_PARSE_VALUE;
         parse_state_.read_left = parse_state_.totalbody - parse_state_.keylen -
@@ -487,7 +520,7 @@ int MemcachedConnection::parse_packet() {
       break;
     }
     case MEMCACHED_PARSE_EXTRA: {
-      // We don't use extra for now. Just read and forget.
+      // We don't use extra and key for now. Just read and forget.
       auto n = std::min(static_cast<size_t>(recvbuf_.last - in),
                         parse_state_.read_left);
 
@@ -498,8 +531,6 @@ int MemcachedConnection::parse_packet() {
         return 0;
       }
       parse_state_.state = MEMCACHED_PARSE_VALUE;
-      // since we require keylen == 0, totalbody - extralen ==
-      // valuelen
       parse_state_.read_left =
           parse_state_.totalbody - parse_state_.keylen - parse_state_.extralen;
       busy = true;
@@ -533,6 +564,8 @@ int MemcachedConnection::parse_packet() {
                                            std::move(parse_state_.value)));
       }
 
+      reqpool_->recycle(std::move(req));
+
       parse_state_ = {};
       break;
     }
@@ -561,21 +594,33 @@ int MemcachedConnection::parse_packet() {
 size_t MemcachedConnection::fill_request_buffer(struct iovec *iov,
                                                 size_t iovlen) {
   if (sendsum_ == 0) {
-    for (auto &req : sendq_) {
+    // true if the last serialized request is GET, which must be
+    // followed by NOOP.
+    auto quiet = false;
+    size_t i = 0;
+    for (; i < sendq_.size(); ++i) {
+      auto req = sendq_[i].get();
       if (req->canceled) {
         continue;
       }
-      if (serialized_size(req.get()) + sendsum_ > 1300) {
+      if (quiet && req->op != MEMCACHED_OP_GET) {
+        insert_noop(i);
+        quiet = false;
+        continue;
+      }
+      if (sendsum_ && serialized_size(req) + sendsum_ > 1300) {
         break;
       }
-      sendbufv_.emplace_back();
-      sendbufv_.back().req = req.get();
-      make_request(&sendbufv_.back(), req.get());
-      sendsum_ += sendbufv_.back().left();
+      serialize_request(req);
+      quiet = req->op == MEMCACHED_OP_GET;
+    }
+
+    if (quiet) {
+      insert_noop(i);
     }
 
     if (sendsum_ == 0) {
-      sendq_.clear();
+      clear_request(sendq_);
       return 0;
     }
   }
@@ -606,11 +651,13 @@ void MemcachedConnection::drain_send_queue(size_t nwrite) {
   while (nwrite > 0) {
     auto &buf = sendbufv_.front();
     auto &req = sendq_.front();
-    if (req->canceled) {
+    // Request canceled before serialization is not in sendbufv_.
+    if (buf.req != req.get()) {
+      assert(req->canceled);
+      reqpool_->recycle(std::move(req));
       sendq_.pop_front();
       continue;
     }
-    assert(buf.req == req.get());
     auto n = std::min(static_cast<size_t>(nwrite), buf.headbuf.rleft());
     buf.headbuf.drain(n);
     nwrite -= n;
@@ -629,6 +676,8 @@ void MemcachedConnection::drain_send_queue(size_t nwrite) {
 
 size_t MemcachedConnection::serialized_size(MemcachedRequest *req) {
   switch (req->op) {
+  case MEMCACHED_OP_NOOP:
+    return 24;
   case MEMCACHED_OP_GET:
     return 24 + req->key.size();
   case MEMCACHED_OP_ADD:
@@ -643,10 +692,17 @@ void MemcachedConnection::make_request(MemcachedSendbuf *sendbuf,
 
   std::fill(std::begin(headbuf.buf), std::end(headbuf.buf), 0);
 
+  req->opaque = next_opaque_++;
+
   headbuf[0] = MEMCACHED_REQ_MAGIC;
   headbuf[1] = req->op;
+  util::put_uint32be(&headbuf[12], req->opaque);
   switch (req->op) {
+  case MEMCACHED_OP_NOOP:
+    headbuf.write(24);
+    break;
   case MEMCACHED_OP_GET:
+    headbuf[1] = MEMCACHED_OP_GETKQ;
     util::put_uint16be(&headbuf[2], req->key.size());
     util::put_uint32be(&headbuf[8], req->key.size());
     headbuf.write(24);
@@ -665,6 +721,22 @@ void MemcachedConnection::make_request(MemcachedSendbuf *sendbuf,
   sendbuf->send_value_left = req->value.size();
 }
 
+void MemcachedConnection::serialize_request(MemcachedRequest *req) {
+  sendbufv_.emplace_back();
+  sendbufv_.back().req = req;
+  make_request(&sendbufv_.back(), req);
+  sendsum_ += sendbufv_.back().left();
+}
+
+void MemcachedConnection::insert_noop(size_t i) {
+  auto req = reqpool_->get();
+  req->op = MEMCACHED_OP_NOOP;
+
+  serialize_request(req.get());
+
+  sendq_.insert(std::begin(sendq_) + i, std::move(req));
+}
+
 int MemcachedConnection::add_request(std::unique_ptr<MemcachedRequest> req) {
   sendq_.push_back(std::move(req));
 
@@ -681,6 +753,10 @@ int MemcachedConnection::add_request(std::unique_ptr<MemcachedRequest> req) {
   return 0;
 }
 
+size_t MemcachedConnection::get_num_requests() const {
+  return sendq_.size() + recvq_.size();
+}
+
 // TODO should we start write timer too?
 void MemcachedConnection::signal_write() { conn_.wlimit.startw(); }
 
@@ -42,6 +42,7 @@ using namespace nghttp2;
 namespace shrpx {
 
 struct MemcachedRequest;
+class MemcachedRequestPool;
 
 enum {
   MEMCACHED_PARSE_HEADER24,
@@ -68,6 +69,8 @@ struct MemcachedParseState {
   int state;
   // status_code in response
   int status_code;
+  // opaque in response
+  uint32_t opaque;
   // op in response
   int op;
 };
@@ -88,7 +91,11 @@ constexpr uint8_t MEMCACHED_RES_MAGIC = 0x81;
 
 // MemcachedConnection implements part of memcached binary protocol.
 // This is not full brown implementation.  Just the part we need is
-// implemented.  We only use GET and ADD.
+// implemented.  We only use GET and ADD.  GET is sent as quiet GETKQ,
+// and a run of GETKQs is terminated by NOOP.  memcached server does
+// not respond to GETKQ which misses, and the response to NOOP tells
+// us that all GETKQs before it have been processed.  Responses are
+// matched to requests by opaque.
 //
 // https://github.com/memcached/memcached/blob/master/doc/protocol-binary.xml
 // https://code.google.com/p/memcached/wiki/MemcacheBinaryProtocol
@@ -96,7 +103,7 @@ class MemcachedConnection {
 public:
   MemcachedConnection(const Address *addr, struct ev_loop *loop,
                       SSL_CTX *ssl_ctx, const StringRef &sni_name,
-                      MemchunkPool *mcpool);
+                      MemchunkPool *mcpool, MemcachedRequestPool *reqpool);
   ~MemcachedConnection();
 
   void disconnect();
@@ -121,6 +128,16 @@ public:
   void make_request(MemcachedSendbuf *sendbuf, MemcachedRequest *req);
   int parse_packet();
   size_t serialized_size(MemcachedRequest *req);
+  // Serializes |req| and appends it to sendbufv_.
+  void serialize_request(MemcachedRequest *req);
+  // Inserts NOOP request at the position |i| of sendq_, and
+  // serializes it.
+  void insert_noop(size_t i);
+  void clear_request(std::deque<std::unique_ptr<MemcachedRequest>> &q);
+
+  // Returns the number of requests which are waiting for being sent,
+  // or response.
+  size_t get_num_requests() const;
 
   void signal_write();
 
@@ -136,8 +153,11 @@ private:
   MemcachedParseState parse_state_;
   const Address *addr_;
   SSL_CTX *ssl_ctx_;
+  MemcachedRequestPool *reqpool_;
   // Sum of the bytes to be transmitted in sendbufv_.
   size_t sendsum_;
+  // opaque assigned to the next request
+  uint32_t next_opaque_;
   bool connected_;
   Buffer<8_k> recvbuf_;
 };
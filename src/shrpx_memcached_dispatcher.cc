@@ -24,6 +24,8 @@
  */
 #include "shrpx_memcached_dispatcher.h"
 
+#include <algorithm>
+
 #include "shrpx_memcached_request.h"
 #include "shrpx_memcached_connection.h"
 #include "shrpx_config.h"
@@ -34,14 +36,31 @@ MemcachedDispatcher::MemcachedDispatcher(const Address *addr,
                                          struct ev_loop *loop, SSL_CTX *ssl_ctx,
                                          const StringRef &sni_name,
                                          MemchunkPool *mcpool)
-    : loop_(loop),
-      mconn_(make_unique<MemcachedConnection>(addr, loop_, ssl_ctx, sni_name,
-                                              mcpool)) {}
+    : loop_(loop) {
+  for (size_t i = 0; i < MEMCACHED_DISPATCHER_NUM_CONNECTIONS; ++i) {
+    mconns_.push_back(make_unique<MemcachedConnection>(
+        addr, loop_, ssl_ctx, sni_name, mcpool, &reqpool_));
+  }
+}
 
 MemcachedDispatcher::~MemcachedDispatcher() {}
 
+std::unique_ptr<MemcachedRequest> MemcachedDispatcher::create_request() {
+  return reqpool_.get();
+}
+
 int MemcachedDispatcher::add_request(std::unique_ptr<MemcachedRequest> req) {
-  if (mconn_->add_request(std::move(req)) != 0) {
+  // Use the connection which has the fewest requests, so that a burst
+  // of requests is spread over the connections instead of queueing
+  // up behind each other.
+  auto &mconn = *std::min_element(
+      std::begin(mconns_), std::end(mconns_),
+      [](const std::unique_ptr<MemcachedConnection> &lhs,
+         const std::unique_ptr<MemcachedConnection> &rhs) {
+        return lhs->get_num_requests() < rhs->get_num_requests();
+      });
+
+  if (mconn->add_request(std::move(req)) != 0) {
     return -1;
   }
 
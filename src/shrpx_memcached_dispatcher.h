@@ -28,19 +28,25 @@
 #include "shrpx.h"
 
 #include <memory>
+#include <vector>
 
 #include <ev.h>
 
 #include <openssl/ssl.h>
 
+#include "shrpx_memcached_request.h"
 #include "memchunk.h"
 #include "network.h"
 
 namespace shrpx {
 
-struct MemcachedRequest;
 class MemcachedConnection;
 
+// The number of connections to memcached server per dispatcher.
+// Connections are established lazily, so the additional connections
+// are only made when requests are queued up.
+constexpr size_t MEMCACHED_DISPATCHER_NUM_CONNECTIONS = 4;
+
 class MemcachedDispatcher {
 public:
   MemcachedDispatcher(const Address *addr, struct ev_loop *loop,
@@ -48,11 +54,17 @@ public:
                       MemchunkPool *mcpool);
   ~MemcachedDispatcher();
 
+  // Returns new MemcachedRequest object.  It may be the one recycled
+  // after previous request finished.
+  std::unique_ptr<MemcachedRequest> create_request();
   int add_request(std::unique_ptr<MemcachedRequest> req);
 
 private:
+  // This must be destroyed after mconns_, since they return requests
+  // to this pool on destruction.
+  MemcachedRequestPool reqpool_;
   struct ev_loop *loop_;
-  std::unique_ptr<MemcachedConnection> mconn_;
+  std::vector<std::unique_ptr<MemcachedConnection>> mconns_;
 };
 
 } // namespace shrpx
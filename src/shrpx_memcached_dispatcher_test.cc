@@ -0,0 +1,442 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_memcached_dispatcher_test.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_memcached_dispatcher.h"
+#include "shrpx_memcached_request.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+struct FakeMemcached;
+
+// Connection accepted by FakeMemcached.
+struct FakeMemcachedConnection {
+  FakeMemcached *server;
+  std::string in, out;
+  ev_io rev, wev;
+  int fd;
+};
+
+// FakeMemcached is a stand-in memcached server which speaks the part
+// of binary protocol MemcachedConnection uses.  It runs in the same
+// event loop as the client.
+struct FakeMemcached {
+  std::map<std::string, std::string> store;
+  std::vector<std::unique_ptr<FakeMemcachedConnection>> conns;
+  struct ev_loop *loop;
+  ev_io acceptev;
+  // The number of GET requests which missed, and were not responded.
+  size_t num_quiet_misses;
+  int fd;
+};
+} // namespace
+
+namespace {
+void append_response(std::string &out, uint8_t op, uint16_t status,
+                     const uint8_t *opaque, const std::string &extra,
+                     const std::string &key, const std::string &value) {
+  std::array<uint8_t, 24> hd{};
+  hd[0] = 0x81;
+  hd[1] = op;
+  util::put_uint16be(&hd[2], key.size());
+  hd[4] = extra.size();
+  util::put_uint16be(&hd[6], status);
+  util::put_uint32be(&hd[8], extra.size() + key.size() + value.size());
+  std::copy_n(opaque, 4, &hd[12]);
+
+  out.append(std::begin(hd), std::end(hd));
+  out += extra;
+  out += key;
+  out += value;
+}
+} // namespace
+
+namespace {
+void process_requests(FakeMemcachedConnection *fconn) {
+  auto server = fconn->server;
+  auto &in = fconn->in;
+  size_t pos = 0;
+
+  for (; in.size() - pos >= 24;) {
+    auto hd = reinterpret_cast<const uint8_t *>(in.data() + pos);
+    auto totalbody = util::get_uint32(&hd[8]);
+    if (in.size() - pos < 24 + totalbody) {
+      break;
+    }
+
+    auto op = hd[1];
+    auto keylen = util::get_uint16(&hd[2]);
+    auto extralen = hd[4];
+    auto opaque = &hd[12];
+    auto key = in.substr(pos + 24 + extralen, keylen);
+    auto value = in.substr(pos + 24 + extralen + keylen,
+                           totalbody - extralen - keylen);
+
+    pos += 24 + totalbody;
+
+    switch (op) {
+    case MEMCACHED_OP_GETKQ: {
+      auto it = server->store.find(key);
+      if (it == std::end(server->store)) {
+        ++server->num_quiet_misses;
+        break;
+      }
+      append_response(fconn->out, op, 0, opaque, std::string(4, '\0'), key,
+                       (*it).second);
+      break;
+    }
+    case MEMCACHED_OP_ADD:
+      if (server->store.count(key)) {
+        append_response(fconn->out, op, 2, opaque, "", "", "Data exists");
+        break;
+      }
+      server->store.emplace(key, value);
+      append_response(fconn->out, op, 0, opaque, "", "", "");
+      break;
+    case MEMCACHED_OP_NOOP:
+      append_response(fconn->out, op, 0, opaque, "", "", "");
+      break;
+    default:
+      append_response(fconn->out, op, 0x81, opaque, "", "",
+                      "Unknown command");
+      break;
+    }
+  }
+
+  in.erase(0, pos);
+}
+} // namespace
+
+namespace {
+void fake_writecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fconn = static_cast<FakeMemcachedConnection *>(w->data);
+  auto &out = fconn->out;
+
+  while (!out.empty()) {
+    auto nwrite = write(fconn->fd, out.data(), out.size());
+    if (nwrite == -1) {
+      ev_io_start(loop, &fconn->wev);
+      return;
+    }
+    out.erase(0, nwrite);
+  }
+
+  ev_io_stop(loop, &fconn->wev);
+}
+} // namespace
+
+namespace {
+void fake_readcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fconn = static_cast<FakeMemcachedConnection *>(w->data);
+  std::array<char, 16_k> buf;
+
+  for (;;) {
+    auto nread = read(fconn->fd, buf.data(), buf.size());
+    if (nread <= 0) {
+      break;
+    }
+    fconn->in.append(buf.data(), nread);
+  }
+
+  process_requests(fconn);
+  fake_writecb(loop, &fconn->wev, 0);
+}
+} // namespace
+
+namespace {
+void fake_acceptcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto server = static_cast<FakeMemcached *>(w->data);
+
+  auto fd = accept(server->fd, nullptr, nullptr);
+  if (fd == -1) {
+    return;
+  }
+
+  util::make_socket_nonblocking(fd);
+
+  auto fconn = make_unique<FakeMemcachedConnection>();
+  fconn->server = server;
+  fconn->fd = fd;
+  ev_io_init(&fconn->rev, fake_readcb, fd, EV_READ);
+  fconn->rev.data = fconn.get();
+  ev_io_init(&fconn->wev, fake_writecb, fd, EV_WRITE);
+  fconn->wev.data = fconn.get();
+  ev_io_start(loop, &fconn->rev);
+
+  server->conns.push_back(std::move(fconn));
+}
+} // namespace
+
+namespace {
+void timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  ev_break(loop);
+}
+} // namespace
+
+namespace {
+// Makes |server| listen on loopback address, which is assigned to
+// |addr|.
+void start_fake_memcached(FakeMemcached &server, Address &addr,
+                          struct ev_loop *loop) {
+  server.loop = loop;
+  server.fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  addr = Address{};
+  addr.su.in.sin_family = AF_INET;
+  addr.su.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.len = sizeof(addr.su.in);
+
+  CU_ASSERT(0 == bind(server.fd, &addr.su.sa, addr.len));
+  CU_ASSERT(0 == listen(server.fd, 16));
+  socklen_t addrlen = addr.len;
+  CU_ASSERT(0 == getsockname(server.fd, &addr.su.sa, &addrlen));
+
+  util::make_socket_nonblocking(server.fd);
+  ev_io_init(&server.acceptev, fake_acceptcb, server.fd, EV_READ);
+  server.acceptev.data = &server;
+  ev_io_start(loop, &server.acceptev);
+}
+} // namespace
+
+namespace {
+void stop_fake_memcached(FakeMemcached &server) {
+  auto loop = server.loop;
+
+  for (auto &fconn : server.conns) {
+    ev_io_stop(loop, &fconn->rev);
+    ev_io_stop(loop, &fconn->wev);
+    close(fconn->fd);
+  }
+  ev_io_stop(loop, &server.acceptev);
+  close(server.fd);
+}
+} // namespace
+
+namespace {
+// Adds keys "key0", "key1", ..., and their values in a burst.  This
+// function returns the number of keys successfully added.
+size_t add_keys(MemcachedDispatcher &dispatcher, struct ev_loop *loop,
+                size_t num_keys) {
+  size_t num_done = 0, num_ok = 0;
+
+  for (size_t i = 0; i < num_keys; ++i) {
+    auto req = dispatcher.create_request();
+    req->op = MEMCACHED_OP_ADD;
+    req->key = "key" + util::utos(i);
+    auto v = "value" + util::utos(i);
+    req->value.assign(std::begin(v), std::end(v));
+    req->cb = [&](MemcachedRequest *req, MemcachedResult res) {
+      ++num_done;
+      if (res.status_code == 0) {
+        ++num_ok;
+      }
+      if (num_done == num_keys) {
+        ev_break(loop);
+      }
+    };
+
+    CU_ASSERT(0 == dispatcher.add_request(std::move(req)));
+  }
+
+  ev_run(loop, 0);
+
+  CU_ASSERT(num_keys == num_done);
+
+  return num_ok;
+}
+} // namespace
+
+namespace {
+struct GetResult {
+  size_t num_done, num_hit, num_miss, num_bad;
+};
+} // namespace
+
+namespace {
+// Gets keys in a burst of |num_gets| requests.  Half of them are the
+// keys added by add_keys(|num_keys|), and the others miss.  The second
+// request is canceled.
+GetResult get_keys(MemcachedDispatcher &dispatcher, struct ev_loop *loop,
+                   size_t num_gets, size_t num_keys) {
+  GetResult res{};
+
+  MemcachedRequest *canceled = nullptr;
+
+  for (size_t i = 0; i < num_gets; ++i) {
+    auto req = dispatcher.create_request();
+    req->op = MEMCACHED_OP_GET;
+    auto n = i % (num_keys * 2);
+    req->key = "key" + util::utos(n);
+    req->cb = [&, n](MemcachedRequest *req, MemcachedResult mres) {
+      ++res.num_done;
+      switch (mres.status_code) {
+      case MEMCACHED_ERR_NO_ERROR: {
+        auto v = "value" + util::utos(n);
+        if (n < num_keys &&
+            std::equal(std::begin(v), std::end(v), std::begin(mres.value))) {
+          ++res.num_hit;
+        } else {
+          ++res.num_bad;
+        }
+        break;
+      }
+      case MEMCACHED_ERR_KEY_NOT_FOUND:
+        if (n >= num_keys) {
+          ++res.num_miss;
+        } else {
+          ++res.num_bad;
+        }
+        break;
+      default:
+        ++res.num_bad;
+      }
+      if (res.num_done == num_gets - 1) {
+        ev_break(loop);
+      }
+    };
+
+    if (i == 1) {
+      canceled = req.get();
+    }
+
+    CU_ASSERT(0 == dispatcher.add_request(std::move(req)));
+  }
+
+  // The callback of canceled request is not called.
+  canceled->canceled = true;
+
+  ev_run(loop, 0);
+
+  return res;
+}
+} // namespace
+
+void test_shrpx_memcached_dispatcher(void) {
+  auto loop = ev_loop_new(0);
+
+  FakeMemcached server{};
+  Address addr;
+
+  start_fake_memcached(server, addr, loop);
+
+  ev_timer timeout;
+  ev_timer_init(&timeout, timeoutcb, 10., 0.);
+  ev_timer_start(loop, &timeout);
+
+  MemchunkPool mcpool;
+
+  {
+    MemcachedDispatcher dispatcher(&addr, loop, nullptr, StringRef{},
+                                   &mcpool);
+
+    constexpr size_t num_keys = 100;
+
+    CU_ASSERT(num_keys == add_keys(dispatcher, loop, num_keys));
+
+    // The burst of requests is spread over the connections.
+    CU_ASSERT(MEMCACHED_DISPATCHER_NUM_CONNECTIONS == server.conns.size());
+
+    // Half of GETs miss.
+    constexpr size_t num_gets = 1000;
+
+    auto res = get_keys(dispatcher, loop, num_gets, num_keys);
+
+    CU_ASSERT(num_gets - 1 == res.num_done);
+    CU_ASSERT(0 == res.num_bad);
+    CU_ASSERT(num_gets / 2 - 1 == res.num_hit);
+    CU_ASSERT(num_gets / 2 == res.num_miss);
+    // Misses are not responded by server.
+    CU_ASSERT(num_gets / 2 == server.num_quiet_misses);
+  }
+
+  ev_timer_stop(loop, &timeout);
+
+  stop_fake_memcached(server);
+
+  ev_loop_destroy(loop);
+}
+
+void test_shrpx_memcached_dispatcher_benchmark(void) {
+  auto loop = ev_loop_new(0);
+
+  FakeMemcached server{};
+  Address addr;
+
+  start_fake_memcached(server, addr, loop);
+
+  ev_timer timeout;
+  ev_timer_init(&timeout, timeoutcb, 60., 0.);
+  ev_timer_start(loop, &timeout);
+
+  MemchunkPool mcpool;
+
+  {
+    MemcachedDispatcher dispatcher(&addr, loop, nullptr, StringRef{},
+                                   &mcpool);
+
+    constexpr size_t num_keys = 100;
+
+    CU_ASSERT(num_keys == add_keys(dispatcher, loop, num_keys));
+
+    constexpr size_t num_gets = 10000;
+
+    auto t = std::chrono::steady_clock::now();
+
+    auto res = get_keys(dispatcher, loop, num_gets, num_keys);
+
+    auto d = std::chrono::steady_clock::now() - t;
+
+    CU_ASSERT(num_gets - 1 == res.num_done);
+    CU_ASSERT(0 == res.num_bad);
+
+    std::cerr << "memcached: " << num_gets << " GETs over "
+              << server.conns.size() << " connections in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(d)
+                     .count()
+              << "us" << std::endl;
+  }
+
+  ev_timer_stop(loop, &timeout);
+
+  stop_fake_memcached(server);
+
+  ev_loop_destroy(loop);
+}
+
+} // namespace shrpx
@@ -32,12 +32,15 @@
 #include <memory>
 
 #include "shrpx_memcached_result.h"
+#include "template.h"
 
 namespace shrpx {
 
 enum {
   MEMCACHED_OP_GET = 0x00,
   MEMCACHED_OP_ADD = 0x02,
+  MEMCACHED_OP_NOOP = 0x0a,
+  MEMCACHED_OP_GETKQ = 0x0d,
 };
 
 struct MemcachedRequest;
@@ -50,10 +53,53 @@ struct MemcachedRequest {
   std::vector<uint8_t> value;
   MemcachedResultCallback cb;
   uint32_t expiry;
+  // opaque sent to memcached server, which is echoed back in
+  // response.  This is assigned by MemcachedConnection.
+  uint32_t opaque;
   int op;
   bool canceled;
 };
 
+// The maximum number of MemcachedRequest objects kept in
+// MemcachedRequestPool.
+constexpr size_t MEMCACHED_REQUEST_POOL_MAX = 256;
+
+// MemcachedRequestPool keeps finished MemcachedRequest objects and
+// hands them out again, so that a burst of requests does not allocate
+// request object and its key buffer each time.
+class MemcachedRequestPool {
+public:
+  std::unique_ptr<MemcachedRequest> get() {
+    if (freelist_.empty()) {
+      return make_unique<MemcachedRequest>();
+    }
+
+    auto req = std::move(freelist_.back());
+    freelist_.pop_back();
+
+    return req;
+  }
+
+  void recycle(std::unique_ptr<MemcachedRequest> req) {
+    if (freelist_.size() >= MEMCACHED_REQUEST_POOL_MAX) {
+      return;
+    }
+
+    req->key.clear();
+    req->value.clear();
+    req->cb = nullptr;
+    req->expiry = 0;
+    req->opaque = 0;
+    req->op = 0;
+    req->canceled = false;
+
+    freelist_.push_back(std::move(req));
+  }
+
+private:
+  std::vector<std::unique_ptr<MemcachedRequest>> freelist_;
+};
+
 } // namespace shrpx
 
 #endif // SHRPX_MEMCACHED_REQUEST_H
@@ -33,6 +33,7 @@ namespace shrpx {
 
 enum MemcachedStatusCode {
   MEMCACHED_ERR_NO_ERROR,
+  MEMCACHED_ERR_KEY_NOT_FOUND = 0x0001,
   MEMCACHED_ERR_EXT_NETWORK_ERROR = 0x1001,
 };
 
@@ -0,0 +1,274 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_metrics.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+#include "util.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+size_t latency_histogram_bucket(uint64_t usec) {
+  if (usec <= (1 << LATENCY_HISTOGRAM_MIN_SHIFT)) {
+    return 0;
+  }
+
+  // Bucket covers half open interval (lower, upper].
+  auto v = usec - 1;
+
+  size_t shift = LATENCY_HISTOGRAM_MIN_SHIFT;
+  for (auto n = v >> (LATENCY_HISTOGRAM_MIN_SHIFT + 1); n; n >>= 1) {
+    ++shift;
+  }
+
+  if (shift >= LATENCY_HISTOGRAM_MAX_SHIFT) {
+    return LATENCY_HISTOGRAM_NUM_BUCKETS - 1;
+  }
+
+  auto sub = (v >> (shift - LATENCY_HISTOGRAM_SUB_BITS)) &
+             ((1 << LATENCY_HISTOGRAM_SUB_BITS) - 1);
+
+  return 1 +
+         ((shift - LATENCY_HISTOGRAM_MIN_SHIFT) << LATENCY_HISTOGRAM_SUB_BITS) +
+         sub;
+}
+
+uint64_t latency_histogram_upper_bound(size_t idx) {
+  if (idx == 0) {
+    return 1 << LATENCY_HISTOGRAM_MIN_SHIFT;
+  }
+
+  --idx;
+
+  auto shift =
+      LATENCY_HISTOGRAM_MIN_SHIFT + (idx >> LATENCY_HISTOGRAM_SUB_BITS);
+  auto sub = idx & ((1 << LATENCY_HISTOGRAM_SUB_BITS) - 1);
+
+  return static_cast<uint64_t>((1 << LATENCY_HISTOGRAM_SUB_BITS) + sub + 1)
+         << (shift - LATENCY_HISTOGRAM_SUB_BITS);
+}
+
+void LatencyHistogram::accumulate(LatencyHistogramSnapshot &snap) const {
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    snap.buckets[i] += buckets_[i].get();
+  }
+  snap.sum += sum_.get();
+}
+
+MetricsSnapshot::MetricsSnapshot()
+    : num_workers(0),
+      frontend_connections(0),
+      active_frontend_connections(0),
+      tls_handshakes(0),
+      tls_resumptions(0),
+      streams(0),
+      requests(0),
+      responses{},
+      request_body_bytes(0),
+      response_body_bytes(0),
+      backend_connects(0),
+      connect_blocker_trips(0),
+      accesslog_dropped(0) {}
+
+void WorkerMetrics::accumulate(MetricsSnapshot &snap) const {
+  ++snap.num_workers;
+  snap.frontend_connections += frontend_connections.get();
+  snap.active_frontend_connections += active_frontend_connections.get();
+  snap.tls_handshakes += tls_handshakes.get();
+  snap.tls_resumptions += tls_resumptions.get();
+  snap.streams += streams.get();
+  snap.requests += requests.get();
+  for (size_t i = 0; i < responses.size(); ++i) {
+    snap.responses[i] += responses[i].get();
+  }
+  snap.request_body_bytes += request_body_bytes.get();
+  snap.response_body_bytes += response_body_bytes.get();
+  snap.backend_connects += backend_connects.get();
+  snap.connect_blocker_trips += connect_blocker_trips.get();
+  request_time.accumulate(snap.request_time);
+  backend_ttfb.accumulate(snap.backend_ttfb);
+}
+
+void WorkerMetrics::on_request_complete(unsigned int status,
+                                        int64_t req_body_bytes,
+                                        int64_t resp_body_bytes,
+                                        uint64_t usec) {
+  requests.add();
+
+  if (status >= 100 && status < 100 * (METRICS_NUM_STATUS_CLASSES + 1)) {
+    responses[status / 100 - 1].add();
+  }
+
+  if (req_body_bytes > 0) {
+    request_body_bytes.add(req_body_bytes);
+  }
+  if (resp_body_bytes > 0) {
+    response_body_bytes.add(resp_body_bytes);
+  }
+
+  request_time.observe(usec);
+}
+
+namespace {
+// Formats |usec| microseconds as seconds without trailing zeros.
+std::string format_seconds(uint64_t usec) {
+  char buf[32];
+  auto len = snprintf(buf, sizeof(buf), "%" PRIu64 ".%06" PRIu64,
+                      usec / 1000000, usec % 1000000);
+  std::string s(buf, len);
+  while (s.back() == '0') {
+    s.pop_back();
+  }
+  if (s.back() == '.') {
+    s.pop_back();
+  }
+  return s;
+}
+} // namespace
+
+namespace {
+void format_header(std::string &out, const char *name, const char *type,
+                   const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+} // namespace
+
+namespace {
+void format_value(std::string &out, const char *name, const char *type,
+                  const char *help, uint64_t value) {
+  format_header(out, name, type, help);
+  out += name;
+  out += ' ';
+  out += util::utos(value);
+  out += '\n';
+}
+} // namespace
+
+namespace {
+void format_histogram(std::string &out, const char *name, const char *help,
+                      const LatencyHistogramSnapshot &h) {
+  format_header(out, name, "histogram", help);
+
+  uint64_t count = 0;
+  for (size_t i = 0; i < LATENCY_HISTOGRAM_NUM_BUCKETS - 1; ++i) {
+    count += h.buckets[i];
+    out += name;
+    out += "_bucket{le=\"";
+    out += format_seconds(latency_histogram_upper_bound(i));
+    out += "\"} ";
+    out += util::utos(count);
+    out += '\n';
+  }
+
+  count += h.buckets[LATENCY_HISTOGRAM_NUM_BUCKETS - 1];
+
+  out += name;
+  out += "_bucket{le=\"+Inf\"} ";
+  out += util::utos(count);
+  out += '\n';
+  out += name;
+  out += "_sum ";
+  out += format_seconds(h.sum);
+  out += '\n';
+  out += name;
+  out += "_count ";
+  out += util::utos(count);
+  out += '\n';
+}
+} // namespace
+
+std::string format_metrics(const MetricsSnapshot &snap) {
+  std::string out;
+
+  format_value(out, "nghttpx_workers", "gauge", "Number of worker threads.",
+               snap.num_workers);
+  format_value(out, "nghttpx_frontend_connections_total", "counter",
+               "Number of accepted frontend connections.",
+               snap.frontend_connections);
+  format_value(out, "nghttpx_frontend_connections", "gauge",
+               "Number of open frontend connections.",
+               snap.active_frontend_connections);
+  format_value(out, "nghttpx_frontend_tls_handshakes_total", "counter",
+               "Number of completed frontend TLS handshakes.",
+               snap.tls_handshakes);
+  format_value(out, "nghttpx_frontend_tls_resumptions_total", "counter",
+               "Number of frontend TLS handshakes which resumed session.",
+               snap.tls_resumptions);
+  format_value(out, "nghttpx_frontend_streams_total", "counter",
+               "Number of frontend HTTP/2 and SPDY streams opened by clients.",
+               snap.streams);
+  format_value(out, "nghttpx_requests_total", "counter",
+               "Number of completed requests.", snap.requests);
+
+  format_header(out, "nghttpx_responses_total", "counter",
+                "Number of responses by status code class.");
+  for (size_t i = 0; i < snap.responses.size(); ++i) {
+    out += "nghttpx_responses_total{code=\"";
+    out += static_cast<char>('1' + i);
+    out += "xx\"} ";
+    out += util::utos(snap.responses[i]);
+    out += '\n';
+  }
+
+  format_value(out, "nghttpx_request_body_bytes_total", "counter",
+               "Number of request body bytes received from clients.",
+               snap.request_body_bytes);
+  format_value(out, "nghttpx_response_body_bytes_total", "counter",
+               "Number of response body bytes sent to clients.",
+               snap.response_body_bytes);
+  format_value(out, "nghttpx_backend_connects_total", "counter",
+               "Number of connect attempts to backends.",
+               snap.backend_connects);
+  format_value(out, "nghttpx_backend_connect_blocker_trips_total", "counter",
+               "Number of times connection to backend was blocked after "
+               "connect failure.",
+               snap.connect_blocker_trips);
+  format_value(out, "nghttpx_accesslog_dropped_total", "counter",
+               "Number of access log lines dropped by full buffer.",
+               snap.accesslog_dropped);
+
+  format_histogram(out, "nghttpx_request_duration_seconds",
+                   "Time from the start of request to the end of response.",
+                   snap.request_time);
+  format_histogram(out, "nghttpx_backend_ttfb_seconds",
+                   "Time from sending request to backend to receiving "
+                   "response header.",
+                   snap.backend_ttfb);
+
+  return out;
+}
+
+} // namespace shrpx
@@ -0,0 +1,190 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_METRICS_H
+#define SHRPX_METRICS_H
+
+#include "shrpx.h"
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <string>
+
+namespace shrpx {
+
+// MetricsCounter is a monotonic counter updated by a single worker
+// thread, and read by other threads without locking.  Since there
+// is only one writer, the update does not need atomic
+// read-modify-write operation.
+class MetricsCounter {
+public:
+  MetricsCounter() : n_(0) {}
+  // Adds |n| to this counter.  Only the owning worker thread may call
+  // this function.
+  void add(uint64_t n = 1) {
+    n_.store(n_.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+  }
+  // Subtracts |n| from this counter.  This is used for gauges.  Only
+  // the owning worker thread may call this function.
+  void sub(uint64_t n = 1) {
+    n_.store(n_.load(std::memory_order_relaxed) - n,
+             std::memory_order_relaxed);
+  }
+  uint64_t get() const { return n_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> n_;
+};
+
+// The latency histogram has 4 log-linear buckets per power of 2 from
+// 128us to 2^26us (about 67s), and one bucket below them.  Each
+// bucket is at most 25% wider than its lower bound.  The last bucket
+// counts the values which exceed the upper bound of all buckets.
+constexpr size_t LATENCY_HISTOGRAM_MIN_SHIFT = 7;
+constexpr size_t LATENCY_HISTOGRAM_MAX_SHIFT = 26;
+constexpr size_t LATENCY_HISTOGRAM_SUB_BITS = 2;
+constexpr size_t LATENCY_HISTOGRAM_NUM_BUCKETS =
+    1 +
+    ((LATENCY_HISTOGRAM_MAX_SHIFT - LATENCY_HISTOGRAM_MIN_SHIFT)
+     << LATENCY_HISTOGRAM_SUB_BITS) +
+    1;
+
+// Returns the index of bucket for |usec| microseconds.  Bucket i
+// counts the values in (upper bound of bucket i - 1, upper bound of
+// bucket i].
+size_t latency_histogram_bucket(uint64_t usec);
+
+// Returns the upper bound in microseconds of bucket |idx|.  |idx|
+// must be less than LATENCY_HISTOGRAM_NUM_BUCKETS - 1.
+uint64_t latency_histogram_upper_bound(size_t idx);
+
+struct LatencyHistogramSnapshot {
+  LatencyHistogramSnapshot() : buckets{}, sum(0) {}
+  std::array<uint64_t, LATENCY_HISTOGRAM_NUM_BUCKETS> buckets;
+  // The sum of observed values in microseconds.
+  uint64_t sum;
+};
+
+class LatencyHistogram {
+public:
+  // Records |usec| microseconds.  Only the owning worker thread may
+  // call this function.
+  void observe(uint64_t usec) {
+    buckets_[latency_histogram_bucket(usec)].add();
+    sum_.add(usec);
+  }
+  // Records |t| seconds.
+  void observe_seconds(double t) {
+    observe(t > 0. ? static_cast<uint64_t>(t * 1000000.) : 0);
+  }
+  // Adds the current values to |snap|.
+  void accumulate(LatencyHistogramSnapshot &snap) const;
+
+private:
+  std::array<MetricsCounter, LATENCY_HISTOGRAM_NUM_BUCKETS> buckets_;
+  MetricsCounter sum_;
+};
+
+enum {
+  METRICS_NUM_STATUS_CLASSES = 5,
+};
+
+// Aggregated values of all workers' metrics.
+struct MetricsSnapshot {
+  MetricsSnapshot();
+
+  size_t num_workers;
+  uint64_t frontend_connections;
+  uint64_t active_frontend_connections;
+  uint64_t tls_handshakes;
+  uint64_t tls_resumptions;
+  uint64_t streams;
+  uint64_t requests;
+  std::array<uint64_t, METRICS_NUM_STATUS_CLASSES> responses;
+  uint64_t request_body_bytes;
+  uint64_t response_body_bytes;
+  uint64_t backend_connects;
+  uint64_t connect_blocker_trips;
+  uint64_t accesslog_dropped;
+  LatencyHistogramSnapshot request_time;
+  LatencyHistogramSnapshot backend_ttfb;
+};
+
+// The number of bytes of a cache line.
+constexpr size_t METRICS_CACHE_LINE_SIZE = 64;
+
+// Metrics of a worker.  Each worker owns its WorkerMetrics object,
+// and is the only writer of it.  The counters are padded so that
+// they do not share cache line with any other object.
+struct WorkerMetrics {
+  // Adds the current values to |snap|.
+  void accumulate(MetricsSnapshot &snap) const;
+
+  // Records the completion of request which got response of status
+  // code |status|.
+  void on_request_complete(unsigned int status, int64_t req_body_bytes,
+                           int64_t resp_body_bytes, uint64_t usec);
+
+private:
+  std::array<uint8_t, METRICS_CACHE_LINE_SIZE> head_pad_;
+
+public:
+  // The number of accepted frontend connections
+  MetricsCounter frontend_connections;
+  // The number of frontend connections currently open.  This is a
+  // gauge.
+  MetricsCounter active_frontend_connections;
+  // The number of completed frontend TLS handshakes
+  MetricsCounter tls_handshakes;
+  // The number of frontend TLS handshakes which resumed session
+  MetricsCounter tls_resumptions;
+  // The number of frontend HTTP/2 and SPDY streams opened by clients
+  MetricsCounter streams;
+  MetricsCounter requests;
+  // The number of responses per status code class (1xx, ..., 5xx)
+  std::array<MetricsCounter, METRICS_NUM_STATUS_CLASSES> responses;
+  MetricsCounter request_body_bytes;
+  MetricsCounter response_body_bytes;
+  // The number of connect attempts to backend
+  MetricsCounter backend_connects;
+  // The number of times ConnectBlocker started blocking connection
+  MetricsCounter connect_blocker_trips;
+  // Time from the start of request to the completion of response
+  LatencyHistogram request_time;
+  // Time from sending request to backend to receiving response
+  // header from it
+  LatencyHistogram backend_ttfb;
+
+private:
+  std::array<uint8_t, METRICS_CACHE_LINE_SIZE> tail_pad_;
+};
+
+// Returns |snap| in Prometheus text exposition format.
+std::string format_metrics(const MetricsSnapshot &snap);
+
+} // namespace shrpx
+
+#endif // SHRPX_METRICS_H
@@ -0,0 +1,304 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_metrics_server.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif // HAVE_UNISTD_H
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+#include "shrpx_connection_handler.h"
+#include "shrpx_config.h"
+#include "shrpx_log.h"
+#include "shrpx_metrics.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+// The maximum size of request header
+constexpr size_t METRICS_MAX_REQUEST_SIZE = 8_k;
+// Timeout for reading request and writing response
+constexpr ev_tstamp METRICS_TIMEOUT = 30.;
+} // namespace
+
+namespace {
+void readcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<MetricsConnection *>(w->data);
+  if (conn->on_read() != 0) {
+    conn->get_server()->remove_connection(conn);
+  }
+}
+} // namespace
+
+namespace {
+void writecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<MetricsConnection *>(w->data);
+  if (conn->on_write() != 0) {
+    conn->get_server()->remove_connection(conn);
+  }
+}
+} // namespace
+
+namespace {
+void timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto conn = static_cast<MetricsConnection *>(w->data);
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "metrics: connection timed out";
+  }
+  conn->get_server()->remove_connection(conn);
+}
+} // namespace
+
+MetricsConnection::MetricsConnection(int fd, MetricsServer *server)
+    : dlnext(nullptr),
+      dlprev(nullptr),
+      wpos_(0),
+      server_(server),
+      fd_(fd) {
+  auto loop = server_->get_loop();
+
+  ev_io_init(&rev_, readcb, fd_, EV_READ);
+  rev_.data = this;
+  ev_io_init(&wev_, writecb, fd_, EV_WRITE);
+  wev_.data = this;
+  ev_timer_init(&rt_, timeoutcb, 0., METRICS_TIMEOUT);
+  rt_.data = this;
+
+  ev_io_start(loop, &rev_);
+  ev_timer_again(loop, &rt_);
+}
+
+MetricsConnection::~MetricsConnection() {
+  auto loop = server_->get_loop();
+
+  ev_timer_stop(loop, &rt_);
+  ev_io_stop(loop, &wev_);
+  ev_io_stop(loop, &rev_);
+
+  close(fd_);
+}
+
+MetricsServer *MetricsConnection::get_server() const { return server_; }
+
+int MetricsConnection::on_read() {
+  std::array<char, 4_k> buf;
+
+  for (;;) {
+    ssize_t nread;
+    while ((nread = read(fd_, buf.data(), buf.size())) == -1 &&
+           errno == EINTR)
+      ;
+
+    if (nread == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+
+    if (nread == 0) {
+      return -1;
+    }
+
+    rbuf_.append(buf.data(), nread);
+
+    if (rbuf_.find("\r\n\r\n") != std::string::npos ||
+        rbuf_.find("\n\n") != std::string::npos) {
+      break;
+    }
+
+    if (rbuf_.size() > METRICS_MAX_REQUEST_SIZE) {
+      return -1;
+    }
+  }
+
+  ev_io_stop(server_->get_loop(), &rev_);
+
+  prepare_response();
+
+  return on_write();
+}
+
+int MetricsConnection::on_write() {
+  auto loop = server_->get_loop();
+
+  while (wpos_ < wbuf_.size()) {
+    ssize_t nwrite;
+    while ((nwrite = write(fd_, wbuf_.data() + wpos_, wbuf_.size() - wpos_)) ==
+               -1 &&
+           errno == EINTR)
+      ;
+
+    if (nwrite == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ev_io_start(loop, &wev_);
+        ev_timer_again(loop, &rt_);
+        return 0;
+      }
+      return -1;
+    }
+
+    wpos_ += nwrite;
+  }
+
+  // Response has been written.  We do not support persistent
+  // connection.
+  return -1;
+}
+
+void MetricsConnection::prepare_response() {
+  auto eol = rbuf_.find('\n');
+  auto line = StringRef{rbuf_.data(), eol};
+
+  auto method_end = std::find(std::begin(line), std::end(line), ' ');
+  auto method = StringRef{std::begin(line), method_end};
+
+  auto path_first =
+      method_end == std::end(line) ? std::end(line) : method_end + 1;
+  auto path_last = std::find(path_first, std::end(line), ' ');
+  auto path = StringRef{path_first, std::find(path_first, path_last, '?')};
+
+  std::string body;
+  const char *status;
+  const char *content_type = "text/plain";
+
+  auto head = method == "HEAD";
+
+  if (method != "GET" && !head) {
+    status = "405 Method Not Allowed";
+    body = "405 Method Not Allowed\n";
+  } else if (path != "/metrics") {
+    status = "404 Not Found";
+    body = "404 Not Found\n";
+  } else {
+    status = "200 OK";
+    content_type = "text/plain; version=0.0.4";
+    body = server_->format();
+  }
+
+  wbuf_ = "HTTP/1.1 ";
+  wbuf_ += status;
+  wbuf_ += "\r\nContent-Type: ";
+  wbuf_ += content_type;
+  wbuf_ += "\r\nContent-Length: ";
+  wbuf_ += util::utos(body.size());
+  wbuf_ += "\r\nConnection: close\r\n";
+  if (method != "GET" && !head) {
+    wbuf_ += "Allow: GET, HEAD\r\n";
+  }
+  wbuf_ += "\r\n";
+  if (!head) {
+    wbuf_ += body;
+  }
+}
+
+namespace {
+void acceptcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto server = static_cast<MetricsServer *>(w->data);
+  server->accept_connection(w->fd);
+}
+} // namespace
+
+MetricsServer::MetricsServer(ConnectionHandler *conn_handler)
+    : conn_handler_(conn_handler) {}
+
+MetricsServer::~MetricsServer() {
+  auto loop = get_loop();
+
+  while (conns_.head) {
+    remove_connection(conns_.head);
+  }
+
+  for (auto &w : listeners_) {
+    ev_io_stop(loop, w.get());
+    close(w->fd);
+  }
+}
+
+void MetricsServer::add_listener(const UpstreamAddr *faddr) {
+  auto w = make_unique<ev_io>();
+  ev_io_init(w.get(), acceptcb, faddr->fd, EV_READ);
+  w->data = this;
+  ev_io_start(get_loop(), w.get());
+
+  listeners_.push_back(std::move(w));
+}
+
+void MetricsServer::accept_connection(int fd) {
+  for (;;) {
+#ifdef HAVE_ACCEPT4
+    auto cfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else // !HAVE_ACCEPT4
+    auto cfd = accept(fd, nullptr, nullptr);
+#endif // !HAVE_ACCEPT4
+
+    if (cfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        auto error = errno;
+        LOG(WARN) << "metrics: accept() failed: " << strerror(error);
+      }
+      return;
+    }
+
+#ifndef HAVE_ACCEPT4
+    util::make_socket_nonblocking(cfd);
+    util::make_socket_closeonexec(cfd);
+#endif // !HAVE_ACCEPT4
+
+    conns_.append(new MetricsConnection(cfd, this));
+  }
+}
+
+void MetricsServer::disable() {
+  auto loop = get_loop();
+
+  for (auto &w : listeners_) {
+    ev_io_stop(loop, w.get());
+  }
+}
+
+void MetricsServer::remove_connection(MetricsConnection *conn) {
+  conns_.remove(conn);
+  delete conn;
+}
+
+std::string MetricsServer::format() const {
+  return format_metrics(conn_handler_->collect_metrics());
+}
+
+struct ev_loop *MetricsServer::get_loop() const {
+  return conn_handler_->get_loop();
+}
+
+} // namespace shrpx
@@ -0,0 +1,100 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_METRICS_SERVER_H
+#define SHRPX_METRICS_SERVER_H
+
+#include "shrpx.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ev.h>
+
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+class ConnectionHandler;
+class MetricsServer;
+struct UpstreamAddr;
+
+// MetricsConnection serves one HTTP/1.1 request to metrics endpoint,
+// and closes connection after response is written.
+class MetricsConnection {
+public:
+  MetricsConnection(int fd, MetricsServer *server);
+  ~MetricsConnection();
+
+  // These functions return -1 if connection should be closed.
+  int on_read();
+  int on_write();
+  MetricsServer *get_server() const;
+
+  MetricsConnection *dlnext, *dlprev;
+
+private:
+  // Prepares response to request in |rbuf_|.
+  void prepare_response();
+
+  std::string rbuf_;
+  std::string wbuf_;
+  size_t wpos_;
+  ev_io rev_;
+  ev_io wev_;
+  ev_timer rt_;
+  MetricsServer *server_;
+  int fd_;
+};
+
+// MetricsServer accepts connections on the addresses given by
+// --metrics-frontend, and serves metrics of workers in Prometheus
+// text format.  It runs in the same event loop as the frontend
+// acceptors.
+class MetricsServer {
+public:
+  MetricsServer(ConnectionHandler *conn_handler);
+  ~MetricsServer();
+  // Starts accepting connections on |faddr|.
+  void add_listener(const UpstreamAddr *faddr);
+  void accept_connection(int fd);
+  // Stops accepting new connections.
+  void disable();
+  void remove_connection(MetricsConnection *conn);
+  // Returns metrics of all workers in Prometheus text format.
+  std::string format() const;
+  struct ev_loop *get_loop() const;
+
+private:
+  std::vector<std::unique_ptr<ev_io>> listeners_;
+  DList<MetricsConnection> conns_;
+  ConnectionHandler *conn_handler_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_METRICS_SERVER_H
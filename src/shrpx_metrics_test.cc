@@ -0,0 +1,128 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_metrics_test.h"
+
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_metrics.h"
+
+namespace shrpx {
+
+void test_shrpx_metrics_latency_histogram(void) {
+  CU_ASSERT(0 == latency_histogram_bucket(0));
+  CU_ASSERT(0 == latency_histogram_bucket(128));
+  CU_ASSERT(1 == latency_histogram_bucket(129));
+  CU_ASSERT(1 == latency_histogram_bucket(160));
+  CU_ASSERT(2 == latency_histogram_bucket(161));
+  CU_ASSERT(4 == latency_histogram_bucket(256));
+  CU_ASSERT(5 == latency_histogram_bucket(257));
+  CU_ASSERT(LATENCY_HISTOGRAM_NUM_BUCKETS - 2 ==
+            latency_histogram_bucket(1 << 26));
+  CU_ASSERT(LATENCY_HISTOGRAM_NUM_BUCKETS - 1 ==
+            latency_histogram_bucket((1 << 26) + 1));
+  CU_ASSERT(LATENCY_HISTOGRAM_NUM_BUCKETS - 1 ==
+            latency_histogram_bucket(UINT64_MAX));
+
+  CU_ASSERT(128 == latency_histogram_upper_bound(0));
+  CU_ASSERT(160 == latency_histogram_upper_bound(1));
+  CU_ASSERT(256 == latency_histogram_upper_bound(4));
+  CU_ASSERT(1 << 26 ==
+            latency_histogram_upper_bound(LATENCY_HISTOGRAM_NUM_BUCKETS - 2));
+
+  // Every value falls in the bucket whose bounds contain it.
+  for (size_t i = 1; i < LATENCY_HISTOGRAM_NUM_BUCKETS - 1; ++i) {
+    auto lower = latency_histogram_upper_bound(i - 1);
+    auto upper = latency_histogram_upper_bound(i);
+
+    CU_ASSERT(lower < upper);
+    // Each bucket is at most 25% wider than its lower bound.
+    CU_ASSERT((upper - lower) * 4 <= lower);
+    CU_ASSERT(i == latency_histogram_bucket(lower + 1));
+    CU_ASSERT(i == latency_histogram_bucket(upper));
+  }
+}
+
+void test_shrpx_metrics_format(void) {
+  WorkerMetrics m1, m2;
+
+  m1.frontend_connections.add(3);
+  m1.active_frontend_connections.add(3);
+  m1.active_frontend_connections.sub();
+  m2.frontend_connections.add();
+
+  m1.on_request_complete(200, 0, 1000, 100);
+  m1.on_request_complete(404, 10, 20, 1000);
+  m2.on_request_complete(503, -1, 0, 100000000);
+
+  m2.backend_ttfb.observe_seconds(0.5);
+
+  MetricsSnapshot snap;
+  m1.accumulate(snap);
+  m2.accumulate(snap);
+
+  CU_ASSERT(2 == snap.num_workers);
+  CU_ASSERT(4 == snap.frontend_connections);
+  CU_ASSERT(2 == snap.active_frontend_connections);
+  CU_ASSERT(3 == snap.requests);
+  CU_ASSERT(10 == snap.request_body_bytes);
+  CU_ASSERT(1020 == snap.response_body_bytes);
+
+  auto s = format_metrics(snap);
+
+  CU_ASSERT(std::string::npos !=
+            s.find("# TYPE nghttpx_frontend_connections_total counter\n"
+                   "nghttpx_frontend_connections_total 4\n"));
+  CU_ASSERT(std::string::npos != s.find("nghttpx_frontend_connections 2\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("nghttpx_responses_total{code=\"2xx\"} 1\n"
+                   "nghttpx_responses_total{code=\"3xx\"} 0\n"
+                   "nghttpx_responses_total{code=\"4xx\"} 1\n"
+                   "nghttpx_responses_total{code=\"5xx\"} 1\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("# TYPE nghttpx_request_duration_seconds histogram\n"
+                   "nghttpx_request_duration_seconds_bucket{le=\"0.000128\"} "
+                   "1\n"
+                   "nghttpx_request_duration_seconds_bucket{le=\"0.00016\"} "
+                   "1\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("nghttpx_request_duration_seconds_bucket{le=\"0.001024\"} "
+                   "2\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("nghttpx_request_duration_seconds_bucket{le=\"67.108864\"} "
+                   "2\n"
+                   "nghttpx_request_duration_seconds_bucket{le=\"+Inf\"} 3\n"
+                   "nghttpx_request_duration_seconds_sum 100.0011\n"
+                   "nghttpx_request_duration_seconds_count 3\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("nghttpx_backend_ttfb_seconds_bucket{le=\"0.524288\"} 1\n"
+                   "nghttpx_backend_ttfb_seconds_bucket{le=\"0.65536\"} 1\n"));
+  CU_ASSERT(std::string::npos !=
+            s.find("nghttpx_backend_ttfb_seconds_sum 0.5\n"
+                   "nghttpx_backend_ttfb_seconds_count 1\n"));
+}
+
+} // namespace shrpx
@@ -238,7 +238,9 @@ mrb_value response_return(mrb_state *mrb, mrb_value self) {
 
   auto upstream = downstream->get_upstream();
 
-  rv = upstream->send_reply(downstream, body, bodylen);
+  auto iov = iovec{const_cast<uint8_t *>(body), bodylen};
+
+  rv = upstream->send_reply(downstream, &iov, 1);
   if (rv != 0) {
     mrb_raise(mrb, E_RUNTIME_ERROR, "could not send response");
   }
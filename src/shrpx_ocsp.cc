@@ -0,0 +1,787 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_ocsp.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+#include "shrpx_config.h"
+#include "shrpx_ssl.h"
+#include "shrpx_log.h"
+#include "shrpx_error.h"
+#include "util.h"
+
+namespace shrpx {
+
+OCSPQuery::OCSPQuery()
+    : port(0), cert(nullptr), issuer(nullptr), id(nullptr) {}
+
+OCSPQuery::~OCSPQuery() {
+  if (id) {
+    OCSP_CERTID_free(id);
+  }
+  if (issuer) {
+    X509_free(issuer);
+  }
+  if (cert) {
+    X509_free(cert);
+  }
+}
+
+namespace {
+// Parses OCSP responder URI |uri|, and stores its host, port and
+// path in |query|.  Only http URI is supported.
+int parse_responder_uri(OCSPQuery &query, const std::string &uri) {
+  http_parser_url u{};
+  if (http_parser_parse_url(uri.c_str(), uri.size(), 0, &u) != 0 ||
+      !util::has_uri_field(u, UF_SCHEMA) || !util::has_uri_field(u, UF_HOST)) {
+    LOG(ERROR) << "Could not parse OCSP responder URI " << uri;
+    return -1;
+  }
+
+  auto &schema = u.field_data[UF_SCHEMA];
+  if (!util::strieq_l("http", uri.c_str() + schema.off, schema.len)) {
+    LOG(ERROR) << "OCSP responder URI " << uri
+               << ": only http scheme is supported";
+    return -1;
+  }
+
+  auto &host = u.field_data[UF_HOST];
+  query.host.assign(uri.c_str() + host.off, host.len);
+
+  if (util::has_uri_field(u, UF_PORT)) {
+    query.port = u.port;
+  } else {
+    query.port = 80;
+  }
+
+  if (util::has_uri_field(u, UF_PATH)) {
+    auto &path = u.field_data[UF_PATH];
+    query.path.assign(uri.c_str() + path.off, path.len);
+  } else {
+    query.path = "/";
+  }
+
+  if (util::has_uri_field(u, UF_QUERY)) {
+    auto &q = u.field_data[UF_QUERY];
+    query.path += '?';
+    query.path.append(uri.c_str() + q.off, q.len);
+  }
+
+  return 0;
+}
+} // namespace
+
+namespace {
+// Returns the first OCSP responder URI in |cert|, or empty string if
+// there is none.
+std::string get_ocsp_uri(X509 *cert) {
+  auto uris = X509_get1_ocsp(cert);
+  if (!uris) {
+    return "";
+  }
+
+  auto uri_del = defer(X509_email_free, uris);
+
+  if (sk_OPENSSL_STRING_num(uris) == 0) {
+    return "";
+  }
+
+  return sk_OPENSSL_STRING_value(uris, 0);
+}
+} // namespace
+
+std::unique_ptr<OCSPQuery> create_ocsp_query(const char *cert_file,
+                                             const StringRef &responder) {
+  auto bio = BIO_new_file(cert_file, "r");
+  if (!bio) {
+    LOG(ERROR) << "Could not open certificate file " << cert_file;
+    return nullptr;
+  }
+
+  auto bio_del = defer(BIO_free, bio);
+
+  auto query = make_unique<OCSPQuery>();
+
+  query->cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  if (!query->cert) {
+    LOG(ERROR) << "Could not read certificate from " << cert_file;
+    return nullptr;
+  }
+
+  if (X509_check_issued(query->cert, query->cert) == X509_V_OK) {
+    query->issuer = X509_dup(query->cert);
+  } else {
+    X509 *cert;
+    while ((cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr))) {
+      if (!query->issuer &&
+          X509_check_issued(cert, query->cert) == X509_V_OK) {
+        query->issuer = cert;
+        continue;
+      }
+      X509_free(cert);
+    }
+    // PEM_read_bio_X509 leaves an error on the queue at the end of
+    // file.
+    ERR_clear_error();
+  }
+
+  if (!query->issuer) {
+    LOG(ERROR) << "Could not find issuer certificate in " << cert_file;
+    return nullptr;
+  }
+
+  auto uri = responder.empty() ? get_ocsp_uri(query->cert)
+                               : std::string(responder.c_str());
+  if (uri.empty()) {
+    LOG(ERROR) << "No OCSP responder URI found in " << cert_file;
+    return nullptr;
+  }
+
+  if (parse_responder_uri(*query, uri) != 0) {
+    return nullptr;
+  }
+
+  query->id = OCSP_cert_to_id(nullptr, query->cert, query->issuer);
+  if (!query->id) {
+    LOG(ERROR) << "Could not create OCSP certificate ID for " << cert_file;
+    return nullptr;
+  }
+
+  auto req = OCSP_REQUEST_new();
+  if (!req) {
+    LOG(ERROR) << "OCSP_REQUEST_new() failed";
+    return nullptr;
+  }
+
+  auto req_del = defer(OCSP_REQUEST_free, req);
+
+  auto id = OCSP_CERTID_dup(query->id);
+  if (!id || !OCSP_request_add0_id(req, id)) {
+    if (id) {
+      OCSP_CERTID_free(id);
+    }
+    LOG(ERROR) << "Could not add certificate ID to OCSP request";
+    return nullptr;
+  }
+
+  auto len = i2d_OCSP_REQUEST(req, nullptr);
+  if (len <= 0) {
+    LOG(ERROR) << "Could not encode OCSP request";
+    return nullptr;
+  }
+
+  query->request.resize(len);
+  auto p = query->request.data();
+  i2d_OCSP_REQUEST(req, &p);
+
+  return query;
+}
+
+int verify_ocsp_response(const OCSPQuery &query, const uint8_t *data,
+                         size_t datalen) {
+  auto p = data;
+  auto resp = d2i_OCSP_RESPONSE(nullptr, &p, datalen);
+  if (!resp) {
+    LOG(ERROR) << "Could not parse OCSP response";
+    return -1;
+  }
+
+  auto resp_del = defer(OCSP_RESPONSE_free, resp);
+
+  auto status = OCSP_response_status(resp);
+  if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+    LOG(ERROR) << "OCSP response status is not successful: "
+               << OCSP_response_status_str(status);
+    return -1;
+  }
+
+  auto bs = OCSP_response_get1_basic(resp);
+  if (!bs) {
+    LOG(ERROR) << "Could not get basic OCSP response";
+    return -1;
+  }
+
+  auto bs_del = defer(OCSP_BASICRESP_free, bs);
+
+  auto store = X509_STORE_new();
+  if (!store) {
+    LOG(ERROR) << "X509_STORE_new() failed";
+    return -1;
+  }
+
+  auto store_del = defer(X509_STORE_free, store);
+
+  // The response is signed by the issuer itself, or by the delegated
+  // responder whose certificate is signed by the issuer.  We have no
+  // root certificate here, and trust the issuer.
+  X509_STORE_add_cert(store, query.issuer);
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+  X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+#endif // X509_V_FLAG_PARTIAL_CHAIN
+
+  auto certs = sk_X509_new_null();
+  if (!certs) {
+    LOG(ERROR) << "sk_X509_new_null() failed";
+    return -1;
+  }
+
+  auto certs_del = defer([](STACK_OF(X509) * certs) { sk_X509_free(certs); },
+                         certs);
+
+  sk_X509_push(certs, query.issuer);
+
+  if (OCSP_basic_verify(bs, certs, store, OCSP_TRUSTOTHER) != 1) {
+    LOG(ERROR) << "Could not verify OCSP response signature: "
+               << ERR_error_string(ERR_get_error(), nullptr);
+    ERR_clear_error();
+    return -1;
+  }
+
+  int cert_status, reason;
+  ASN1_GENERALIZEDTIME *thisupd, *nextupd;
+  if (!OCSP_resp_find_status(bs, query.id, &cert_status, &reason, nullptr,
+                             &thisupd, &nextupd)) {
+    LOG(ERROR) << "OCSP response does not contain status of certificate";
+    return -1;
+  }
+
+  // Allow 5 minutes clock skew between us and responder.
+  if (!OCSP_check_validity(thisupd, nextupd, 300, -1)) {
+    LOG(ERROR) << "OCSP response is not valid at this time";
+    ERR_clear_error();
+    return -1;
+  }
+
+  switch (cert_status) {
+  case V_OCSP_CERTSTATUS_GOOD:
+    break;
+  case V_OCSP_CERTSTATUS_REVOKED:
+    LOG(WARN) << "OCSP responder says that certificate has been revoked";
+    break;
+  default:
+    LOG(ERROR) << "OCSP responder does not know the certificate";
+    return -1;
+  }
+
+  return 0;
+}
+
+namespace {
+void fetch_writecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fetch = static_cast<OCSPFetch *>(w->data);
+
+  if (fetch->on_write() != 0) {
+    fetch->finish(-1);
+  }
+}
+} // namespace
+
+namespace {
+void fetch_readcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fetch = static_cast<OCSPFetch *>(w->data);
+
+  auto rv = fetch->on_read();
+  switch (rv) {
+  case 0:
+    return;
+  case SHRPX_ERR_EOF:
+    fetch->finish(0);
+    return;
+  default:
+    fetch->finish(-1);
+    return;
+  }
+}
+} // namespace
+
+namespace {
+void fetch_timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto fetch = static_cast<OCSPFetch *>(w->data);
+
+  LOG(WARN) << "OCSP query timed out";
+
+  fetch->finish(-1);
+}
+} // namespace
+
+namespace {
+int htp_hdrs_completecb(http_parser *htp) {
+  if (htp->status_code != 200) {
+    LOG(ERROR) << "OCSP responder returned HTTP status code "
+               << htp->status_code;
+    return -1;
+  }
+  return 0;
+}
+} // namespace
+
+namespace {
+int htp_bodycb(http_parser *htp, const char *data, size_t len) {
+  auto fetch = static_cast<OCSPFetch *>(htp->data);
+
+  return fetch->on_body(reinterpret_cast<const uint8_t *>(data), len);
+}
+} // namespace
+
+namespace {
+int htp_msg_completecb(http_parser *htp) {
+  auto fetch = static_cast<OCSPFetch *>(htp->data);
+
+  fetch->on_message_complete();
+
+  return 0;
+}
+} // namespace
+
+namespace {
+http_parser_settings htp_hooks = {
+    nullptr,             // http_cb on_message_begin;
+    nullptr,             // http_data_cb on_url;
+    nullptr,             // http_data_cb on_status;
+    nullptr,             // http_data_cb on_header_field;
+    nullptr,             // http_data_cb on_header_value;
+    htp_hdrs_completecb, // http_cb      on_headers_complete;
+    htp_bodycb,          // http_data_cb on_body;
+    htp_msg_completecb   // http_cb      on_message_complete;
+};
+} // namespace
+
+OCSPFetch::OCSPFetch(struct ev_loop *loop, OCSPUpdater *updater,
+                     SSL_CTX *ssl_ctx, std::unique_ptr<OCSPQuery> query)
+    : query_(std::move(query)),
+      loop_(loop),
+      updater_(updater),
+      ssl_ctx_(ssl_ctx),
+      wpos_(0),
+      fd_(-1),
+      connected_(false),
+      message_complete_(false) {
+  ev_io_init(&wev_, fetch_writecb, -1, EV_WRITE);
+  wev_.data = this;
+
+  ev_io_init(&rev_, fetch_readcb, -1, EV_READ);
+  rev_.data = this;
+
+  ev_timer_init(&t_, fetch_timeoutcb, OCSP_FETCH_TIMEOUT, 0.);
+  t_.data = this;
+
+  http_parser_init(&htp_, HTTP_RESPONSE);
+  htp_.data = this;
+}
+
+OCSPFetch::~OCSPFetch() {
+  ev_timer_stop(loop_, &t_);
+  ev_io_stop(loop_, &rev_);
+  ev_io_stop(loop_, &wev_);
+
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+int OCSPFetch::initiate_connection(const Address &addr) {
+  fd_ = util::create_nonblock_socket(addr.su.storage.ss_family);
+  if (fd_ == -1) {
+    return -1;
+  }
+
+  auto rv = connect(fd_, &addr.su.sa, addr.len);
+  if (rv != 0 && errno != EINPROGRESS) {
+    auto error = errno;
+    LOG(WARN) << "OCSP query: connect() to " << query_->host << " failed; "
+              << "errno=" << error;
+    return -1;
+  }
+
+  auto hostport = util::make_http_hostport(StringRef(query_->host),
+                                           query_->port);
+
+  wbuf_ = "POST ";
+  wbuf_ += query_->path;
+  wbuf_ += " HTTP/1.1\r\nHost: ";
+  wbuf_ += hostport;
+  wbuf_ += "\r\nContent-Type: application/ocsp-request\r\nContent-Length: ";
+  wbuf_ += util::utos(query_->request.size());
+  wbuf_ += "\r\nConnection: close\r\n\r\n";
+  wbuf_.append(std::begin(query_->request), std::end(query_->request));
+
+  ev_io_set(&wev_, fd_, EV_WRITE);
+  ev_io_set(&rev_, fd_, EV_READ);
+
+  ev_io_start(loop_, &wev_);
+  ev_timer_start(loop_, &t_);
+
+  return 0;
+}
+
+int OCSPFetch::on_write() {
+  if (!connected_) {
+    if (!util::check_socket_connected(fd_)) {
+      LOG(WARN) << "OCSP query: could not connect to " << query_->host;
+      return -1;
+    }
+
+    connected_ = true;
+
+    ev_io_start(loop_, &rev_);
+  }
+
+  while (wpos_ < wbuf_.size()) {
+    ssize_t nwrite;
+    while ((nwrite = write(fd_, wbuf_.c_str() + wpos_,
+                           wbuf_.size() - wpos_)) == -1 &&
+           errno == EINTR)
+      ;
+    if (nwrite == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+
+    wpos_ += nwrite;
+  }
+
+  ev_io_stop(loop_, &wev_);
+
+  return 0;
+}
+
+int OCSPFetch::on_read() {
+  std::array<uint8_t, 8_k> buf;
+
+  for (;;) {
+    ssize_t nread;
+    while ((nread = read(fd_, buf.data(), buf.size())) == -1 &&
+           errno == EINTR)
+      ;
+    if (nread == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+
+    // Passing 0 length tells http_parser that the connection has been
+    // closed.
+    http_parser_execute(&htp_, &htp_hooks,
+                        reinterpret_cast<const char *>(buf.data()), nread);
+
+    if (HTTP_PARSER_ERRNO(&htp_) != HPE_OK) {
+      LOG(WARN) << "OCSP query: could not parse HTTP response: "
+                << http_errno_name(HTTP_PARSER_ERRNO(&htp_));
+      return -1;
+    }
+
+    if (message_complete_) {
+      return SHRPX_ERR_EOF;
+    }
+
+    if (nread == 0) {
+      LOG(WARN) << "OCSP query: connection closed prematurely";
+      return -1;
+    }
+  }
+}
+
+void OCSPFetch::finish(int rv) {
+  ev_timer_stop(loop_, &t_);
+  ev_io_stop(loop_, &rev_);
+  ev_io_stop(loop_, &wev_);
+
+  updater_->on_fetch_done(this, rv);
+}
+
+int OCSPFetch::on_body(const uint8_t *data, size_t len) {
+  if (body_.size() + len > OCSP_MAX_RESPONSE_LENGTH) {
+    LOG(WARN) << "OCSP query: response is too large";
+    return -1;
+  }
+
+  body_.insert(std::end(body_), data, data + len);
+
+  return 0;
+}
+
+void OCSPFetch::on_message_complete() { message_complete_ = true; }
+
+SSL_CTX *OCSPFetch::get_ssl_ctx() const { return ssl_ctx_; }
+
+const OCSPQuery &OCSPFetch::get_query() const { return *query_; }
+
+std::vector<uint8_t> &OCSPFetch::get_response() { return body_; }
+
+namespace {
+void resolve_async_cb(struct ev_loop *loop, ev_async *w, int revents) {
+  auto updater = static_cast<OCSPUpdater *>(w->data);
+
+  updater->on_resolved();
+}
+} // namespace
+
+namespace {
+using HostPort = std::pair<std::string, uint16_t>;
+} // namespace
+
+namespace {
+std::string hostport_key(const std::string &host, uint16_t port) {
+  return util::make_hostport(StringRef(host), port);
+}
+} // namespace
+
+namespace {
+// Resolves |hosts|.  This function may block, and it does not write
+// log, so that it can be called from another thread.  Host which
+// cannot be resolved is not included in the result.
+std::map<std::string, Address>
+resolve_hosts(const std::vector<HostPort> &hosts) {
+  std::map<std::string, Address> res;
+
+  for (auto &hp : hosts) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    auto service = util::utos(hp.second);
+
+    addrinfo *ai;
+    if (getaddrinfo(hp.first.c_str(), service.c_str(), &hints, &ai) != 0) {
+      continue;
+    }
+
+    Address addr;
+    addr.len = ai->ai_addrlen;
+    memcpy(&addr.su, ai->ai_addr, ai->ai_addrlen);
+
+    freeaddrinfo(ai);
+
+    res.emplace(hostport_key(hp.first, hp.second), addr);
+  }
+
+  return res;
+}
+} // namespace
+
+OCSPUpdater::OCSPUpdater(struct ev_loop *loop)
+    : loop_(loop), running_(false) {
+  ev_async_init(&resolve_asyncev_, resolve_async_cb);
+  resolve_asyncev_.data = this;
+}
+
+OCSPUpdater::~OCSPUpdater() {
+  ev_async_stop(loop_, &resolve_asyncev_);
+
+#ifndef NOTHREADS
+  if (resolve_fut_.valid()) {
+    resolve_fut_.wait();
+  }
+#endif // !NOTHREADS
+}
+
+void OCSPUpdater::start(const std::vector<SSL_CTX *> &ssl_ctxs,
+                        std::function<void()> donecb) {
+  cancel();
+
+  auto &ocspconf = get_config()->tls.ocsp;
+  auto responder = StringRef(ocspconf.responder);
+
+  std::vector<HostPort> hosts;
+
+  for (auto ssl_ctx : ssl_ctxs) {
+    auto tls_ctx_data =
+        static_cast<ssl::TLSContextData *>(SSL_CTX_get_app_data(ssl_ctx));
+
+    // client SSL_CTX has no tls_ctx_data.
+    if (!tls_ctx_data) {
+      continue;
+    }
+
+    auto query = create_ocsp_query(tls_ctx_data->cert_file, responder);
+    if (!query) {
+      LOG(WARN) << "ocsp update for " << tls_ctx_data->cert_file
+                << " skipped";
+      continue;
+    }
+
+    auto hp = HostPort{query->host, query->port};
+    if (std::find(std::begin(hosts), std::end(hosts), hp) ==
+        std::end(hosts)) {
+      hosts.push_back(std::move(hp));
+    }
+
+    queue_.push_back(Job{ssl_ctx, std::move(query)});
+  }
+
+  if (queue_.empty()) {
+    donecb();
+    return;
+  }
+
+  running_ = true;
+  donecb_ = std::move(donecb);
+
+#ifndef NOTHREADS
+  if (resolve_fut_.valid()) {
+    // Previous resolution was canceled, but it is still running.
+    resolve_fut_.wait();
+    resolve_fut_ = {};
+  }
+
+  ev_async_start(loop_, &resolve_asyncev_);
+
+  // getaddrinfo may block, so that it is done in another thread.
+  resolve_fut_ = std::async(std::launch::async, [this, hosts]() {
+    auto res = resolve_hosts(hosts);
+
+    ev_async_send(loop_, &resolve_asyncev_);
+
+    return res;
+  });
+#else  // NOTHREADS
+  addrs_ = resolve_hosts(hosts);
+  on_resolved();
+#endif // NOTHREADS
+}
+
+void OCSPUpdater::cancel() {
+  running_ = false;
+  queue_.clear();
+  fetches_.clear();
+  addrs_.clear();
+  donecb_ = nullptr;
+}
+
+bool OCSPUpdater::running() const { return running_; }
+
+void OCSPUpdater::on_resolved() {
+#ifndef NOTHREADS
+  if (!resolve_fut_.valid()) {
+    return;
+  }
+
+  ev_async_stop(loop_, &resolve_asyncev_);
+
+  addrs_ = resolve_fut_.get();
+#endif // !NOTHREADS
+
+  if (!running_) {
+    addrs_.clear();
+    return;
+  }
+
+  fetch_next();
+}
+
+void OCSPUpdater::fetch_next() {
+  auto &ocspconf = get_config()->tls.ocsp;
+  auto concurrency = std::max<size_t>(1, ocspconf.fetch_concurrency);
+
+  while (fetches_.size() < concurrency && !queue_.empty()) {
+    auto job = std::move(queue_.front());
+    queue_.pop_front();
+
+    auto tls_ctx_data =
+        static_cast<ssl::TLSContextData *>(SSL_CTX_get_app_data(job.ssl_ctx));
+
+    auto it = addrs_.find(hostport_key(job.query->host, job.query->port));
+    if (it == std::end(addrs_)) {
+      LOG(WARN) << "ocsp update for " << tls_ctx_data->cert_file
+                << " failed: could not resolve " << job.query->host;
+      continue;
+    }
+
+    if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "Start ocsp update for " << tls_ctx_data->cert_file;
+    }
+
+    auto fetch = make_unique<OCSPFetch>(loop_, this, job.ssl_ctx,
+                                        std::move(job.query));
+    if (fetch->initiate_connection((*it).second) != 0) {
+      LOG(WARN) << "ocsp update for " << tls_ctx_data->cert_file
+                << " failed";
+      continue;
+    }
+
+    fetches_.push_back(std::move(fetch));
+  }
+
+  if (!fetches_.empty() || !queue_.empty()) {
+    return;
+  }
+
+  running_ = false;
+  addrs_.clear();
+
+  auto donecb = std::move(donecb_);
+  donecb_ = nullptr;
+
+  donecb();
+}
+
+void OCSPUpdater::on_fetch_done(OCSPFetch *fetch, int rv) {
+  auto tls_ctx_data = static_cast<ssl::TLSContextData *>(
+      SSL_CTX_get_app_data(fetch->get_ssl_ctx()));
+
+  auto &resp = fetch->get_response();
+
+  if (rv != 0 ||
+      verify_ocsp_response(fetch->get_query(), resp.data(), resp.size()) !=
+          0) {
+    LOG(WARN) << "ocsp update for " << tls_ctx_data->cert_file
+              << " failed";
+  } else {
+    if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "ocsp update for " << tls_ctx_data->cert_file
+                << " finished successfully";
+    }
+
+    ssl::update_ocsp_response(fetch->get_ssl_ctx(), std::move(resp));
+  }
+
+  auto it = std::find_if(std::begin(fetches_), std::end(fetches_),
+                         [fetch](const std::unique_ptr<OCSPFetch> &f) {
+                           return f.get() == fetch;
+                         });
+
+  assert(it != std::end(fetches_));
+
+  fetches_.erase(it);
+
+  fetch_next();
+}
+
+} // namespace shrpx
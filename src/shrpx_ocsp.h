@@ -0,0 +1,183 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_OCSP_H
+#define SHRPX_OCSP_H
+
+#include "shrpx.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <deque>
+#include <map>
+#include <functional>
+#ifndef NOTHREADS
+#include <future>
+#endif // !NOTHREADS
+
+#include <ev.h>
+
+#include <openssl/ssl.h>
+#include <openssl/ocsp.h>
+
+#include "http-parser/http_parser.h"
+
+#include "network.h"
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+// The maximum length of OCSP response the builtin client accepts.
+constexpr size_t OCSP_MAX_RESPONSE_LENGTH = 64_k;
+// Timeout for a single OCSP query, including connection
+// establishment.
+constexpr ev_tstamp OCSP_FETCH_TIMEOUT = 30.;
+
+// OCSPQuery holds the certificate, its issuer, and the OCSP request
+// which asks the status of the certificate.
+struct OCSPQuery {
+  OCSPQuery();
+  ~OCSPQuery();
+
+  // DER encoded OCSP request
+  std::vector<uint8_t> request;
+  // Host, port, and path of OCSP responder
+  std::string host;
+  std::string path;
+  uint16_t port;
+  X509 *cert;
+  X509 *issuer;
+  // Identifies |cert| in OCSP request and response
+  OCSP_CERTID *id;
+};
+
+// Creates OCSPQuery for the leaf certificate in |cert_file|.  The
+// issuer certificate must follow the leaf certificate in the file,
+// unless the leaf certificate is self-signed.  If |responder| is not
+// empty, it is used as responder URI instead of the one in the
+// certificate.  This function returns nullptr if it fails.
+std::unique_ptr<OCSPQuery> create_ocsp_query(const char *cert_file,
+                                             const StringRef &responder);
+
+// Verifies DER encoded OCSP response |data| of length |datalen| for
+// |query|.  This function returns 0 if the response is properly
+// signed, and currently valid, or -1.
+int verify_ocsp_response(const OCSPQuery &query, const uint8_t *data,
+                         size_t datalen);
+
+class OCSPUpdater;
+
+// OCSPFetch sends OCSP request to responder using HTTP/1.1 POST, and
+// reads its response.
+class OCSPFetch {
+public:
+  OCSPFetch(struct ev_loop *loop, OCSPUpdater *updater, SSL_CTX *ssl_ctx,
+            std::unique_ptr<OCSPQuery> query);
+  ~OCSPFetch();
+
+  // Starts connecting to |addr|.
+  int initiate_connection(const Address &addr);
+  int on_write();
+  // Returns 0 if more data is needed, SHRPX_ERR_EOF if response has
+  // been read completely, or -1.
+  int on_read();
+  // Tells OCSPUpdater that this query has finished with result |rv|.
+  // This object is deleted by this call.
+  void finish(int rv);
+
+  int on_body(const uint8_t *data, size_t len);
+  void on_message_complete();
+
+  SSL_CTX *get_ssl_ctx() const;
+  const OCSPQuery &get_query() const;
+  // Returns the body of HTTP response, which is OCSP response.
+  std::vector<uint8_t> &get_response();
+
+private:
+  std::string wbuf_;
+  std::vector<uint8_t> body_;
+  std::unique_ptr<OCSPQuery> query_;
+  http_parser htp_;
+  ev_io wev_;
+  ev_io rev_;
+  ev_timer t_;
+  struct ev_loop *loop_;
+  OCSPUpdater *updater_;
+  SSL_CTX *ssl_ctx_;
+  size_t wpos_;
+  int fd_;
+  bool connected_;
+  bool message_complete_;
+};
+
+// OCSPUpdater refreshes OCSP responses stapled by server SSL_CTXs
+// without forking fetch-ocsp-response script.  Responder addresses
+// are resolved in a separate thread, and then OCSP queries are made
+// in parallel on the event loop.  The number of concurrent queries is
+// bounded by fetch-ocsp-response-concurrency.
+class OCSPUpdater {
+public:
+  OCSPUpdater(struct ev_loop *loop);
+  ~OCSPUpdater();
+
+  // Starts updating OCSP responses of |ssl_ctxs|.  SSL_CTX without
+  // TLSContextData is ignored.  |donecb| is called when all queries
+  // have finished.
+  void start(const std::vector<SSL_CTX *> &ssl_ctxs,
+             std::function<void()> donecb);
+  // Cancels update in progress.  |donecb| is not called.
+  void cancel();
+  // Returns true if update is in progress.
+  bool running() const;
+
+  void on_resolved();
+  void on_fetch_done(OCSPFetch *fetch, int rv);
+
+private:
+  void fetch_next();
+
+  struct Job {
+    SSL_CTX *ssl_ctx;
+    std::unique_ptr<OCSPQuery> query;
+  };
+
+  std::deque<Job> queue_;
+  std::vector<std::unique_ptr<OCSPFetch>> fetches_;
+  // Resolved responder addresses, keyed by host and port.
+  std::map<std::string, Address> addrs_;
+#ifndef NOTHREADS
+  std::future<std::map<std::string, Address>> resolve_fut_;
+#endif // !NOTHREADS
+  std::function<void()> donecb_;
+  ev_async resolve_asyncev_;
+  struct ev_loop *loop_;
+  bool running_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_OCSP_H
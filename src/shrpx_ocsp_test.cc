@@ -0,0 +1,534 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_ocsp_test.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "shrpx_ocsp.h"
+#include "shrpx_ssl.h"
+#include "shrpx_config.h"
+#include "util.h"
+
+namespace shrpx {
+
+namespace {
+// Generates P-256 key.
+EVP_PKEY *generate_key() {
+  auto ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  auto ctx_del = defer(EVP_PKEY_CTX_free, ctx);
+
+  EVP_PKEY *pkey = nullptr;
+  if (EVP_PKEY_keygen_init(ctx) != 1 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) !=
+          1 ||
+      EVP_PKEY_keygen(ctx, &pkey) != 1) {
+    return nullptr;
+  }
+
+  return pkey;
+}
+} // namespace
+
+namespace {
+// Generates self-signed certificate for |pkey|.  If |ocsp_uri| is not
+// empty, it is included in Authority Information Access extension.
+X509 *generate_cert(EVP_PKEY *pkey, const std::string &ocsp_uri) {
+  auto cert = X509_new();
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+
+  auto name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, pkey);
+
+  if (!ocsp_uri.empty()) {
+    auto value = "OCSP;URI:" + ocsp_uri;
+    auto ext = X509V3_EXT_conf_nid(nullptr, nullptr, NID_info_access,
+                                   const_cast<char *>(value.c_str()));
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+  }
+
+  X509_sign(cert, pkey, EVP_sha256());
+
+  return cert;
+}
+} // namespace
+
+namespace {
+// Writes |cert| to temporary file, and returns its path.
+std::string write_cert(X509 *cert) {
+  char path[] = "/tmp/nghttpx-unittest.XXXXXX";
+  auto fd = mkstemp(path);
+  close(fd);
+
+  auto bio = BIO_new_file(path, "w");
+  PEM_write_bio_X509(bio, cert);
+  BIO_free(bio);
+
+  return path;
+}
+} // namespace
+
+namespace {
+enum FakeResponderMode {
+  RESPOND_GOOD,
+  // Signed by the key which is not related to the issuer.
+  RESPOND_WRONG_SIGNER,
+  RESPOND_GARBAGE,
+  RESPOND_HTTP_ERROR,
+};
+} // namespace
+
+namespace {
+struct FakeResponder;
+
+struct FakeResponderConnection {
+  FakeResponder *server;
+  std::string in, out;
+  ev_io rev, wev;
+  int fd;
+};
+
+// FakeResponder is a stand-in OCSP responder which answers the
+// status of any certificate as good.  It runs in the same event loop
+// as OCSPUpdater.
+struct FakeResponder {
+  std::vector<std::unique_ptr<FakeResponderConnection>> conns;
+  EVP_PKEY *key;
+  X509 *cert;
+  EVP_PKEY *wrong_key;
+  X509 *wrong_cert;
+  struct ev_loop *loop;
+  ev_io acceptev;
+  FakeResponderMode mode;
+  size_t num_requests;
+  // The number of connections currently open, and its maximum.
+  size_t num_active;
+  size_t max_active;
+  int fd;
+};
+} // namespace
+
+namespace {
+std::string create_ocsp_response(FakeResponder *server,
+                                 const std::string &body) {
+  auto p = reinterpret_cast<const uint8_t *>(body.data());
+  auto req = d2i_OCSP_REQUEST(nullptr, &p, body.size());
+  if (!req) {
+    return "";
+  }
+
+  auto req_del = defer(OCSP_REQUEST_free, req);
+
+  auto id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0));
+
+  auto bs = OCSP_BASICRESP_new();
+  auto bs_del = defer(OCSP_BASICRESP_free, bs);
+
+  auto thisupd = X509_gmtime_adj(nullptr, 0);
+  auto nextupd = X509_gmtime_adj(nullptr, 3600);
+
+  OCSP_basic_add1_status(bs, id, V_OCSP_CERTSTATUS_GOOD, 0, nullptr, thisupd,
+                         nextupd);
+
+  ASN1_TIME_free(nextupd);
+  ASN1_TIME_free(thisupd);
+
+  if (server->mode == RESPOND_WRONG_SIGNER) {
+    OCSP_basic_sign(bs, server->wrong_cert, server->wrong_key, EVP_sha256(),
+                    nullptr, 0);
+  } else {
+    OCSP_basic_sign(bs, server->cert, server->key, EVP_sha256(), nullptr, 0);
+  }
+
+  auto resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+  auto resp_del = defer(OCSP_RESPONSE_free, resp);
+
+  std::string res;
+  res.resize(i2d_OCSP_RESPONSE(resp, nullptr));
+  auto q = reinterpret_cast<uint8_t *>(&res[0]);
+  i2d_OCSP_RESPONSE(resp, &q);
+
+  return res;
+}
+} // namespace
+
+namespace {
+void close_connection(FakeResponderConnection *fconn) {
+  auto loop = fconn->server->loop;
+
+  ev_io_stop(loop, &fconn->rev);
+  ev_io_stop(loop, &fconn->wev);
+  close(fconn->fd);
+  fconn->fd = -1;
+
+  --fconn->server->num_active;
+}
+} // namespace
+
+namespace {
+void fake_writecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fconn = static_cast<FakeResponderConnection *>(w->data);
+  auto &out = fconn->out;
+
+  while (!out.empty()) {
+    auto nwrite = write(fconn->fd, out.data(), out.size());
+    if (nwrite == -1) {
+      ev_io_start(loop, &fconn->wev);
+      return;
+    }
+    out.erase(0, nwrite);
+  }
+
+  close_connection(fconn);
+}
+} // namespace
+
+namespace {
+// Returns true if HTTP request has been read completely, and prepares
+// response.
+bool process_request(FakeResponderConnection *fconn) {
+  auto server = fconn->server;
+  auto &in = fconn->in;
+
+  auto end = in.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return false;
+  }
+
+  auto hd = in.find("Content-Length: ");
+  if (hd == std::string::npos || hd > end) {
+    return false;
+  }
+
+  auto len = strtoul(in.c_str() + hd + str_size("Content-Length: "), nullptr,
+                     10);
+  if (in.size() < end + 4 + len) {
+    return false;
+  }
+
+  ++server->num_requests;
+
+  std::string body;
+  auto status = "200 OK";
+
+  switch (server->mode) {
+  case RESPOND_GOOD:
+  case RESPOND_WRONG_SIGNER:
+    body = create_ocsp_response(server, in.substr(end + 4, len));
+    break;
+  case RESPOND_GARBAGE:
+    body = "garbage";
+    break;
+  case RESPOND_HTTP_ERROR:
+    status = "500 Internal Server Error";
+    break;
+  }
+
+  fconn->out = "HTTP/1.1 ";
+  fconn->out += status;
+  fconn->out += "\r\nContent-Type: application/ocsp-response\r\n"
+                "Content-Length: ";
+  fconn->out += util::utos(body.size());
+  fconn->out += "\r\nConnection: close\r\n\r\n";
+  fconn->out += body;
+
+  return true;
+}
+} // namespace
+
+namespace {
+void fake_readcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto fconn = static_cast<FakeResponderConnection *>(w->data);
+  std::array<char, 16_k> buf;
+
+  for (;;) {
+    auto nread = read(fconn->fd, buf.data(), buf.size());
+    if (nread <= 0) {
+      break;
+    }
+    fconn->in.append(buf.data(), nread);
+  }
+
+  if (!process_request(fconn)) {
+    return;
+  }
+
+  ev_io_stop(loop, &fconn->rev);
+  fake_writecb(loop, &fconn->wev, 0);
+}
+} // namespace
+
+namespace {
+void fake_acceptcb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto server = static_cast<FakeResponder *>(w->data);
+
+  auto fd = accept(server->fd, nullptr, nullptr);
+  if (fd == -1) {
+    return;
+  }
+
+  util::make_socket_nonblocking(fd);
+
+  auto fconn = make_unique<FakeResponderConnection>();
+  fconn->server = server;
+  fconn->fd = fd;
+  ev_io_init(&fconn->rev, fake_readcb, fd, EV_READ);
+  fconn->rev.data = fconn.get();
+  ev_io_init(&fconn->wev, fake_writecb, fd, EV_WRITE);
+  fconn->wev.data = fconn.get();
+  ev_io_start(loop, &fconn->rev);
+
+  server->max_active = std::max(server->max_active, ++server->num_active);
+
+  server->conns.push_back(std::move(fconn));
+}
+} // namespace
+
+void test_shrpx_ocsp_create_query(void) {
+  auto pkey = generate_key();
+  auto cert = generate_cert(pkey, "http://127.0.0.1:3000/ocsp");
+  auto cert_file = write_cert(cert);
+
+  {
+    auto query = create_ocsp_query(cert_file.c_str(), StringRef{});
+
+    CU_ASSERT(nullptr != query);
+    CU_ASSERT("127.0.0.1" == query->host);
+    CU_ASSERT(3000 == query->port);
+    CU_ASSERT("/ocsp" == query->path);
+    CU_ASSERT(!query->request.empty());
+  }
+
+  {
+    auto query = create_ocsp_query(
+        cert_file.c_str(), StringRef::from_lit("http://localhost/a?b=c"));
+
+    CU_ASSERT(nullptr != query);
+    CU_ASSERT("localhost" == query->host);
+    CU_ASSERT(80 == query->port);
+    CU_ASSERT("/a?b=c" == query->path);
+  }
+
+  // https responder is not supported.
+  CU_ASSERT(nullptr ==
+            create_ocsp_query(cert_file.c_str(),
+                              StringRef::from_lit("https://localhost/")));
+
+  unlink(cert_file.c_str());
+  X509_free(cert);
+
+  // No responder URI in certificate.
+  cert = generate_cert(pkey, "");
+  cert_file = write_cert(cert);
+
+  CU_ASSERT(nullptr == create_ocsp_query(cert_file.c_str(), StringRef{}));
+
+  unlink(cert_file.c_str());
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+}
+
+namespace {
+void timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  ev_break(loop);
+}
+} // namespace
+
+void test_shrpx_ocsp_updater(void) {
+  auto loop = ev_loop_new(0);
+
+  FakeResponder server{};
+  server.loop = loop;
+  server.fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  Address addr{};
+  addr.su.in.sin_family = AF_INET;
+  addr.su.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.len = sizeof(addr.su.in);
+
+  CU_ASSERT(0 == bind(server.fd, &addr.su.sa, addr.len));
+  CU_ASSERT(0 == listen(server.fd, 16));
+  socklen_t addrlen = addr.len;
+  CU_ASSERT(0 == getsockname(server.fd, &addr.su.sa, &addrlen));
+
+  util::make_socket_nonblocking(server.fd);
+  ev_io_init(&server.acceptev, fake_acceptcb, server.fd, EV_READ);
+  server.acceptev.data = &server;
+  ev_io_start(loop, &server.acceptev);
+
+  auto uri = "http://127.0.0.1:" + util::utos(ntohs(addr.su.in.sin_port)) +
+             "/ocsp";
+
+  server.key = generate_key();
+  server.cert = generate_cert(server.key, uri);
+  server.wrong_key = generate_key();
+  server.wrong_cert = generate_cert(server.wrong_key, "");
+
+  auto cert_file = write_cert(server.cert);
+
+  constexpr size_t num_ctxs = 5;
+
+  std::vector<SSL_CTX *> ssl_ctxs;
+  std::vector<std::unique_ptr<ssl::TLSContextData>> tls_ctx_datas;
+
+  for (size_t i = 0; i < num_ctxs; ++i) {
+    auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    auto tls_ctx_data = make_unique<ssl::TLSContextData>();
+    tls_ctx_data->cert_file = cert_file.c_str();
+    SSL_CTX_set_app_data(ssl_ctx, tls_ctx_data.get());
+    ssl_ctxs.push_back(ssl_ctx);
+    tls_ctx_datas.push_back(std::move(tls_ctx_data));
+  }
+
+  // SSL_CTX without TLSContextData is ignored.
+  ssl_ctxs.push_back(SSL_CTX_new(SSLv23_client_method()));
+
+  auto &ocspconf = mod_config()->tls.ocsp;
+  ocspconf.fetch_concurrency = 2;
+  ocspconf.responder = ImmutableString{};
+
+  ev_timer timeout;
+  ev_timer_init(&timeout, timeoutcb, 10., 0.);
+  ev_timer_start(loop, &timeout);
+
+  {
+    OCSPUpdater updater(loop);
+
+    auto query = create_ocsp_query(cert_file.c_str(), StringRef{});
+
+    size_t num_done = 0;
+    auto donecb = [&]() {
+      ++num_done;
+      ev_break(loop);
+    };
+
+    updater.start(ssl_ctxs, donecb);
+
+    CU_ASSERT(updater.running());
+
+    ev_run(loop, 0);
+
+    CU_ASSERT(1 == num_done);
+    CU_ASSERT(!updater.running());
+    CU_ASSERT(num_ctxs == server.num_requests);
+    CU_ASSERT(ocspconf.fetch_concurrency >= server.max_active);
+
+    for (auto &tls_ctx_data : tls_ctx_datas) {
+      auto &ocsp_data = tls_ctx_data->ocsp_data;
+
+      CU_ASSERT(nullptr != ocsp_data);
+      if (ocsp_data) {
+        CU_ASSERT(0 == verify_ocsp_response(*query, ocsp_data->data(),
+                                            ocsp_data->size()));
+      }
+    }
+
+    auto good = tls_ctx_datas[0]->ocsp_data;
+
+    // Responses which fail verification do not replace the current
+    // one.
+    for (auto mode :
+         {RESPOND_WRONG_SIGNER, RESPOND_GARBAGE, RESPOND_HTTP_ERROR}) {
+      server.mode = mode;
+      server.num_requests = 0;
+      num_done = 0;
+
+      updater.start(ssl_ctxs, donecb);
+
+      ev_run(loop, 0);
+
+      CU_ASSERT(1 == num_done);
+      CU_ASSERT(num_ctxs == server.num_requests);
+      CU_ASSERT(good == tls_ctx_datas[0]->ocsp_data);
+    }
+
+    // Responder is not listening.
+    ev_io_stop(loop, &server.acceptev);
+    close(server.fd);
+    server.fd = -1;
+    num_done = 0;
+
+    updater.start(ssl_ctxs, donecb);
+
+    ev_run(loop, 0);
+
+    CU_ASSERT(1 == num_done);
+    CU_ASSERT(good == tls_ctx_datas[0]->ocsp_data);
+
+    // Canceled update does not call donecb.
+    server.mode = RESPOND_GOOD;
+    num_done = 0;
+
+    updater.start(ssl_ctxs, donecb);
+    updater.cancel();
+
+    CU_ASSERT(!updater.running());
+    CU_ASSERT(0 == num_done);
+  }
+
+  ev_timer_stop(loop, &timeout);
+
+  for (auto &fconn : server.conns) {
+    if (fconn->fd != -1) {
+      close_connection(fconn.get());
+    }
+  }
+
+  for (auto ssl_ctx : ssl_ctxs) {
+    SSL_CTX_free(ssl_ctx);
+  }
+
+  unlink(cert_file.c_str());
+
+  X509_free(server.wrong_cert);
+  EVP_PKEY_free(server.wrong_key);
+  X509_free(server.cert);
+  EVP_PKEY_free(server.key);
+
+  ev_loop_destroy(loop);
+}
+
+} // namespace shrpx
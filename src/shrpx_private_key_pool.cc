@@ -0,0 +1,452 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_private_key_pool.h"
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <openssl/async.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+
+#include "shrpx_log.h"
+#include "util.h"
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+// The pipe to wake up the paused job.  This is shared by
+// AsyncPrivateKeyContext and the operations in flight, so that the
+// thread in PrivateKeyPool never writes to the closed file descriptor
+// even if the connection is closed during the operation.
+struct AsyncNotifier {
+  AsyncNotifier() : rfd(-1), wfd(-1) {}
+  ~AsyncNotifier() {
+    if (rfd != -1) {
+      close(rfd);
+    }
+    if (wfd != -1) {
+      close(wfd);
+    }
+  }
+  int rfd, wfd;
+};
+
+namespace {
+// The result of private key operation performed in PrivateKeyPool.
+struct AsyncOp {
+  std::vector<uint8_t> out;
+  unsigned int outlen;
+  int rv;
+  std::atomic<bool> done;
+};
+} // namespace
+
+namespace {
+std::shared_ptr<AsyncNotifier> create_notifier() {
+  std::array<int, 2> pfd;
+  if (pipe(pfd.data()) == -1) {
+    auto error = errno;
+    LOG(ERROR) << "Could not create pipe: " << strerror(error);
+    return nullptr;
+  }
+
+  auto notifier = std::make_shared<AsyncNotifier>();
+  notifier->rfd = pfd[0];
+  notifier->wfd = pfd[1];
+
+  for (auto fd : pfd) {
+    util::make_socket_nonblocking(fd);
+    util::make_socket_closeonexec(fd);
+  }
+
+  return notifier;
+}
+} // namespace
+
+namespace {
+void drain_notifier(AsyncNotifier *notifier) {
+  std::array<uint8_t, 16> buf;
+  for (;;) {
+    auto n = read(notifier->rfd, buf.data(), buf.size());
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+  }
+}
+} // namespace
+
+namespace {
+pthread_key_t ctxkey;
+pthread_once_t ctxkey_once = PTHREAD_ONCE_INIT;
+} // namespace
+
+namespace {
+void make_ctxkey(void) { pthread_key_create(&ctxkey, nullptr); }
+} // namespace
+
+AsyncPrivateKeyContext::AsyncPrivateKeyContext() : canceled_(false) {}
+
+AsyncPrivateKeyContext::~AsyncPrivateKeyContext() {}
+
+int AsyncPrivateKeyContext::get_fd() const {
+  if (!notifier_) {
+    return -1;
+  }
+  return notifier_->rfd;
+}
+
+void AsyncPrivateKeyContext::cancel() { canceled_ = true; }
+
+void AsyncPrivateKeyContext::release() { notifier_.reset(); }
+
+void AsyncPrivateKeyContext::set_current(AsyncPrivateKeyContext *ctx) {
+  pthread_once(&ctxkey_once, make_ctxkey);
+  pthread_setspecific(ctxkey, ctx);
+}
+
+AsyncPrivateKeyContext *AsyncPrivateKeyContext::get_current() {
+  pthread_once(&ctxkey_once, make_ctxkey);
+  return static_cast<AsyncPrivateKeyContext *>(pthread_getspecific(ctxkey));
+}
+
+int AsyncPrivateKeyContext::offload(PrivateKeyPool *pool, uint8_t *out,
+                                    unsigned int *outlen, PrivateKeyOp f) {
+  if (canceled_) {
+    return -1;
+  }
+
+  if (!notifier_) {
+    notifier_ = create_notifier();
+    if (!notifier_) {
+      return f(out, outlen);
+    }
+  }
+
+  auto op = std::make_shared<AsyncOp>();
+  op->out.resize(*outlen);
+  op->outlen = *outlen;
+  op->rv = -1;
+  op->done = false;
+
+  auto notifier = notifier_;
+
+  pool->submit([op, notifier, f]() {
+    op->rv = f(op->out.data(), &op->outlen);
+    // Store result before waking up the job.  Otherwise, the job may
+    // be resumed, and paused again forever.
+    op->done.store(true);
+
+    uint8_t b = 1;
+    while (write(notifier->wfd, &b, 1) == -1 && errno == EINTR)
+      ;
+  });
+
+  for (;;) {
+    // The job may be resumed before the operation finishes, for
+    // example, by the arrival of data from the peer.  Also a byte
+    // written after the previous operation finished may remain.
+    drain_notifier(notifier_.get());
+
+    if (op->done.load()) {
+      break;
+    }
+
+    if (canceled_) {
+      // The connection is going away.  The operation in flight only
+      // touches the objects it shares with us.
+      return -1;
+    }
+
+    if (!ASYNC_pause_job()) {
+      // This should not happen inside async job.  Do not wait for the
+      // operation in event loop, and perform it here instead.
+      return f(out, outlen);
+    }
+  }
+
+  if (op->rv > 0) {
+    std::copy_n(std::begin(op->out), op->outlen, out);
+  }
+  *outlen = op->outlen;
+
+  return op->rv;
+}
+
+namespace {
+// Performs |f| in |pool| if this function is called inside async job
+// which has AsyncPrivateKeyContext.  Otherwise, |f| is called in
+// place.
+int offload(PrivateKeyPool *pool, uint8_t *out, unsigned int *outlen,
+            PrivateKeyOp f) {
+  auto ctx = AsyncPrivateKeyContext::get_current();
+  if (!ctx || !ASYNC_get_current_job()) {
+    return f(out, outlen);
+  }
+
+  return ctx->offload(pool, out, outlen, std::move(f));
+}
+} // namespace
+
+namespace {
+int rsa_ex_index() {
+  static int idx = RSA_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return idx;
+}
+} // namespace
+
+namespace {
+int ec_ex_index() {
+  static int idx =
+      EC_KEY_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return idx;
+}
+} // namespace
+
+namespace {
+int rsa_private_op(int flen, const unsigned char *from, unsigned char *to,
+                   RSA *rsa, int padding, bool decrypt) {
+  auto pool =
+      static_cast<PrivateKeyPool *>(RSA_get_ex_data(rsa, rsa_ex_index()));
+  auto meth = RSA_PKCS1_OpenSSL();
+  auto cb =
+      decrypt ? RSA_meth_get_priv_dec(meth) : RSA_meth_get_priv_enc(meth);
+
+  if (!pool) {
+    return cb(flen, from, to, rsa, padding);
+  }
+
+  // The key might be freed while the operation is in progress.
+  RSA_up_ref(rsa);
+  auto key = std::shared_ptr<RSA>(rsa, RSA_free);
+  auto in = std::make_shared<std::vector<uint8_t>>(from, from + flen);
+
+  unsigned int outlen = RSA_size(rsa);
+
+  return offload(pool, to, &outlen,
+                 [key, in, cb, padding](uint8_t *out, unsigned int *outlen) {
+                   return cb(in->size(), in->data(), out, key.get(),
+                             padding);
+                 });
+}
+} // namespace
+
+namespace {
+int rsa_priv_enc(int flen, const unsigned char *from, unsigned char *to,
+                 RSA *rsa, int padding) {
+  return rsa_private_op(flen, from, to, rsa, padding, false);
+}
+} // namespace
+
+namespace {
+int rsa_priv_dec(int flen, const unsigned char *from, unsigned char *to,
+                 RSA *rsa, int padding) {
+  return rsa_private_op(flen, from, to, rsa, padding, true);
+}
+} // namespace
+
+namespace {
+int ec_sign(int type, const unsigned char *dgst, int dlen, unsigned char *sig,
+            unsigned int *siglen, const BIGNUM *kinv, const BIGNUM *r,
+            EC_KEY *eckey) {
+  auto pool =
+      static_cast<PrivateKeyPool *>(EC_KEY_get_ex_data(eckey, ec_ex_index()));
+
+  int (*cb)(int, const unsigned char *, int, unsigned char *, unsigned int *,
+            const BIGNUM *, const BIGNUM *, EC_KEY *);
+  EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &cb, nullptr, nullptr);
+
+  if (!pool || kinv || r) {
+    return cb(type, dgst, dlen, sig, siglen, kinv, r, eckey);
+  }
+
+  EC_KEY_up_ref(eckey);
+  auto key = std::shared_ptr<EC_KEY>(eckey, EC_KEY_free);
+  auto in = std::make_shared<std::vector<uint8_t>>(dgst, dgst + dlen);
+
+  unsigned int outlen = ECDSA_size(eckey);
+
+  auto rv = offload(pool, sig, &outlen, [key, in, cb, type](
+                                             uint8_t *out,
+                                             unsigned int *outlen) {
+    return cb(type, in->data(), in->size(), out, outlen, nullptr, nullptr,
+              key.get());
+  });
+
+  *siglen = outlen;
+
+  return rv;
+}
+} // namespace
+
+PrivateKeyPool::PrivateKeyPool(size_t nthreads)
+    : rsa_meth_(RSA_meth_dup(RSA_PKCS1_OpenSSL())),
+      ec_meth_(EC_KEY_METHOD_new(EC_KEY_OpenSSL())),
+      stop_(false) {
+  RSA_meth_set1_name(rsa_meth_, "nghttpx async RSA method");
+  RSA_meth_set_priv_enc(rsa_meth_, rsa_priv_enc);
+  RSA_meth_set_priv_dec(rsa_meth_, rsa_priv_dec);
+
+  int (*sign_setup)(EC_KEY *, BN_CTX *, BIGNUM **, BIGNUM **);
+  ECDSA_SIG *(*sign_sig)(const unsigned char *, int, const BIGNUM *,
+                         const BIGNUM *, EC_KEY *);
+  EC_KEY_METHOD_get_sign(ec_meth_, nullptr, &sign_setup, &sign_sig);
+  EC_KEY_METHOD_set_sign(ec_meth_, ec_sign, sign_setup, sign_sig);
+
+  for (size_t i = 0; i < nthreads; ++i) {
+    threads_.emplace_back([this]() { run(); });
+  }
+}
+
+PrivateKeyPool::~PrivateKeyPool() {
+  {
+    std::lock_guard<std::mutex> g(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+
+  for (auto &t : threads_) {
+    t.join();
+  }
+
+  RSA_meth_free(rsa_meth_);
+  EC_KEY_METHOD_free(ec_meth_);
+}
+
+int PrivateKeyPool::enable_async(SSL_CTX *ssl_ctx) {
+  auto pkey = SSL_CTX_get0_privatekey(ssl_ctx);
+  if (!pkey) {
+    return -1;
+  }
+
+  EVP_PKEY *new_pkey = nullptr;
+
+  switch (EVP_PKEY_base_id(pkey)) {
+  case EVP_PKEY_RSA: {
+    auto rsa = EVP_PKEY_get1_RSA(pkey);
+    if (!rsa) {
+      return -1;
+    }
+    auto rsa_del = defer(RSA_free, rsa);
+
+    // Do not modify the key which may be shared.
+    auto new_rsa = RSAPrivateKey_dup(rsa);
+    if (!new_rsa) {
+      return -1;
+    }
+
+    RSA_set_method(new_rsa, rsa_meth_);
+    RSA_set_ex_data(new_rsa, rsa_ex_index(), this);
+
+    new_pkey = EVP_PKEY_new();
+    EVP_PKEY_assign_RSA(new_pkey, new_rsa);
+
+    break;
+  }
+  case EVP_PKEY_EC: {
+    auto eckey = EVP_PKEY_get1_EC_KEY(pkey);
+    if (!eckey) {
+      return -1;
+    }
+    auto eckey_del = defer(EC_KEY_free, eckey);
+
+    auto new_eckey = EC_KEY_dup(eckey);
+    if (!new_eckey) {
+      return -1;
+    }
+
+    EC_KEY_set_method(new_eckey, ec_meth_);
+    EC_KEY_set_ex_data(new_eckey, ec_ex_index(), this);
+
+    new_pkey = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(new_pkey, new_eckey);
+
+    break;
+  }
+  default:
+    // Other keys are used synchronously.
+    return 0;
+  }
+
+  auto new_pkey_del = defer(EVP_PKEY_free, new_pkey);
+
+  if (SSL_CTX_use_PrivateKey(ssl_ctx, new_pkey) != 1) {
+    LOG(ERROR) << "SSL_CTX_use_PrivateKey failed: "
+               << ERR_error_string(ERR_get_error(), nullptr);
+    return -1;
+  }
+
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ASYNC);
+
+  return 0;
+}
+
+void PrivateKeyPool::submit(std::function<void()> op) {
+  {
+    std::lock_guard<std::mutex> g(mu_);
+    q_.push_back(std::move(op));
+  }
+  cv_.notify_one();
+}
+
+void PrivateKeyPool::run() {
+  std::unique_lock<std::mutex> g(mu_);
+
+  for (;;) {
+    cv_.wait(g, [this]() { return stop_ || !q_.empty(); });
+
+    // Finish queued operations before exiting.
+    if (q_.empty()) {
+      return;
+    }
+
+    auto op = std::move(q_.front());
+    q_.pop_front();
+
+    g.unlock();
+
+    op();
+
+    g.lock();
+  }
+}
+
+} // namespace shrpx
+
+#endif // SHRPX_ASYNC_PRIVATE_KEY
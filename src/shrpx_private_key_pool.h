@@ -0,0 +1,150 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_PRIVATE_KEY_POOL_H
+#define SHRPX_PRIVATE_KEY_POOL_H
+
+#include "shrpx.h"
+
+#include <openssl/ssl.h>
+
+// Asynchronous private key operation requires OpenSSL async job
+// (OpenSSL >= 1.1.0) and threads.
+#if defined(SSL_MODE_ASYNC) && !defined(NOTHREADS)
+#define SHRPX_ASYNC_PRIVATE_KEY 1
+#endif // SSL_MODE_ASYNC && !NOTHREADS
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+#include <pthread.h>
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
+namespace shrpx {
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+
+// PrivateKeyPool performs RSA and ECDSA private key operations in
+// dedicated threads.  SSL_CTX prepared by enable_async() runs
+// handshake inside OpenSSL async job.  When the private key is used,
+// the job is paused until the operation finishes in this pool, and
+// SSL_do_handshake() returns SSL_ERROR_WANT_ASYNC instead of blocking
+// the event loop.  The operation is tracked by the
+// AsyncPrivateKeyContext of the connection.
+class PrivateKeyPool {
+public:
+  // Starts |nthreads| threads.
+  PrivateKeyPool(size_t nthreads);
+  ~PrivateKeyPool();
+
+  // Replaces the private key of |ssl_ctx| with the one whose
+  // operations are performed in this pool, and enables
+  // SSL_MODE_ASYNC.  The private key must have been loaded.  Keys
+  // other than RSA and EC are used as is, and SSL_MODE_ASYNC is not
+  // enabled for them.  This function returns 0 if it succeeds, or
+  // -1.
+  int enable_async(SSL_CTX *ssl_ctx);
+
+  // Runs |op| in one of the threads.
+  void submit(std::function<void()> op);
+
+private:
+  void run();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> q_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  RSA_METHOD *rsa_meth_;
+  EC_KEY_METHOD *ec_meth_;
+  bool stop_;
+};
+
+// Private key operation.  It writes the result to the given buffer,
+// whose length is given in the second argument, and updates the
+// length.  It returns positive integer if it succeeds.
+using PrivateKeyOp = std::function<int(uint8_t *out, unsigned int *outlen)>;
+
+struct AsyncNotifier;
+
+// AsyncPrivateKeyContext is the state of private key operation
+// performed for a connection.  The connection owns this object, and
+// makes it current while it calls SSL_do_handshake().  If the
+// connection is closed while the async job is paused for the
+// operation, the connection must call cancel(), and resume the job,
+// so that the job finishes before this object is destroyed.
+class AsyncPrivateKeyContext {
+public:
+  AsyncPrivateKeyContext();
+  ~AsyncPrivateKeyContext();
+
+  // Performs |f| in |pool| while the current async job is paused, and
+  // returns its result.  |f| writes at most |*outlen| bytes to the
+  // given buffer, and the result is copied to |out|.  If the job
+  // cannot be paused, |f| is called in place.  If cancel() is called
+  // while the job is paused, this function returns -1 when the job is
+  // resumed.
+  int offload(PrivateKeyPool *pool, uint8_t *out, unsigned int *outlen,
+              PrivateKeyOp f);
+  // Returns the file descriptor which becomes readable when the
+  // paused job can be resumed, or -1 if no operation has been
+  // offloaded.
+  int get_fd() const;
+  // Makes the operation in flight, and the later ones fail.
+  void cancel();
+  // Releases the pipe.  The operation in flight keeps it until it
+  // finishes.  The pipe is created again if another operation is
+  // offloaded.
+  void release();
+
+  // Makes |ctx| the context of private key operations which start in
+  // the current thread.  nullptr clears it.
+  static void set_current(AsyncPrivateKeyContext *ctx);
+  static AsyncPrivateKeyContext *get_current();
+
+private:
+  // The pipe is created when the first operation is offloaded, and
+  // shared with the operations in flight.
+  std::shared_ptr<AsyncNotifier> notifier_;
+  bool canceled_;
+};
+
+#else // !SHRPX_ASYNC_PRIVATE_KEY
+
+class PrivateKeyPool;
+
+#endif // !SHRPX_ASYNC_PRIVATE_KEY
+
+} // namespace shrpx
+
+#endif // SHRPX_PRIVATE_KEY_POOL_H
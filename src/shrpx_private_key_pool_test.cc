@@ -0,0 +1,488 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_private_key_pool_test.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_private_key_pool.h"
+#include "shrpx_connection.h"
+#include "shrpx_config.h"
+#include "util.h"
+#include "template.h"
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+#include <openssl/async.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#endif // SHRPX_ASYNC_PRIVATE_KEY
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+
+namespace {
+EVP_PKEY *generate_key(int id) {
+  auto ctx = EVP_PKEY_CTX_new_id(id, nullptr);
+  auto ctx_del = defer(EVP_PKEY_CTX_free, ctx);
+
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_keygen_init(ctx);
+  if (id == EVP_PKEY_RSA) {
+    EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048);
+  } else {
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+  }
+  EVP_PKEY_keygen(ctx, &pkey);
+
+  return pkey;
+}
+} // namespace
+
+namespace {
+// Creates server SSL_CTX whose private key operations are performed
+// in |pool|.  The private key and self-signed certificate are newly
+// generated.
+SSL_CTX *create_server_ssl_ctx(PrivateKeyPool &pool) {
+  auto pkey = generate_key(EVP_PKEY_RSA);
+  auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+  auto cert = X509_new();
+  auto cert_del = defer(X509_free, cert);
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+
+  auto name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, pkey);
+  X509_sign(cert, pkey, EVP_sha256());
+
+  auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL_CTX_use_certificate(ssl_ctx, cert);
+  SSL_CTX_use_PrivateKey(ssl_ctx, pkey);
+  pool.enable_async(ssl_ctx);
+
+  return ssl_ctx;
+}
+} // namespace
+
+namespace {
+// Runs |f| inside async job with |ctx|, and returns its result.
+// |paused| becomes true if the job was paused.  If |cancel| is true,
+// the operation is canceled when the job is paused first time.
+int run_job(AsyncPrivateKeyContext &ctx, int (*f)(void *), void *arg,
+            bool &paused, bool cancel = false) {
+  auto waitctx = ASYNC_WAIT_CTX_new();
+  auto waitctx_del = defer(ASYNC_WAIT_CTX_free, waitctx);
+
+  ASYNC_JOB *job = nullptr;
+  int ret = 0;
+
+  paused = false;
+
+  for (;;) {
+    AsyncPrivateKeyContext::set_current(&ctx);
+    auto rv = ASYNC_start_job(&job, waitctx, &ret, f, &arg, sizeof(arg));
+    AsyncPrivateKeyContext::set_current(nullptr);
+
+    if (rv == ASYNC_FINISH) {
+      return ret;
+    }
+    if (rv != ASYNC_PAUSE) {
+      return -1;
+    }
+
+    paused = true;
+
+    if (cancel) {
+      ctx.cancel();
+      continue;
+    }
+
+    pollfd pfd{ctx.get_fd(), POLLIN, 0};
+    poll(&pfd, 1, 1000);
+  }
+}
+} // namespace
+
+namespace {
+struct SignArg {
+  EVP_PKEY *pkey;
+  std::array<uint8_t, 32> dgst;
+  std::array<uint8_t, 256> sig;
+  unsigned int siglen;
+};
+} // namespace
+
+namespace {
+int rsa_sign_job(void *arg) {
+  auto sa = *static_cast<SignArg **>(arg);
+  auto rsa = EVP_PKEY_get1_RSA(sa->pkey);
+  auto rsa_del = defer(RSA_free, rsa);
+  return RSA_sign(NID_sha256, sa->dgst.data(), sa->dgst.size(),
+                  sa->sig.data(), &sa->siglen, rsa);
+}
+} // namespace
+
+namespace {
+int ec_sign_job(void *arg) {
+  auto sa = *static_cast<SignArg **>(arg);
+  auto eckey = EVP_PKEY_get1_EC_KEY(sa->pkey);
+  auto eckey_del = defer(EC_KEY_free, eckey);
+  return ECDSA_sign(0, sa->dgst.data(), sa->dgst.size(), sa->sig.data(),
+                    &sa->siglen, eckey);
+}
+} // namespace
+
+namespace {
+// Keeps the only thread of |pool| busy for a while, so that the next
+// operation pauses the job.
+void make_busy(PrivateKeyPool &pool) {
+  pool.submit(
+      []() { std::this_thread::sleep_for(std::chrono::milliseconds(100)); });
+}
+} // namespace
+
+namespace {
+// Returns true if |fd| is open.
+bool fd_is_open(int fd) { return fcntl(fd, F_GETFD) != -1; }
+} // namespace
+
+void test_shrpx_private_key_pool(void) {
+  PrivateKeyPool pool(1);
+  AsyncPrivateKeyContext ctx;
+
+  // RSA
+  {
+    auto pkey = generate_key(EVP_PKEY_RSA);
+    auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+    auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+    CU_ASSERT(1 == SSL_CTX_use_PrivateKey(ssl_ctx, pkey));
+    CU_ASSERT(0 == pool.enable_async(ssl_ctx));
+    CU_ASSERT(SSL_CTX_get_mode(ssl_ctx) & SSL_MODE_ASYNC);
+    CU_ASSERT(pkey != SSL_CTX_get0_privatekey(ssl_ctx));
+
+    SignArg expected{};
+    expected.pkey = pkey;
+    expected.dgst.fill(0xab);
+    auto pexpected = &expected;
+    CU_ASSERT(1 == rsa_sign_job(&pexpected));
+
+    // PKCS #1 v1.5 signature is deterministic.
+    SignArg sa{};
+    sa.pkey = SSL_CTX_get0_privatekey(ssl_ctx);
+    sa.dgst.fill(0xab);
+
+    make_busy(pool);
+
+    bool paused;
+    CU_ASSERT(1 == run_job(ctx, rsa_sign_job, &sa, paused));
+    CU_ASSERT(paused);
+    CU_ASSERT(expected.siglen == sa.siglen);
+    CU_ASSERT(std::equal(std::begin(expected.sig),
+                         std::begin(expected.sig) + expected.siglen,
+                         std::begin(sa.sig)));
+
+    // Outside async job, the operation is performed in place.
+    SignArg sa_in_place{};
+    sa_in_place.pkey = SSL_CTX_get0_privatekey(ssl_ctx);
+    sa_in_place.dgst.fill(0xab);
+    auto psa = &sa_in_place;
+
+    CU_ASSERT(1 == rsa_sign_job(&psa));
+    CU_ASSERT(std::equal(std::begin(expected.sig),
+                         std::begin(expected.sig) + expected.siglen,
+                         std::begin(sa_in_place.sig)));
+  }
+
+  // ECDSA
+  {
+    auto pkey = generate_key(EVP_PKEY_EC);
+    auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+    auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+    CU_ASSERT(1 == SSL_CTX_use_PrivateKey(ssl_ctx, pkey));
+    CU_ASSERT(0 == pool.enable_async(ssl_ctx));
+    CU_ASSERT(SSL_CTX_get_mode(ssl_ctx) & SSL_MODE_ASYNC);
+
+    SignArg sa{};
+    sa.pkey = SSL_CTX_get0_privatekey(ssl_ctx);
+    sa.dgst.fill(0xab);
+
+    make_busy(pool);
+
+    bool paused;
+    CU_ASSERT(1 == run_job(ctx, ec_sign_job, &sa, paused));
+    CU_ASSERT(paused);
+    auto eckey = EVP_PKEY_get1_EC_KEY(pkey);
+    auto eckey_del = defer(EC_KEY_free, eckey);
+
+    CU_ASSERT(1 == ECDSA_verify(0, sa.dgst.data(), sa.dgst.size(),
+                                sa.sig.data(), sa.siglen, eckey));
+  }
+}
+
+void test_shrpx_private_key_pool_cancel(void) {
+  int fd;
+
+  {
+    PrivateKeyPool pool(1);
+
+    auto pkey = generate_key(EVP_PKEY_RSA);
+    auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+    auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+    CU_ASSERT(1 == SSL_CTX_use_PrivateKey(ssl_ctx, pkey));
+    CU_ASSERT(0 == pool.enable_async(ssl_ctx));
+
+    {
+      AsyncPrivateKeyContext ctx;
+
+      SignArg sa{};
+      sa.pkey = SSL_CTX_get0_privatekey(ssl_ctx);
+      sa.dgst.fill(0xab);
+
+      make_busy(pool);
+
+      // The job finishes with failure although the operation is still
+      // queued.
+      bool paused;
+      CU_ASSERT(0 == run_job(ctx, rsa_sign_job, &sa, paused, true));
+      CU_ASSERT(paused);
+
+      ERR_clear_error();
+
+      fd = ctx.get_fd();
+
+      CU_ASSERT(-1 != fd);
+    }
+
+    // The queued operation still holds the pipe.
+    CU_ASSERT(fd_is_open(fd));
+  }
+
+  // The pipe is closed after the operation finished.
+  CU_ASSERT(!fd_is_open(fd));
+}
+
+namespace {
+struct HandshakeState {
+  // The file descriptor which Connection watched for the paused job,
+  // or -1.
+  int async_fd;
+  // true if the handshake was paused for private key operation.
+  bool async_seen;
+  // true if event loop is broken when the handshake is paused.
+  bool break_on_async;
+  // true if SSL_MODE_ASYNC is still set when event loop returns.
+  bool async_mode;
+  // true if Connection still has the pipe when event loop returns.
+  bool async_fd_open;
+  int rv;
+};
+} // namespace
+
+namespace {
+void handshakecb(struct ev_loop *loop, ev_io *w, int revents) {
+  auto conn = static_cast<Connection *>(w->data);
+  auto st = static_cast<HandshakeState *>(conn->data);
+
+  st->rv = conn->tls_handshake();
+  if (st->rv == SHRPX_ERR_INPROGRESS) {
+    if (!ev_is_active(&conn->tls.asyncev)) {
+      return;
+    }
+
+    st->async_seen = true;
+    st->async_fd = conn->tls.async_ctx.get_fd();
+
+    if (!st->break_on_async) {
+      return;
+    }
+  }
+
+  ev_break(loop);
+}
+} // namespace
+
+namespace {
+void handshake_timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {
+  ev_break(loop);
+}
+} // namespace
+
+namespace {
+// Performs TLS handshake with blocking client in another thread over
+// socketpair, until the handshake finishes, or |st| tells to stop.
+void run_handshake(struct ev_loop *loop, SSL_CTX *ssl_ctx,
+                   HandshakeState &st) {
+  st.async_fd = -1;
+
+  std::array<int, 2> fds;
+  CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds.data()));
+
+  util::make_socket_nonblocking(fds[0]);
+
+  std::promise<void> done;
+  auto done_fut = done.get_future();
+
+  auto client = std::thread([&fds, &done_fut]() {
+    auto ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+    auto ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(ssl, fds[1]);
+    SSL_connect(ssl);
+    done_fut.wait();
+    SSL_free(ssl);
+    SSL_CTX_free(ssl_ctx);
+    close(fds[1]);
+  });
+
+  MemchunkPool mcpool;
+
+  {
+    Connection conn(loop, fds[0], SSL_new(ssl_ctx), &mcpool, 10., 10., {},
+                    {}, handshakecb, handshakecb, handshake_timeoutcb, &st, 0,
+                    0., false, PROTO_NONE);
+    conn.prepare_server_handshake();
+    conn.rlimit.startw();
+
+    ev_timer timeout;
+    ev_timer_init(&timeout, handshake_timeoutcb, 10., 0.);
+    ev_timer_start(loop, &timeout);
+
+    ev_run(loop, 0);
+
+    ev_timer_stop(loop, &timeout);
+
+    st.async_mode = SSL_get_mode(conn.tls.ssl) & SSL_MODE_ASYNC;
+    st.async_fd_open = conn.tls.async_ctx.get_fd() != -1;
+  }
+
+  done.set_value();
+  client.join();
+}
+} // namespace
+
+void test_shrpx_private_key_pool_connection(void) {
+  auto loop = ev_loop_new(0);
+  auto loop_del = defer(ev_loop_destroy, loop);
+
+  // Failed handshake may write to the socket already closed by peer.
+  auto sigpipe = signal(SIGPIPE, SIG_IGN);
+  auto sigpipe_del = defer(signal, SIGPIPE, sigpipe);
+
+  // The handshake completes with the private key operation performed
+  // in pool.
+  {
+    PrivateKeyPool pool(1);
+    auto ssl_ctx = create_server_ssl_ctx(pool);
+    auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+    HandshakeState st{};
+
+    make_busy(pool);
+
+    run_handshake(loop, ssl_ctx, st);
+
+    CU_ASSERT(0 == st.rv);
+    CU_ASSERT(st.async_seen);
+    CU_ASSERT(-1 != st.async_fd);
+    // Later I/O is not performed in async job, and the pipe is
+    // released after handshake.
+    CU_ASSERT(!st.async_mode);
+    CU_ASSERT(!st.async_fd_open);
+    // No operation is in flight.
+    CU_ASSERT(!fd_is_open(st.async_fd));
+  }
+
+  // The connection is closed while the private key operation is in
+  // flight.
+  {
+    int async_fd;
+
+    {
+      PrivateKeyPool pool(1);
+      auto ssl_ctx = create_server_ssl_ctx(pool);
+      auto ssl_ctx_del = defer(SSL_CTX_free, ssl_ctx);
+
+      HandshakeState st{};
+      st.break_on_async = true;
+
+      make_busy(pool);
+
+      run_handshake(loop, ssl_ctx, st);
+
+      CU_ASSERT(SHRPX_ERR_INPROGRESS == st.rv);
+      CU_ASSERT(st.async_seen);
+      CU_ASSERT(st.async_mode);
+      CU_ASSERT(st.async_fd_open);
+      CU_ASSERT(-1 != st.async_fd);
+
+      async_fd = st.async_fd;
+    }
+
+    // Once the canceled operation finished, nothing holds the pipe.
+    CU_ASSERT(!fd_is_open(async_fd));
+  }
+}
+
+#else // !SHRPX_ASYNC_PRIVATE_KEY
+
+void test_shrpx_private_key_pool(void) {}
+
+void test_shrpx_private_key_pool_cancel(void) {}
+
+void test_shrpx_private_key_pool_connection(void) {}
+
+#endif // !SHRPX_ASYNC_PRIVATE_KEY
+
+} // namespace shrpx
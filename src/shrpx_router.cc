@@ -26,6 +26,10 @@
 
 #include <algorithm>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
 #include "shrpx_config.h"
 
 namespace shrpx {
@@ -67,9 +71,21 @@ void Router::add_node(RNode *node, const char *pattern, size_t patlen,
 }
 
 bool Router::add_route(const StringRef &pattern, size_t index) {
+  assert(nodes_.empty());
+
   auto node = &root_;
   size_t i = 0;
 
+  if (pattern.empty()) {
+    // Empty pattern is stored in the root.  It only matches with
+    // match_prefix().
+    if (node->index != -1) {
+      return false;
+    }
+    node->index = index;
+    return true;
+  }
+
   for (;;) {
     auto next_node = find_next_node(node, pattern[i]);
     if (next_node == nullptr) {
@@ -132,9 +148,74 @@ bool Router::add_route(const StringRef &pattern, size_t index) {
   }
 }
 
-namespace {
-const RNode *match_complete(size_t *offset, const RNode *node,
-                            const char *first, const char *last) {
+void Router::compile() {
+  assert(nodes_.empty());
+
+  // Source node of each element in nodes_.  Nodes are laid out in
+  // breadth first order, so that the children of a node are
+  // contiguous.
+  std::vector<const RNode *> src;
+
+  nodes_.push_back({0, 0, 0, 0, 0, root_.index});
+  src.push_back(&root_);
+
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    auto node = src[i];
+    auto nnext = node->next.size();
+    auto keys_offset = keys_.size();
+
+    nodes_[i].next = nodes_.size();
+    nodes_[i].nnext = nnext;
+    nodes_[i].keys_offset = keys_offset;
+
+    for (auto &nd : node->next) {
+      keys_.push_back(nd->s[0]);
+      nodes_.push_back({static_cast<uint32_t>(str_.size()),
+                        static_cast<uint32_t>(nd->len), 0, 0, 0, nd->index});
+      str_.append(nd->s, nd->len);
+      src.push_back(nd.get());
+    }
+
+    keys_.resize(keys_offset + (nnext + 15) / 16 * 16);
+  }
+
+  root_ = RNode();
+}
+
+const RCNode *Router::find_child(const RCNode *node, char c) const {
+  auto keys = keys_.data() + node->keys_offset;
+
+#ifdef __SSE2__
+  auto needle = _mm_set1_epi8(c);
+
+  for (size_t i = 0; i < node->nnext; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    auto left = node->nnext - i;
+    if (left < 16) {
+      mask &= (1u << left) - 1;
+    }
+    if (mask) {
+      return &nodes_[node->next + i + __builtin_ctz(mask)];
+    }
+  }
+
+  return nullptr;
+#else  // !__SSE2__
+  // Keys are sorted.
+  auto end = keys + node->nnext;
+  auto it = std::lower_bound(keys, end, static_cast<uint8_t>(c));
+  if (it == end || *it != static_cast<uint8_t>(c)) {
+    return nullptr;
+  }
+
+  return &nodes_[node->next + (it - keys)];
+#endif // !__SSE2__
+}
+
+const RCNode *Router::match_complete(size_t *offset, const RCNode *node,
+                                     const char *first,
+                                     const char *last) const {
   *offset = 0;
 
   if (first == last) {
@@ -144,15 +225,16 @@ const RNode *match_complete(size_t *offset, const RNode *node,
   auto p = first;
 
   for (;;) {
-    auto next_node = find_next_node(node, *p);
+    auto next_node = find_child(node, *p);
     if (next_node == nullptr) {
       return nullptr;
     }
 
     node = next_node;
 
-    auto n = std::min(node->len, static_cast<size_t>(last - p));
-    if (memcmp(node->s, p, n) != 0) {
+    auto n = std::min(static_cast<size_t>(node->len),
+                      static_cast<size_t>(last - p));
+    if (memcmp(&str_[node->str_offset], p, n) != 0) {
       return nullptr;
     }
     p += n;
@@ -162,11 +244,10 @@ const RNode *match_complete(size_t *offset, const RNode *node,
     }
   }
 }
-} // namespace
 
-namespace {
-const RNode *match_partial(const RNode *node, size_t offset, const char *first,
-                           const char *last) {
+const RCNode *Router::match_partial(const RCNode *node, size_t offset,
+                                    const char *first,
+                                    const char *last) const {
   if (first == last) {
     if (node->len == offset) {
       return node;
@@ -176,11 +257,12 @@ const RNode *match_partial(const RNode *node, size_t offset, const char *first,
 
   auto p = first;
 
-  const RNode *found_node = nullptr;
+  const RCNode *found_node = nullptr;
 
   if (offset > 0) {
+    auto s = &str_[node->str_offset];
     auto n = std::min(node->len - offset, static_cast<size_t>(last - first));
-    if (memcmp(node->s + offset, first, n) != 0) {
+    if (memcmp(s + offset, first, n) != 0) {
       return nullptr;
     }
 
@@ -196,14 +278,14 @@ const RNode *match_partial(const RNode *node, size_t offset, const char *first,
       }
 
       if (node->index != -1 && offset + n + 1 == node->len &&
-          node->s[node->len - 1] == '/') {
+          s[node->len - 1] == '/') {
         return node;
       }
 
       return nullptr;
     }
 
-    if (node->index != -1 && node->s[node->len - 1] == '/') {
+    if (node->index != -1 && s[node->len - 1] == '/') {
       found_node = node;
     }
 
@@ -211,15 +293,17 @@ const RNode *match_partial(const RNode *node, size_t offset, const char *first,
   }
 
   for (;;) {
-    auto next_node = find_next_node(node, *p);
+    auto next_node = find_child(node, *p);
     if (next_node == nullptr) {
       return found_node;
     }
 
     node = next_node;
 
-    auto n = std::min(node->len, static_cast<size_t>(last - p));
-    if (memcmp(node->s, p, n) != 0) {
+    auto s = &str_[node->str_offset];
+    auto n = std::min(static_cast<size_t>(node->len),
+                      static_cast<size_t>(last - p));
+    if (memcmp(s, p, n) != 0) {
       return found_node;
     }
 
@@ -241,7 +325,7 @@ const RNode *match_partial(const RNode *node, size_t offset, const char *first,
       // request to the directory without trailing slash.  That is if
       // pattern is "/foo/" and path is "/foo", we consider they
       // match.
-      if (node->index != -1 && n + 1 == node->len && node->s[n] == '/') {
+      if (node->index != -1 && n + 1 == node->len && s[n] == '/') {
         return node;
       }
 
@@ -250,42 +334,89 @@ const RNode *match_partial(const RNode *node, size_t offset, const char *first,
 
     // This is the case when pattern which ends with "/" is included
     // in query.
-    if (node->index != -1 && node->s[node->len - 1] == '/') {
+    if (node->index != -1 && s[node->len - 1] == '/') {
       found_node = node;
     }
 
     assert(node->len == n);
   }
 }
-} // namespace
 
 ssize_t Router::match(const StringRef &host, const StringRef &path) const {
-  const RNode *node;
+  assert(!nodes_.empty());
+
+  const RCNode *node;
   size_t offset;
 
-  node = match_complete(&offset, &root_, std::begin(host), std::end(host));
+  node = match_complete(&offset, &nodes_[0], std::begin(host), std::end(host));
   if (node == nullptr) {
     return -1;
   }
 
   node = match_partial(node, offset, std::begin(path), std::end(path));
-  if (node == nullptr || node == &root_) {
+  if (node == nullptr || node == &nodes_[0]) {
     return -1;
   }
 
   return node->index;
 }
 
-namespace {
-void dump_node(const RNode *node, int depth) {
-  fprintf(stderr, "%*ss='%.*s', len=%zu, index=%zd\n", depth, "",
-          (int)node->len, node->s, node->len, node->index);
-  for (auto &nd : node->next) {
-    dump_node(nd.get(), depth + 4);
+ssize_t Router::match_prefix(size_t *nread, const RCNode **last_node,
+                             const StringRef &s) const {
+  assert(!nodes_.empty());
+
+  auto node = *last_node;
+
+  if (node == nullptr) {
+    node = &nodes_[0];
+
+    if (node->index != -1) {
+      *nread = 0;
+      *last_node = node;
+      return node->index;
+    }
+  }
+
+  auto first = std::begin(s);
+  auto last = std::end(s);
+
+  for (auto p = first; p != last;) {
+    node = find_child(node, *p);
+    if (node == nullptr) {
+      return -1;
+    }
+
+    if (static_cast<size_t>(last - p) < node->len ||
+        memcmp(&str_[node->str_offset], p, node->len) != 0) {
+      return -1;
+    }
+
+    p += node->len;
+
+    if (node->index != -1) {
+      *nread = p - first;
+      *last_node = node;
+      return node->index;
+    }
+  }
+
+  return -1;
+}
+
+void Router::dump_node(const RCNode *node, int depth) const {
+  fprintf(stderr, "%*ss='%.*s', len=%u, index=%zd\n", depth, "",
+          static_cast<int>(node->len), &str_[node->str_offset], node->len,
+          node->index);
+  for (size_t i = 0; i < node->nnext; ++i) {
+    dump_node(&nodes_[node->next + i], depth + 4);
   }
 }
-} // namespace
 
-void Router::dump() const { dump_node(&root_, 0); }
+void Router::dump() const {
+  if (nodes_.empty()) {
+    return;
+  }
+  dump_node(&nodes_[0], 0);
+}
 
 } // namespace shrpx
@@ -29,6 +29,7 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 
 namespace shrpx {
 
@@ -52,22 +53,70 @@ struct RNode {
   ssize_t index;
 };
 
+// Node of compiled Router.  The children of a node are stored
+// contiguously in Router::nodes_, so that the whole tree is laid out
+// in a single array.
+struct RCNode {
+  // Offset of the string this node represents in Router::str_.
+  uint32_t str_offset;
+  // Length of the string
+  uint32_t len;
+  // Index of the first child in Router::nodes_.
+  uint32_t next;
+  // The number of children.
+  uint32_t nnext;
+  // Offset of the first bytes of children in Router::keys_.  The
+  // keys of each node are padded to the multiple of 16 bytes so that
+  // they can be compared 16 bytes at once.
+  uint32_t keys_offset;
+  // Index of pattern if match ends in this node.
+  ssize_t index;
+};
+
 class Router {
 public:
   Router();
-  // Adds route |pattern| with its |index|.
+  // Adds route |pattern| with its |index|.  This function must not be
+  // called after compile().
   bool add_route(const StringRef &pattern, size_t index);
+  // Flattens the routes added so far into contiguous arrays, and
+  // releases the Patricia tree built by add_route().  The strings
+  // passed to add_route() are copied, and they need not outlive this
+  // call.  This function must be called before match functions.
+  void compile();
   // Returns the matched index of pattern.  -1 if there is no match.
   ssize_t match(const StringRef &host, const StringRef &path) const;
+  // Returns the index of pattern which is a prefix of |s|.  The
+  // search starts at |*last_node|, or at the root if it is nullptr.
+  // If a pattern matches, the number of bytes consumed in |s| is
+  // assigned to |*nread|, and the node where the match ended is
+  // assigned to |*last_node|, so that calling this function again
+  // with the remaining of |s| finds longer pattern.  Returns -1 if
+  // there is no match.
+  ssize_t match_prefix(size_t *nread, const RCNode **last_node,
+                       const StringRef &s) const;
 
   void add_node(RNode *node, const char *pattern, size_t patlen, size_t index);
 
   void dump() const;
 
 private:
+  const RCNode *find_child(const RCNode *node, char c) const;
+  const RCNode *match_complete(size_t *offset, const RCNode *node,
+                               const char *first, const char *last) const;
+  const RCNode *match_partial(const RCNode *node, size_t offset,
+                              const char *first, const char *last) const;
+  void dump_node(const RCNode *node, int depth) const;
+
   // The root node of Patricia tree.  This is special node and its s
   // field is nulptr, and len field is 0.
   RNode root_;
+  // Compiled nodes.  The first element is the root.
+  std::vector<RCNode> nodes_;
+  // Concatenation of the strings of compiled nodes.
+  std::string str_;
+  // The first bytes of children of each compiled node.
+  std::vector<uint8_t> keys_;
 };
 
 } // namespace shrpx
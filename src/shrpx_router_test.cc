@@ -0,0 +1,229 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_router_test.h"
+
+#include <chrono>
+#include <iostream>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_router.h"
+#include "shrpx_config.h"
+#include "shrpx_worker.h"
+#include "util.h"
+
+namespace shrpx {
+
+void test_shrpx_router_match(void) {
+  std::vector<std::string> patterns{"nghttp2.org/",
+                                    "nghttp2.org/alpha",
+                                    "nghttp2.org/alpha/",
+                                    "nghttp2.org/alpha/bravo/",
+                                    "www.nghttp2.org/alpha/",
+                                    "/alpha",
+                                    "example.com/alpha/"};
+
+  // Add more than 16 children to a node so that child lookup spans
+  // several blocks.
+  for (char c = 'a'; c <= 'z'; ++c) {
+    patterns.push_back(std::string("/") + c + "/");
+  }
+
+  Router router;
+
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    CU_ASSERT(router.add_route(StringRef{patterns[i]}, i));
+  }
+
+  // Duplicate is rejected.
+  CU_ASSERT(!router.add_route(StringRef::from_lit("nghttp2.org/"), 100));
+
+  router.compile();
+
+  // Patterns are copied by compile().
+  for (auto &s : patterns) {
+    std::fill(std::begin(s), std::end(s), '\0');
+  }
+
+  CU_ASSERT(0 == router.match(StringRef::from_lit("nghttp2.org"),
+                              StringRef::from_lit("/")));
+  CU_ASSERT(1 == router.match(StringRef::from_lit("nghttp2.org"),
+                              StringRef::from_lit("/alpha")));
+  CU_ASSERT(2 == router.match(StringRef::from_lit("nghttp2.org"),
+                              StringRef::from_lit("/alpha/")));
+  CU_ASSERT(2 == router.match(StringRef::from_lit("nghttp2.org"),
+                              StringRef::from_lit("/alpha/charlie")));
+  CU_ASSERT(3 == router.match(StringRef::from_lit("nghttp2.org"),
+                              StringRef::from_lit("/alpha/bravo")));
+  CU_ASSERT(4 == router.match(StringRef::from_lit("www.nghttp2.org"),
+                              StringRef::from_lit("/alpha")));
+  CU_ASSERT(-1 == router.match(StringRef::from_lit("www.nghttp2.org"),
+                               StringRef::from_lit("/")));
+  CU_ASSERT(5 == router.match(StringRef{}, StringRef::from_lit("/alpha")));
+  CU_ASSERT(-1 == router.match(StringRef::from_lit("example.com"),
+                               StringRef::from_lit("/alph")));
+
+  for (size_t i = 0; i < 26; ++i) {
+    auto path = std::string("/") + static_cast<char>('a' + i) + "/echo";
+    CU_ASSERT(static_cast<ssize_t>(7 + i) ==
+              router.match(StringRef{}, StringRef{path}));
+  }
+
+  CU_ASSERT(-1 == router.match(StringRef{}, StringRef::from_lit("/A/")));
+}
+
+void test_shrpx_router_match_prefix(void) {
+  Router router;
+
+  CU_ASSERT(router.add_route(StringRef::from_lit("gro.2ptthgn."), 0));
+  CU_ASSERT(router.add_route(StringRef::from_lit("gro.2ptthgn.tig."), 1));
+  CU_ASSERT(router.add_route(StringRef::from_lit("gro."), 2));
+
+  router.compile();
+
+  auto s = StringRef::from_lit("gro.2ptthgn.tig.www");
+  const RCNode *last_node = nullptr;
+  size_t nread;
+
+  CU_ASSERT(2 == router.match_prefix(&nread, &last_node, s));
+  CU_ASSERT(4 == nread);
+
+  s = StringRef{std::begin(s) + nread, std::end(s)};
+
+  CU_ASSERT(0 == router.match_prefix(&nread, &last_node, s));
+  CU_ASSERT(8 == nread);
+
+  s = StringRef{std::begin(s) + nread, std::end(s)};
+
+  CU_ASSERT(1 == router.match_prefix(&nread, &last_node, s));
+  CU_ASSERT(4 == nread);
+
+  s = StringRef{std::begin(s) + nread, std::end(s)};
+
+  CU_ASSERT(-1 == router.match_prefix(&nread, &last_node, s));
+
+  last_node = nullptr;
+
+  CU_ASSERT(-1 == router.match_prefix(&nread, &last_node,
+                                      StringRef::from_lit("ten.")));
+  CU_ASSERT(-1 == router.match_prefix(&nread, &last_node,
+                                      StringRef::from_lit("gr")));
+}
+
+namespace {
+constexpr size_t NUM_BENCHMARK_PATTERNS = 10000;
+} // namespace
+
+void test_shrpx_router_match_benchmark(void) {
+  std::vector<std::shared_ptr<DownstreamAddrGroup>> groups;
+  std::vector<std::string> hosts;
+
+  RouterConfig routerconf;
+  auto &wp = routerconf.wildcard_patterns;
+
+  // Half of the patterns are exact hosts with some paths, and the
+  // other half are wildcard hosts.
+  for (size_t i = 0; i < NUM_BENCHMARK_PATTERNS / 2; ++i) {
+    auto host = "host" + util::utos(i) + ".example.com";
+    auto pattern = host + "/api/v" + util::utos(i % 3) + "/";
+
+    groups.push_back(std::make_shared<DownstreamAddrGroup>(
+        DownstreamAddrGroup{ImmutableString{pattern}}));
+    CU_ASSERT(routerconf.router.add_route(StringRef{groups.back()->pattern},
+                                          groups.size() - 1));
+    hosts.push_back(std::move(host));
+  }
+
+  for (size_t i = 0; i < NUM_BENCHMARK_PATTERNS / 2; ++i) {
+    groups.push_back(std::make_shared<DownstreamAddrGroup>(DownstreamAddrGroup{
+        ImmutableString{"*.tenant" + util::utos(i) + ".example.net/"}}));
+    wp.push_back({ImmutableString{".tenant" + util::utos(i) + ".example.net"}});
+    wp.back().router.add_route(StringRef::from_lit("/"), groups.size() - 1);
+  }
+
+  groups.push_back(std::make_shared<DownstreamAddrGroup>(
+      DownstreamAddrGroup{ImmutableString::from_lit("/")}));
+  routerconf.router.add_route(StringRef{groups.back()->pattern},
+                              groups.size() - 1);
+
+  auto catch_all = groups.size() - 1;
+
+  std::vector<std::string> rev_hosts;
+  rev_hosts.reserve(wp.size());
+
+  for (size_t i = 0; i < wp.size(); ++i) {
+    rev_hosts.emplace_back(wp[i].host.rbegin(), wp[i].host.rend());
+    routerconf.rev_wildcard_router.add_route(StringRef{rev_hosts.back()}, i);
+    wp[i].router.compile();
+  }
+
+  routerconf.router.compile();
+  routerconf.rev_wildcard_router.compile();
+
+  std::vector<std::pair<std::string, size_t>> queries;
+
+  for (size_t i = 0; i < NUM_BENCHMARK_PATTERNS / 2; ++i) {
+    queries.emplace_back(hosts[i], i);
+    queries.emplace_back("www.tenant" + util::utos(i) + ".example.net",
+                         NUM_BENCHMARK_PATTERNS / 2 + i);
+  }
+
+  for (auto &q : queries) {
+    auto path = q.second < NUM_BENCHMARK_PATTERNS / 2
+                    ? "/api/v" + util::utos(q.second % 3) + "/users"
+                    : std::string("/index.html");
+    CU_ASSERT(q.second ==
+              match_downstream_addr_group(routerconf, StringRef{q.first},
+                                          StringRef{path}, groups, catch_all));
+  }
+
+  CU_ASSERT(catch_all == match_downstream_addr_group(
+                             routerconf, StringRef::from_lit("example.org"),
+                             StringRef::from_lit("/"), groups, catch_all));
+
+  auto path = StringRef::from_lit("/api/v0/users");
+  size_t nmatch = 0;
+
+  auto t = std::chrono::steady_clock::now();
+
+  for (size_t n = 0; n < 10; ++n) {
+    for (auto &q : queries) {
+      nmatch += match_downstream_addr_group(routerconf, StringRef{q.first},
+                                            path, groups, catch_all) !=
+                catch_all;
+    }
+  }
+
+  auto d = std::chrono::steady_clock::now() - t;
+
+  CU_ASSERT(nmatch > 0);
+
+  std::cerr << "router: " << queries.size() * 10 << " lookups over "
+            << NUM_BENCHMARK_PATTERNS << " patterns in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(d).count()
+            << "us" << std::endl;
+}
+
+} // namespace shrpx
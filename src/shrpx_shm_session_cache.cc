@@ -0,0 +1,338 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_shm_session_cache.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include "shrpx_log.h"
+#include "template.h"
+
+namespace shrpx {
+
+namespace {
+struct Slot {
+  // The time when the session expires.  0 if this slot is empty.
+  int64_t expiry;
+  uint16_t datalen;
+  uint8_t idlen;
+  // Reference bit for clock algorithm
+  uint8_t referenced;
+  uint8_t id[SHM_SESSION_CACHE_MAX_ID_LENGTH];
+  uint8_t data[SHM_SESSION_CACHE_MAX_SESSION_LENGTH];
+};
+} // namespace
+
+namespace {
+struct Set {
+  Slot slots[SHM_SESSION_CACHE_SET_SIZE];
+  // Clock hand, the index of slot to examine next
+  uint32_t hand;
+};
+} // namespace
+
+namespace {
+// Shard header, which is followed by its sets.  It is aligned to
+// cache line so that locks of adjacent shards do not share a line.
+struct alignas(64) Shard {
+  // Process shared mutex.  If robust mutex is available and a worker
+  // process dies while holding it, the next owner gets EOWNERDEAD
+  // instead of waiting forever.
+  pthread_mutex_t mu;
+};
+} // namespace
+
+namespace {
+// ShardLock locks |shard| which has |nsets| sets during its lifetime.
+// If the previous owner died while holding the lock, the sets may be
+// partially updated.  In that case, all sessions in the shard are
+// dropped.  locked() returns false if the lock could not be acquired,
+// and the caller must not touch the shard.
+class ShardLock {
+public:
+  ShardLock(Shard *shard, size_t nsets) : shard_(shard), locked_(false) {
+#ifdef SHRPX_SHM_ROBUST_MUTEX
+    auto rv = pthread_mutex_lock(&shard_->mu);
+    if (rv == EOWNERDEAD) {
+      LOG(WARN) << "TLS session cache: the lock owner died; clearing shard";
+
+      memset(reinterpret_cast<Set *>(shard_ + 1), 0, sizeof(Set) * nsets);
+
+      rv = pthread_mutex_consistent(&shard_->mu);
+      if (rv != 0) {
+        pthread_mutex_unlock(&shard_->mu);
+      }
+    }
+#else  // !SHRPX_SHM_ROBUST_MUTEX
+    // We cannot tell whether the owner is dead or not.  Do not wait
+    // for it, so that the lock left by a dead worker process does not
+    // block the others.  The critical section is short, and the
+    // contention just results in cache miss.
+    auto rv = pthread_mutex_trylock(&shard_->mu);
+#endif // !SHRPX_SHM_ROBUST_MUTEX
+    if (rv != 0) {
+      // The mutex is not recoverable.  Treat this as cache miss.
+      return;
+    }
+    locked_ = true;
+  }
+  ~ShardLock() {
+    if (locked_) {
+      pthread_mutex_unlock(&shard_->mu);
+    }
+  }
+  bool locked() const { return locked_; }
+
+private:
+  Shard *shard_;
+  bool locked_;
+};
+} // namespace
+
+namespace {
+// FNV-1a
+uint32_t hash_id(const uint8_t *id, size_t idlen) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < idlen; ++i) {
+    h ^= id[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+} // namespace
+
+namespace {
+bool id_equal(const Slot &slot, const uint8_t *id, size_t idlen) {
+  return slot.expiry != 0 && slot.idlen == idlen &&
+         memcmp(slot.id, id, idlen) == 0;
+}
+} // namespace
+
+namespace {
+Shard *get_shard(uint8_t *mem, size_t shardlen, uint32_t h) {
+  auto i = h % SHM_SESSION_CACHE_NUM_SHARDS;
+  return reinterpret_cast<Shard *>(mem + shardlen * i);
+}
+} // namespace
+
+namespace {
+Set *get_set(Shard *shard, size_t nsets, uint32_t h) {
+  auto sets = reinterpret_cast<Set *>(shard + 1);
+  return &sets[(h / SHM_SESSION_CACHE_NUM_SHARDS) % nsets];
+}
+} // namespace
+
+ShmSessionCache::ShmSessionCache(uint8_t *mem, size_t shardlen, size_t nsets)
+    : mem_(mem), shardlen_(shardlen), nsets_(nsets) {}
+
+ShmSessionCache::~ShmSessionCache() {
+  // The mutexes are not destroyed because the other processes may
+  // still use them.
+  munmap(mem_, shardlen_ * SHM_SESSION_CACHE_NUM_SHARDS);
+}
+
+std::unique_ptr<ShmSessionCache> ShmSessionCache::create(size_t size) {
+  constexpr size_t align = alignof(Shard);
+
+  auto budget = (size / SHM_SESSION_CACHE_NUM_SHARDS) & ~(align - 1);
+  if (budget < sizeof(Shard) + sizeof(Set)) {
+    auto minlen = (sizeof(Shard) + sizeof(Set) + align - 1) & ~(align - 1);
+    LOG(ERROR) << "TLS session cache: shared memory size " << size
+               << " is too small, at least "
+               << minlen * SHM_SESSION_CACHE_NUM_SHARDS
+               << " bytes are required";
+    return nullptr;
+  }
+
+  auto nsets = (budget - sizeof(Shard)) / sizeof(Set);
+  auto shardlen =
+      (sizeof(Shard) + nsets * sizeof(Set) + align - 1) & ~(align - 1);
+  auto memlen = shardlen * SHM_SESSION_CACHE_NUM_SHARDS;
+
+  auto p = mmap(nullptr, memlen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    auto error = errno;
+    LOG(ERROR) << "TLS session cache: could not allocate shared memory: "
+               << strerror(error);
+    return nullptr;
+  }
+
+  auto mem = static_cast<uint8_t *>(p);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  auto attr_del = defer(pthread_mutexattr_destroy, &attr);
+
+  int rv;
+  if ((rv = pthread_mutexattr_setpshared(&attr,
+                                         PTHREAD_PROCESS_SHARED)) != 0
+#ifdef SHRPX_SHM_ROBUST_MUTEX
+      || (rv = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) != 0
+#endif // SHRPX_SHM_ROBUST_MUTEX
+      ) {
+    LOG(ERROR) << "TLS session cache: could not set mutex attribute: "
+               << strerror(rv);
+    munmap(p, memlen);
+    return nullptr;
+  }
+
+  // Anonymous mapping is zero filled, which makes all slots empty.
+  for (size_t i = 0; i < SHM_SESSION_CACHE_NUM_SHARDS; ++i) {
+    auto shard = new (mem + shardlen * i) Shard;
+    rv = pthread_mutex_init(&shard->mu, &attr);
+    if (rv != 0) {
+      LOG(ERROR) << "TLS session cache: could not initialize mutex: "
+                 << strerror(rv);
+      munmap(p, memlen);
+      return nullptr;
+    }
+  }
+
+  return std::unique_ptr<ShmSessionCache>(
+      new ShmSessionCache(mem, shardlen, nsets));
+}
+
+int ShmSessionCache::store(const uint8_t *id, size_t idlen,
+                           const uint8_t *data, size_t datalen,
+                           time_t expiry) {
+  if (idlen == 0 || idlen > SHM_SESSION_CACHE_MAX_ID_LENGTH ||
+      datalen > SHM_SESSION_CACHE_MAX_SESSION_LENGTH) {
+    return -1;
+  }
+
+  auto h = hash_id(id, idlen);
+  auto shard = get_shard(mem_, shardlen_, h);
+  auto set = get_set(shard, nsets_, h);
+
+  ShardLock lock(shard, nsets_);
+  if (!lock.locked()) {
+    return -1;
+  }
+
+  Slot *dst = nullptr;
+  Slot *empty = nullptr;
+
+  for (auto &slot : set->slots) {
+    if (id_equal(slot, id, idlen)) {
+      dst = &slot;
+      break;
+    }
+    if (!empty && slot.expiry == 0) {
+      empty = &slot;
+    }
+  }
+
+  if (!dst) {
+    dst = empty;
+  }
+
+  while (!dst) {
+    auto &slot = set->slots[set->hand];
+    set->hand = (set->hand + 1) % SHM_SESSION_CACHE_SET_SIZE;
+
+    if (slot.referenced) {
+      slot.referenced = 0;
+      continue;
+    }
+
+    dst = &slot;
+  }
+
+  dst->expiry = expiry;
+  dst->datalen = datalen;
+  dst->idlen = idlen;
+  dst->referenced = 1;
+  memcpy(dst->id, id, idlen);
+  memcpy(dst->data, data, datalen);
+
+  return 0;
+}
+
+ssize_t ShmSessionCache::lookup(uint8_t *dst, const uint8_t *id,
+                                size_t idlen, time_t now) {
+  if (idlen == 0 || idlen > SHM_SESSION_CACHE_MAX_ID_LENGTH) {
+    return -1;
+  }
+
+  auto h = hash_id(id, idlen);
+  auto shard = get_shard(mem_, shardlen_, h);
+  auto set = get_set(shard, nsets_, h);
+
+  ShardLock lock(shard, nsets_);
+  if (!lock.locked()) {
+    return -1;
+  }
+
+  for (auto &slot : set->slots) {
+    if (!id_equal(slot, id, idlen)) {
+      continue;
+    }
+
+    if (slot.expiry <= now) {
+      slot.expiry = 0;
+      return -1;
+    }
+
+    slot.referenced = 1;
+    memcpy(dst, slot.data, slot.datalen);
+
+    return slot.datalen;
+  }
+
+  return -1;
+}
+
+void ShmSessionCache::remove(const uint8_t *id, size_t idlen) {
+  if (idlen == 0 || idlen > SHM_SESSION_CACHE_MAX_ID_LENGTH) {
+    return;
+  }
+
+  auto h = hash_id(id, idlen);
+  auto shard = get_shard(mem_, shardlen_, h);
+  auto set = get_set(shard, nsets_, h);
+
+  ShardLock lock(shard, nsets_);
+  if (!lock.locked()) {
+    return;
+  }
+
+  for (auto &slot : set->slots) {
+    if (id_equal(slot, id, idlen)) {
+      slot.expiry = 0;
+      return;
+    }
+  }
+}
+
+size_t ShmSessionCache::get_num_slots() const {
+  return SHM_SESSION_CACHE_NUM_SHARDS * nsets_ * SHM_SESSION_CACHE_SET_SIZE;
+}
+
+} // namespace shrpx
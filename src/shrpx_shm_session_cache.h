@@ -0,0 +1,106 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_SHM_SESSION_CACHE_H
+#define SHRPX_SHM_SESSION_CACHE_H
+
+#include "shrpx.h"
+
+#include <sys/types.h>
+
+#include <ctime>
+#include <memory>
+
+// Robust mutex is not available on some platforms (e.g., macOS).
+#if defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) &&                              \
+    defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+#define SHRPX_SHM_ROBUST_MUTEX 1
+#endif // HAVE_PTHREAD_MUTEXATTR_SETROBUST && HAVE_PTHREAD_MUTEX_CONSISTENT
+
+namespace shrpx {
+
+// The maximum length of DER encoded TLS session which can be stored
+// in ShmSessionCache.  Larger session is not cached.
+constexpr size_t SHM_SESSION_CACHE_MAX_SESSION_LENGTH = 1024;
+// The maximum length of session ID.  This is the same value as
+// SSL_MAX_SSL_SESSION_ID_LENGTH.
+constexpr size_t SHM_SESSION_CACHE_MAX_ID_LENGTH = 32;
+// The number of slots in a set.  A session can be stored in any slot
+// of the set selected by its ID.
+constexpr size_t SHM_SESSION_CACHE_SET_SIZE = 8;
+// The number of shards.  Each shard has its own lock.
+constexpr size_t SHM_SESSION_CACHE_NUM_SHARDS = 64;
+
+// ShmSessionCache is a server side TLS session cache which lives in
+// anonymous shared memory.  Master process creates it before forking
+// worker process, and all worker threads share the same cache without
+// any external service.  The memory is split into
+// SHM_SESSION_CACHE_NUM_SHARDS shards, each of which is protected by
+// its own process shared robust mutex, so that a worker process which
+// dies while holding the lock does not block the others.  If robust
+// mutex is not available, the lock is only tried, and the shard is
+// treated as empty if it is locked by someone else.  A shard is
+// a set associative array of fixed size slots.  If all slots in a set
+// are occupied, victim is chosen by clock algorithm.
+class ShmSessionCache {
+public:
+  ~ShmSessionCache();
+
+  // Creates cache which uses at most |size| bytes of shared memory.
+  // This function returns nullptr if |size| is too small, or shared
+  // memory cannot be allocated.
+  static std::unique_ptr<ShmSessionCache> create(size_t size);
+
+  // Stores DER encoded session |data| of length |datalen| under the
+  // session ID |id| of length |idlen|.  |expiry| is the time when the
+  // session expires.  This function returns 0 if it succeeds, or -1
+  // if |id| or |data| is too long.
+  int store(const uint8_t *id, size_t idlen, const uint8_t *data,
+            size_t datalen, time_t expiry);
+  // Looks up session of ID |id| of length |idlen|, and copies it to
+  // |dst| which must have at least
+  // SHM_SESSION_CACHE_MAX_SESSION_LENGTH bytes.  This function returns
+  // the length of session, or -1 if no session which has not expired
+  // at |now| is found.
+  ssize_t lookup(uint8_t *dst, const uint8_t *id, size_t idlen,
+                 time_t now);
+  // Removes session of ID |id| of length |idlen|.
+  void remove(const uint8_t *id, size_t idlen);
+  // Returns the number of slots.
+  size_t get_num_slots() const;
+
+private:
+  ShmSessionCache(uint8_t *mem, size_t shardlen, size_t nsets);
+
+  // Pointer to shared memory
+  uint8_t *mem_;
+  // The length of a shard in bytes
+  size_t shardlen_;
+  // The number of sets per shard
+  size_t nsets_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_SHM_SESSION_CACHE_H
@@ -0,0 +1,207 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_shm_session_cache_test.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <array>
+#include <string>
+
+#include <CUnit/CUnit.h>
+
+#include "shrpx_shm_session_cache.h"
+
+namespace shrpx {
+
+namespace {
+std::array<uint8_t, 32> make_id(uint32_t n) {
+  std::array<uint8_t, 32> id{};
+  id[0] = n >> 24;
+  id[1] = n >> 16;
+  id[2] = n >> 8;
+  id[3] = n;
+  return id;
+}
+} // namespace
+
+namespace {
+int store_str(ShmSessionCache &cache, const std::array<uint8_t, 32> &id,
+              const std::string &s, time_t expiry) {
+  return cache.store(id.data(), id.size(),
+                     reinterpret_cast<const uint8_t *>(s.c_str()), s.size(),
+                     expiry);
+}
+} // namespace
+
+namespace {
+std::string lookup_str(ShmSessionCache &cache,
+                       const std::array<uint8_t, 32> &id, time_t now) {
+  std::array<uint8_t, SHM_SESSION_CACHE_MAX_SESSION_LENGTH> buf;
+  auto n = cache.lookup(buf.data(), id.data(), id.size(), now);
+  if (n == -1) {
+    return "<none>";
+  }
+  return std::string(buf.data(), buf.data() + n);
+}
+} // namespace
+
+void test_shrpx_shm_session_cache(void) {
+  CU_ASSERT(nullptr == ShmSessionCache::create(4096));
+
+  auto cache = ShmSessionCache::create(1024 * 1024);
+
+  CU_ASSERT(nullptr != cache);
+  CU_ASSERT(cache->get_num_slots() > 0);
+
+  auto id1 = make_id(1);
+  auto id2 = make_id(2);
+
+  CU_ASSERT("<none>" == lookup_str(*cache, id1, 100));
+
+  CU_ASSERT(0 == store_str(*cache, id1, "alpha", 200));
+  CU_ASSERT(0 == store_str(*cache, id2, "bravo", 300));
+
+  CU_ASSERT("alpha" == lookup_str(*cache, id1, 100));
+  CU_ASSERT("bravo" == lookup_str(*cache, id2, 100));
+
+  // Session ID is compared in its full length.
+  CU_ASSERT(0 == cache->store(id1.data(), 4,
+                              reinterpret_cast<const uint8_t *>("x"), 1,
+                              200));
+  CU_ASSERT("alpha" == lookup_str(*cache, id1, 100));
+
+  // Overwrite
+  CU_ASSERT(0 == store_str(*cache, id1, "charlie", 200));
+  CU_ASSERT("charlie" == lookup_str(*cache, id1, 100));
+
+  // Expired
+  CU_ASSERT("<none>" == lookup_str(*cache, id1, 200));
+  CU_ASSERT("bravo" == lookup_str(*cache, id2, 200));
+
+  cache->remove(id2.data(), id2.size());
+
+  CU_ASSERT("<none>" == lookup_str(*cache, id2, 100));
+
+  // Too large session is not stored.
+  CU_ASSERT(-1 == store_str(*cache, id1,
+                            std::string(SHM_SESSION_CACHE_MAX_SESSION_LENGTH +
+                                            1,
+                                        'a'),
+                            200));
+  CU_ASSERT("<none>" == lookup_str(*cache, id1, 100));
+
+  // Too long session ID is rejected.
+  std::array<uint8_t, SHM_SESSION_CACHE_MAX_ID_LENGTH + 1> longid{};
+  CU_ASSERT(-1 == cache->store(longid.data(), longid.size(),
+                               reinterpret_cast<const uint8_t *>("x"), 1,
+                               200));
+}
+
+void test_shrpx_shm_session_cache_evict(void) {
+  // The smallest cache, which has only 1 set per shard.
+  auto cache = ShmSessionCache::create(1);
+
+  CU_ASSERT(nullptr == cache);
+
+  for (size_t size = 64 * 1024;; size += 64 * 1024) {
+    cache = ShmSessionCache::create(size);
+    if (cache) {
+      break;
+    }
+  }
+
+  auto nslots = cache->get_num_slots();
+
+  CU_ASSERT(SHM_SESSION_CACHE_NUM_SHARDS * SHM_SESSION_CACHE_SET_SIZE ==
+            nslots);
+
+  auto n = static_cast<uint32_t>(nslots * 4);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    CU_ASSERT(0 == store_str(*cache, make_id(i), std::to_string(i), 1000));
+  }
+
+  size_t nfound = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (lookup_str(*cache, make_id(i), 0) != "<none>") {
+      ++nfound;
+    }
+  }
+
+  CU_ASSERT(nfound <= nslots);
+  CU_ASSERT(nfound > 0);
+
+  // The most recently stored session must not be evicted.
+  CU_ASSERT(std::to_string(n - 1) == lookup_str(*cache, make_id(n - 1), 0));
+}
+
+void test_shrpx_shm_session_cache_owner_dead(void) {
+  auto cache = ShmSessionCache::create(1024 * 1024);
+
+  CU_ASSERT(nullptr != cache);
+
+  auto id1 = make_id(1);
+
+  CU_ASSERT(0 == store_str(*cache, id1, "alpha", 1000));
+
+  auto pid = fork();
+  if (pid == 0) {
+    rlimit rlim{};
+    setrlimit(RLIMIT_CORE, &rlim);
+
+    // Copying session to inaccessible memory kills this process while
+    // it holds the lock of the shard.
+    auto dst = mmap(nullptr, SHM_SESSION_CACHE_MAX_SESSION_LENGTH, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cache->lookup(static_cast<uint8_t *>(dst), id1.data(), id1.size(), 100);
+    _exit(EXIT_SUCCESS);
+  }
+
+  CU_ASSERT(-1 != pid);
+
+  int status;
+  CU_ASSERT(pid == waitpid(pid, &status, 0));
+  CU_ASSERT(WIFSIGNALED(status));
+
+#ifdef SHRPX_SHM_ROBUST_MUTEX
+  // The lock left by the dead process does not block us, and the
+  // shard which might be inconsistent is cleared.
+  CU_ASSERT("<none>" == lookup_str(*cache, id1, 100));
+  CU_ASSERT(0 == store_str(*cache, id1, "bravo", 1000));
+  CU_ASSERT("bravo" == lookup_str(*cache, id1, 100));
+#else  // !SHRPX_SHM_ROBUST_MUTEX
+  // The lock left by the dead process does not block us, but the
+  // shard is not usable any more.
+  CU_ASSERT("<none>" == lookup_str(*cache, id1, 100));
+  CU_ASSERT(-1 == store_str(*cache, id1, "bravo", 1000));
+#endif // !SHRPX_SHM_ROBUST_MUTEX
+}
+
+} // namespace shrpx
@@ -114,8 +114,9 @@ constexpr auto master_proc_ign_signals = std::array<int, 1>{{SIGPIPE}};
 } // namespace
 
 namespace {
-constexpr auto worker_proc_ign_signals = std::array<int, 4>{
-    {REOPEN_LOG_SIGNAL, EXEC_BINARY_SIGNAL, GRACEFUL_SHUTDOWN_SIGNAL, SIGPIPE}};
+constexpr auto worker_proc_ign_signals =
+    std::array<int, 5>{{REOPEN_LOG_SIGNAL, EXEC_BINARY_SIGNAL,
+                        GRACEFUL_SHUTDOWN_SIGNAL, RELOAD_SIGNAL, SIGPIPE}};
 } // namespace
 
 void shrpx_signal_set_master_proc_ign_handler() {
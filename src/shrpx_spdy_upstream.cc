@@ -314,6 +314,28 @@ void on_ctrl_recv_callback(spdylay_session *session, spdylay_frame_type type,
       return;
     }
 
+    auto rv = handler->lookup_response_cache(downstream);
+    if (rv == -1) {
+      if (upstream->error_reply(downstream, 500) != 0) {
+        ULOG(FATAL, upstream) << "error_reply failed";
+      }
+      return;
+    }
+    if (rv != 0) {
+      return;
+    }
+
+    rv = handler->acquire_concurrency_limit(downstream);
+    if (rv == -1) {
+      if (upstream->error_reply(downstream, 503) != 0) {
+        ULOG(FATAL, upstream) << "error_reply failed";
+      }
+      return;
+    }
+    if (rv != 0) {
+      return;
+    }
+
     upstream->start_downstream(downstream);
 
     break;
@@ -695,6 +717,18 @@ int SpdyUpstream::downstream_eof(DownstreamConnection *dconn) {
     DCLOG(INFO, dconn) << "EOF. stream_id=" << downstream->get_stream_id();
   }
 
+  if (downstream->get_response_state() == Downstream::INITIAL) {
+    auto rv = downstream->retry_on_another_addr();
+    if (rv == -1) {
+      return -1;
+    }
+    if (rv == 0) {
+      // dconn was deleted
+      handler_->signal_write();
+      return 0;
+    }
+  }
+
   // Delete downstream connection. If we don't delete it here, it will
   // be pooled in on_stream_close_callback.
   downstream->pop_downstream_connection();
@@ -739,6 +773,18 @@ int SpdyUpstream::downstream_error(DownstreamConnection *dconn, int events) {
     }
   }
 
+  if (downstream->get_response_state() == Downstream::INITIAL) {
+    auto rv = downstream->retry_on_another_addr();
+    if (rv == -1) {
+      return -1;
+    }
+    if (rv == 0) {
+      // dconn was deleted
+      handler_->signal_write();
+      return 0;
+    }
+  }
+
   // Delete downstream connection. If we don't delete it here, it will
   // be pooled in on_stream_close_callback.
   downstream->pop_downstream_connection();
@@ -844,12 +890,18 @@ ssize_t spdy_data_read_callback(spdylay_session *session, int32_t stream_id,
 }
 } // namespace
 
-int SpdyUpstream::send_reply(Downstream *downstream, const uint8_t *body,
-                             size_t bodylen) {
+int SpdyUpstream::send_reply(Downstream *downstream,
+                             const struct iovec *iov, int iovcnt) {
   int rv;
 
+  auto buf = downstream->get_response_buf();
+
+  for (int i = 0; i < iovcnt; ++i) {
+    buf->append(iov[i].iov_base, iov[i].iov_len);
+  }
+
   spdylay_data_provider data_prd, *data_prd_ptr = nullptr;
-  if (bodylen) {
+  if (buf->rleft()) {
     data_prd.source.ptr = downstream;
     data_prd.read_callback = spdy_data_read_callback;
     data_prd_ptr = &data_prd;
@@ -909,10 +961,6 @@ int SpdyUpstream::send_reply(Downstream *downstream, const uint8_t *body,
     return -1;
   }
 
-  auto buf = downstream->get_response_buf();
-
-  buf->append(body, bodylen);
-
   downstream->set_response_state(Downstream::MSG_COMPLETE);
 
   return 0;
@@ -958,6 +1006,8 @@ int SpdyUpstream::error_reply(Downstream *downstream,
 }
 
 Downstream *SpdyUpstream::add_pending_downstream(int32_t stream_id) {
+  handler_->get_worker()->get_metrics()->streams.add();
+
   auto downstream =
       make_unique<Downstream>(this, handler_->get_mcpool(), stream_id);
   spdylay_session_set_stream_user_data(session_, stream_id, downstream.get());
@@ -1027,6 +1077,8 @@ int SpdyUpstream::on_downstream_header_complete(Downstream *downstream) {
     downstream->rewrite_location_response_header(req.scheme);
   }
 
+  downstream->prepare_response_cache_store();
+
   // 8 means server, :status, :version and possible via header field.
   auto nv =
       make_unique<const char *[]>(resp.fs.headers().size() * 2 + 8 +
@@ -1124,6 +1176,8 @@ int SpdyUpstream::on_downstream_body(Downstream *downstream,
   auto body = downstream->get_response_buf();
   body->append(data, len);
 
+  downstream->add_response_cache_body(data, len);
+
   if (flush) {
     spdylay_session_resume_data(session_, downstream->get_stream_id());
 
@@ -1148,6 +1202,8 @@ int SpdyUpstream::on_downstream_body_complete(Downstream *downstream) {
     return 0;
   }
 
+  downstream->finish_response_cache_store();
+
   spdylay_session_resume_data(session_, downstream->get_stream_id());
   downstream->ensure_upstream_wtimer();
 
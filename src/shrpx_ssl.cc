@@ -58,8 +58,12 @@
 #include "shrpx_http2_session.h"
 #include "shrpx_memcached_request.h"
 #include "shrpx_memcached_dispatcher.h"
+#include "shrpx_shm_session_cache.h"
+#include "shrpx_ssl_context_pool.h"
+#include "shrpx_private_key_pool.h"
 #include "util.h"
 #include "ssl.h"
+#include "ssl_compat.h"
 #include "template.h"
 
 using namespace nghttp2;
@@ -68,6 +72,14 @@ namespace shrpx {
 
 namespace ssl {
 
+#if !OPENSSL_1_1_API
+namespace {
+const unsigned char *ASN1_STRING_get0_data(ASN1_STRING *x) {
+  return ASN1_STRING_data(x);
+}
+} // namespace
+#endif // !OPENSSL_1_1_API
+
 namespace {
 int next_proto_cb(SSL *s, const unsigned char **data, unsigned int *len,
                   void *arg) {
@@ -142,15 +154,54 @@ int servername_callback(SSL *ssl, int *al, void *arg) {
   auto handler = static_cast<ClientHandler *>(conn->data);
   auto worker = handler->get_worker();
   auto cert_tree = worker->get_cert_lookup_tree();
-  if (cert_tree) {
-    const char *hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
-    if (hostname) {
-      auto ssl_ctx = cert_tree->lookup(hostname, strlen(hostname));
-      if (ssl_ctx) {
-        SSL_set_SSL_CTX(ssl, ssl_ctx);
-      }
-    }
+  auto ssl_ctx_pool = worker->get_ssl_ctx_pool();
+  if (!cert_tree || !ssl_ctx_pool) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  const char *hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (!hostname) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  if (conn->tls.loaded_ssl_ctx) {
+    // Client hello is replayed.  Use SSL_CTX loaded for it, which
+    // might be evicted from the pool already.
+    SSL_set_SSL_CTX(ssl, conn->tls.loaded_ssl_ctx);
+    SSL_CTX_free(conn->tls.loaded_ssl_ctx);
+    conn->tls.loaded_ssl_ctx = nullptr;
+
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  auto idx = cert_tree->lookup(hostname, strlen(hostname));
+  if (idx == -1) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  auto rv = ssl_ctx_pool->select(ssl, idx, worker);
+  if (rv != 1) {
+    // If certificate could not be loaded, default certificate is
+    // used.
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  // SSL_CTX is being loaded.  The handshake is suspended, and client
+  // hello is replayed when it is ready.  Session looked up from
+  // memcached would be discarded by the replay anyway.
+  if (conn->tls.cached_session_lookup_req) {
+    conn->tls.cached_session_lookup_req->canceled = true;
+    conn->tls.cached_session_lookup_req = nullptr;
+  }
+
+  if (LOG_ENABLED(INFO)) {
+    CLOG(INFO, handler) << "Waiting for certificate for " << hostname
+                        << " being loaded";
   }
+
+  conn->tls.handshake_state = TLS_CONN_WAIT_FOR_CERT;
+  worker->add_ssl_ctx_waiter(conn, idx);
+
   return SSL_TLSEXT_ERR_OK;
 }
 } // namespace
@@ -195,23 +246,66 @@ int ocsp_resp_cb(SSL *ssl, void *arg) {
 constexpr char MEMCACHED_SESSION_CACHE_KEY_PREFIX[] =
     "nghttpx:tls-session-cache:";
 
+namespace {
+// Returns the time when |session| expires.
+time_t get_session_expiry(SSL_SESSION *session) {
+  return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+}
+} // namespace
+
+namespace {
+void shm_session_cache_store(ShmSessionCache *shm_cache, const uint8_t *id,
+                             size_t idlen, SSL_SESSION *session) {
+  auto sessionlen = i2d_SSL_SESSION(session, nullptr);
+  if (sessionlen <= 0 ||
+      static_cast<size_t>(sessionlen) > SHM_SESSION_CACHE_MAX_SESSION_LENGTH) {
+    if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "Shared memory: session is too large to cache, id="
+                << util::format_hex(id, idlen) << ", length=" << sessionlen;
+    }
+    return;
+  }
+
+  std::array<uint8_t, SHM_SESSION_CACHE_MAX_SESSION_LENGTH> buf;
+  auto p = buf.data();
+  i2d_SSL_SESSION(session, &p);
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Shared memory: cache session, id="
+              << util::format_hex(id, idlen);
+  }
+
+  shm_cache->store(id, idlen, buf.data(), sessionlen,
+                   get_session_expiry(session));
+}
+} // namespace
+
 namespace {
 int tls_session_new_cb(SSL *ssl, SSL_SESSION *session) {
   auto conn = static_cast<Connection *>(SSL_get_app_data(ssl));
   auto handler = static_cast<ClientHandler *>(conn->data);
   auto worker = handler->get_worker();
   auto dispatcher = worker->get_session_cache_memcached_dispatcher();
+  auto shm_cache = get_config()->tls.session_cache.shm.cache;
 
   const unsigned char *id;
   unsigned int idlen;
 
   id = SSL_SESSION_get_id(session, &idlen);
 
+  if (shm_cache) {
+    shm_session_cache_store(shm_cache, id, idlen, session);
+  }
+
+  if (!dispatcher) {
+    return 0;
+  }
+
   if (LOG_ENABLED(INFO)) {
     LOG(INFO) << "Memached: cache session, id=" << util::format_hex(id, idlen);
   }
 
-  auto req = make_unique<MemcachedRequest>();
+  auto req = dispatcher->create_request();
   req->op = MEMCACHED_OP_ADD;
   req->key = MEMCACHED_SESSION_CACHE_KEY_PREFIX;
   req->key += util::format_hex(id, idlen);
@@ -242,12 +336,18 @@ int tls_session_new_cb(SSL *ssl, SSL_SESSION *session) {
 } // namespace
 
 namespace {
-SSL_SESSION *tls_session_get_cb(SSL *ssl, unsigned char *id, int idlen,
-                                int *copy) {
+SSL_SESSION *tls_session_get_cb(SSL *ssl,
+#if OPENSSL_1_1_API
+                                const unsigned char *id,
+#else  // !OPENSSL_1_1_API
+                                unsigned char *id,
+#endif // !OPENSSL_1_1_API
+                                int idlen, int *copy) {
   auto conn = static_cast<Connection *>(SSL_get_app_data(ssl));
   auto handler = static_cast<ClientHandler *>(conn->data);
   auto worker = handler->get_worker();
   auto dispatcher = worker->get_session_cache_memcached_dispatcher();
+  auto shm_cache = get_config()->tls.session_cache.shm.cache;
 
   if (conn->tls.cached_session) {
     if (LOG_ENABLED(INFO)) {
@@ -263,16 +363,39 @@ SSL_SESSION *tls_session_get_cb(SSL *ssl, unsigned char *id, int idlen,
     return session;
   }
 
+  if (shm_cache) {
+    std::array<uint8_t, SHM_SESSION_CACHE_MAX_SESSION_LENGTH> buf;
+    auto n = shm_cache->lookup(buf.data(), id, idlen, time(nullptr));
+    if (n != -1) {
+      const uint8_t *p = buf.data();
+      auto session = d2i_SSL_SESSION(nullptr, &p, n);
+      if (session) {
+        if (LOG_ENABLED(INFO)) {
+          LOG(INFO) << "Shared memory: found cached session, id="
+                    << util::format_hex(id, idlen);
+        }
+
+        *copy = 0;
+
+        return session;
+      }
+    }
+  }
+
+  if (!dispatcher) {
+    return nullptr;
+  }
+
   if (LOG_ENABLED(INFO)) {
     LOG(INFO) << "Memcached: get cached session, id="
               << util::format_hex(id, idlen);
   }
 
-  auto req = make_unique<MemcachedRequest>();
+  auto req = dispatcher->create_request();
   req->op = MEMCACHED_OP_GET;
   req->key = MEMCACHED_SESSION_CACHE_KEY_PREFIX;
   req->key += util::format_hex(id, idlen);
-  req->cb = [conn](MemcachedRequest *, MemcachedResult res) {
+  req->cb = [conn, shm_cache](MemcachedRequest *, MemcachedResult res) {
     if (LOG_ENABLED(INFO)) {
       LOG(INFO) << "Memcached: returned status code " << res.status_code;
     }
@@ -301,6 +424,19 @@ SSL_SESSION *tls_session_get_cb(SSL *ssl, unsigned char *id, int idlen,
       return;
     }
 
+    // Populate shared memory cache, so that the next lookup does not
+    // hit memcached.
+    if (shm_cache &&
+        res.value.size() <= SHM_SESSION_CACHE_MAX_SESSION_LENGTH) {
+      const unsigned char *id;
+      unsigned int idlen;
+
+      id = SSL_SESSION_get_id(session, &idlen);
+
+      shm_cache->store(id, idlen, res.value.data(), res.value.size(),
+                       get_session_expiry(session));
+    }
+
     conn->tls.cached_session = session;
     conn->tls.handshake_state = TLS_CONN_GOT_SESSION_CACHE;
   };
@@ -314,6 +450,24 @@ SSL_SESSION *tls_session_get_cb(SSL *ssl, unsigned char *id, int idlen,
 }
 } // namespace
 
+namespace {
+void tls_session_remove_cb(SSL_CTX *ssl_ctx, SSL_SESSION *session) {
+  auto shm_cache = get_config()->tls.session_cache.shm.cache;
+
+  const unsigned char *id;
+  unsigned int idlen;
+
+  id = SSL_SESSION_get_id(session, &idlen);
+
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Shared memory: remove session, id="
+              << util::format_hex(id, idlen);
+  }
+
+  shm_cache->remove(id, idlen);
+}
+} // namespace
+
 namespace {
 int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
                   EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc) {
@@ -460,12 +614,14 @@ long int create_tls_proto_mask(const std::vector<std::string> &tls_proto_list) {
   return res;
 }
 
-SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
+SSL_CTX *try_create_ssl_context(const char *private_key_file,
+                                const char *cert_file,
+                                TLSContextData *tls_ctx_data
 #ifdef HAVE_NEVERBLEED
-                            ,
-                            neverbleed_t *nb
+                                ,
+                                neverbleed_t *nb
 #endif // HAVE_NEVERBLEED
-                            ) {
+                                ) {
   auto ssl_ctx = SSL_CTX_new(SSLv23_server_method());
   if (!ssl_ctx) {
     LOG(FATAL) << ERR_error_string(ERR_get_error(), nullptr);
@@ -484,11 +640,22 @@ SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
 
   const unsigned char sid_ctx[] = "shrpx";
   SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
-  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
 
-  if (!tlsconf.session_cache.memcached.host.empty()) {
+  if (tlsconf.session_cache.shm.cache) {
+    // Shared memory cache replaces OpenSSL internal cache.  memcached,
+    // if configured, is consulted when it misses.
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER |
+                                                SSL_SESS_CACHE_NO_INTERNAL);
     SSL_CTX_sess_set_new_cb(ssl_ctx, tls_session_new_cb);
     SSL_CTX_sess_set_get_cb(ssl_ctx, tls_session_get_cb);
+    SSL_CTX_sess_set_remove_cb(ssl_ctx, tls_session_remove_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+
+    if (!tlsconf.session_cache.memcached.host.empty()) {
+      SSL_CTX_sess_set_new_cb(ssl_ctx, tls_session_new_cb);
+      SSL_CTX_sess_set_get_cb(ssl_ctx, tls_session_get_cb);
+    }
   }
 
   SSL_CTX_set_timeout(ssl_ctx, tlsconf.session_timeout.count());
@@ -557,28 +724,42 @@ SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
 #ifndef HAVE_NEVERBLEED
   if (SSL_CTX_use_PrivateKey_file(ssl_ctx, private_key_file,
                                   SSL_FILETYPE_PEM) != 1) {
-    LOG(FATAL) << "SSL_CTX_use_PrivateKey_file failed: "
+    LOG(ERROR) << "SSL_CTX_use_PrivateKey_file failed: "
                << ERR_error_string(ERR_get_error(), nullptr);
+    SSL_CTX_free(ssl_ctx);
+    return nullptr;
   }
 #else  // HAVE_NEVERBLEED
   std::array<char, NEVERBLEED_ERRBUF_SIZE> errbuf;
   if (neverbleed_load_private_key_file(nb, ssl_ctx, private_key_file,
                                        errbuf.data()) != 1) {
-    LOG(FATAL) << "neverbleed_load_private_key_file failed: " << errbuf.data();
-    DIE();
+    LOG(ERROR) << "neverbleed_load_private_key_file failed: " << errbuf.data();
+    SSL_CTX_free(ssl_ctx);
+    return nullptr;
   }
 #endif // HAVE_NEVERBLEED
 
   if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
-    LOG(FATAL) << "SSL_CTX_use_certificate_file failed: "
+    LOG(ERROR) << "SSL_CTX_use_certificate_file failed: "
                << ERR_error_string(ERR_get_error(), nullptr);
-    DIE();
+    SSL_CTX_free(ssl_ctx);
+    return nullptr;
   }
   if (SSL_CTX_check_private_key(ssl_ctx) != 1) {
-    LOG(FATAL) << "SSL_CTX_check_private_key failed: "
+    LOG(ERROR) << "SSL_CTX_check_private_key failed: "
                << ERR_error_string(ERR_get_error(), nullptr);
-    DIE();
+    SSL_CTX_free(ssl_ctx);
+    return nullptr;
   }
+#ifdef SHRPX_ASYNC_PRIVATE_KEY
+  if (tlsconf.private_key_pool &&
+      tlsconf.private_key_pool->enable_async(ssl_ctx) != 0) {
+    LOG(ERROR) << "Could not enable asynchronous private key operation for "
+               << cert_file;
+    SSL_CTX_free(ssl_ctx);
+    return nullptr;
+  }
+#endif // SHRPX_ASYNC_PRIVATE_KEY
   if (tlsconf.client_verify.enabled) {
     if (!tlsconf.client_verify.cacert.empty()) {
       if (SSL_CTX_load_verify_locations(
@@ -620,10 +801,30 @@ SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
   SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_proto_cb, nullptr);
 #endif // OPENSSL_VERSION_NUMBER >= 0x10002000L
 
+  SSL_CTX_set_app_data(ssl_ctx, tls_ctx_data);
+
+  return ssl_ctx;
+}
+
+SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
+#ifdef HAVE_NEVERBLEED
+                            ,
+                            neverbleed_t *nb
+#endif // HAVE_NEVERBLEED
+                            ) {
   auto tls_ctx_data = new TLSContextData();
   tls_ctx_data->cert_file = cert_file;
 
-  SSL_CTX_set_app_data(ssl_ctx, tls_ctx_data);
+  auto ssl_ctx = try_create_ssl_context(private_key_file, cert_file,
+                                        tls_ctx_data
+#ifdef HAVE_NEVERBLEED
+                                        ,
+                                        nb
+#endif // HAVE_NEVERBLEED
+                                        );
+  if (!ssl_ctx) {
+    DIE();
+  }
 
   return ssl_ctx;
 }
@@ -961,7 +1162,8 @@ int verify_hostname(X509 *cert, const char *hostname, size_t hlen,
         continue;
       }
 
-      auto name = reinterpret_cast<char *>(ASN1_STRING_data(altname->d.ia5));
+      auto name = reinterpret_cast<const char *>(
+          ASN1_STRING_get0_data(altname->d.ia5));
       if (!name) {
         continue;
       }
@@ -1024,159 +1226,188 @@ int check_cert(SSL *ssl, const DownstreamAddr *addr) {
   return check_cert(ssl, &addr->addr, hostname);
 }
 
-CertLookupTree::CertLookupTree() {
-  root_.ssl_ctx = nullptr;
-  root_.str = nullptr;
-  root_.first = root_.last = 0;
+CertLookupTree::CertLookupTree() : num_exact_(0), num_wildcard_(0) {}
+
+namespace {
+// Computes FNV-1a hash of lowercased |s| of length |len|.
+uint32_t hash_hostname(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= static_cast<uint8_t>(util::lowcase(s[i]));
+    h *= 16777619u;
+  }
+  return h;
 }
+} // namespace
 
 namespace {
-// The |offset| is the index in the hostname we are examining.  We are
-// going to scan from |offset| in backwards.
-void cert_lookup_tree_add_cert(CertNode *node, SSL_CTX *ssl_ctx, char *hostname,
-                               size_t len, int offset) {
-  int i, next_len = node->next.size();
-  char c = hostname[offset];
-  CertNode *cn = nullptr;
-  for (i = 0; i < next_len; ++i) {
-    cn = node->next[i].get();
-    if (cn->str[cn->first] == c) {
-      break;
-    }
+// Returns the position of the first '.' in |hostname| if it is
+// eligible for wildcard matching in tls_hostname_match(), or nullptr.
+const char *find_wildcard_suffix(const char *hostname, size_t len) {
+  auto end = hostname + len;
+  auto wildcard = std::find(hostname, end, '*');
+  if (wildcard == end) {
+    return nullptr;
   }
-  if (i == next_len) {
-    if (c == '*') {
-      // We assume hostname as wildcard hostname when first '*' is
-      // encountered. Note that as per RFC 6125 (6.4.3), there are
-      // some restrictions for wildcard hostname. We just ignore
-      // these rules here but do the proper check when we do the
-      // match.
-      node->wildcard_certs.push_back({ssl_ctx, hostname, len});
-      return;
-    }
+  auto dot = std::find(hostname, end, '.');
+  if (dot == end || dot < wildcard || std::find(dot + 1, end, '.') == end ||
+      util::istarts_with(hostname, len, "xn--")) {
+    return nullptr;
+  }
+  return dot;
+}
+} // namespace
 
-    int j;
-    auto new_node = make_unique<CertNode>();
-    new_node->str = hostname;
-    new_node->first = offset;
-    // If wildcard is found, set the region before it because we
-    // don't include it in [first, last).
-    for (j = offset; j >= 0 && hostname[j] != '*'; --j)
-      ;
-    new_node->last = j;
-    if (j == -1) {
-      new_node->ssl_ctx = ssl_ctx;
-    } else {
-      new_node->ssl_ctx = nullptr;
-      new_node->wildcard_certs.push_back({ssl_ctx, hostname, len});
+const CertLookupEntry *
+CertLookupTree::find(const std::vector<CertLookupEntry> &table,
+                     const char *name, size_t len, uint32_t hash) const {
+  if (table.empty()) {
+    return nullptr;
+  }
+
+  auto mask = table.size() - 1;
+  for (auto i = hash & mask;; i = (i + 1) & mask) {
+    auto &ent = table[i];
+    if (ent.namelen == 0) {
+      return nullptr;
+    }
+    if (ent.hash == hash &&
+        util::strieq(&names_[ent.name_offset], ent.namelen, name, len)) {
+      return &ent;
     }
-    node->next.push_back(std::move(new_node));
-    return;
   }
+}
 
-  int j;
-  for (i = cn->first, j = offset;
-       i > cn->last && j >= 0 && cn->str[i] == hostname[j]; --i, --j)
-    ;
-  if (i == cn->last) {
-    if (j == -1) {
-      // If the same hostname already exists, we don't overwrite
-      // exiting ssl_ctx
-      if (!cn->ssl_ctx) {
-        cn->ssl_ctx = ssl_ctx;
+CertLookupEntry *CertLookupTree::insert(std::vector<CertLookupEntry> &table,
+                                        size_t *nentries, uint32_t offset,
+                                        size_t len, uint32_t hash) {
+  // Keep load factor at most 1/2 so that probe sequence is short.
+  if ((*nentries + 1) * 2 > table.size()) {
+    std::vector<CertLookupEntry> newtable(
+        std::max(static_cast<size_t>(16), table.size() * 2));
+    auto mask = newtable.size() - 1;
+    for (auto &ent : table) {
+      if (ent.namelen == 0) {
+        continue;
       }
-      return;
+      auto i = ent.hash & mask;
+      for (; newtable[i].namelen; i = (i + 1) & mask)
+        ;
+      newtable[i] = ent;
+    }
+    table = std::move(newtable);
+  }
+
+  auto mask = table.size() - 1;
+  auto i = hash & mask;
+  for (; table[i].namelen; i = (i + 1) & mask) {
+    auto &ent = table[i];
+    if (ent.hash == hash &&
+        util::streq(&names_[ent.name_offset], ent.namelen, &names_[offset],
+                    len)) {
+      return &ent;
     }
+  }
 
-    // The existing hostname is a suffix of this hostname.  Continue
-    // matching at potion j.
-    cert_lookup_tree_add_cert(cn, ssl_ctx, hostname, len, j);
+  auto &ent = table[i];
+  ent.name_offset = offset;
+  ent.namelen = len;
+  ent.hash = hash;
+  ent.value = -1;
+
+  ++*nentries;
+
+  return &ent;
+}
+
+void CertLookupTree::add_cert(size_t idx, const char *hostname, size_t len) {
+  if (len == 0) {
     return;
   }
 
-  {
-    auto new_node = make_unique<CertNode>();
-    new_node->ssl_ctx = cn->ssl_ctx;
-    new_node->str = cn->str;
-    new_node->first = i;
-    new_node->last = cn->last;
-    new_node->wildcard_certs.swap(cn->wildcard_certs);
-    new_node->next.swap(cn->next);
+  uint32_t offset = names_.size();
+  for (size_t i = 0; i < len; ++i) {
+    names_ += util::lowcase(hostname[i]);
+  }
+
+  auto name = &names_[offset];
+  auto dot = find_wildcard_suffix(name, len);
 
-    cn->next.push_back(std::move(new_node));
+  if (!dot) {
+    // Even if hostname contains '*', it is not treated as wildcard,
+    // and only matches literally.
+    auto ent =
+        insert(exact_, &num_exact_, offset, len, hash_hostname(name, len));
+    if (ent->value == static_cast<uint32_t>(-1)) {
+      ent->value = idx;
+    } else {
+      // Duplicate.  We don't overwrite the existing index.
+      names_.resize(offset);
+    }
+    return;
   }
 
-  cn->last = i;
-  if (j == -1) {
-    // This hostname is a suffix of the existing hostname.
-    cn->ssl_ctx = ssl_ctx;
+  auto suffix_offset = offset + (dot - name);
+  auto suffixlen = len - (dot - name);
+
+  auto ent = insert(wildcard_, &num_wildcard_, suffix_offset, suffixlen,
+                    hash_hostname(dot, suffixlen));
+
+  wildcard_certs_.push_back({offset, static_cast<uint32_t>(len), -1,
+                             static_cast<uint32_t>(idx)});
+  int32_t wcidx = wildcard_certs_.size() - 1;
+
+  if (ent->value == static_cast<uint32_t>(-1)) {
+    ent->value = wcidx;
     return;
   }
 
-  // This hostname and existing one share suffix.
-  cn->ssl_ctx = nullptr;
-  cert_lookup_tree_add_cert(cn, ssl_ctx, hostname, len, j);
+  // Append to the tail, so that the pattern added first wins.
+  auto wc = &wildcard_certs_[ent->value];
+  for (; wc->next != -1; wc = &wildcard_certs_[wc->next])
+    ;
+  wc->next = wcidx;
 }
-} // namespace
 
-void CertLookupTree::add_cert(SSL_CTX *ssl_ctx, const char *hostname,
-                              size_t len) {
+ssize_t CertLookupTree::lookup(const char *hostname, size_t len) {
   if (len == 0) {
-    return;
+    return -1;
   }
-  // Copy hostname including terminal NULL
-  hosts_.push_back(make_unique<char[]>(len + 1));
-  const auto &host_copy = hosts_.back();
-  for (size_t i = 0; i < len; ++i) {
-    host_copy[i] = util::lowcase(hostname[i]);
+
+  auto ent = find(exact_, hostname, len, hash_hostname(hostname, len));
+  if (ent) {
+    return ent->value;
   }
-  host_copy[len] = '\0';
-  cert_lookup_tree_add_cert(&root_, ssl_ctx, host_copy.get(), len, len - 1);
-}
 
-namespace {
-SSL_CTX *cert_lookup_tree_lookup(CertNode *node, const char *hostname,
-                                 size_t len, int offset) {
-  int i, j;
-  for (i = node->first, j = offset;
-       i > node->last && j >= 0 && node->str[i] == util::lowcase(hostname[j]);
-       --i, --j)
-    ;
-  if (i != node->last) {
-    return nullptr;
+  if (wildcard_certs_.empty()) {
+    return -1;
   }
-  if (j == -1) {
-    if (node->ssl_ctx) {
-      // exact match
-      return node->ssl_ctx;
-    }
 
-    // Do not perform wildcard-match because '*' must match at least
-    // one character.
-    return nullptr;
+  auto end = hostname + len;
+  auto dot = std::find(hostname, end, '.');
+  if (dot == end) {
+    return -1;
   }
 
-  for (const auto &wildcert : node->wildcard_certs) {
-    if (tls_hostname_match(wildcert.hostname, wildcert.hostnamelen, hostname,
-                           len)) {
-      return wildcert.ssl_ctx;
-    }
+  auto suffixlen = end - dot;
+  ent = find(wildcard_, dot, suffixlen, hash_hostname(dot, suffixlen));
+  if (!ent) {
+    return -1;
   }
-  auto c = util::lowcase(hostname[j]);
-  for (const auto &next_node : node->next) {
-    if (next_node->str[next_node->first] == c) {
-      return cert_lookup_tree_lookup(next_node.get(), hostname, len, j);
+
+  for (auto i = static_cast<int32_t>(ent->value); i != -1;) {
+    auto &wc = wildcard_certs_[i];
+    if (tls_hostname_match(&names_[wc.name_offset], wc.namelen, hostname,
+                           len)) {
+      return wc.ssl_ctx_idx;
     }
+    i = wc.next;
   }
-  return nullptr;
-}
-} // namespace
 
-SSL_CTX *CertLookupTree::lookup(const char *hostname, size_t len) {
-  return cert_lookup_tree_lookup(&root_, hostname, len, len - 1);
+  return -1;
 }
 
-int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, SSL_CTX *ssl_ctx,
+int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, size_t idx,
                                         const char *certfile) {
   auto bio = BIO_new(BIO_s_file());
   if (!bio) {
@@ -1207,7 +1438,8 @@ int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, SSL_CTX *ssl_ctx,
         continue;
       }
 
-      auto name = reinterpret_cast<char *>(ASN1_STRING_data(altname->d.ia5));
+      auto name = reinterpret_cast<const char *>(
+          ASN1_STRING_get0_data(altname->d.ia5));
       if (!name) {
         continue;
       }
@@ -1218,7 +1450,7 @@ int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, SSL_CTX *ssl_ctx,
         continue;
       }
 
-      lt->add_cert(ssl_ctx, name, len);
+      lt->add_cert(idx, name, len);
     }
   }
 
@@ -1228,7 +1460,7 @@ int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, SSL_CTX *ssl_ctx,
     return 0;
   }
 
-  lt->add_cert(ssl_ctx, reinterpret_cast<char *>(cn), cnlen);
+  lt->add_cert(idx, reinterpret_cast<char *>(cn), cnlen);
 
   OPENSSL_free(cn);
 
@@ -1246,7 +1478,8 @@ bool in_proto_list(const std::vector<std::string> &protos,
 }
 
 SSL_CTX *setup_server_ssl_context(std::vector<SSL_CTX *> &all_ssl_ctx,
-                                  CertLookupTree *cert_tree
+                                  CertLookupTree *cert_tree,
+                                  SSLContextPool *ssl_ctx_pool
 #ifdef HAVE_NEVERBLEED
                                   ,
                                   neverbleed_t *nb
@@ -1272,30 +1505,39 @@ SSL_CTX *setup_server_ssl_context(std::vector<SSL_CTX *> &all_ssl_ctx,
     return ssl_ctx;
   }
 
-  if (!cert_tree) {
+  if (!cert_tree || !ssl_ctx_pool) {
     LOG(WARN) << "We have multiple additional certificates (--subcert), but "
                  "cert_tree is not given.  SNI may not work.";
     return ssl_ctx;
   }
 
   for (auto &keycert : tlsconf.subcerts) {
-    auto ssl_ctx =
-        ssl::create_ssl_context(keycert.first.c_str(), keycert.second.c_str()
+    size_t idx;
+    if (tlsconf.subcert_lazy_cache_size) {
+      // SSL_CTX is created when the name is requested first time.
+      idx = ssl_ctx_pool->add_lazy(keycert.first.c_str(),
+                                   keycert.second.c_str());
+    } else {
+      auto ssl_ctx =
+          ssl::create_ssl_context(keycert.first.c_str(), keycert.second.c_str()
 #ifdef HAVE_NEVERBLEED
-                                                           ,
-                                nb
+                                                             ,
+                                  nb
 #endif // HAVE_NEVERBLEED
-                                );
-    all_ssl_ctx.push_back(ssl_ctx);
+                                  );
+      all_ssl_ctx.push_back(ssl_ctx);
+      idx = ssl_ctx_pool->add_ssl_ctx(ssl_ctx);
+    }
     if (ssl::cert_lookup_tree_add_cert_from_file(
-            cert_tree, ssl_ctx, keycert.second.c_str()) == -1) {
+            cert_tree, idx, keycert.second.c_str()) == -1) {
       LOG(FATAL) << "Failed to add sub certificate.";
       DIE();
     }
   }
 
   if (ssl::cert_lookup_tree_add_cert_from_file(
-          cert_tree, ssl_ctx, tlsconf.cert_file.c_str()) == -1) {
+          cert_tree, ssl_ctx_pool->add_ssl_ctx(ssl_ctx),
+          tlsconf.cert_file.c_str()) == -1) {
     LOG(FATAL) << "Failed to add default certificate.";
     DIE();
   }
@@ -1392,6 +1634,19 @@ SSL_SESSION *reuse_tls_session(const DownstreamAddr *addr) {
   return d2i_SSL_SESSION(nullptr, &p, cache.session_data.size());
 }
 
+void update_ocsp_response(SSL_CTX *ssl_ctx, std::vector<uint8_t> data) {
+#ifndef OPENSSL_IS_BORINGSSL
+  auto tls_ctx_data =
+      static_cast<TLSContextData *>(SSL_CTX_get_app_data(ssl_ctx));
+  auto ocsp_data = std::make_shared<std::vector<uint8_t>>(std::move(data));
+
+  std::lock_guard<std::mutex> g(tls_ctx_data->mu);
+  tls_ctx_data->ocsp_data = std::move(ocsp_data);
+#else  // OPENSSL_IS_BORINGSSL
+  SSL_CTX_set_ocsp_response(ssl_ctx, data.data(), data.size());
+#endif // OPENSSL_IS_BORINGSSL
+}
+
 } // namespace ssl
 
 } // namespace shrpx
@@ -28,6 +28,7 @@
 #include "shrpx.h"
 
 #include <vector>
+#include <string>
 #include <mutex>
 
 #include <openssl/ssl.h>
@@ -46,6 +47,7 @@ namespace shrpx {
 class ClientHandler;
 class Worker;
 class DownstreamConnectionPool;
+class SSLContextPool;
 struct DownstreamAddr;
 struct UpstreamAddr;
 
@@ -63,7 +65,8 @@ struct TLSContextData {
   const char *cert_file;
 };
 
-// Create server side SSL_CTX
+// Create server side SSL_CTX.  This function terminates the process
+// if it fails.
 SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
 #ifdef HAVE_NEVERBLEED
                             ,
@@ -71,6 +74,18 @@ SSL_CTX *create_ssl_context(const char *private_key_file, const char *cert_file
 #endif // HAVE_NEVERBLEED
                             );
 
+// Just like create_ssl_context(), but returns nullptr if private key
+// or certificate cannot be loaded.  |tls_ctx_data| is attached to the
+// returned SSL_CTX, and the caller keeps its ownership.
+SSL_CTX *try_create_ssl_context(const char *private_key_file,
+                                const char *cert_file,
+                                TLSContextData *tls_ctx_data
+#ifdef HAVE_NEVERBLEED
+                                ,
+                                neverbleed_t *nb
+#endif // HAVE_NEVERBLEED
+                                );
+
 // Create client side SSL_CTX.  This does not configure ALPN settings.
 // |next_proto_select_cb| is for NPN.
 SSL_CTX *create_ssl_client_context(
@@ -95,72 +110,98 @@ int check_cert(SSL *ssl, const DownstreamAddr *addr);
 void get_altnames(X509 *cert, std::vector<std::string> &dns_names,
                   std::vector<std::string> &ip_addrs, std::string &common_name);
 
-// CertLookupTree forms lookup tree to get SSL_CTX whose DNS or
-// commonName matches hostname in query. The tree is patricia trie
-// data structure formed from the tail of the hostname pattern. Each
-// CertNode contains part of hostname str member in range [first,
-// last) member and the next member contains the following CertNode
-// pointers ('following' means character before the current one). The
-// CertNode where a hostname pattern ends contains its SSL_CTX pointer
-// in the ssl_ctx member.  For wildcard hostname pattern, we store the
-// its pattern and SSL_CTX in CertNode one before first "*" found from
-// the tail.
-//
-// When querying SSL_CTX with particular hostname, we match from its
-// tail in our lookup tree. If the query goes to the first character
-// of the hostname and current CertNode has non-NULL ssl_ctx member,
-// then it is the exact match. The ssl_ctx member is returned.  Along
-// the way, if CertNode which contains non-empty wildcard_certs member
-// is encountered, wildcard hostname matching is performed against
-// them. If there is a match, its SSL_CTX is returned. If none
-// matches, query is continued to the next character.
-
-struct WildcardCert {
-  SSL_CTX *ssl_ctx;
-  char *hostname;
-  size_t hostnamelen;
+// Entry of open addressing hash table in CertLookupTree.
+struct CertLookupEntry {
+  // Offset of the name in CertLookupTree::names_.
+  uint32_t name_offset;
+  // Length of the name.  0 if this entry is empty.
+  uint32_t namelen;
+  // Hash value of the name.
+  uint32_t hash;
+  // For exact match table, the index of SSL_CTX.  For wildcard
+  // table, the index of the first WildcardCert in
+  // CertLookupTree::wildcard_certs_.
+  uint32_t value;
 };
 
-struct CertNode {
-  // list of wildcard domain name and its SSL_CTX pair, the wildcard
-  // '*' appears in this position.
-  std::vector<WildcardCert> wildcard_certs;
-  // Next CertNode index of CertLookupTree::nodes
-  std::vector<std::unique_ptr<CertNode>> next;
-  // SSL_CTX for exact match
-  SSL_CTX *ssl_ctx;
-  char *str;
-  // [first, last) in the reverse direction in str, first >=
-  // last. This indices only work for str member.
-  int first, last;
+struct WildcardCert {
+  // Offset of the hostname pattern in CertLookupTree::names_.
+  uint32_t name_offset;
+  uint32_t namelen;
+  // The index of next WildcardCert which has the same suffix, or -1.
+  int32_t next;
+  uint32_t ssl_ctx_idx;
 };
 
+// CertLookupTree looks up the index of SSL_CTX whose DNS or
+// commonName matches hostname in query.  The index is the one given
+// by the caller when the hostname is added, and it is usually the
+// index in SSLContextPool.  All hostname patterns are stored in
+// lowercase in the single string, and the hash tables refer to them
+// by offset so that lookup does not chase pointers.
+//
+// The hostname pattern without wildcard is stored in the open
+// addressing hash table keyed by the whole name.  As per RFC 6125,
+// wildcard is only allowed in the left-most label, so that the
+// wildcard pattern can match a hostname only if the labels following
+// the left-most one are equal.  The wildcard pattern is stored in
+// another hash table keyed by them, for example ".example.com" for
+// "*.example.com".  The patterns which share the same key are
+// chained in the order they are added.
+//
+// When querying SSL_CTX with particular hostname, we look up the
+// exact match first.  If it is not found, we look up the wildcard
+// table by the hostname without its left-most label, and perform
+// wildcard hostname matching against the chained patterns.
 class CertLookupTree {
 public:
   CertLookupTree();
 
-  // Adds |ssl_ctx| with hostname pattern |hostname| with length |len|
-  // to the lookup tree.  The |hostname| must be NULL-terminated.
-  void add_cert(SSL_CTX *ssl_ctx, const char *hostname, size_t len);
+  // Adds SSL_CTX index |idx| with hostname pattern |hostname| with
+  // length |len| to the lookup tree.  The |hostname| must be
+  // NULL-terminated.  If the same hostname pattern has already been
+  // added, the existing index is kept.
+  void add_cert(size_t idx, const char *hostname, size_t len);
 
-  // Looks up SSL_CTX using the given |hostname| with length |len|.
-  // If more than one SSL_CTX which matches the query, it is undefined
-  // which one is returned.  The |hostname| must be NULL-terminated.
-  // If no matching SSL_CTX found, returns NULL.
-  SSL_CTX *lookup(const char *hostname, size_t len);
+  // Looks up the index of SSL_CTX using the given |hostname| with
+  // length |len|.  If more than one SSL_CTX which matches the query,
+  // the one added with the exact hostname is preferred, and then the
+  // wildcard one added first.  The |hostname| must be
+  // NULL-terminated.  If no matching SSL_CTX found, returns -1.
+  ssize_t lookup(const char *hostname, size_t len);
 
 private:
-  CertNode root_;
-  // Stores pointers to copied hostname when adding hostname and
-  // ssl_ctx pair.
-  std::vector<std::unique_ptr<char[]>> hosts_;
+  // Returns the entry for the name |name| of length |len| whose hash
+  // value is |hash| in |table|.  If no entry is found, returns
+  // nullptr.
+  const CertLookupEntry *find(const std::vector<CertLookupEntry> &table,
+                              const char *name, size_t len,
+                              uint32_t hash) const;
+  // Adds the name stored at |offset| in names_ with length |len| to
+  // |table| which has |*nentries| entries.  If the same name exists,
+  // returns the existing entry.  Otherwise returns new entry whose
+  // value must be set by the caller.
+  CertLookupEntry *insert(std::vector<CertLookupEntry> &table,
+                          size_t *nentries, uint32_t offset, size_t len,
+                          uint32_t hash);
+
+  // Concatenation of lowercased hostname patterns.
+  std::string names_;
+  // Hash table for the exact match.  The size is power of 2.
+  std::vector<CertLookupEntry> exact_;
+  // Hash table keyed by the labels following the wildcard label.
+  // The size is power of 2.
+  std::vector<CertLookupEntry> wildcard_;
+  std::vector<WildcardCert> wildcard_certs_;
+  // The number of entries in exact_ and wildcard_ respectively.
+  size_t num_exact_, num_wildcard_;
 };
 
-// Adds |ssl_ctx| to lookup tree |lt| using hostnames read from
-// |certfile|. The subjectAltNames and commonName are considered as
-// eligible hostname. This function returns 0 if it succeeds, or -1.
-// Even if no ssl_ctx is added to tree, this function returns 0.
-int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, SSL_CTX *ssl_ctx,
+// Adds SSL_CTX index |idx| to lookup tree |lt| using hostnames read
+// from |certfile|. The subjectAltNames and commonName are considered
+// as eligible hostname. This function returns 0 if it succeeds, or
+// -1.  Even if no index is added to tree, this function returns 0.
+int cert_lookup_tree_add_cert_from_file(CertLookupTree *lt, size_t idx,
                                         const char *certfile);
 
 // Returns true if |needle| which has |len| bytes is included in the
@@ -183,10 +224,15 @@ set_alpn_prefs(const std::vector<std::string> &protos);
 // and if upstream_no_tls is true, returns nullptr.  Otherwise
 // construct default SSL_CTX.  If subcerts are available
 // (get_config()->subcerts), caller should provide CertLookupTree
-// object as |cert_tree| parameter, otherwise SNI does not work.  All
-// the created SSL_CTX is stored into |all_ssl_ctx|.
+// object as |cert_tree| parameter and SSLContextPool object as
+// |ssl_ctx_pool| parameter, otherwise SNI does not work.  All the
+// created SSL_CTX is stored into |all_ssl_ctx|.  If
+// get_config()->tls.subcert_lazy_cache_size is nonzero, SSL_CTX for
+// subcerts are not created here, and |ssl_ctx_pool| creates them on
+// demand.
 SSL_CTX *setup_server_ssl_context(std::vector<SSL_CTX *> &all_ssl_ctx,
-                                  CertLookupTree *cert_tree
+                                  CertLookupTree *cert_tree,
+                                  SSLContextPool *ssl_ctx_pool
 #ifdef HAVE_NEVERBLEED
                                   ,
                                   neverbleed_t *nb
@@ -234,6 +280,10 @@ void try_cache_tls_session(DownstreamAddr *addr, SSL_SESSION *session,
 // found associated to |addr|, nullptr will be returned.
 SSL_SESSION *reuse_tls_session(const DownstreamAddr *addr);
 
+// Replaces OCSP response stapled by |ssl_ctx| with |data|.  Handshakes
+// in progress keep using the old response.
+void update_ocsp_response(SSL_CTX *ssl_ctx, std::vector<uint8_t> data);
+
 } // namespace ssl
 
 } // namespace shrpx
@@ -0,0 +1,282 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_ssl_context_pool.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "shrpx_worker.h"
+#include "shrpx_log.h"
+#include "ssl_compat.h"
+
+namespace shrpx {
+
+
+SSLContextPool::SSLContextPool(size_t capacity
+#ifdef HAVE_NEVERBLEED
+                               ,
+                               neverbleed_t *nb
+#endif // HAVE_NEVERBLEED
+                               )
+    :
+#ifndef NOTHREADS
+      loader_started_(false),
+      stop_(false),
+#endif // !NOTHREADS
+#ifdef HAVE_NEVERBLEED
+      nb_(nb),
+#endif // HAVE_NEVERBLEED
+      capacity_(std::max(capacity, static_cast<size_t>(1))) {
+}
+
+SSLContextPool::~SSLContextPool() {
+#ifndef NOTHREADS
+  {
+    std::lock_guard<std::mutex> g(mu_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+
+  if (loader_.joinable()) {
+    loader_.join();
+  }
+#endif // !NOTHREADS
+
+  // Handshakes in progress still hold the reference to SSL_CTX.
+  for (auto &ent : entries_) {
+    if (!ent->pinned && ent->ssl_ctx) {
+      SSL_CTX_free(ent->ssl_ctx);
+    }
+  }
+}
+
+size_t SSLContextPool::add_ssl_ctx(SSL_CTX *ssl_ctx) {
+  auto ent = make_unique<SSLContextEntry>();
+  ent->dlnext = ent->dlprev = nullptr;
+  ent->tls_ctx_data.cert_file = nullptr;
+  ent->private_key_file = nullptr;
+  ent->ssl_ctx = ssl_ctx;
+  ent->state = SSL_CTX_STATE_LOADED;
+  ent->pinned = true;
+
+  entries_.push_back(std::move(ent));
+
+  return entries_.size() - 1;
+}
+
+size_t SSLContextPool::add_lazy(const char *private_key_file,
+                                const char *cert_file) {
+  auto ent = make_unique<SSLContextEntry>();
+  ent->dlnext = ent->dlprev = nullptr;
+  ent->tls_ctx_data.cert_file = cert_file;
+  ent->private_key_file = private_key_file;
+  ent->ssl_ctx = nullptr;
+  ent->state = SSL_CTX_STATE_NONE;
+  ent->pinned = false;
+
+  entries_.push_back(std::move(ent));
+
+  return entries_.size() - 1;
+}
+
+int SSLContextPool::select(SSL *ssl, size_t idx, Worker *worker) {
+  assert(idx < entries_.size());
+
+  auto ent = entries_[idx].get();
+
+  // Pinned entry is never modified, and it does not need lock.
+  if (ent->pinned) {
+    SSL_set_SSL_CTX(ssl, ent->ssl_ctx);
+    return 0;
+  }
+
+  std::unique_lock<std::mutex> g(mu_);
+
+  switch (ent->state) {
+  case SSL_CTX_STATE_LOADED:
+    // SSL_set_SSL_CTX increments reference count of SSL_CTX, so that
+    // it can be evicted while |ssl| uses it.
+    SSL_set_SSL_CTX(ssl, ent->ssl_ctx);
+
+    lru_.remove(ent);
+    lru_.append(ent);
+
+    return 0;
+  case SSL_CTX_STATE_FAILED:
+    return -1;
+  case SSL_CTX_STATE_LOADING:
+    break;
+  default: {
+    ent->state = SSL_CTX_STATE_LOADING;
+
+#ifdef NOTHREADS
+    g.unlock();
+
+    auto ssl_ctx = create_ssl_ctx(ent);
+
+    g.lock();
+
+    std::vector<Worker *> waiters;
+    on_loaded(ent, ssl_ctx, waiters);
+
+    if (!ssl_ctx) {
+      return -1;
+    }
+
+    SSL_set_SSL_CTX(ssl, ssl_ctx);
+
+    return 0;
+#else  // !NOTHREADS
+    if (!loader_started_) {
+      loader_started_ = true;
+      loader_ = std::thread([this]() { run_loader(); });
+    }
+
+    load_queue_.push_back(idx);
+    cv_.notify_one();
+#endif // !NOTHREADS
+
+    break;
+  }
+  }
+
+  if (worker && std::find(std::begin(ent->waiters), std::end(ent->waiters),
+                          worker) == std::end(ent->waiters)) {
+    ent->waiters.push_back(worker);
+  }
+
+  return 1;
+}
+
+size_t SSLContextPool::get_num_loaded() {
+  std::lock_guard<std::mutex> g(mu_);
+
+  return lru_.size();
+}
+
+SSL_CTX *SSLContextPool::create_ssl_ctx(SSLContextEntry *ent) {
+  if (LOG_ENABLED(INFO)) {
+    LOG(INFO) << "Loading certificate " << ent->tls_ctx_data.cert_file;
+  }
+
+  auto ssl_ctx = ssl::try_create_ssl_context(
+      ent->private_key_file, ent->tls_ctx_data.cert_file, &ent->tls_ctx_data
+#ifdef HAVE_NEVERBLEED
+      ,
+      nb_
+#endif // HAVE_NEVERBLEED
+      );
+
+  if (!ssl_ctx) {
+    LOG(ERROR) << "Could not load certificate " << ent->tls_ctx_data.cert_file
+               << ".  Default certificate is used for its names.";
+  }
+
+  return ssl_ctx;
+}
+
+void SSLContextPool::on_loaded(SSLContextEntry *ent, SSL_CTX *ssl_ctx,
+                               std::vector<Worker *> &waiters) {
+  waiters.swap(ent->waiters);
+
+  if (!ssl_ctx) {
+    ent->state = SSL_CTX_STATE_FAILED;
+    return;
+  }
+
+  ent->ssl_ctx = ssl_ctx;
+  ent->state = SSL_CTX_STATE_LOADED;
+
+  // Each waiter gets its own reference, so that it can resume
+  // handshake with |ssl_ctx| even if it is evicted before the
+  // waiter replays client hello.
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    SSL_CTX_up_ref(ssl_ctx);
+  }
+
+  lru_.append(ent);
+
+  while (lru_.size() > capacity_) {
+    auto victim = lru_.head;
+
+    lru_.remove(victim);
+
+    if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "Evict certificate " << victim->tls_ctx_data.cert_file;
+    }
+
+    SSL_CTX_free(victim->ssl_ctx);
+    victim->ssl_ctx = nullptr;
+    victim->state = SSL_CTX_STATE_NONE;
+  }
+}
+
+void SSLContextPool::notify(size_t idx, SSL_CTX *ssl_ctx,
+                            const std::vector<Worker *> &waiters) {
+  WorkerEvent wev{};
+  wev.type = SSL_CTX_LOADED;
+  wev.ssl_ctx_idx = idx;
+  wev.ssl_ctx = ssl_ctx;
+
+  for (auto worker : waiters) {
+    worker->send(wev);
+  }
+}
+
+#ifndef NOTHREADS
+void SSLContextPool::run_loader() {
+  std::unique_lock<std::mutex> g(mu_);
+
+  for (;;) {
+    cv_.wait(g, [this]() { return stop_ || !load_queue_.empty(); });
+
+    if (stop_) {
+      return;
+    }
+
+    auto idx = load_queue_.front();
+    load_queue_.pop_front();
+
+    auto ent = entries_[idx].get();
+
+    g.unlock();
+
+    auto ssl_ctx = create_ssl_ctx(ent);
+
+    g.lock();
+
+    std::vector<Worker *> waiters;
+    on_loaded(ent, ssl_ctx, waiters);
+
+    g.unlock();
+
+    notify(idx, ssl_ctx, waiters);
+
+    g.lock();
+  }
+}
+#endif // !NOTHREADS
+
+} // namespace shrpx
@@ -0,0 +1,152 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SHRPX_SSL_CONTEXT_POOL_H
+#define SHRPX_SSL_CONTEXT_POOL_H
+
+#include "shrpx.h"
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#ifndef NOTHREADS
+#include <thread>
+#include <condition_variable>
+#endif // !NOTHREADS
+
+#include <openssl/ssl.h>
+
+#ifdef HAVE_NEVERBLEED
+#include <neverbleed.h>
+#endif // HAVE_NEVERBLEED
+
+#include "shrpx_ssl.h"
+#include "template.h"
+
+using namespace nghttp2;
+
+namespace shrpx {
+
+class Worker;
+
+enum SSLContextState {
+  // SSL_CTX has not been created, or has been evicted.
+  SSL_CTX_STATE_NONE,
+  // SSL_CTX is being created by the loader thread.
+  SSL_CTX_STATE_LOADING,
+  // SSL_CTX is available.
+  SSL_CTX_STATE_LOADED,
+  // Private key or certificate could not be loaded.
+  SSL_CTX_STATE_FAILED,
+};
+
+struct SSLContextEntry {
+  SSLContextEntry *dlnext, *dlprev;
+  // Persists across eviction, so that OCSP response and handshakes
+  // in progress can refer to it.
+  ssl::TLSContextData tls_ctx_data;
+  // Workers which are waiting for this SSL_CTX being loaded.
+  std::vector<Worker *> waiters;
+  const char *private_key_file;
+  SSL_CTX *ssl_ctx;
+  int state;
+  // true if ssl_ctx was created at startup, and it is never evicted.
+  bool pinned;
+};
+
+// SSLContextPool maps the index stored in CertLookupTree to SSL_CTX.
+// SSL_CTX created at startup is pinned.  For the certificate added by
+// add_lazy(), SSL_CTX is created by the loader thread when a client
+// asks for its name first time, and at most |capacity| of them are
+// kept in LRU order.  The pool is shared by all worker threads.
+class SSLContextPool {
+public:
+  SSLContextPool(size_t capacity
+#ifdef HAVE_NEVERBLEED
+                 ,
+                 neverbleed_t *nb
+#endif // HAVE_NEVERBLEED
+                 );
+  ~SSLContextPool();
+
+  // Adds |ssl_ctx| which is never evicted, and returns its index.
+  // The caller keeps the ownership of |ssl_ctx|.  This function must
+  // be called before worker threads start.
+  size_t add_ssl_ctx(SSL_CTX *ssl_ctx);
+  // Adds the pair of |private_key_file| and |cert_file|, from which
+  // SSL_CTX is created on demand, and returns its index.  This
+  // function must be called before worker threads start.
+  size_t add_lazy(const char *private_key_file, const char *cert_file);
+
+  // Switches |ssl| to the SSL_CTX at |idx|, and returns 0.  If the
+  // SSL_CTX is not available yet, this function starts loading it,
+  // and returns 1.  When loading finishes, |worker| is sent
+  // SSL_CTX_LOADED event.  If |worker| is nullptr, no event is sent.
+  // If private key or certificate could not be loaded, returns -1.
+  int select(SSL *ssl, size_t idx, Worker *worker);
+
+  // Returns the number of lazily created SSL_CTX which are currently
+  // kept.
+  size_t get_num_loaded();
+
+private:
+  SSL_CTX *create_ssl_ctx(SSLContextEntry *ent);
+  // Stores |ssl_ctx| created for |ent|, and evicts least recently
+  // used ones if the pool is full.  Workers waiting for |ent| are
+  // moved to |waiters|, and a reference to |ssl_ctx| is taken for
+  // each of them.  |ssl_ctx| is nullptr if loading failed.  mu_ must
+  // be held.
+  void on_loaded(SSLContextEntry *ent, SSL_CTX *ssl_ctx,
+                 std::vector<Worker *> &waiters);
+  // Sends SSL_CTX_LOADED event for |idx| to |waiters|.  Each event
+  // carries one of the references to |ssl_ctx| taken by on_loaded().
+  void notify(size_t idx, SSL_CTX *ssl_ctx,
+              const std::vector<Worker *> &waiters);
+#ifndef NOTHREADS
+  void run_loader();
+#endif // !NOTHREADS
+
+  std::vector<std::unique_ptr<SSLContextEntry>> entries_;
+  // Lazily created SSL_CTX in LRU order.  The head is the least
+  // recently used one.
+  DList<SSLContextEntry> lru_;
+  std::mutex mu_;
+#ifndef NOTHREADS
+  // Indices of entries to load.
+  std::deque<size_t> load_queue_;
+  std::condition_variable cv_;
+  std::thread loader_;
+  bool loader_started_;
+  bool stop_;
+#endif // !NOTHREADS
+#ifdef HAVE_NEVERBLEED
+  neverbleed_t *nb_;
+#endif // HAVE_NEVERBLEED
+  size_t capacity_;
+};
+
+} // namespace shrpx
+
+#endif // SHRPX_SSL_CONTEXT_POOL_H
@@ -0,0 +1,285 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "shrpx_ssl_context_pool_test.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <CUnit/CUnit.h>
+
+#include <openssl/pem.h>
+
+#include "shrpx_ssl_context_pool.h"
+#include "shrpx_ssl.h"
+#include "shrpx_worker.h"
+#include "shrpx_connection.h"
+#include "shrpx_config.h"
+#include "memchunk.h"
+#include "template.h"
+
+namespace shrpx {
+
+namespace {
+// Writes newly generated private key and self-signed certificate to
+// temporary files, and stores their paths to |keyfile| and
+// |certfile|.
+void write_keycert(std::string &keyfile, std::string &certfile) {
+  auto ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  auto ctx_del = defer(EVP_PKEY_CTX_free, ctx);
+
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_keygen_init(ctx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+  EVP_PKEY_keygen(ctx, &pkey);
+  auto pkey_del = defer(EVP_PKEY_free, pkey);
+
+  auto cert = X509_new();
+  auto cert_del = defer(X509_free, cert);
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+
+  auto name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(
+      name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, pkey);
+  X509_sign(cert, pkey, EVP_sha256());
+
+  char keypath[] = "/tmp/nghttpx-unittest.XXXXXX";
+  close(mkstemp(keypath));
+  char certpath[] = "/tmp/nghttpx-unittest.XXXXXX";
+  close(mkstemp(certpath));
+
+  auto bio = BIO_new_file(keypath, "w");
+  PEM_write_bio_PrivateKey(bio, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+  BIO_free(bio);
+
+  bio = BIO_new_file(certpath, "w");
+  PEM_write_bio_X509(bio, cert);
+  BIO_free(bio);
+
+  keyfile = keypath;
+  certfile = certpath;
+}
+} // namespace
+
+namespace {
+// Calls SSLContextPool::select() until SSL_CTX is loaded or loading
+// fails, and returns the last result.
+int select_wait(SSLContextPool &pool, SSL *ssl, size_t idx) {
+  for (size_t i = 0; i < 1000; ++i) {
+    auto rv = pool.select(ssl, idx, nullptr);
+    if (rv != 1) {
+      return rv;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return 1;
+}
+} // namespace
+
+void test_shrpx_ssl_context_pool(void) {
+  std::string keyfiles[3], certfiles[3];
+  for (size_t i = 0; i < 3; ++i) {
+    write_keycert(keyfiles[i], certfiles[i]);
+  }
+
+  auto default_ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  auto default_ssl_ctx_del = defer(SSL_CTX_free, default_ssl_ctx);
+
+  auto ssl = SSL_new(default_ssl_ctx);
+  auto ssl_del = defer(SSL_free, ssl);
+
+  {
+    SSLContextPool pool(2
+#ifdef HAVE_NEVERBLEED
+                        ,
+                        nullptr
+#endif // HAVE_NEVERBLEED
+                        );
+
+    size_t idx[3];
+    for (size_t i = 0; i < 3; ++i) {
+      idx[i] = pool.add_lazy(keyfiles[i].c_str(), certfiles[i].c_str());
+    }
+    // Private key does not match certificate.
+    auto bad_idx = pool.add_lazy(keyfiles[0].c_str(), certfiles[1].c_str());
+    auto pinned_idx = pool.add_ssl_ctx(default_ssl_ctx);
+
+    // Pinned SSL_CTX is selected immediately.
+    CU_ASSERT(0 == pool.select(ssl, pinned_idx, nullptr));
+    CU_ASSERT(default_ssl_ctx == SSL_get_SSL_CTX(ssl));
+    CU_ASSERT(0 == pool.get_num_loaded());
+
+    CU_ASSERT(0 == select_wait(pool, ssl, idx[0]));
+    CU_ASSERT(default_ssl_ctx != SSL_get_SSL_CTX(ssl));
+
+    auto ssl_ctx0 = SSL_get_SSL_CTX(ssl);
+    auto tls_ctx_data =
+        static_cast<ssl::TLSContextData *>(SSL_CTX_get_app_data(ssl_ctx0));
+
+    CU_ASSERT(certfiles[0] == tls_ctx_data->cert_file);
+
+    // Loaded SSL_CTX is selected immediately.
+    CU_ASSERT(0 == pool.select(ssl, idx[0], nullptr));
+    CU_ASSERT(ssl_ctx0 == SSL_get_SSL_CTX(ssl));
+
+    CU_ASSERT(0 == select_wait(pool, ssl, idx[1]));
+    CU_ASSERT(2 == pool.get_num_loaded());
+
+    // Make idx[1] least recently used.
+    CU_ASSERT(0 == pool.select(ssl, idx[0], nullptr));
+
+    // idx[1] is evicted.
+    CU_ASSERT(0 == select_wait(pool, ssl, idx[2]));
+    CU_ASSERT(2 == pool.get_num_loaded());
+    CU_ASSERT(0 == pool.select(ssl, idx[0], nullptr));
+    CU_ASSERT(1 == pool.select(ssl, idx[1], nullptr));
+    CU_ASSERT(0 == select_wait(pool, ssl, idx[1]));
+    CU_ASSERT(2 == pool.get_num_loaded());
+
+    CU_ASSERT(-1 == select_wait(pool, ssl, bad_idx));
+    CU_ASSERT(-1 == pool.select(ssl, bad_idx, nullptr));
+    CU_ASSERT(2 == pool.get_num_loaded());
+
+    // |ssl| still holds the reference to SSL_CTX selected last.
+    SSL_set_SSL_CTX(ssl, default_ssl_ctx);
+  }
+
+  for (size_t i = 0; i < 3; ++i) {
+    unlink(keyfiles[i].c_str());
+    unlink(certfiles[i].c_str());
+  }
+}
+
+namespace {
+void noop_iocb(struct ev_loop *loop, ev_io *w, int revents) {}
+} // namespace
+
+namespace {
+void noop_timeoutcb(struct ev_loop *loop, ev_timer *w, int revents) {}
+} // namespace
+
+void test_shrpx_ssl_context_pool_evicted_waiter(void) {
+  std::string keyfiles[2], certfiles[2];
+  for (size_t i = 0; i < 2; ++i) {
+    write_keycert(keyfiles[i], certfiles[i]);
+  }
+
+  auto default_ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  auto default_ssl_ctx_del = defer(SSL_CTX_free, default_ssl_ctx);
+
+  auto loop = ev_loop_new(0);
+  auto loop_del = defer(ev_loop_destroy, loop);
+
+  auto &downstreamconf = mod_config()->conn.downstream;
+  auto saved_routing = downstreamconf.routing;
+  downstreamconf.routing = std::make_shared<DownstreamRoutingConfig>();
+  auto routing_del = defer([&downstreamconf, &saved_routing]() {
+    downstreamconf.routing = std::move(saved_routing);
+  });
+
+  MemchunkPool mcpool;
+
+  {
+    // Only one SSL_CTX can be loaded at a time, and 2 connections
+    // wait for the different ones.
+    SSLContextPool pool(1
+#ifdef HAVE_NEVERBLEED
+                        ,
+                        nullptr
+#endif // HAVE_NEVERBLEED
+                        );
+
+    size_t idx[2];
+    for (size_t i = 0; i < 2; ++i) {
+      idx[i] = pool.add_lazy(keyfiles[i].c_str(), certfiles[i].c_str());
+    }
+
+    Worker worker(loop, default_ssl_ctx, nullptr, nullptr, nullptr, &pool,
+                  nullptr);
+
+    std::unique_ptr<Connection> conns[2];
+    for (size_t i = 0; i < 2; ++i) {
+      int fds[2];
+      CU_ASSERT_FATAL(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+      close(fds[1]);
+
+      conns[i] = make_unique<Connection>(
+          loop, fds[0], SSL_new(default_ssl_ctx), &mcpool, 30., 30.,
+          RateLimitConfig{}, RateLimitConfig{}, noop_iocb, noop_iocb,
+          noop_timeoutcb, nullptr, 0, 0., false, PROTO_HTTP1);
+
+      auto &conn = conns[i];
+
+      CU_ASSERT(1 == pool.select(conn->tls.ssl, idx[i], &worker));
+
+      conn->tls.handshake_state = TLS_CONN_WAIT_FOR_CERT;
+      worker.add_ssl_ctx_waiter(conn.get(), idx[i]);
+    }
+
+    for (size_t i = 0; i < 1000; ++i) {
+      ev_run(loop, EVRUN_NOWAIT);
+
+      if (conns[0]->tls.handshake_state == TLS_CONN_GOT_CERT &&
+          conns[1]->tls.handshake_state == TLS_CONN_GOT_CERT) {
+        break;
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // The first SSL_CTX has been evicted by the second one, but both
+    // connections can resume handshake with their SSL_CTX.
+    CU_ASSERT(1 == pool.get_num_loaded());
+
+    for (size_t i = 0; i < 2; ++i) {
+      auto &conn = conns[i];
+
+      CU_ASSERT(TLS_CONN_GOT_CERT == conn->tls.handshake_state);
+      CU_ASSERT_FATAL(nullptr != conn->tls.loaded_ssl_ctx);
+
+      auto tls_ctx_data = static_cast<ssl::TLSContextData *>(
+          SSL_CTX_get_app_data(conn->tls.loaded_ssl_ctx));
+
+      CU_ASSERT(certfiles[i] == tls_ctx_data->cert_file);
+    }
+  }
+
+  for (size_t i = 0; i < 2; ++i) {
+    unlink(keyfiles[i].c_str());
+    unlink(certfiles[i].c_str());
+  }
+}
+
+} // namespace shrpx
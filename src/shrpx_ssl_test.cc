@@ -24,6 +24,9 @@
  */
 #include "shrpx_ssl_test.h"
 
+#include <chrono>
+#include <iostream>
+
 #include <CUnit/CUnit.h>
 
 #include "shrpx_ssl.h"
@@ -36,12 +39,6 @@ namespace shrpx {
 
 void test_shrpx_ssl_create_lookup_tree(void) {
   auto tree = make_unique<ssl::CertLookupTree>();
-  SSL_CTX *ctxs[] = {
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method()),
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method()),
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method()),
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method()),
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method())};
 
   const char *hostnames[] = {
       "example.com", "www.example.org", "*www.example.org", "x*.host.domain",
@@ -49,70 +46,119 @@ void test_shrpx_ssl_create_lookup_tree(void) {
       "sourceforge.net", // duplicate
       "*.foo.bar",       // oo.bar is suffix of *.foo.bar
       "oo.bar"};
-  int num = array_size(ctxs);
+  int num = array_size(hostnames);
   for (int i = 0; i < num; ++i) {
-    tree->add_cert(ctxs[i], hostnames[i], strlen(hostnames[i]));
+    tree->add_cert(i, hostnames[i], strlen(hostnames[i]));
   }
 
-  CU_ASSERT(ctxs[0] == tree->lookup(hostnames[0], strlen(hostnames[0])));
-  CU_ASSERT(ctxs[1] == tree->lookup(hostnames[1], strlen(hostnames[1])));
+  CU_ASSERT(0 == tree->lookup(hostnames[0], strlen(hostnames[0])));
+  CU_ASSERT(1 == tree->lookup(hostnames[1], strlen(hostnames[1])));
   const char h1[] = "2www.example.org";
-  CU_ASSERT(ctxs[2] == tree->lookup(h1, strlen(h1)));
+  CU_ASSERT(2 == tree->lookup(h1, strlen(h1)));
   const char h2[] = "www2.example.org";
-  CU_ASSERT(0 == tree->lookup(h2, strlen(h2)));
+  CU_ASSERT(-1 == tree->lookup(h2, strlen(h2)));
   const char h3[] = "x1.host.domain";
-  CU_ASSERT(ctxs[3] == tree->lookup(h3, strlen(h3)));
+  CU_ASSERT(3 == tree->lookup(h3, strlen(h3)));
   // Does not match *yy.host.domain, because * must match at least 1
   // character.
   const char h4[] = "yy.Host.domain";
-  CU_ASSERT(0 == tree->lookup(h4, strlen(h4)));
+  CU_ASSERT(-1 == tree->lookup(h4, strlen(h4)));
   const char h5[] = "zyy.host.domain";
-  CU_ASSERT(ctxs[4] == tree->lookup(h5, strlen(h5)));
-  CU_ASSERT(0 == tree->lookup("", 0));
-  CU_ASSERT(ctxs[5] == tree->lookup(hostnames[5], strlen(hostnames[5])));
-  CU_ASSERT(ctxs[6] == tree->lookup(hostnames[6], strlen(hostnames[6])));
+  CU_ASSERT(4 == tree->lookup(h5, strlen(h5)));
+  CU_ASSERT(-1 == tree->lookup("", 0));
+  CU_ASSERT(5 == tree->lookup(hostnames[5], strlen(hostnames[5])));
+  CU_ASSERT(6 == tree->lookup(hostnames[6], strlen(hostnames[6])));
   const char h6[] = "pdylay.sourceforge.net";
   for (int i = 0; i < 7; ++i) {
-    CU_ASSERT(0 == tree->lookup(h6 + i, strlen(h6) - i));
+    CU_ASSERT(-1 == tree->lookup(h6 + i, strlen(h6) - i));
   }
   const char h7[] = "x.foo.bar";
-  CU_ASSERT(ctxs[8] == tree->lookup(h7, strlen(h7)));
-  CU_ASSERT(ctxs[9] == tree->lookup(hostnames[9], strlen(hostnames[9])));
-
-  for (int i = 0; i < num; ++i) {
-    SSL_CTX_free(ctxs[i]);
-  }
+  CU_ASSERT(8 == tree->lookup(h7, strlen(h7)));
+  CU_ASSERT(9 == tree->lookup(hostnames[9], strlen(hostnames[9])));
 
-  SSL_CTX *ctxs2[] = {
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method()),
-      SSL_CTX_new(SSLv23_method()), SSL_CTX_new(SSLv23_method())};
   const char *names[] = {"rab", "zab", "zzub", "ab"};
-  num = array_size(ctxs2);
+  num = array_size(names);
 
   tree = make_unique<ssl::CertLookupTree>();
   for (int i = 0; i < num; ++i) {
-    tree->add_cert(ctxs2[i], names[i], strlen(names[i]));
+    tree->add_cert(i, names[i], strlen(names[i]));
   }
   for (int i = 0; i < num; ++i) {
-    CU_ASSERT(ctxs2[i] == tree->lookup(names[i], strlen(names[i])));
+    CU_ASSERT(i == tree->lookup(names[i], strlen(names[i])));
   }
 
-  for (int i = 0; i < num; ++i) {
-    SSL_CTX_free(ctxs2[i]);
+  tree = make_unique<ssl::CertLookupTree>();
+  const char exact[] = "www.example.com";
+  const char wildcard[] = "*.example.com";
+  // Exact match is preferred regardless of the order.
+  tree->add_cert(0, wildcard, strlen(wildcard));
+  tree->add_cert(1, exact, strlen(exact));
+  CU_ASSERT(1 == tree->lookup(exact, strlen(exact)));
+  const char h8[] = "WWW2.Example.COM";
+  CU_ASSERT(0 == tree->lookup(h8, strlen(h8)));
+  const char h9[] = "example.com";
+  CU_ASSERT(-1 == tree->lookup(h9, strlen(h9)));
+}
+
+namespace {
+constexpr size_t NUM_BENCHMARK_HOSTNAMES = 100000;
+} // namespace
+
+void test_shrpx_ssl_cert_lookup_tree_benchmark(void) {
+  ssl::CertLookupTree tree;
+
+  std::vector<std::pair<std::string, size_t>> queries;
+
+  // 90% of hostnames are exact, and the rest are wildcard.
+  for (size_t i = 0; i < NUM_BENCHMARK_HOSTNAMES; ++i) {
+    std::string host;
+    if (i % 10 == 0) {
+      host = "*.tenant" + util::utos(i) + ".example.net";
+      queries.emplace_back("www.tenant" + util::utos(i) + ".example.net", i);
+    } else {
+      host = "host" + util::utos(i) + ".example" + util::utos(i % 1000) +
+             ".com";
+      queries.emplace_back(host, i);
+    }
+    tree.add_cert(i, host.c_str(), host.size());
   }
+
+  for (auto &q : queries) {
+    CU_ASSERT(static_cast<ssize_t>(q.second) ==
+              tree.lookup(q.first.c_str(), q.first.size()));
+  }
+
+  const char nomatch[] = "www.example.org";
+  CU_ASSERT(-1 == tree.lookup(nomatch, strlen(nomatch)));
+
+  size_t nmatch = 0;
+
+  auto t = std::chrono::steady_clock::now();
+
+  for (size_t n = 0; n < 10; ++n) {
+    for (auto &q : queries) {
+      nmatch += tree.lookup(q.first.c_str(), q.first.size()) != -1;
+    }
+  }
+
+  auto d = std::chrono::steady_clock::now() - t;
+
+  CU_ASSERT(queries.size() * 10 == nmatch);
+
+  std::cerr << "cert_lookup_tree: " << queries.size() * 10
+            << " lookups over " << NUM_BENCHMARK_HOSTNAMES << " hostnames in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(d).count()
+            << "us" << std::endl;
 }
 
 void test_shrpx_ssl_cert_lookup_tree_add_cert_from_file(void) {
   int rv;
   ssl::CertLookupTree tree;
-  auto ssl_ctx = SSL_CTX_new(SSLv23_method());
   const char certfile[] = NGHTTP2_TESTS_DIR "/testdata/cacert.pem";
-  rv = ssl::cert_lookup_tree_add_cert_from_file(&tree, ssl_ctx, certfile);
+  rv = ssl::cert_lookup_tree_add_cert_from_file(&tree, 7, certfile);
   CU_ASSERT(0 == rv);
   const char localhost[] = "localhost";
-  CU_ASSERT(ssl_ctx == tree.lookup(localhost, sizeof(localhost) - 1));
-
-  SSL_CTX_free(ssl_ctx);
+  CU_ASSERT(7 == tree.lookup(localhost, sizeof(localhost) - 1));
 }
 
 template <size_t N, size_t M>
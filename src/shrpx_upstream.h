@@ -65,8 +65,11 @@ public:
   virtual void pause_read(IOCtrlReason reason) = 0;
   virtual int resume_read(IOCtrlReason reason, Downstream *downstream,
                           size_t consumed) = 0;
-  virtual int send_reply(Downstream *downstream, const uint8_t *body,
-                         size_t bodylen) = 0;
+  // Sends response prepared in |downstream| with the response body
+  // gathered from |iov| of length |iovcnt|.  The body is copied, so
+  // the buffers pointed by |iov| can be released after this call.
+  virtual int send_reply(Downstream *downstream, const struct iovec *iov,
+                         int iovcnt) = 0;
 
   virtual int initiate_push(Downstream *downstream, const StringRef &uri) = 0;
 
@@ -97,6 +100,10 @@ public:
   // PUSH_PROMISE for |promised_downstream| is not submitted to
   // upstream session.
   virtual void cancel_premature_downstream(Downstream *promised_downstream) = 0;
+  // Forwards |downstream|, whose request headers have been received,
+  // to backend.  This is used to start the request which has been
+  // waiting for the response to the identical request.
+  virtual void start_downstream(Downstream *downstream) = 0;
 };
 
 } // namespace shrpx
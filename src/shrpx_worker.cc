@@ -29,6 +29,11 @@
 #endif // HAVE_UNISTD_H
 
 #include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <openssl/evp.h>
 
 #include "shrpx_ssl.h"
 #include "shrpx_log.h"
@@ -37,11 +42,15 @@
 #include "shrpx_log_config.h"
 #include "shrpx_connect_blocker.h"
 #include "shrpx_memcached_dispatcher.h"
+#include "shrpx_cache.h"
+#include "shrpx_concurrency_limiter.h"
+#include "shrpx_connection.h"
 #ifdef HAVE_MRUBY
 #include "shrpx_mruby.h"
 #endif // HAVE_MRUBY
 #include "util.h"
 #include "template.h"
+#include "ssl_compat.h"
 
 namespace shrpx {
 
@@ -62,11 +71,28 @@ void mcpool_clear_cb(struct ev_loop *loop, ev_timer *w, int revents) {
 }
 } // namespace
 
+namespace {
+// Interval between the checks of warmed HTTP/2 sessions.  This must
+// be shorter than the connection check timeout of Http2Session, so
+// that idle sessions are pinged before requests need them.
+constexpr ev_tstamp HTTP2_WARM_INTERVAL = 1.;
+} // namespace
+
+namespace {
+void http2_warm_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  auto worker = static_cast<Worker *>(w->data);
+  worker->warm_http2_sessions();
+}
+} // namespace
+
 namespace {
 bool match_shared_downstream_addr(
     const std::shared_ptr<SharedDownstreamAddr> &lhs,
     const std::shared_ptr<SharedDownstreamAddr> &rhs) {
-  if (lhs->addrs.size() != rhs->addrs.size() || lhs->proto != rhs->proto) {
+  if (lhs->addrs.size() != rhs->addrs.size() || lhs->proto != rhs->proto ||
+      lhs->lb_policy != rhs->lb_policy || lhs->affinity != rhs->affinity ||
+      lhs->affinity_name != rhs->affinity_name || lhs->retry != rhs->retry ||
+      lhs->hedge != rhs->hedge || !lhs->limiter != !rhs->limiter) {
     return false;
   }
 
@@ -74,7 +100,8 @@ bool match_shared_downstream_addr(
     if (std::find_if(std::begin(rhs->addrs), std::end(rhs->addrs),
                      [&a](const DownstreamAddr &b) {
                        return a.host == b.host && a.port == b.port &&
-                              a.host_unix == b.host_unix;
+                              a.host_unix == b.host_unix &&
+                              a.weight == b.weight;
                      }) == std::end(rhs->addrs)) {
       return false;
     }
@@ -84,13 +111,85 @@ bool match_shared_downstream_addr(
 }
 } // namespace
 
+namespace {
+// Returns true if |shared_addr| created from reloaded configuration
+// can be replaced with |old| which is currently used.  In addition to
+// match_shared_downstream_addr(), backend addresses must be resolved
+// to the same addresses.  If this function returns true, health state
+// of the addresses in |old| is updated with the ones in
+// |shared_addr|.
+bool reuse_shared_downstream_addr(
+    const std::shared_ptr<SharedDownstreamAddr> &old,
+    const std::shared_ptr<SharedDownstreamAddr> &shared_addr) {
+  if (old->retired || !match_shared_downstream_addr(old, shared_addr)) {
+    return false;
+  }
+
+  std::vector<DownstreamAddr *> old_addrs;
+
+  for (auto &a : shared_addr->addrs) {
+    auto it = std::find_if(std::begin(old->addrs), std::end(old->addrs),
+                           [&a](const DownstreamAddr &b) {
+                             return a.host == b.host && a.port == b.port &&
+                                    a.host_unix == b.host_unix;
+                           });
+
+    // match_shared_downstream_addr() does not guarantee this if
+    // the same address appears more than once.
+    if (it == std::end(old->addrs)) {
+      return false;
+    }
+
+    auto &b = *it;
+
+    if (a.addr.len != b.addr.len ||
+        memcmp(&a.addr.su, &b.addr.su, a.addr.len) != 0) {
+      return false;
+    }
+
+    old_addrs.push_back(&b);
+  }
+
+  for (size_t i = 0; i < old_addrs.size(); ++i) {
+    old_addrs[i]->healthy = shared_addr->addrs[i].healthy;
+  }
+
+  return true;
+}
+} // namespace
+
+namespace {
+// Stops using connections to the backend addresses in |shared_addr|
+// for new requests.  Idle connections are closed, and busy ones are
+// closed after their requests finish.
+void retire_shared_downstream_addr(SharedDownstreamAddr *shared_addr) {
+  shared_addr->retired = true;
+
+  shared_addr->dconn_pool.remove_all();
+
+  auto &http2_freelist = shared_addr->http2_freelist;
+
+  for (auto session = http2_freelist.head; session;) {
+    auto next = session->dlnext;
+
+    http2_freelist.remove(session);
+
+    if (session->get_num_dconns() == 0) {
+      delete session;
+    }
+
+    session = next;
+  }
+}
+} // namespace
+
 namespace {
 std::random_device rd;
 } // namespace
 
 Worker::Worker(struct ev_loop *loop, SSL_CTX *sv_ssl_ctx, SSL_CTX *cl_ssl_ctx,
                SSL_CTX *tls_session_cache_memcached_ssl_ctx,
-               ssl::CertLookupTree *cert_tree,
+               ssl::CertLookupTree *cert_tree, SSLContextPool *ssl_ctx_pool,
                const std::shared_ptr<TicketKeys> &ticket_keys)
     : randgen_(rd()),
       worker_stat_{},
@@ -98,10 +197,15 @@ Worker::Worker(struct ev_loop *loop, SSL_CTX *sv_ssl_ctx, SSL_CTX *cl_ssl_ctx,
       sv_ssl_ctx_(sv_ssl_ctx),
       cl_ssl_ctx_(cl_ssl_ctx),
       cert_tree_(cert_tree),
+      ssl_ctx_pool_(ssl_ctx_pool),
       ticket_keys_(ticket_keys),
-      downstream_addr_groups_(get_config()->conn.downstream.addr_groups.size()),
-      connect_blocker_(make_unique<ConnectBlocker>(randgen_, loop_)),
-      graceful_shutdown_(false) {
+      http2_warm_tstamp_(0.),
+      connect_blocker_(
+          make_unique<ConnectBlocker>(randgen_, loop_, &metrics_)),
+      accesslog_writer_(nullptr),
+      accesslog_buffer_(nullptr),
+      graceful_shutdown_(false),
+      has_response_cache_(false) {
   ev_async_init(&w_, eventcb);
   w_.data = this;
   ev_async_start(loop_, &w_);
@@ -118,22 +222,93 @@ Worker::Worker(struct ev_loop *loop, SSL_CTX *sv_ssl_ctx, SSL_CTX *cl_ssl_ctx,
         StringRef{session_cacheconf.memcached.host}, &mcpool_);
   }
 
+  // Fire immediately, so that sessions are opened as soon as this
+  // worker starts its event loop.
+  ev_timer_init(&http2_warm_timer_, http2_warm_cb, 0., HTTP2_WARM_INTERVAL);
+  http2_warm_timer_.data = this;
+
+  replace_downstream_routing(get_config()->conn.downstream.routing);
+}
+
+Worker::~Worker() {
+  ev_async_stop(loop_, &w_);
+  ev_timer_stop(loop_, &mcpool_clear_timer_);
+  ev_timer_stop(loop_, &http2_warm_timer_);
+
+  // Pooled connections refer to their group.
+  for (auto &group : downstream_addr_groups_) {
+    group->shared_addr->dconn_pool.remove_all();
+  }
+
+  for (auto &wev : q_) {
+    if (wev.type == SSL_CTX_LOADED && wev.ssl_ctx) {
+      SSL_CTX_free(wev.ssl_ctx);
+    }
+  }
+}
+
+void Worker::replace_downstream_routing(
+    std::shared_ptr<const DownstreamRoutingConfig> routing) {
   auto &downstreamconf = get_config()->conn.downstream;
 
-  for (size_t i = 0; i < downstreamconf.addr_groups.size(); ++i) {
-    auto &src = downstreamconf.addr_groups[i];
-    auto &dst = downstream_addr_groups_[i];
+  // Old groups must be alive until connections to retired addresses
+  // are cleaned up.
+  auto old_routing = std::move(downstream_routing_);
+  auto old_groups = std::move(downstream_addr_groups_);
 
-    dst.pattern = src.pattern;
+  downstream_routing_ = std::move(routing);
 
-    auto shared_addr = std::make_shared<SharedDownstreamAddr>();
+  auto &addr_groups = downstream_routing_->addr_groups;
+
+  downstream_addr_groups_ =
+      std::vector<std::shared_ptr<DownstreamAddrGroup>>(addr_groups.size());
+  http2_warm_groups_.clear();
+  has_response_cache_ = false;
+
+  for (size_t i = 0; i < addr_groups.size(); ++i) {
+    auto &src = addr_groups[i];
+    auto dst = std::make_shared<DownstreamAddrGroup>();
+
+    downstream_addr_groups_[i] = dst;
+
+    dst->pattern = src.pattern;
+
+    if (src.cache_size) {
+      // Keep cached responses if the cache of the same pattern is
+      // configured in the same way.
+      for (size_t j = 0; old_routing && j < old_groups.size(); ++j) {
+        auto &old_src = old_routing->addr_groups[j];
+        if (old_groups[j]->cache && old_src.pattern == src.pattern &&
+            old_src.cache_size == src.cache_size &&
+            old_src.cache_collapse == src.cache_collapse) {
+          dst->cache = old_groups[j]->cache;
+          break;
+        }
+      }
+
+      if (!dst->cache) {
+        dst->cache = std::make_shared<ResponseCache>(
+            loop_, src.cache_size,
+            src.cache_collapse ? downstreamconf.cache_collapse_timeout : 0.);
+      }
 
-    // TODO for some reason, clang-3.6 which comes with Ubuntu 15.10
-    // does not value initialize SharedDownstreamAddr above.
-    *shared_addr = SharedDownstreamAddr{};
+      has_response_cache_ = true;
+    }
+
+    auto shared_addr = std::make_shared<SharedDownstreamAddr>();
 
     shared_addr->addrs.resize(src.addrs.size());
     shared_addr->proto = src.proto;
+    shared_addr->lb_policy = src.lb_policy;
+    shared_addr->affinity = src.affinity;
+    shared_addr->affinity_name = src.affinity_name;
+    shared_addr->retry = src.retry;
+    shared_addr->hedge = src.hedge;
+
+    if (src.adaptive_limit) {
+      shared_addr->limiter = std::make_shared<ConcurrencyLimiter>(
+          loop_, downstreamconf.limit_queue_timeout);
+    }
 
     for (size_t j = 0; j < src.addrs.size(); ++j) {
       auto &src_addr = src.addrs[j];
@@ -144,30 +319,98 @@ Worker::Worker(struct ev_loop *loop, SSL_CTX *sv_ssl_ctx, SSL_CTX *cl_ssl_ctx,
       dst_addr.hostport = src_addr.hostport;
       dst_addr.port = src_addr.port;
       dst_addr.host_unix = src_addr.host_unix;
+      dst_addr.weight = src_addr.weight;
+      dst_addr.healthy = src_addr.healthy;
+
+      if (dst_addr.weight != 1) {
+        shared_addr->weighted = true;
+      }
 
-      dst_addr.connect_blocker = make_unique<ConnectBlocker>(randgen_, loop_);
+      dst_addr.connect_blocker =
+          make_unique<ConnectBlocker>(randgen_, loop_, &metrics_);
+    }
+
+    if (shared_addr->affinity != AFFINITY_NONE) {
+      for (size_t j = 0; j < shared_addr->addrs.size(); ++j) {
+        auto &addr = shared_addr->addrs[j];
+        compute_affinity_hash(shared_addr->affinity_hash, j,
+                              StringRef{make_affinity_hash_key(addr)},
+                              addr.weight);
+      }
+
+      std::sort(std::begin(shared_addr->affinity_hash),
+                std::end(shared_addr->affinity_hash),
+                [](const AffinityHash &lhs, const AffinityHash &rhs) {
+                  return lhs.hash < rhs.hash;
+                });
+    }
+
+    if (get_config()->http2.downstream.coalesce &&
+        shared_addr->proto == PROTO_HTTP2 && !shared_addr->addrs.empty()) {
+      // Each worker only opens a few sessions per group in this mode.
+      // Start from random address so that workers do not all connect
+      // to the first one.
+      shared_addr->next = std::uniform_int_distribution<size_t>(
+          0, shared_addr->addrs.size() - 1)(randgen_);
     }
 
     // share the connection if patterns have the same set of backend
     // addresses.
     auto end = std::begin(downstream_addr_groups_) + i;
-    auto it = std::find_if(std::begin(downstream_addr_groups_), end,
-                           [&shared_addr](const DownstreamAddrGroup &group) {
-                             return match_shared_downstream_addr(
-                                 group.shared_addr, shared_addr);
-                           });
+    auto it = std::find_if(
+        std::begin(downstream_addr_groups_), end,
+        [&shared_addr](const std::shared_ptr<DownstreamAddrGroup> &group) {
+          return match_shared_downstream_addr(group->shared_addr,
+                                              shared_addr);
+        });
+
+    if (it != end) {
+      dst->shared_addr = (*it)->shared_addr;
+      continue;
+    }
 
-    if (it == end) {
-      dst.shared_addr = shared_addr;
+    // Keep the connections to the same backend addresses across
+    // configuration reload.
+    auto old_it = std::find_if(
+        std::begin(old_groups), std::end(old_groups),
+        [&shared_addr](const std::shared_ptr<DownstreamAddrGroup> &group) {
+          return reuse_shared_downstream_addr(group->shared_addr,
+                                              shared_addr);
+        });
+
+    if (old_it == std::end(old_groups)) {
+      dst->shared_addr = shared_addr;
     } else {
-      dst.shared_addr = (*it).shared_addr;
+      dst->shared_addr = (*old_it)->shared_addr;
+    }
+
+    if (dst->shared_addr->proto == PROTO_HTTP2) {
+      http2_warm_groups_.push_back(dst);
     }
   }
-}
 
-Worker::~Worker() {
-  ev_async_stop(loop_, &w_);
-  ev_timer_stop(loop_, &mcpool_clear_timer_);
+  for (auto &group : old_groups) {
+    auto &shared_addr = group->shared_addr;
+
+    if (shared_addr->retired ||
+        std::find_if(std::begin(downstream_addr_groups_),
+                     std::end(downstream_addr_groups_),
+                     [&shared_addr](
+                         const std::shared_ptr<DownstreamAddrGroup> &g) {
+                       return g->shared_addr == shared_addr;
+                     }) != std::end(downstream_addr_groups_)) {
+      continue;
+    }
+
+    retire_shared_downstream_addr(shared_addr.get());
+  }
+
+  if (get_config()->http2.downstream.warm_connections &&
+      !http2_warm_groups_.empty() && !graceful_shutdown_) {
+    ev_timer_start(loop_, &http2_warm_timer_);
+  } else {
+    ev_timer_stop(loop_, &http2_warm_timer_);
+  }
 }
 
 void Worker::schedule_clear_mcpool() {
@@ -186,6 +429,10 @@ void Worker::wait() {
 void Worker::run_async() {
 #ifndef NOTHREADS
   fut_ = std::async(std::launch::async, [this] {
+    auto lgconf = log_config();
+    lgconf->accesslog_writer = accesslog_writer_;
+    lgconf->accesslog_buffer = accesslog_buffer_;
+
     (void)reopen_log_files();
     ev_run(loop_);
     delete log_config();
@@ -193,6 +440,12 @@ void Worker::run_async() {
 #endif // !NOTHREADS
 }
 
+void Worker::set_accesslog_buffer(AccessLogWriter *writer,
+                                  AccessLogBuffer *buf) {
+  accesslog_writer_ = writer;
+  accesslog_buffer_ = buf;
+}
+
 void Worker::send(const WorkerEvent &event) {
   {
     std::lock_guard<std::mutex> g(m_);
@@ -260,12 +513,24 @@ void Worker::process_events() {
 
       graceful_shutdown_ = true;
 
+      ev_timer_stop(loop_, &http2_warm_timer_);
+
       if (worker_stat_.num_connections == 0) {
         ev_break(loop_);
 
         return;
       }
 
+      break;
+    case REPLACE_DOWNSTREAM:
+      WLOG(NOTICE, this) << "Replacing backend configuration";
+
+      replace_downstream_routing(std::move(wev.routing));
+
+      break;
+    case SSL_CTX_LOADED:
+      resume_ssl_ctx_waiters(wev.ssl_ctx_idx, wev.ssl_ctx);
+
       break;
     default:
       if (LOG_ENABLED(INFO)) {
@@ -277,6 +542,68 @@ void Worker::process_events() {
 
 ssl::CertLookupTree *Worker::get_cert_lookup_tree() const { return cert_tree_; }
 
+SSLContextPool *Worker::get_ssl_ctx_pool() const { return ssl_ctx_pool_; }
+
+void Worker::add_ssl_ctx_waiter(Connection *conn, size_t idx) {
+  ssl_ctx_waiters_.emplace_back(conn, idx);
+}
+
+void Worker::remove_ssl_ctx_waiter(Connection *conn) {
+  if (ssl_ctx_waiters_.empty()) {
+    return;
+  }
+
+  ssl_ctx_waiters_.erase(
+      std::remove_if(std::begin(ssl_ctx_waiters_), std::end(ssl_ctx_waiters_),
+                     [conn](const std::pair<Connection *, size_t> &p) {
+                       return p.first == conn;
+                     }),
+      std::end(ssl_ctx_waiters_));
+}
+
+void Worker::resume_ssl_ctx_waiters(size_t idx, SSL_CTX *ssl_ctx) {
+  auto ssl_ctx_del = defer([ssl_ctx]() {
+    if (ssl_ctx) {
+      SSL_CTX_free(ssl_ctx);
+    }
+  });
+
+
+  auto it = std::begin(ssl_ctx_waiters_);
+  while (it != std::end(ssl_ctx_waiters_)) {
+    if ((*it).second != idx) {
+      ++it;
+      continue;
+    }
+
+    auto conn = (*it).first;
+
+    it = ssl_ctx_waiters_.erase(it);
+
+    // The pool may evict |ssl_ctx| before client hello is replayed.
+    // Keep the reference, so that replay does not start loading it
+    // again.
+    if (ssl_ctx) {
+      if (conn->tls.loaded_ssl_ctx) {
+        SSL_CTX_free(conn->tls.loaded_ssl_ctx);
+      }
+      SSL_CTX_up_ref(ssl_ctx);
+      conn->tls.loaded_ssl_ctx = ssl_ctx;
+    }
+
+    // Even if loading failed, replay client hello so that default
+    // certificate is used.
+    conn->tls.handshake_state = TLS_CONN_GOT_CERT;
+
+    // We might stop reading, so start it again
+    conn->rlimit.startw();
+    ev_timer_again(conn->loop, &conn->rt);
+
+    conn->wlimit.startw();
+    ev_timer_again(conn->loop, &conn->wt);
+  }
+}
+
 std::shared_ptr<TicketKeys> Worker::get_ticket_keys() {
   std::lock_guard<std::mutex> g(m_);
   return ticket_keys_;
@@ -289,6 +616,8 @@ void Worker::set_ticket_keys(std::shared_ptr<TicketKeys> ticket_keys) {
 
 WorkerStat *Worker::get_worker_stat() { return &worker_stat_; }
 
+WorkerMetrics *Worker::get_metrics() { return &metrics_; }
+
 struct ev_loop *Worker::get_loop() const {
   return loop_;
 }
@@ -324,25 +653,520 @@ mruby::MRubyContext *Worker::get_mruby_context() const {
 }
 #endif // HAVE_MRUBY
 
-std::vector<DownstreamAddrGroup> &Worker::get_downstream_addr_groups() {
+std::vector<std::shared_ptr<DownstreamAddrGroup>> &
+Worker::get_downstream_addr_groups() {
   return downstream_addr_groups_;
 }
 
+const DownstreamRoutingConfig *Worker::get_downstream_routing() const {
+  return downstream_routing_.get();
+}
+
+bool Worker::has_response_cache() const { return has_response_cache_; }
+
 ConnectBlocker *Worker::get_connect_blocker() const {
   return connect_blocker_.get();
 }
 
+void Worker::warm_http2_sessions() {
+  auto min_sessions = get_config()->http2.downstream.warm_connections;
+  auto now = ev_now(loop_);
+  auto elapsed = http2_warm_tstamp_ == 0. ? 0. : now - http2_warm_tstamp_;
+
+  http2_warm_tstamp_ = now;
+
+  for (auto &group : http2_warm_groups_) {
+    auto shared_addr = group->shared_addr.get();
+    auto &http2_freelist = shared_addr->http2_freelist;
+
+    for (auto &addr : shared_addr->addrs) {
+      if (elapsed > 0.) {
+        addr.request_rate = addr.request_rate * 0.5 +
+                            static_cast<double>(addr.num_requests) / elapsed *
+                                0.5;
+      }
+      addr.num_requests = 0;
+
+      if (!downstream_addr_available(addr)) {
+        continue;
+      }
+
+      size_t num_sessions = 0;
+      size_t num_streams = 0;
+
+      for (auto session = http2_freelist.head; session;
+           session = session->dlnext) {
+        auto saddr = session->get_addr();
+        if (!saddr) {
+          saddr = session->get_pinned_addr();
+        }
+        if (saddr != &addr) {
+          continue;
+        }
+
+        if (num_sessions < min_sessions) {
+          // Send PING if the session has been idle for a while, so
+          // that the request does not have to wait for it.  The
+          // extra sessions are left to be closed by idle timeout.
+          session->start_checking_connection();
+        }
+
+        ++num_sessions;
+        num_streams += session->get_num_available_streams();
+      }
+
+      auto n = count_http2_sessions_to_warm(min_sessions, num_sessions,
+                                            num_streams, addr.request_rate,
+                                            addr.ewma_latency);
+
+      for (; n > 0; --n) {
+        auto session =
+            make_unique<Http2Session>(loop_, cl_ssl_ctx_, this, group);
+        session->set_pinned_addr(&addr);
+
+        if (session->initiate_connection() != 0) {
+          if (LOG_ENABLED(INFO)) {
+            WLOG(INFO, this) << "Could not warm HTTP/2 session to "
+                             << addr.hostport;
+          }
+          break;
+        }
+
+        if (LOG_ENABLED(INFO)) {
+          WLOG(INFO, this) << "Warming HTTP/2 session to " << addr.hostport;
+        }
+
+        http2_freelist.append(session.release());
+      }
+    }
+  }
+}
+
+namespace {
+// Decay time of peak EWMA in seconds.
+constexpr ev_tstamp EWMA_DECAY_TIME = 10.;
+// The cost of the address which has requests in flight, but has not
+// responded yet.
+constexpr double EWMA_PENALTY = 1e6;
+} // namespace
+
+namespace {
+// Returns the weight to decay EWMA which was last updated at |t|.
+double ewma_decay(ev_tstamp t, ev_tstamp now) {
+  return exp(-std::max(0., now - t) / EWMA_DECAY_TIME);
+}
+} // namespace
+
+void update_downstream_addr_latency(DownstreamAddr *addr, ev_tstamp latency,
+                                    ev_tstamp now) {
+  if (addr->ewma_tstamp == 0. || latency > addr->ewma_latency) {
+    // Peak sensitive: the latency spike is reflected immediately.
+    addr->ewma_latency = latency;
+  } else {
+    auto w = ewma_decay(addr->ewma_tstamp, now);
+    addr->ewma_latency = addr->ewma_latency * w + latency * (1. - w);
+  }
+  addr->ewma_tstamp = now;
+  addr->last_latency = latency;
+}
+
+double downstream_addr_cost(const DownstreamAddr *addr, ev_tstamp now) {
+  if (addr->ewma_tstamp == 0.) {
+    // No response has been received yet.
+    return addr->num_outstanding
+               ? (EWMA_PENALTY + addr->num_outstanding) / addr->weight
+               : 0.;
+  }
+
+  // Latency spike decays toward the last observed latency.  If it
+  // decayed toward 0, slow address would become the cheapest one
+  // after it has been idle for a while.
+  auto latency =
+      addr->last_latency + (addr->ewma_latency - addr->last_latency) *
+                               ewma_decay(addr->ewma_tstamp, now);
+
+  return latency * (addr->num_outstanding + 1) / addr->weight;
+}
+
+bool downstream_addr_available(const DownstreamAddr &addr) {
+  return !addr.connect_blocker->blocked() &&
+         (!addr.healthy || addr.healthy->load(std::memory_order_relaxed));
+}
+
+namespace {
+// Returns available address in |shared_addr| which minimizes |cost|.
+// The scan starts at shared_addr->next so that ties are broken in
+// round robin fashion.
+template <typename F>
+DownstreamAddr *select_min_cost(SharedDownstreamAddr *shared_addr, F cost) {
+  auto &addrs = shared_addr->addrs;
+
+  DownstreamAddr *res = nullptr;
+  size_t res_idx = 0;
+  double min_cost = 0.;
+
+  for (size_t i = 0; i < addrs.size(); ++i) {
+    auto idx = (shared_addr->next + i) % addrs.size();
+    auto &addr = addrs[idx];
+
+    if (!downstream_addr_available(addr)) {
+      if (LOG_ENABLED(INFO)) {
+        LOG(INFO) << "Backend server " << util::to_numeric_addr(&addr.addr)
+                  << " was not available temporarily";
+      }
+      continue;
+    }
+
+    auto c = cost(addr);
+    if (!res || c < min_cost) {
+      res = &addr;
+      res_idx = idx;
+      min_cost = c;
+    }
+  }
+
+  if (res) {
+    shared_addr->next = (res_idx + 1) % addrs.size();
+  }
+
+  return res;
+}
+} // namespace
+
+namespace {
+// Selects available address in |shared_addr| using smooth weighted
+// round robin, which spreads the selections of heavily weighted
+// address evenly, instead of selecting it in a row.
+DownstreamAddr *select_weighted_round_robin(SharedDownstreamAddr *shared_addr) {
+  DownstreamAddr *res = nullptr;
+  int64_t total = 0;
+
+  for (auto &addr : shared_addr->addrs) {
+    if (!downstream_addr_available(addr)) {
+      if (LOG_ENABLED(INFO)) {
+        LOG(INFO) << "Backend server " << util::to_numeric_addr(&addr.addr)
+                  << " was not available temporarily";
+      }
+      continue;
+    }
+
+    addr.current_weight += addr.weight;
+    total += addr.weight;
+
+    if (!res || addr.current_weight > res->current_weight) {
+      res = &addr;
+    }
+  }
+
+  if (res) {
+    res->current_weight -= total;
+  }
+
+  return res;
+}
+} // namespace
+
+DownstreamAddr *select_downstream_addr(SharedDownstreamAddr *shared_addr,
+                                       std::mt19937 &gen, ev_tstamp now) {
+  auto &addrs = shared_addr->addrs;
+
+  auto ewma_cost = [now](const DownstreamAddr &addr) {
+    return downstream_addr_cost(&addr, now);
+  };
+
+  switch (shared_addr->lb_policy) {
+  case LB_ROUND_ROBIN:
+    if (shared_addr->weighted) {
+      return select_weighted_round_robin(shared_addr);
+    }
+    return select_min_cost(shared_addr,
+                           [](const DownstreamAddr &) { return 0.; });
+  case LB_LEAST_OUTSTANDING:
+    return select_min_cost(shared_addr, [](const DownstreamAddr &addr) {
+      return static_cast<double>(addr.num_outstanding) / addr.weight;
+    });
+  case LB_PEAK_EWMA:
+    return select_min_cost(shared_addr, ewma_cost);
+  case LB_P2C: {
+    if (addrs.size() <= 2) {
+      return select_min_cost(shared_addr, ewma_cost);
+    }
+
+    auto i = std::uniform_int_distribution<size_t>(0, addrs.size() - 1)(gen);
+    auto j = std::uniform_int_distribution<size_t>(0, addrs.size() - 2)(gen);
+    if (j >= i) {
+      ++j;
+    }
+
+    auto a = &addrs[i];
+    auto b = &addrs[j];
+
+    if (!downstream_addr_available(*a)) {
+      if (!downstream_addr_available(*b)) {
+        // Look for any available address.
+        return select_min_cost(shared_addr, ewma_cost);
+      }
+      return b;
+    }
+
+    if (!downstream_addr_available(*b)) {
+      return a;
+    }
+
+    return ewma_cost(*a) <= ewma_cost(*b) ? a : b;
+  }
+  }
+
+  // gcc needs this.
+  assert(0);
+}
+
+Http2Session *select_http2_session(SharedDownstreamAddr *shared_addr,
+                                   ev_tstamp now) {
+  auto &http2_freelist = shared_addr->http2_freelist;
+
+  Http2Session *res = nullptr;
+  double min_cost = 0.;
+
+  for (auto session = http2_freelist.head; session;
+       session = session->dlnext) {
+    auto addr = session->get_addr();
+    if (!addr) {
+      // Backend address has not been selected yet.  It will be
+      // selected from available ones.
+      if (shared_addr->lb_policy == LB_ROUND_ROBIN) {
+        return session;
+      }
+      if (!res) {
+        res = session;
+      }
+      continue;
+    }
+
+    if (addr->healthy && !addr->healthy->load(std::memory_order_relaxed)) {
+      continue;
+    }
+
+    if (shared_addr->lb_policy == LB_ROUND_ROBIN) {
+      return session;
+    }
+
+    auto c = shared_addr->lb_policy == LB_LEAST_OUTSTANDING
+                 ? static_cast<double>(addr->num_outstanding) / addr->weight
+                 : downstream_addr_cost(addr, now);
+    if (!res || !res->get_addr() || c < min_cost) {
+      res = session;
+      min_cost = c;
+    }
+  }
+
+  return res;
+}
+
+size_t count_http2_sessions_to_warm(size_t min_sessions, size_t num_sessions,
+                                    size_t num_streams, double rate,
+                                    double latency) {
+  if (min_sessions == 0) {
+    return 0;
+  }
+
+  if (num_sessions < min_sessions) {
+    return min_sessions - num_sessions;
+  }
+
+  // Little's law
+  if (rate * latency * 2 > num_streams) {
+    return 1;
+  }
+
+  return 0;
+}
+
+DownstreamAddr *
+select_retry_downstream_addr(SharedDownstreamAddr *shared_addr,
+                             const std::vector<DownstreamAddr *> &tried) {
+  auto &addrs = shared_addr->addrs;
+
+  DownstreamAddr *res = nullptr;
+  double min_cost = 0.;
+
+  for (size_t i = 0; i < addrs.size(); ++i) {
+    auto &addr = addrs[(shared_addr->next + i) % addrs.size()];
+
+    if (!downstream_addr_available(addr) ||
+        std::find(std::begin(tried), std::end(tried), &addr) !=
+            std::end(tried)) {
+      continue;
+    }
+
+    auto c = static_cast<double>(addr.num_outstanding) / addr.weight;
+    if (!res || c < min_cost) {
+      res = &addr;
+      min_cost = c;
+    }
+  }
+
+  return res;
+}
+
+namespace {
+// The number of response latencies kept to compute hedge delay.
+constexpr size_t MAX_LATENCY_SAMPLES = 256;
+// The minimum number of response latencies required to compute hedge
+// delay.
+constexpr size_t MIN_LATENCY_SAMPLES = 32;
+// Hedge delay is recomputed each time this number of samples is
+// added.
+constexpr size_t HEDGE_DELAY_UPDATE_INTERVAL = 16;
+} // namespace
+
+void add_downstream_latency_sample(SharedDownstreamAddr *shared_addr,
+                                   ev_tstamp latency) {
+  auto &samples = shared_addr->latency_samples;
+  auto &next = shared_addr->latency_sample_next;
+
+  if (samples.size() < MAX_LATENCY_SAMPLES) {
+    samples.push_back(latency);
+  } else {
+    samples[next] = latency;
+  }
+
+  next = (next + 1) % MAX_LATENCY_SAMPLES;
+
+  if (next % HEDGE_DELAY_UPDATE_INTERVAL == 0) {
+    shared_addr->hedge_delay =
+        compute_hedge_delay(samples, shared_addr->hedge);
+  }
+}
+
+ev_tstamp compute_hedge_delay(std::vector<ev_tstamp> samples,
+                              unsigned int percentile) {
+  if (samples.size() < MIN_LATENCY_SAMPLES) {
+    return 0.;
+  }
+
+  auto nth = std::begin(samples) + samples.size() * percentile / 100;
+  std::nth_element(std::begin(samples), nth, std::end(samples));
+
+  return *nth;
+}
+
+Http2Session *
+select_http2_session_by_addr(SharedDownstreamAddr *shared_addr,
+                             const DownstreamAddr *addr) {
+  for (auto session = shared_addr->http2_freelist.head; session;
+       session = session->dlnext) {
+    auto saddr = session->get_addr();
+    if (!saddr) {
+      saddr = session->get_pinned_addr();
+    }
+    if (saddr == addr) {
+      return session;
+    }
+  }
+
+  return nullptr;
+}
+
+namespace {
+// The number of virtual nodes per backend address in consistent hash
+// ring.  Each MD5 digest makes 4 nodes.
+constexpr size_t NUM_AFFINITY_VNODES = 160;
+} // namespace
+
+namespace {
+// Computes MD5 digest of |s|, and stores it in |md|.
+int md5(std::array<uint8_t, 16> &md, const StringRef &s) {
+  unsigned int mdlen = md.size();
+  if (EVP_Digest(s.c_str(), s.size(), md.data(), &mdlen, EVP_md5(),
+                 nullptr) != 1) {
+    return -1;
+  }
+
+  return 0;
+}
+} // namespace
+
+std::string make_affinity_hash_key(const DownstreamAddr &addr) {
+  // hostport of all UNIX domain socket addresses is "localhost".
+  if (addr.host_unix) {
+    return StringRef{addr.host}.str();
+  }
+
+  return util::make_hostport(StringRef{addr.host}, addr.port);
+}
+
+void compute_affinity_hash(std::vector<AffinityHash> &res, size_t idx,
+                           const StringRef &key, size_t weight) {
+  std::array<uint8_t, 16> md;
+
+  for (size_t i = 0; i < NUM_AFFINITY_VNODES / 4 * weight; ++i) {
+    auto s = key.str();
+    s += '-';
+    s += util::utos(i);
+
+    if (md5(md, StringRef{s}) != 0) {
+      continue;
+    }
+
+    for (size_t j = 0; j < 4; ++j) {
+      res.emplace_back(idx, util::get_uint32(&md[j * 4]));
+    }
+  }
+}
+
+uint32_t compute_affinity_key_hash(const StringRef &key) {
+  std::array<uint8_t, 16> md;
+
+  if (md5(md, key) != 0) {
+    return 0;
+  }
+
+  return util::get_uint32(md.data());
+}
+
+DownstreamAddr *
+select_affinity_downstream_addr(SharedDownstreamAddr *shared_addr,
+                                uint32_t hash) {
+  auto &affinity_hash = shared_addr->affinity_hash;
+  auto &addrs = shared_addr->addrs;
+
+  if (affinity_hash.empty()) {
+    return nullptr;
+  }
+
+  auto it = std::lower_bound(
+      std::begin(affinity_hash), std::end(affinity_hash), hash,
+      [](const AffinityHash &lhs, uint32_t rhs) { return lhs.hash < rhs; });
+
+  for (size_t i = 0; i < affinity_hash.size(); ++i, ++it) {
+    if (it == std::end(affinity_hash)) {
+      it = std::begin(affinity_hash);
+    }
+
+    auto &addr = addrs[(*it).idx];
+    if (downstream_addr_available(addr)) {
+      return &addr;
+    }
+  }
+
+  return nullptr;
+}
+
 namespace {
 size_t match_downstream_addr_group_host(
-    const Router &router, const std::vector<WildcardPattern> &wildcard_patterns,
-    const StringRef &host, const StringRef &path,
-    const std::vector<DownstreamAddrGroup> &groups, size_t catch_all) {
+    const RouterConfig &routerconf, const StringRef &host,
+    const StringRef &path,
+    const std::vector<std::shared_ptr<DownstreamAddrGroup>> &groups,
+    size_t catch_all) {
+  auto &router = routerconf.router;
+
   if (path.empty() || path[0] != '/') {
     auto group = router.match(host, StringRef::from_lit("/"));
     if (group != -1) {
       if (LOG_ENABLED(INFO)) {
         LOG(INFO) << "Found pattern with query " << host
-                  << ", matched pattern=" << groups[group].pattern;
+                  << ", matched pattern=" << groups[group]->pattern;
       }
       return group;
     }
@@ -358,28 +1182,57 @@ size_t match_downstream_addr_group_host(
   if (group != -1) {
     if (LOG_ENABLED(INFO)) {
       LOG(INFO) << "Found pattern with query " << host << path
-                << ", matched pattern=" << groups[group].pattern;
+                << ", matched pattern=" << groups[group]->pattern;
     }
     return group;
   }
 
-  for (auto it = std::begin(wildcard_patterns);
-       it != std::end(wildcard_patterns); ++it) {
-    /* left most '*' must match at least one character */
-    if (host.size() <= (*it).host.size() ||
-        !util::ends_with(std::begin(host), std::end(host),
-                         std::begin((*it).host), std::end((*it).host))) {
-      continue;
+  auto &wildcard_patterns = routerconf.wildcard_patterns;
+
+  if (!wildcard_patterns.empty() && !host.empty()) {
+    // Host is reversed without its first character, because left
+    // most '*' must match at least one character.  Then wildcard
+    // hosts which are suffix of host are found from shortest to
+    // longest.
+    std::array<char, 256> buf;
+    std::string rev_host_str;
+    StringRef rev_host;
+
+    if (host.size() - 1 <= buf.size()) {
+      auto end = std::reverse_copy(std::begin(host) + 1, std::end(host),
+                                   std::begin(buf));
+      rev_host = StringRef{std::begin(buf), end};
+    } else {
+      rev_host_str.assign(host.rbegin(), host.rend() - 1);
+      rev_host = StringRef{rev_host_str};
     }
-    auto group = (*it).router.match(StringRef{}, path);
-    if (group != -1) {
-      // We sorted wildcard_patterns in a way that first match is the
-      // longest host pattern.
+
+    ssize_t best_group = -1;
+    const RCNode *last_node = nullptr;
+
+    for (;;) {
+      size_t nread = 0;
+      auto wcidx = routerconf.rev_wildcard_router.match_prefix(
+          &nread, &last_node, rev_host);
+      if (wcidx == -1) {
+        break;
+      }
+
+      rev_host = StringRef{std::begin(rev_host) + nread, std::end(rev_host)};
+
+      auto group = wildcard_patterns[wcidx].router.match(StringRef{}, path);
+      if (group != -1) {
+        // The longest host pattern wins.
+        best_group = group;
+      }
+    }
+
+    if (best_group != -1) {
       if (LOG_ENABLED(INFO)) {
         LOG(INFO) << "Found wildcard pattern with query " << host << path
-                  << ", matched pattern=" << groups[group].pattern;
+                  << ", matched pattern=" << groups[best_group]->pattern;
       }
-      return group;
+      return best_group;
     }
   }
 
@@ -387,7 +1240,7 @@ size_t match_downstream_addr_group_host(
   if (group != -1) {
     if (LOG_ENABLED(INFO)) {
       LOG(INFO) << "Found pattern with query " << path
-                << ", matched pattern=" << groups[group].pattern;
+                << ", matched pattern=" << groups[group]->pattern;
     }
     return group;
   }
@@ -400,9 +1253,10 @@ size_t match_downstream_addr_group_host(
 } // namespace
 
 size_t match_downstream_addr_group(
-    const Router &router, const std::vector<WildcardPattern> &wildcard_patterns,
-    const StringRef &hostport, const StringRef &raw_path,
-    const std::vector<DownstreamAddrGroup> &groups, size_t catch_all) {
+    const RouterConfig &routerconf, const StringRef &hostport,
+    const StringRef &raw_path,
+    const std::vector<std::shared_ptr<DownstreamAddrGroup>> &groups,
+    size_t catch_all) {
   if (std::find(std::begin(hostport), std::end(hostport), '/') !=
       std::end(hostport)) {
     // We use '/' specially, and if '/' is included in host, it breaks
@@ -415,8 +1269,8 @@ size_t match_downstream_addr_group(
   auto path = StringRef{std::begin(raw_path), query};
 
   if (hostport.empty()) {
-    return match_downstream_addr_group_host(router, wildcard_patterns, hostport,
-                                            path, groups, catch_all);
+    return match_downstream_addr_group_host(routerconf, hostport, path, groups,
+                                            catch_all);
   }
 
   StringRef host;
@@ -440,14 +1294,14 @@ size_t match_downstream_addr_group(
 
   std::string low_host;
   if (std::find_if(std::begin(host), std::end(host), [](char c) {
-        return 'A' <= c || c <= 'Z';
+        return 'A' <= c && c <= 'Z';
       }) != std::end(host)) {
     low_host = host.str();
     util::inp_strlower(low_host);
     host = StringRef{low_host};
   }
-  return match_downstream_addr_group_host(router, wildcard_patterns, host, path,
-                                          groups, catch_all);
+  return match_downstream_addr_group_host(routerconf, host, path, groups,
+                                          catch_all);
 }
 
 } // namespace shrpx
@@ -33,6 +33,7 @@
 #include <unordered_map>
 #include <deque>
 #include <thread>
+#include <atomic>
 #ifndef NOTHREADS
 #include <future>
 #endif // NOTHREADS
@@ -44,6 +45,7 @@
 
 #include "shrpx_config.h"
 #include "shrpx_downstream_connection_pool.h"
+#include "shrpx_metrics.h"
 #include "memchunk.h"
 
 using namespace nghttp2;
@@ -52,7 +54,13 @@ namespace shrpx {
 
 class Http2Session;
 class ConnectBlocker;
+class ResponseCache;
+class ConcurrencyLimiter;
 class MemcachedDispatcher;
+class AccessLogWriter;
+class AccessLogBuffer;
+class SSLContextPool;
+struct Connection;
 struct UpstreamAddr;
 
 #ifdef HAVE_MRUBY
@@ -81,28 +89,96 @@ struct DownstreamAddr {
   std::unique_ptr<ConnectBlocker> connect_blocker;
   // Client side TLS session cache
   TLSSessionCache tls_session_cache;
+  // The number of requests in flight to this address.
+  size_t num_outstanding;
+  // Peak EWMA of response latency in seconds.  0 if no response has
+  // been received.
+  double ewma_latency;
+  // The time when ewma_latency was last updated.
+  ev_tstamp ewma_tstamp;
+  // The latency of the last response in seconds.  While no response
+  // is received, ewma_latency decays toward this value.
+  ev_tstamp last_latency;
+  // Health state published by HealthMonitor, or nullptr if active
+  // health check is disabled for this address.
+  std::shared_ptr<const std::atomic<bool>> healthy;
+  // Relative weight of this address in load balancing.
+  size_t weight;
+  // Current weight used by smooth weighted round robin.
+  int64_t current_weight;
+  // The number of requests sent to this address since request_rate
+  // was last updated.
+  size_t num_requests;
+  // EWMA of the number of requests per second sent to this address.
+  // This is only updated if HTTP/2 session warming is enabled.
+  double request_rate;
+};
+
+// Virtual node of backend address in consistent hash ring.
+struct AffinityHash {
+  AffinityHash(size_t idx, uint32_t hash) : idx(idx), hash(hash) {}
+
+  // Index in SharedDownstreamAddr::addrs.
+  size_t idx;
+  // Position in the hash ring.
+  uint32_t hash;
 };
 
 struct SharedDownstreamAddr {
   std::vector<DownstreamAddr> addrs;
   // Application protocol used in this group
   shrpx_proto proto;
+  // Policy to select backend address
+  shrpx_lb_policy lb_policy;
+  // Session affinity, and the name of header field or cookie used
+  // as the key.
+  shrpx_affinity affinity;
+  ImmutableString affinity_name;
+  // Consistent hash ring sorted by hash.  This is empty if affinity
+  // is AFFINITY_NONE.
+  std::vector<AffinityHash> affinity_hash;
+  // true if at least one address in addrs has weight other than 1.
+  // In this case, backend address is selected for each request, and
+  // connection to that address is used.
+  bool weighted;
   // List of Http2Session which is not fully utilized (i.e., the
   // server advertized maximum concurrency is not reached).  We will
   // coalesce as much stream as possible in one Http2Session to fully
-  // utilize TCP connection.
-  //
-  // TODO Verify that this approach performs better in performance
-  // wise.
+  // utilize TCP connection.  By default, at least one Http2Session
+  // per backend address is kept in this list, so that requests are
+  // spread over addresses.  If --backend-http2-coalesce is given, new
+  // Http2Session is created only when this list becomes empty.
   DList<Http2Session> http2_freelist;
   DownstreamConnectionPool dconn_pool;
   // Next downstream address index in addrs.
   size_t next;
+  // The maximum number of times an idempotent request is retried on
+  // another address.
+  size_t retry;
+  // Percentile of response latency used as hedge delay.  0 means
+  // that hedging is disabled.
+  unsigned int hedge;
+  // Ring buffer of recent response latencies in seconds.  This is
+  // only filled if hedging is enabled.
+  std::vector<ev_tstamp> latency_samples;
+  // Next position in latency_samples.
+  size_t latency_sample_next;
+  // The time after which request is hedged, computed from
+  // latency_samples.  0 if not enough samples have been collected.
+  ev_tstamp hedge_delay;
+  // Adaptive concurrency limiter for this group.  nullptr if it is
+  // disabled.
+  std::shared_ptr<ConcurrencyLimiter> limiter;
+  // true if backend configuration was reloaded, and this object is
+  // no longer used for new requests.  Connections are not pooled.
+  bool retired;
 };
 
 struct DownstreamAddrGroup {
   ImmutableString pattern;
   std::shared_ptr<SharedDownstreamAddr> shared_addr;
+  // Response cache for this group.  nullptr if it is disabled.
+  std::shared_ptr<ResponseCache> cache;
 };
 
 struct WorkerStat {
@@ -113,6 +189,8 @@ enum WorkerEventType {
   NEW_CONNECTION = 0x01,
   REOPEN_LOG = 0x02,
   GRACEFUL_SHUTDOWN = 0x03,
+  REPLACE_DOWNSTREAM = 0x04,
+  SSL_CTX_LOADED = 0x05,
 };
 
 struct WorkerEvent {
@@ -124,13 +202,20 @@ struct WorkerEvent {
     const UpstreamAddr *faddr;
   };
   std::shared_ptr<TicketKeys> ticket_keys;
+  // Reloaded backend configuration for REPLACE_DOWNSTREAM.
+  std::shared_ptr<const DownstreamRoutingConfig> routing;
+  // Index of SSL_CTX in SSLContextPool for SSL_CTX_LOADED.
+  size_t ssl_ctx_idx;
+  // SSL_CTX loaded for SSL_CTX_LOADED, or nullptr if loading failed.
+  // The receiver owns a reference to it.
+  SSL_CTX *ssl_ctx;
 };
 
 class Worker {
 public:
   Worker(struct ev_loop *loop, SSL_CTX *sv_ssl_ctx, SSL_CTX *cl_ssl_ctx,
          SSL_CTX *tls_session_cache_memcached_ssl_ctx,
-         ssl::CertLookupTree *cert_tree,
+         ssl::CertLookupTree *cert_tree, SSLContextPool *ssl_ctx_pool,
          const std::shared_ptr<TicketKeys> &ticket_keys);
   ~Worker();
   void run_async();
@@ -139,6 +224,12 @@ public:
   void send(const WorkerEvent &event);
 
   ssl::CertLookupTree *get_cert_lookup_tree() const;
+  SSLContextPool *get_ssl_ctx_pool() const;
+
+  // Makes |conn| resume TLS handshake when SSL_CTX at |idx| in
+  // SSLContextPool is loaded.
+  void add_ssl_ctx_waiter(Connection *conn, size_t idx);
+  void remove_ssl_ctx_waiter(Connection *conn);
 
   // These 2 functions make a lock m_ to get/set ticket keys
   // atomically.
@@ -146,6 +237,7 @@ public:
   void set_ticket_keys(std::shared_ptr<TicketKeys> ticket_keys);
 
   WorkerStat *get_worker_stat();
+  WorkerMetrics *get_metrics();
   struct ev_loop *get_loop() const;
   SSL_CTX *get_sv_ssl_ctx() const;
   SSL_CTX *get_cl_ssl_ctx() const;
@@ -166,11 +258,37 @@ public:
   mruby::MRubyContext *get_mruby_context() const;
 #endif // HAVE_MRUBY
 
-  std::vector<DownstreamAddrGroup> &get_downstream_addr_groups();
+  std::vector<std::shared_ptr<DownstreamAddrGroup>> &
+  get_downstream_addr_groups();
+  // Returns backend configuration which get_downstream_addr_groups()
+  // was created from.  Its routers select the index of group.
+  const DownstreamRoutingConfig *get_downstream_routing() const;
+  // Replaces backend address groups with the ones created from
+  // |routing|.  The groups which have the same backend addresses as
+  // before keep their connections.  Connections to the other
+  // addresses are no longer used for new requests, and they are
+  // closed after in-flight requests finish.
+  void replace_downstream_routing(
+      std::shared_ptr<const DownstreamRoutingConfig> routing);
+  // Returns true if at least one of downstream address groups has
+  // response cache.
+  bool has_response_cache() const;
 
   ConnectBlocker *get_connect_blocker() const;
 
+  // Opens HTTP/2 sessions to backend addresses so that the number of
+  // sessions which can accept new requests does not fall below
+  // --backend-http2-warm-connections, and keeps the idle ones alive.
+  void warm_http2_sessions();
+
+  // Makes this worker write access log to |buf| which is drained by
+  // |writer|.  This must be called before run_async().
+  void set_accesslog_buffer(AccessLogWriter *writer, AccessLogBuffer *buf);
+
 private:
+  // Resumes TLS handshake of connections waiting for SSL_CTX at |idx|.
+  void resume_ssl_ctx_waiters(size_t idx, SSL_CTX *ssl_ctx);
+
 #ifndef NOTHREADS
   std::future<void> fut_;
 #endif // NOTHREADS
@@ -179,8 +297,11 @@ private:
   std::mt19937 randgen_;
   ev_async w_;
   ev_timer mcpool_clear_timer_;
+  ev_timer http2_warm_timer_;
   MemchunkPool mcpool_;
   WorkerStat worker_stat_;
+  // Metrics of this worker.  Only this worker updates them.
+  WorkerMetrics metrics_;
 
   std::unique_ptr<MemcachedDispatcher> session_cache_memcached_dispatcher_;
 #ifdef HAVE_MRUBY
@@ -193,26 +314,131 @@ private:
   SSL_CTX *sv_ssl_ctx_;
   SSL_CTX *cl_ssl_ctx_;
   ssl::CertLookupTree *cert_tree_;
+  SSLContextPool *ssl_ctx_pool_;
+  // Connections which wait for SSL_CTX being loaded, and the index of
+  // SSL_CTX.
+  std::vector<std::pair<Connection *, size_t>> ssl_ctx_waiters_;
 
   std::shared_ptr<TicketKeys> ticket_keys_;
-  std::vector<DownstreamAddrGroup> downstream_addr_groups_;
+  std::shared_ptr<const DownstreamRoutingConfig> downstream_routing_;
+  std::vector<std::shared_ptr<DownstreamAddrGroup>> downstream_addr_groups_;
+  // Groups whose HTTP/2 sessions are warmed.  Groups which share the
+  // same backend addresses appear only once.
+  std::vector<std::shared_ptr<DownstreamAddrGroup>> http2_warm_groups_;
+  // The last time when warm_http2_sessions() was called.
+  ev_tstamp http2_warm_tstamp_;
   // Worker level blocker for downstream connection.  For example,
   // this is used when file decriptor is exhausted.
   std::unique_ptr<ConnectBlocker> connect_blocker_;
+  AccessLogWriter *accesslog_writer_;
+  AccessLogBuffer *accesslog_buffer_;
 
   bool graceful_shutdown_;
+  bool has_response_cache_;
 };
 
+// Updates peak EWMA response latency of |addr| with |latency| in
+// seconds observed at the time |now|.
+void update_downstream_addr_latency(DownstreamAddr *addr, ev_tstamp latency,
+                                    ev_tstamp now);
+
+// Returns the cost of sending a request to |addr| at the time |now|
+// for peak EWMA load balancing.  The cost is divided by the weight of
+// |addr|.  Lower is better.
+double downstream_addr_cost(const DownstreamAddr *addr, ev_tstamp now);
+
+// Returns true if |addr| is neither blocked by its connect_blocker
+// nor marked unhealthy by active health check.
+bool downstream_addr_available(const DownstreamAddr &addr);
+
+// Returns the key which identifies |addr| in the consistent hash
+// ring.  It is UNIX domain socket path, or host and port.  Unlike
+// hostport, port is always included.
+std::string make_affinity_hash_key(const DownstreamAddr &addr);
+
+// Appends virtual nodes of backend address whose index is |idx| to
+// |res|.  |key| identifies the address, and it determines the
+// positions of nodes in the ring.  The number of nodes is
+// proportional to |weight|.  |res| must be sorted by hash after all
+// addresses are added.
+void compute_affinity_hash(std::vector<AffinityHash> &res, size_t idx,
+                           const StringRef &key, size_t weight);
+
+// Returns hash of session affinity key |key|.
+uint32_t compute_affinity_key_hash(const StringRef &key);
+
+// Returns available backend address which |hash| is mapped to in the
+// consistent hash ring of |shared_addr|.  If the address is not
+// available, the next one in the ring is returned, so that only the
+// keys mapped to the unavailable address move.  Returns nullptr if
+// no address is available.
+DownstreamAddr *
+select_affinity_downstream_addr(SharedDownstreamAddr *shared_addr,
+                                uint32_t hash);
+
+// Selects backend address in |shared_addr| according to its load
+// balancing policy, taking weight of each address into account.  The
+// address which is not available is not selected.  Returns nullptr if
+// no address is available.
+DownstreamAddr *select_downstream_addr(SharedDownstreamAddr *shared_addr,
+                                       std::mt19937 &gen, ev_tstamp now);
+
+// Selects available backend address in |shared_addr| to retry a
+// request which has already been sent to the addresses in |tried|.
+// The address which has the least number of requests in flight per
+// weight is selected.  Returns nullptr if no address is left.
+DownstreamAddr *
+select_retry_downstream_addr(SharedDownstreamAddr *shared_addr,
+                             const std::vector<DownstreamAddr *> &tried);
+
+// Adds response |latency| in seconds to the latency samples of
+// |shared_addr|, and updates its hedge delay.
+void add_downstream_latency_sample(SharedDownstreamAddr *shared_addr,
+                                   ev_tstamp latency);
+
+// Returns |percentile|-th percentile of |samples|.  This function
+// returns 0 if |samples| contains too few samples to estimate it.
+ev_tstamp compute_hedge_delay(std::vector<ev_tstamp> samples,
+                              unsigned int percentile);
+
+// Selects Http2Session in http2_freelist of |shared_addr| according
+// to its load balancing policy.  The session connected to unhealthy
+// address is not selected.  Returns nullptr if no session is
+// selected.
+Http2Session *select_http2_session(SharedDownstreamAddr *shared_addr,
+                                   ev_tstamp now);
+
+// Returns Http2Session in http2_freelist of |shared_addr| which is
+// connected, or is going to connect, to |addr|.  Returns nullptr if
+// there is no such session.
+Http2Session *
+select_http2_session_by_addr(SharedDownstreamAddr *shared_addr,
+                             const DownstreamAddr *addr);
+
+// Returns the number of HTTP/2 sessions which should be opened to a
+// backend address in addition to |num_sessions| sessions which can
+// accept new requests.  Those sessions can accept |num_streams| more
+// streams in total.  At least |min_sessions| sessions are kept.  An
+// extra session is opened ahead of demand if the number of requests
+// in flight, estimated from request rate |rate| per second and
+// response latency |latency| in seconds, exceeds the half of
+// |num_streams|.
+size_t count_http2_sessions_to_warm(size_t min_sessions, size_t num_sessions,
+                                    size_t num_streams, double rate,
+                                    double latency);
+
 // Selects group based on request's |hostport| and |path|.  |hostport|
 // is the value taken from :authority or host header field, and may
 // contain port.  The |path| may contain query part.  We require the
 // catch-all pattern in place, so this function always selects one
 // group.  The catch-all group index is given in |catch_all|.  All
-// patterns are given in |groups|.
+// patterns are given in |groups|.  All routers in |routerconf| must
+// be compiled.
 size_t match_downstream_addr_group(
-    const Router &router, const std::vector<WildcardPattern> &wildcard_patterns,
-    const StringRef &hostport, const StringRef &path,
-    const std::vector<DownstreamAddrGroup> &groups, size_t catch_all);
+    const RouterConfig &routerconf, const StringRef &hostport,
+    const StringRef &path,
+    const std::vector<std::shared_ptr<DownstreamAddrGroup>> &groups,
+    size_t catch_all);
 
 } // namespace shrpx
 
@@ -33,6 +33,7 @@
 
 #include <cinttypes>
 #include <cstdlib>
+#include <cstring>
 
 #include <openssl/rand.h>
 
@@ -47,7 +48,9 @@
 #include "shrpx_http2_session.h"
 #include "shrpx_memcached_dispatcher.h"
 #include "shrpx_memcached_request.h"
+#include "shrpx_metrics_server.h"
 #include "shrpx_process.h"
+#include "shrpx_private_key_pool.h"
 #include "shrpx_ssl.h"
 #include "util.h"
 #include "app_helper.h"
@@ -105,6 +108,12 @@ void graceful_shutdown(ConnectionHandler *conn_handler) {
 
   conn_handler->disable_acceptor();
 
+  auto metrics_server = conn_handler->get_metrics_server();
+  if (metrics_server) {
+    // New process takes over the metrics acceptors.
+    metrics_server->disable();
+  }
+
   // After disabling accepting new connection, disptach incoming
   // connection in backlog.
 
@@ -136,6 +145,18 @@ void reopen_log(ConnectionHandler *conn_handler) {
 }
 } // namespace
 
+namespace {
+void reload_config(ConnectionHandler *conn_handler) {
+  if (conn_handler->get_graceful_shutdown()) {
+    return;
+  }
+
+  LOG(NOTICE) << "Reloading backend configuration: worker process";
+
+  conn_handler->reload_config();
+}
+} // namespace
+
 namespace {
 void ipc_readcb(struct ev_loop *loop, ev_io *w, int revents) {
   auto conn_handler = static_cast<ConnectionHandler *>(w->data);
@@ -163,6 +184,9 @@ void ipc_readcb(struct ev_loop *loop, ev_io *w, int revents) {
     case SHRPX_IPC_REOPEN_LOG:
       reopen_log(conn_handler);
       break;
+    case SHRPX_IPC_RELOAD_CONFIG:
+      reload_config(conn_handler);
+      break;
     }
   }
 }
@@ -259,7 +283,7 @@ void memcached_get_ticket_key_cb(struct ev_loop *loop, ev_timer *w,
   auto conn_handler = static_cast<ConnectionHandler *>(w->data);
   auto dispatcher = conn_handler->get_tls_ticket_key_memcached_dispatcher();
 
-  auto req = make_unique<MemcachedRequest>();
+  auto req = dispatcher->create_request();
   req->key = "nghttpx:tls-ticket-key";
   req->op = MEMCACHED_OP_GET;
   req->cb = [conn_handler, dispatcher, w](MemcachedRequest *req,
@@ -387,12 +411,34 @@ int worker_process_event_loop(WorkerProcessConfig *wpconf) {
 
   auto loop = EV_DEFAULT;
 
+  {
+    auto want = str_event_backend(get_config()->ev_loop_flags);
+    auto got = str_event_backend(ev_backend(loop));
+    if (get_config()->ev_loop_flags && strcmp(want, got) != 0) {
+      // This happens if io_uring is requested, but the kernel does
+      // not support it.
+      LOG(WARN) << "Event backend " << want << " is not available, using "
+                << got;
+    } else if (LOG_ENABLED(INFO)) {
+      LOG(INFO) << "Using event backend " << got;
+    }
+  }
+
   ConnectionHandler conn_handler(loop);
 
   for (auto &addr : get_config()->conn.listener.addrs) {
     conn_handler.add_acceptor(make_unique<AcceptHandler>(&addr, &conn_handler));
   }
 
+  auto &metrics_addrs = get_config()->conn.listener.metrics_addrs;
+  if (!metrics_addrs.empty()) {
+    auto metrics_server = make_unique<MetricsServer>(&conn_handler);
+    for (auto &addr : metrics_addrs) {
+      metrics_server->add_listener(&addr);
+    }
+    conn_handler.set_metrics_server(std::move(metrics_server));
+  }
+
   auto &upstreamconf = get_config()->conn.upstream;
 
 #ifdef HAVE_NEVERBLEED
@@ -420,6 +466,21 @@ int worker_process_event_loop(WorkerProcessConfig *wpconf) {
 
 #endif // HAVE_NEVERBLEED
 
+  if (!upstreamconf.no_tls && get_config()->tls.private_key_threads) {
+#ifdef HAVE_NEVERBLEED
+    LOG(WARN) << "private-key-threads is ignored because private key "
+                 "operations are performed by neverbleed";
+#elif defined(SHRPX_ASYNC_PRIVATE_KEY)
+    auto pool =
+        make_unique<PrivateKeyPool>(get_config()->tls.private_key_threads);
+    mod_config()->tls.private_key_pool = pool.get();
+    conn_handler.set_private_key_pool(std::move(pool));
+#else  // !HAVE_NEVERBLEED && !SHRPX_ASYNC_PRIVATE_KEY
+    LOG(WARN) << "private-key-threads is ignored because asynchronous "
+                 "private key operation is not supported";
+#endif // !HAVE_NEVERBLEED && !SHRPX_ASYNC_PRIVATE_KEY
+  }
+
   MemchunkPool mcpool;
 
   ev_timer renew_ticket_key_timer;
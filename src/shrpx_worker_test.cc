@@ -29,157 +29,167 @@
 #endif // HAVE_UNISTD_H
 
 #include <cstdlib>
+#include <algorithm>
 
 #include <CUnit/CUnit.h>
 
 #include "shrpx_worker.h"
 #include "shrpx_connect_blocker.h"
+#include "shrpx_config.h"
+#include "shrpx_http_downstream_connection.h"
+#include "shrpx_http2_session.h"
+#include "util.h"
+#include "template.h"
 
 namespace shrpx {
 
 void test_shrpx_worker_match_downstream_addr_group(void) {
-  auto groups = std::vector<DownstreamAddrGroup>();
+  auto groups = std::vector<std::shared_ptr<DownstreamAddrGroup>>();
   for (auto &s : {"nghttp2.org/", "nghttp2.org/alpha/bravo/",
                   "nghttp2.org/alpha/charlie", "nghttp2.org/delta%3A",
                   "www.nghttp2.org/", "[::1]/", "nghttp2.org/alpha/bravo/delta",
                   // Check that match is done in the single node
                   "example.com/alpha/bravo", "192.168.0.1/alpha/", "/golf/"}) {
-    groups.push_back(DownstreamAddrGroup{ImmutableString(s)});
+    groups.push_back(std::make_shared<DownstreamAddrGroup>(
+        DownstreamAddrGroup{ImmutableString(s)}));
   }
 
-  Router router;
+  RouterConfig routerconf;
+
+  auto &router = routerconf.router;
+  auto &wp = routerconf.wildcard_patterns;
 
   for (size_t i = 0; i < groups.size(); ++i) {
     auto &g = groups[i];
-    router.add_route(StringRef{g.pattern}, i);
+    router.add_route(StringRef{g->pattern}, i);
   }
 
-  std::vector<WildcardPattern> wp;
+  router.compile();
 
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/"), groups, 255));
 
   // port is removed
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org:8080"),
+                     routerconf, StringRef::from_lit("nghttp2.org:8080"),
                      StringRef::from_lit("/"), groups, 255));
 
   // host is case-insensitive
   CU_ASSERT(4 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("WWW.nghttp2.org"),
+                     routerconf, StringRef::from_lit("WWW.nghttp2.org"),
                      StringRef::from_lit("/alpha"), groups, 255));
 
   CU_ASSERT(1 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/bravo/"), groups, 255));
 
   // /alpha/bravo also matches /alpha/bravo/
   CU_ASSERT(1 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/bravo"), groups, 255));
 
   // path part is case-sensitive
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/Alpha/bravo"), groups, 255));
 
   CU_ASSERT(1 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/bravo/charlie"), groups, 255));
 
   CU_ASSERT(2 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/charlie"), groups, 255));
 
   // pattern which does not end with '/' must match its entirely.  So
   // this matches to group 0, not group 2.
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/charlie/"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("example.org"),
+                       routerconf, StringRef::from_lit("example.org"),
                        StringRef::from_lit("/"), groups, 255));
 
-  CU_ASSERT(255 ==
-            match_downstream_addr_group(router, wp, StringRef::from_lit(""),
-                                        StringRef::from_lit("/"), groups, 255));
+  CU_ASSERT(255 == match_downstream_addr_group(
+                       routerconf, StringRef::from_lit(""),
+                       StringRef::from_lit("/"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit(""),
+                       routerconf, StringRef::from_lit(""),
                        StringRef::from_lit("alpha"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("foo/bar"),
+                       routerconf, StringRef::from_lit("foo/bar"),
                        StringRef::from_lit("/"), groups, 255));
 
   // If path is StringRef::from_lit("*", only match with host + "/").
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("*"), groups, 255));
 
-  CU_ASSERT(
-      5 == match_downstream_addr_group(router, wp, StringRef::from_lit("[::1]"),
-                                       StringRef::from_lit("/"), groups, 255));
   CU_ASSERT(5 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("[::1]:8080"),
+                     routerconf, StringRef::from_lit("[::1]"),
                      StringRef::from_lit("/"), groups, 255));
-  CU_ASSERT(255 ==
-            match_downstream_addr_group(router, wp, StringRef::from_lit("[::1"),
-                                        StringRef::from_lit("/"), groups, 255));
+  CU_ASSERT(5 == match_downstream_addr_group(
+                     routerconf, StringRef::from_lit("[::1]:8080"),
+                     StringRef::from_lit("/"), groups, 255));
+  CU_ASSERT(255 == match_downstream_addr_group(
+                       routerconf, StringRef::from_lit("[::1"),
+                       StringRef::from_lit("/"), groups, 255));
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("[::1]8000"),
+                       routerconf, StringRef::from_lit("[::1]8000"),
                        StringRef::from_lit("/"), groups, 255));
 
   // Check the case where adding route extends tree
   CU_ASSERT(6 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/bravo/delta"), groups, 255));
 
   CU_ASSERT(1 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/alpha/bravo/delta/"), groups, 255));
 
   // Check the case where query is done in a single node
   CU_ASSERT(7 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("example.com"),
+                     routerconf, StringRef::from_lit("example.com"),
                      StringRef::from_lit("/alpha/bravo"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("example.com"),
+                       routerconf, StringRef::from_lit("example.com"),
                        StringRef::from_lit("/alpha/bravo/"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("example.com"),
+                       routerconf, StringRef::from_lit("example.com"),
                        StringRef::from_lit("/alpha"), groups, 255));
 
   // Check the case where quey is done in a single node
   CU_ASSERT(8 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("192.168.0.1"),
+                     routerconf, StringRef::from_lit("192.168.0.1"),
                      StringRef::from_lit("/alpha"), groups, 255));
 
   CU_ASSERT(8 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("192.168.0.1"),
+                     routerconf, StringRef::from_lit("192.168.0.1"),
                      StringRef::from_lit("/alpha/"), groups, 255));
 
   CU_ASSERT(8 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("192.168.0.1"),
+                     routerconf, StringRef::from_lit("192.168.0.1"),
                      StringRef::from_lit("/alpha/bravo"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("192.168.0.1"),
+                       routerconf, StringRef::from_lit("192.168.0.1"),
                        StringRef::from_lit("/alph"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit("192.168.0.1"),
+                       routerconf, StringRef::from_lit("192.168.0.1"),
                        StringRef::from_lit("/"), groups, 255));
 
   // Test for wildcard hosts
-  groups.push_back(
-      DownstreamAddrGroup{ImmutableString::from_lit("git.nghttp2.org")});
-  groups.push_back(
-      DownstreamAddrGroup{ImmutableString::from_lit(".nghttp2.org")});
+  groups.push_back(std::make_shared<DownstreamAddrGroup>(
+      DownstreamAddrGroup{ImmutableString::from_lit("git.nghttp2.org")}));
+  groups.push_back(std::make_shared<DownstreamAddrGroup>(
+      DownstreamAddrGroup{ImmutableString::from_lit(".nghttp2.org")}));
 
   wp.push_back({ImmutableString("git.nghttp2.org")});
   wp.back().router.add_route(StringRef::from_lit("/echo/"), 10);
@@ -188,29 +198,636 @@ void test_shrpx_worker_match_downstream_addr_group(void) {
   wp.back().router.add_route(StringRef::from_lit("/echo/"), 11);
   wp.back().router.add_route(StringRef::from_lit("/echo/foxtrot"), 12);
 
+  std::vector<std::string> rev_hosts;
+  rev_hosts.reserve(wp.size());
+
+  for (size_t i = 0; i < wp.size(); ++i) {
+    rev_hosts.emplace_back(wp[i].host.rbegin(), wp[i].host.rend());
+    routerconf.rev_wildcard_router.add_route(StringRef{rev_hosts.back()}, i);
+    wp[i].router.compile();
+  }
+
+  routerconf.rev_wildcard_router.compile();
+
   CU_ASSERT(11 == match_downstream_addr_group(
-                      router, wp, StringRef::from_lit("git.nghttp2.org"),
+                      routerconf, StringRef::from_lit("git.nghttp2.org"),
                       StringRef::from_lit("/echo"), groups, 255));
 
   CU_ASSERT(10 == match_downstream_addr_group(
-                      router, wp, StringRef::from_lit("0git.nghttp2.org"),
+                      routerconf, StringRef::from_lit("0git.nghttp2.org"),
                       StringRef::from_lit("/echo"), groups, 255));
 
   CU_ASSERT(11 == match_downstream_addr_group(
-                      router, wp, StringRef::from_lit("it.nghttp2.org"),
+                      routerconf, StringRef::from_lit("it.nghttp2.org"),
                       StringRef::from_lit("/echo"), groups, 255));
 
   CU_ASSERT(255 == match_downstream_addr_group(
-                       router, wp, StringRef::from_lit(".nghttp2.org"),
+                       routerconf, StringRef::from_lit(".nghttp2.org"),
                        StringRef::from_lit("/echo/foxtrot"), groups, 255));
 
   CU_ASSERT(9 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("alpha.nghttp2.org"),
+                     routerconf, StringRef::from_lit("alpha.nghttp2.org"),
                      StringRef::from_lit("/golf"), groups, 255));
 
   CU_ASSERT(0 == match_downstream_addr_group(
-                     router, wp, StringRef::from_lit("nghttp2.org"),
+                     routerconf, StringRef::from_lit("nghttp2.org"),
                      StringRef::from_lit("/echo"), groups, 255));
 }
 
+void test_shrpx_worker_select_downstream_addr(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.addrs.resize(3);
+  for (auto &addr : shared_addr.addrs) {
+    addr.connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+    addr.weight = 1;
+  }
+
+  auto &addrs = shared_addr.addrs;
+  ev_tstamp now = 1000.;
+
+  // round-robin
+  shared_addr.lb_policy = LB_ROUND_ROBIN;
+
+  CU_ASSERT(&addrs[0] == select_downstream_addr(&shared_addr, gen, now));
+  CU_ASSERT(&addrs[1] == select_downstream_addr(&shared_addr, gen, now));
+  CU_ASSERT(&addrs[2] == select_downstream_addr(&shared_addr, gen, now));
+  CU_ASSERT(&addrs[0] == select_downstream_addr(&shared_addr, gen, now));
+
+  // least-outstanding
+  shared_addr.lb_policy = LB_LEAST_OUTSTANDING;
+  shared_addr.next = 0;
+
+  addrs[0].num_outstanding = 2;
+  addrs[1].num_outstanding = 1;
+  addrs[2].num_outstanding = 3;
+
+  CU_ASSERT(&addrs[1] == select_downstream_addr(&shared_addr, gen, now));
+
+  addrs[2].num_outstanding = 1;
+
+  // Tie is broken in round robin fashion.
+  CU_ASSERT(&addrs[2] == select_downstream_addr(&shared_addr, gen, now));
+  CU_ASSERT(&addrs[1] == select_downstream_addr(&shared_addr, gen, now));
+
+  // peak-ewma
+  shared_addr.lb_policy = LB_PEAK_EWMA;
+
+  for (auto &addr : addrs) {
+    addr.num_outstanding = 0;
+  }
+
+  update_downstream_addr_latency(&addrs[0], 0.1, now);
+  update_downstream_addr_latency(&addrs[1], 0.01, now);
+  update_downstream_addr_latency(&addrs[2], 0.5, now);
+
+  CU_ASSERT(&addrs[1] == select_downstream_addr(&shared_addr, gen, now));
+
+  // Requests in flight raise the cost.
+  addrs[1].num_outstanding = 100;
+
+  CU_ASSERT(&addrs[0] == select_downstream_addr(&shared_addr, gen, now));
+
+  // Latency spike is reflected immediately.
+  update_downstream_addr_latency(&addrs[0], 1., now);
+
+  CU_ASSERT(1. == addrs[0].ewma_latency);
+  CU_ASSERT(&addrs[2] == select_downstream_addr(&shared_addr, gen, now));
+
+  // Lower latency is averaged.
+  update_downstream_addr_latency(&addrs[0], 0.1, now + 10.);
+
+  CU_ASSERT(addrs[0].ewma_latency > 0.1);
+  CU_ASSERT(addrs[0].ewma_latency < 1.);
+
+  // Address which has not responded yet, but has requests in flight
+  // is not preferred.
+  auto fresh_addr = DownstreamAddr{};
+  fresh_addr.num_outstanding = 1;
+  fresh_addr.weight = 1;
+
+  CU_ASSERT(downstream_addr_cost(&fresh_addr, now) >
+            downstream_addr_cost(&addrs[2], now));
+
+  // The weight is honored before the first response as well.
+  auto heavy_addr = DownstreamAddr{};
+  heavy_addr.num_outstanding = 3;
+  heavy_addr.weight = 4;
+
+  CU_ASSERT(downstream_addr_cost(&heavy_addr, now) <
+            downstream_addr_cost(&fresh_addr, now));
+
+  fresh_addr.num_outstanding = 0;
+
+  CU_ASSERT(0. == downstream_addr_cost(&fresh_addr, now));
+
+  // p2c never selects the worse address of the 2.
+  shared_addr.lb_policy = LB_P2C;
+  addrs[1].num_outstanding = 0;
+
+  for (size_t i = 0; i < 100; ++i) {
+    CU_ASSERT(&addrs[2] != select_downstream_addr(&shared_addr, gen, now));
+  }
+
+  // Blocked address is skipped.
+  addrs[1].connect_blocker->on_failure();
+
+  for (size_t i = 0; i < 100; ++i) {
+    CU_ASSERT(&addrs[1] != select_downstream_addr(&shared_addr, gen, now));
+  }
+
+  shared_addr.lb_policy = LB_LEAST_OUTSTANDING;
+
+  // Address marked unhealthy by health check is skipped.
+  auto healthy = std::make_shared<std::atomic<bool>>(false);
+  addrs[0].healthy = healthy;
+
+  CU_ASSERT(&addrs[2] == select_downstream_addr(&shared_addr, gen, now));
+
+  *healthy = true;
+
+  CU_ASSERT(&addrs[0] == select_downstream_addr(&shared_addr, gen, now));
+
+  addrs[0].connect_blocker->on_failure();
+
+  CU_ASSERT(&addrs[2] == select_downstream_addr(&shared_addr, gen, now));
+
+  addrs[2].connect_blocker->on_failure();
+
+  CU_ASSERT(nullptr == select_downstream_addr(&shared_addr, gen, now));
+}
+
+void test_shrpx_worker_select_affinity_downstream_addr(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.addrs.resize(3);
+  shared_addr.affinity = AFFINITY_IP;
+
+  auto &addrs = shared_addr.addrs;
+
+  addrs[0].host = ImmutableString::from_lit("alpha");
+  addrs[1].host = ImmutableString::from_lit("bravo");
+  addrs[2].host = ImmutableString::from_lit("charlie");
+
+  for (size_t i = 0; i < addrs.size(); ++i) {
+    addrs[i].port = 80;
+    addrs[i].connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+    addrs[i].weight = 1;
+    compute_affinity_hash(shared_addr.affinity_hash, i,
+                          StringRef{make_affinity_hash_key(addrs[i])},
+                          addrs[i].weight);
+  }
+
+  std::sort(std::begin(shared_addr.affinity_hash),
+            std::end(shared_addr.affinity_hash),
+            [](const AffinityHash &lhs, const AffinityHash &rhs) {
+              return lhs.hash < rhs.hash;
+            });
+
+  std::vector<DownstreamAddr *> selected;
+  std::array<size_t, 3> counts{};
+
+  for (size_t i = 0; i < 1000; ++i) {
+    auto key = "192.168.0." + util::utos(i);
+    auto addr = select_affinity_downstream_addr(
+        &shared_addr, compute_affinity_key_hash(StringRef{key}));
+
+    CU_ASSERT(nullptr != addr);
+
+    selected.push_back(addr);
+    ++counts[addr - addrs.data()];
+  }
+
+  // Keys are spread over all addresses.
+  for (auto n : counts) {
+    CU_ASSERT(n > 200);
+  }
+
+  // Mapping is deterministic.
+  CU_ASSERT(selected[0] ==
+            select_affinity_downstream_addr(
+                &shared_addr, compute_affinity_key_hash(
+                                  StringRef::from_lit("192.168.0.0"))));
+
+  // Only the keys mapped to unavailable address move.
+  auto healthy = std::make_shared<std::atomic<bool>>(false);
+  addrs[1].healthy = healthy;
+
+  for (size_t i = 0; i < 1000; ++i) {
+    auto key = "192.168.0." + util::utos(i);
+    auto addr = select_affinity_downstream_addr(
+        &shared_addr, compute_affinity_key_hash(StringRef{key}));
+
+    CU_ASSERT(&addrs[1] != addr);
+
+    if (selected[i] != &addrs[1]) {
+      CU_ASSERT(selected[i] == addr);
+    }
+  }
+
+  // They come back when the address is available again.
+  *healthy = true;
+
+  for (size_t i = 0; i < 1000; ++i) {
+    auto key = "192.168.0." + util::utos(i);
+    CU_ASSERT(selected[i] ==
+              select_affinity_downstream_addr(
+                  &shared_addr, compute_affinity_key_hash(StringRef{key})));
+  }
+
+  for (auto &addr : addrs) {
+    addr.connect_blocker->on_failure();
+  }
+
+  CU_ASSERT(nullptr == select_affinity_downstream_addr(&shared_addr, 0));
+}
+
+void test_shrpx_worker_affinity_hash_key(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.addrs.resize(2);
+  shared_addr.affinity = AFFINITY_IP;
+
+  auto &addrs = shared_addr.addrs;
+
+  // All UNIX domain socket addresses have the same hostport.
+  addrs[0].host = ImmutableString::from_lit("/tmp/alpha.sock");
+  addrs[1].host = ImmutableString::from_lit("/tmp/bravo.sock");
+
+  for (size_t i = 0; i < addrs.size(); ++i) {
+    addrs[i].hostport = ImmutableString::from_lit("localhost");
+    addrs[i].host_unix = true;
+    addrs[i].connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+    addrs[i].weight = 1;
+  }
+
+  CU_ASSERT("/tmp/alpha.sock" == make_affinity_hash_key(addrs[0]));
+  CU_ASSERT("/tmp/bravo.sock" == make_affinity_hash_key(addrs[1]));
+
+  for (size_t i = 0; i < addrs.size(); ++i) {
+    compute_affinity_hash(shared_addr.affinity_hash, i,
+                          StringRef{make_affinity_hash_key(addrs[i])},
+                          addrs[i].weight);
+  }
+
+  std::sort(std::begin(shared_addr.affinity_hash),
+            std::end(shared_addr.affinity_hash),
+            [](const AffinityHash &lhs, const AffinityHash &rhs) {
+              return lhs.hash < rhs.hash;
+            });
+
+  // The ring is not occupied by the nodes of a single address.
+  std::array<size_t, 2> counts{};
+
+  for (size_t i = 0; i < 1000; ++i) {
+    auto key = "192.168.0." + util::utos(i);
+    auto addr = select_affinity_downstream_addr(
+        &shared_addr, compute_affinity_key_hash(StringRef{key}));
+
+    CU_ASSERT(nullptr != addr);
+
+    ++counts[addr - addrs.data()];
+  }
+
+  for (auto n : counts) {
+    CU_ASSERT(n > 300);
+  }
+
+  // Port is included even if hostport omits the default port.
+  DownstreamAddr http, https;
+  http.host = https.host = ImmutableString::from_lit("example.com");
+  http.hostport = https.hostport = ImmutableString::from_lit("example.com");
+  http.port = 80;
+  https.port = 443;
+  http.host_unix = https.host_unix = false;
+
+  CU_ASSERT("example.com:80" == make_affinity_hash_key(http));
+  CU_ASSERT("example.com:443" == make_affinity_hash_key(https));
+}
+
+void test_shrpx_worker_select_weighted_downstream_addr(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.addrs.resize(3);
+  shared_addr.lb_policy = LB_ROUND_ROBIN;
+  shared_addr.weighted = true;
+
+  auto &addrs = shared_addr.addrs;
+
+  for (auto &addr : addrs) {
+    addr.connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+  }
+
+  addrs[0].weight = 5;
+  addrs[1].weight = 1;
+  addrs[2].weight = 1;
+
+  ev_tstamp now = 1000.;
+
+  // Heavily weighted address is not selected in a row.
+  std::array<size_t, 7> expected{{0, 0, 1, 0, 2, 0, 0}};
+  for (size_t i = 0; i < 2; ++i) {
+    for (auto idx : expected) {
+      CU_ASSERT(&addrs[idx] == select_downstream_addr(&shared_addr, gen, now));
+    }
+  }
+
+  // Unavailable address is skipped, and the others share its
+  // traffic by weight.
+  addrs[0].connect_blocker->on_failure();
+
+  std::array<size_t, 3> counts{};
+  for (size_t i = 0; i < 100; ++i) {
+    auto addr = select_downstream_addr(&shared_addr, gen, now);
+    CU_ASSERT(&addrs[0] != addr);
+    ++counts[addr - addrs.data()];
+  }
+
+  CU_ASSERT(50 == counts[1]);
+  CU_ASSERT(50 == counts[2]);
+
+  // least-outstanding divides the number of requests in flight by
+  // weight.
+  shared_addr.lb_policy = LB_LEAST_OUTSTANDING;
+
+  addrs[1].weight = 4;
+  addrs[1].num_outstanding = 3;
+  addrs[2].num_outstanding = 1;
+
+  CU_ASSERT(&addrs[1] == select_downstream_addr(&shared_addr, gen, now));
+}
+
+void test_shrpx_worker_downstream_addr_cost(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.lb_policy = LB_PEAK_EWMA;
+  shared_addr.addrs.resize(2);
+  for (auto &addr : shared_addr.addrs) {
+    addr.connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+    addr.weight = 1;
+  }
+
+  auto &addrs = shared_addr.addrs;
+  auto &fast = addrs[0];
+  auto &slow = addrs[1];
+  ev_tstamp now = 1000.;
+
+  update_downstream_addr_latency(&fast, 0.01, now);
+  update_downstream_addr_latency(&slow, 1., now);
+
+  // Only the fast address has been used for a while.
+  for (size_t i = 1; i <= 60; ++i) {
+    update_downstream_addr_latency(&fast, 0.01, now + i);
+  }
+
+  now += 60.;
+
+  // The slow address which has been idle does not become cheaper.
+  CU_ASSERT(1. == downstream_addr_cost(&slow, now));
+
+  for (size_t i = 0; i < 10; ++i) {
+    CU_ASSERT(&fast == select_downstream_addr(&shared_addr, gen, now));
+  }
+
+  // Latency spike decays toward the last observed latency.
+  update_downstream_addr_latency(&fast, 2., now);
+  update_downstream_addr_latency(&fast, 0.01, now);
+
+  CU_ASSERT(downstream_addr_cost(&fast, now) > 1.9);
+  CU_ASSERT(downstream_addr_cost(&fast, now + 10.) < 1.);
+  CU_ASSERT(downstream_addr_cost(&fast, now + 60.) > 0.01);
+  CU_ASSERT(downstream_addr_cost(&fast, now + 60.) < 0.02);
+  CU_ASSERT(&fast == select_downstream_addr(&shared_addr, gen, now + 60.));
+}
+
+void test_shrpx_worker_count_http2_sessions_to_warm(void) {
+  // Warming is disabled.
+  CU_ASSERT(0 == count_http2_sessions_to_warm(0, 0, 0, 1000., 1.));
+
+  // Open sessions up to the minimum.
+  CU_ASSERT(2 == count_http2_sessions_to_warm(2, 0, 0, 0., 0.));
+  CU_ASSERT(1 == count_http2_sessions_to_warm(2, 1, 100, 0., 0.));
+  CU_ASSERT(0 == count_http2_sessions_to_warm(2, 2, 200, 0., 0.));
+  CU_ASSERT(0 == count_http2_sessions_to_warm(2, 3, 300, 0., 0.));
+
+  // 100 requests per second with 0.5 seconds latency makes 50
+  // requests in flight.
+  CU_ASSERT(0 == count_http2_sessions_to_warm(1, 1, 100, 100., 0.5));
+  CU_ASSERT(1 == count_http2_sessions_to_warm(1, 1, 99, 100., 0.5));
+  CU_ASSERT(1 == count_http2_sessions_to_warm(1, 2, 20, 100., 0.5));
+}
+
+void test_shrpx_worker_select_retry_downstream_addr(void) {
+  std::mt19937 gen(1);
+  auto loop = EV_DEFAULT;
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.addrs.resize(3);
+
+  auto &addrs = shared_addr.addrs;
+
+  for (auto &addr : addrs) {
+    addr.connect_blocker = make_unique<ConnectBlocker>(gen, loop);
+    addr.weight = 1;
+  }
+
+  std::vector<DownstreamAddr *> tried{&addrs[0]};
+
+  addrs[1].num_outstanding = 2;
+  addrs[2].num_outstanding = 1;
+
+  // The address which has the least number of requests in flight is
+  // selected among the ones which have not been tried.
+  CU_ASSERT(&addrs[2] == select_retry_downstream_addr(&shared_addr, tried));
+
+  addrs[2].connect_blocker->on_failure();
+
+  CU_ASSERT(&addrs[1] == select_retry_downstream_addr(&shared_addr, tried));
+
+  tried.push_back(&addrs[1]);
+
+  CU_ASSERT(nullptr == select_retry_downstream_addr(&shared_addr, tried));
+}
+
+void test_shrpx_worker_compute_hedge_delay(void) {
+  std::vector<ev_tstamp> samples;
+
+  for (size_t i = 0; i < 31; ++i) {
+    samples.push_back(i + 1);
+  }
+
+  // Too few samples.
+  CU_ASSERT(0. == compute_hedge_delay(samples, 50));
+
+  for (size_t i = 31; i < 100; ++i) {
+    samples.push_back(i + 1);
+  }
+
+  std::shuffle(std::begin(samples), std::end(samples), std::mt19937(1));
+
+  CU_ASSERT(51. == compute_hedge_delay(samples, 50));
+  CU_ASSERT(96. == compute_hedge_delay(samples, 95));
+  CU_ASSERT(100. == compute_hedge_delay(samples, 99));
+
+  SharedDownstreamAddr shared_addr{};
+  shared_addr.hedge = 90;
+
+  for (size_t i = 0; i < 31; ++i) {
+    add_downstream_latency_sample(&shared_addr, 1.);
+  }
+
+  CU_ASSERT(0. == shared_addr.hedge_delay);
+
+  add_downstream_latency_sample(&shared_addr, 1.);
+
+  CU_ASSERT(1. == shared_addr.hedge_delay);
+
+  // Old samples are replaced by new ones.
+  for (size_t i = 0; i < 256; ++i) {
+    add_downstream_latency_sample(&shared_addr, 0.5);
+  }
+
+  CU_ASSERT(256 == shared_addr.latency_samples.size());
+  CU_ASSERT(0.5 == shared_addr.hedge_delay);
+}
+
+namespace {
+// Returns backend configuration which has a group for each pattern
+// in |groups|.  The group has addresses of 127.0.0.1 with given
+// ports.
+std::shared_ptr<DownstreamRoutingConfig> make_routing(
+    const std::vector<std::pair<StringRef, std::vector<uint16_t>>> &groups) {
+  auto routing = std::make_shared<DownstreamRoutingConfig>();
+
+  for (auto &g : groups) {
+    DownstreamAddrGroupConfig group(g.first);
+
+    for (auto port : g.second) {
+      DownstreamAddrConfig addr{};
+      addr.host = ImmutableString::from_lit("127.0.0.1");
+      addr.hostport = ImmutableString(
+          util::make_hostport(StringRef::from_lit("127.0.0.1"), port));
+      addr.port = port;
+      addr.weight = 1;
+      addr.addr.su.in.sin_family = AF_INET;
+      addr.addr.su.in.sin_port = htons(port);
+      addr.addr.su.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.addr.len = sizeof(addr.addr.su.in);
+
+      group.addrs.push_back(std::move(addr));
+    }
+
+    routing->addr_groups.push_back(std::move(group));
+  }
+
+  return routing;
+}
+} // namespace
+
+void test_shrpx_worker_replace_downstream_routing(void) {
+  auto loop = ev_loop_new(0);
+  auto loop_del = defer(ev_loop_destroy, loop);
+
+  auto &downstreamconf = mod_config()->conn.downstream;
+  auto saved_routing = downstreamconf.routing;
+  downstreamconf.routing = make_routing(
+      {{StringRef::from_lit("/"), {8001, 8002}},
+       {StringRef::from_lit("/alpha/"), {8003}},
+       {StringRef::from_lit("/bravo/"), {8004}}});
+  auto routing_del = defer([&downstreamconf, &saved_routing]() {
+    downstreamconf.routing = std::move(saved_routing);
+  });
+
+  Worker worker(loop, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+
+  auto &groups = worker.get_downstream_addr_groups();
+
+  CU_ASSERT_FATAL(3 == groups.size());
+
+  auto unchanged = groups[0]->shared_addr;
+  auto removed_group = std::weak_ptr<DownstreamAddrGroup>(groups[1]);
+  auto removed = groups[1]->shared_addr;
+  auto removed_h2_group = std::weak_ptr<DownstreamAddrGroup>(groups[2]);
+  auto removed_h2 = groups[2]->shared_addr;
+
+  // Requests are in flight to the backends which are removed.
+  auto dconn = make_unique<HttpDownstreamConnection>(groups[1], loop, &worker);
+  auto http2session =
+      make_unique<Http2Session>(loop, nullptr, &worker, groups[2]);
+
+  // The order of addresses does not matter.
+  worker.replace_downstream_routing(
+      make_routing({{StringRef::from_lit("/"), {8002, 8001}},
+                    {StringRef::from_lit("/charlie/"), {8005}}}));
+
+  CU_ASSERT_FATAL(2 == groups.size());
+
+  // The group which has the same addresses keeps its connections.
+  CU_ASSERT(unchanged == groups[0]->shared_addr);
+  CU_ASSERT(!unchanged->retired);
+
+  CU_ASSERT(unchanged != groups[1]->shared_addr);
+  CU_ASSERT(removed != groups[1]->shared_addr);
+  CU_ASSERT(!groups[1]->shared_addr->retired);
+
+  // The removed groups are retired, and they are kept alive by the
+  // connections.
+  CU_ASSERT(removed->retired);
+  CU_ASSERT(removed_h2->retired);
+  CU_ASSERT(!removed_group.expired());
+  CU_ASSERT(!removed_h2_group.expired());
+  CU_ASSERT(dconn->get_downstream_addr_group() == removed_group.lock().get());
+  CU_ASSERT(http2session->get_downstream_addr_group() ==
+            removed_h2_group.lock().get());
+
+  dconn.reset();
+
+  CU_ASSERT(removed_group.expired());
+
+  http2session.reset();
+
+  CU_ASSERT(removed_h2_group.expired());
+
+  auto added = groups[1]->shared_addr;
+
+  // Retired group is not reused even if the same addresses come
+  // back.
+  worker.replace_downstream_routing(
+      make_routing({{StringRef::from_lit("/"), {8001, 8002}},
+                    {StringRef::from_lit("/alpha/"), {8003}}}));
+
+  CU_ASSERT_FATAL(2 == groups.size());
+  CU_ASSERT(unchanged == groups[0]->shared_addr);
+  CU_ASSERT(removed != groups[1]->shared_addr);
+  CU_ASSERT(!groups[1]->shared_addr->retired);
+  CU_ASSERT(added->retired);
+
+  // The same address appears more than once.
+  worker.replace_downstream_routing(
+      make_routing({{StringRef::from_lit("/"), {8001, 8001}}}));
+
+  CU_ASSERT_FATAL(1 == groups.size());
+  CU_ASSERT(unchanged->retired);
+
+  auto duplicated = groups[0]->shared_addr;
+
+  worker.replace_downstream_routing(
+      make_routing({{StringRef::from_lit("/"), {8001, 8002}}}));
+
+  CU_ASSERT_FATAL(1 == groups.size());
+  CU_ASSERT(duplicated != groups[0]->shared_addr);
+  CU_ASSERT(duplicated->retired);
+  CU_ASSERT(!groups[0]->shared_addr->retired);
+}
+
 } // namespace shrpx
@@ -32,6 +32,15 @@
 namespace shrpx {
 
 void test_shrpx_worker_match_downstream_addr_group(void);
+void test_shrpx_worker_select_downstream_addr(void);
+void test_shrpx_worker_select_affinity_downstream_addr(void);
+void test_shrpx_worker_affinity_hash_key(void);
+void test_shrpx_worker_select_weighted_downstream_addr(void);
+void test_shrpx_worker_downstream_addr_cost(void);
+void test_shrpx_worker_count_http2_sessions_to_warm(void);
+void test_shrpx_worker_select_retry_downstream_addr(void);
+void test_shrpx_worker_compute_hedge_delay(void);
+void test_shrpx_worker_replace_downstream_routing(void);
 
 } // namespace shrpx
 
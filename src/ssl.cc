@@ -32,6 +32,8 @@
 #include <openssl/crypto.h>
 #include <openssl/conf.h>
 
+#include "ssl_compat.h"
+
 namespace nghttp2 {
 
 namespace ssl {
@@ -52,6 +54,7 @@ const char *const DEFAULT_CIPHER_LIST =
     "SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-"
     "SHA:DES-CBC3-SHA:!DSS";
 
+#if !OPENSSL_1_1_API
 namespace {
 std::vector<std::mutex> ssl_global_locks;
 } // namespace
@@ -65,8 +68,10 @@ void ssl_locking_cb(int mode, int type, const char *file, int line) {
   }
 }
 } // namespace
+#endif // !OPENSSL_1_1_API
 
 LibsslGlobalLock::LibsslGlobalLock() {
+#if !OPENSSL_1_1_API
   if (!ssl_global_locks.empty()) {
     std::cerr << "OpenSSL global lock has been already set" << std::endl;
     assert(0);
@@ -77,9 +82,14 @@ LibsslGlobalLock::LibsslGlobalLock() {
   // CRYPTO_THREADID_set_callback(), then default implementation is
   // used. We use this default one.
   CRYPTO_set_locking_callback(ssl_locking_cb);
+#endif // !OPENSSL_1_1_API
 }
 
-LibsslGlobalLock::~LibsslGlobalLock() { ssl_global_locks.clear(); }
+LibsslGlobalLock::~LibsslGlobalLock() {
+#if !OPENSSL_1_1_API
+  ssl_global_locks.clear();
+#endif // !OPENSSL_1_1_API
+}
 
 const char *get_tls_protocol(SSL *ssl) {
   switch (SSL_version(ssl)) {
@@ -151,12 +161,18 @@ bool check_http2_requirement(SSL *ssl) {
 }
 
 void libssl_init() {
+#if OPENSSL_1_1_API
+  // OpenSSL 1.1.0 initializes itself on demand.  Just load the
+  // configuration file as OPENSSL_config() does.
+  OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG, nullptr);
+#else // !OPENSSL_1_1_API
 #ifndef OPENSSL_IS_BORINGSSL
   OPENSSL_config(nullptr);
 #endif // OPENSSL_IS_BORINGSSL
   SSL_load_error_strings();
   SSL_library_init();
   OpenSSL_add_all_algorithms();
+#endif // !OPENSSL_1_1_API
 }
 
 } // namespace ssl
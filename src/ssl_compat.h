@@ -0,0 +1,49 @@
+/*
+ * nghttp2 - HTTP/2 C Library
+ *
+ * Copyright (c) 2016 Tatsuhiro Tsujikawa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef SSL_COMPAT_H
+#define SSL_COMPAT_H
+
+#include <openssl/opensslv.h>
+
+// OPENSSL_1_1_API is nonzero if OpenSSL 1.1.0 API is available.
+// LibreSSL claims newer version, but it does not have the new API.
+#ifdef LIBRESSL_VERSION_NUMBER
+#define OPENSSL_1_1_API 0
+#else // !LIBRESSL_VERSION_NUMBER
+#define OPENSSL_1_1_API (OPENSSL_VERSION_NUMBER >= 0x1010000fL)
+#endif // !LIBRESSL_VERSION_NUMBER
+
+#if !OPENSSL_1_1_API && !defined(OPENSSL_IS_BORINGSSL) &&                     \
+    (!defined(LIBRESSL_VERSION_NUMBER) ||                                      \
+     LIBRESSL_VERSION_NUMBER < 0x2070000fL)
+#include <openssl/ssl.h>
+
+inline int SSL_CTX_up_ref(SSL_CTX *ssl_ctx) {
+  CRYPTO_add(&ssl_ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+  return 1;
+}
+#endif // !OPENSSL_1_1_API && !OPENSSL_IS_BORINGSSL && LibreSSL < 2.7.0
+
+#endif // SSL_COMPAT_H